@@ -9,17 +9,35 @@
 #include "font_awesome_symbols.h"
 #include "iot/thing_manager.h"
 #include "assets/lang_config.h"
-
+#include "audio_telemetry.h"
+#include "latency_probe.h"
+#include "settings.h"
+#include "trace.h"
+#include "task_topology.h"
+#include "memory_arena.h"
+
+#include <cassert>
 #include <cstring>
+#include <algorithm>
 #include <esp_log.h>
+#include <freertos/semphr.h>
+#include <esp_app_desc.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
-#include <arpa/inet.h>
 #include <time.h>
 #include <sys/time.h>
 
 #define TAG "Application"
 
+// 检查版本失败后的重试次数和最长间隔，间隔从 1 秒开始翻倍
+#define OTA_CHECK_VERSION_RETRIES 10
+#define OTA_CHECK_VERSION_MAX_DELAY_MS 30000
+// 音频通道建立期间缓存的上行音频, 覆盖较慢的 TLS 握手
+#define UPLINK_BUFFER_MS 3000
+#define UPLINK_BUFFER_SLOT_SIZE 512
+// 按下后未确认为单击的预连接在此时间后关闭
+#define SPECULATIVE_OPEN_TIMEOUT_SECONDS 3
+
 
 static const char* const STATE_STRINGS[] = {
     "unknown",
@@ -37,27 +55,19 @@ static const char* const STATE_STRINGS[] = {
 
 Application::Application() {
     event_group_ = xEventGroupCreate();
-    background_task_ = new BackgroundTask(4096 * 8);
-
-    esp_timer_create_args_t clock_timer_args = {
-        .callback = [](void* arg) {
-            Application* app = (Application*)arg;
-            app->OnClockTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "clock_timer",
-        .skip_unhandled_events = true
-    };
-    esp_timer_create(&clock_timer_args, &clock_timer_handle_);
-    esp_timer_start_periodic(clock_timer_handle_, 1000000);
+    background_task_ = new BackgroundTask(TASK_ENCODE_STACK_SIZE, TASK_ENCODE_PRIORITY, TASK_CORE(TASK_ENCODE_CORE),
+        TASK_ENCODE_QUEUE_SIZE, TASK_ENCODE_WORKERS);
+
+    // Aligned to whole seconds, so it shares the wakeup with the display status refresh
+    auto& timers = TimerService::GetInstance();
+    clock_timer_ = timers.Create("clock_timer", [this]() {
+        OnClockTimer();
+    }, 1000);
+    timers.StartPeriodic(clock_timer_, 1000);
 }
 
 Application::~Application() {
-    if (clock_timer_handle_ != nullptr) {
-        esp_timer_stop(clock_timer_handle_);
-        esp_timer_delete(clock_timer_handle_);
-    }
+    TimerService::GetInstance().Delete(clock_timer_);
     if (background_task_ != nullptr) {
         delete background_task_;
     }
@@ -87,32 +97,14 @@ void Application::DismissAlert() {
 }
 
 void Application::PlaySound(const std::string_view& sound) {
-    // Wait for the previous sound to finish
-    {
-        std::unique_lock<std::mutex> lock(mutex_);
-        audio_decode_cv_.wait(lock, [this]() {
-            return audio_decode_queue_.empty();
-        });
-    }
-    background_task_->WaitForCompletion();
-
-    // The assets are encoded at 16000Hz, 60ms frame duration
-    SetDecodeSampleRate(16000, 60);
-    const char* data = sound.data();
-    size_t size = sound.size();
-    for (const char* p = data; p < data + size; ) {
-        auto p3 = (BinaryProtocol3*)p;
-        p += sizeof(BinaryProtocol3);
-
-        auto payload_size = ntohs(p3->payload_size);
-        std::vector<uint8_t> opus;
-        opus.resize(payload_size);
-        memcpy(opus.data(), p3->payload, payload_size);
-        p += payload_size;
-
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(opus));
-    }
+    // Mixed over the audio already playing, the caller never waits for it
+    playback_.PlaySound(sound);
+#if CONFIG_USE_IDLE_POWER_SAVE
+    // Alerts such as the low battery sound also show something, bring the display back
+    Schedule([this]() {
+        ExitIdlePowerMode();
+    });
+#endif
 }
 
 void Application::ToggleChatState() {
@@ -123,12 +115,9 @@ void Application::ToggleChatState() {
 
     if (device_state_ == kDeviceStateIdle) {
         Schedule([this]() {
-            SetDeviceState(kDeviceStateConnecting);
-            if (!protocol_->OpenAudioChannel()) {
-                return;
+            if (device_state_ == kDeviceStateIdle) {
+                OpenAndListen(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
             }
-
-            SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
@@ -149,14 +138,9 @@ void Application::StartListening() {
     
     if (device_state_ == kDeviceStateIdle) {
         Schedule([this]() {
-            if (!protocol_->IsAudioChannelOpened()) {
-                SetDeviceState(kDeviceStateConnecting);
-                if (!protocol_->OpenAudioChannel()) {
-                    return;
-                }
+            if (device_state_ == kDeviceStateIdle) {
+                OpenAndListen(kListeningModeManualStop);
             }
-
-            SetListeningMode(kListeningModeManualStop);
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
@@ -167,7 +151,8 @@ void Application::StartListening() {
 }
 
 void Application::StopListening() {
-    const std::array<int, 3> valid_states = {
+    const std::array<int, 4> valid_states = {
+        kDeviceStateConnecting,
         kDeviceStateListening,
         kDeviceStateSpeaking,
         kDeviceStateIdle,
@@ -178,84 +163,297 @@ void Application::StopListening() {
     }
 
     Schedule([this]() {
-        if (device_state_ == kDeviceStateListening) {
+        if (device_state_ == kDeviceStateConnecting && channel_opening_) {
+            stop_after_open_ = true;
+        } else if (device_state_ == kDeviceStateListening) {
+            protocol_->SendStopListening();
+            SetDeviceState(kDeviceStateIdle);
+        }
+    });
+}
+
+void Application::PrepareListening() {
+#if CONFIG_USE_SPECULATIVE_OPEN
+    if (!protocol_ || device_state_ != kDeviceStateIdle) {
+        return;
+    }
+    Schedule([this]() {
+        if (device_state_ != kDeviceStateIdle || channel_opening_ || protocol_->IsAudioChannelOpened()) {
+            return;
+        }
+        ESP_LOGI(TAG, "Opening the audio channel ahead of the click");
+        speculative_open_time_ = esp_timer_get_time();
+        StartUplinkBuffering();
+        OpenAudioChannelAsync(nullptr);
+    });
+#endif
+}
+
+// The handshake blocks for a round trip or more, the main task keeps serving the UI and the
+// buttons meanwhile. A later call while opening replaces the callback, so a click takes over
+// the speculative open of its press down.
+void Application::OpenAudioChannelAsync(std::function<void(bool opened)> callback) {
+    if (channel_opening_) {
+        channel_open_callback_ = std::move(callback);
+        return;
+    }
+    if (protocol_->IsAudioChannelOpened()) {
+        if (callback != nullptr) {
+            callback(true);
+        }
+        return;
+    }
+    channel_opening_ = true;
+    channel_open_callback_ = std::move(callback);
+    auto ret = xTaskCreatePinnedToCore([](void* arg) {
+        auto app = (Application*)arg;
+        bool opened = app->protocol_->OpenAudioChannel();
+        app->Schedule([app, opened]() {
+            app->channel_opening_ = false;
+            auto callback = std::move(app->channel_open_callback_);
+            app->channel_open_callback_ = nullptr;
+            if (!opened) {
+                app->speculative_open_time_ = 0;
+                app->StopUplinkBuffering();
+                if (app->device_state_ == kDeviceStateConnecting) {
+                    app->SetDeviceState(kDeviceStateIdle);
+                }
+            }
+            if (callback != nullptr) {
+                callback(opened);
+            }
+        });
+        vTaskDelete(NULL);
+    }, "open_channel", TASK_NETWORK_STACK_SIZE, this, TASK_NETWORK_PRIORITY, nullptr, TASK_CORE(TASK_NETWORK_CORE));
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the channel open task");
+        channel_opening_ = false;
+        channel_open_callback_ = nullptr;
+        StopUplinkBuffering();
+        if (device_state_ == kDeviceStateConnecting) {
+            SetDeviceState(kDeviceStateIdle);
+        }
+        if (callback != nullptr) {
+            callback(false);
+        }
+    }
+}
+
+// The microphone is buffered from here on, so nothing said during the handshake is lost
+void Application::OpenAndListen(ListeningMode mode, std::function<void()> on_opened) {
+    speculative_open_time_ = 0;
+    stop_after_open_ = false;
+    if (channel_opening_ || !protocol_->IsAudioChannelOpened()) {
+        SetDeviceState(kDeviceStateConnecting);
+    }
+    StartUplinkBuffering();
+    OpenAudioChannelAsync([this, mode, on_opened = std::move(on_opened)](bool opened) {
+        if (!opened) {
+            return;
+        }
+        if (on_opened != nullptr) {
+            on_opened();
+        }
+        SetListeningMode(mode);
+        if (stop_after_open_) {
+            stop_after_open_ = false;
             protocol_->SendStopListening();
             SetDeviceState(kDeviceStateIdle);
         }
     });
 }
 
+void Application::CancelSpeculativeOpen() {
+    // Still opening, the next clock tick looks again
+    if (speculative_open_time_ == 0 || device_state_ != kDeviceStateIdle || channel_opening_) {
+        return;
+    }
+    ESP_LOGI(TAG, "No click followed the press, closing the audio channel");
+    speculative_open_time_ = 0;
+    StopUplinkBuffering();
+    if (protocol_->IsAudioChannelOpened()) {
+        protocol_->CloseAudioChannel();
+    }
+}
+
+void Application::StartUplinkBuffering() {
+    if (uplink_buffering_) {
+        return;
+    }
+    if (!uplink_buffer_) {
+        int frame_duration = std::min(opus_encoder_->duration_ms(), Protocol::PreferredFrameDuration());
+        uplink_buffer_ = std::make_unique<AudioPacketRing>(UPLINK_BUFFER_MS / frame_duration + 1, UPLINK_BUFFER_SLOT_SIZE);
+    }
+    // Nothing is encoded in the idle state, the encoder can be reset from here
+    background_task_->WaitForCompletion(uplink_tasks_);
+    uplink_buffer_->Clear();
+    opus_encoder_->ResetState();
+    encoder_tuner_.Reset();
+    uplink_buffering_ = true;
+#if CONFIG_USE_AUDIO_PROCESSOR
+    if (!audio_processor_.IsRunning()) {
+        // The VAD gate is set up once listening starts, keep everything until then
+        audio_processor_.SetUplinkGate(false);
+        audio_processor_.Start();
+    }
+#endif
+    NotifyAudioInput();
+}
+
+void Application::StopUplinkBuffering() {
+    if (!uplink_buffering_.exchange(false)) {
+        return;
+    }
+#if CONFIG_USE_AUDIO_PROCESSOR
+    if (device_state_ != kDeviceStateListening) {
+        audio_processor_.Stop();
+    }
+#endif
+    background_task_->WaitForCompletion(uplink_tasks_);
+    uplink_buffer_->Clear();
+}
+
+// Called right after listen start. The drain runs in the uplink group behind the frames already
+// queued for the encoder, which land in the buffer first; buffering ends only once it is empty,
+// so live frames follow the backlog and PackAudio keeps the uplink group as its one caller.
+void Application::FlushUplinkBuffer() {
+    if (!uplink_buffering_) {
+        return;
+    }
+    background_task_->Schedule([this]() {
+        // Stopped meanwhile, StopUplinkBuffering clears the buffer
+        if (!uplink_buffering_) {
+            return;
+        }
+        const uint8_t* data;
+        size_t size;
+        int count = 0;
+        while (uplink_buffer_->Front(data, size)) {
+            auto frame = PacketPool::GetInstance().Allocate(data, size);
+            uplink_buffer_->Pop();
+#if CONFIG_USE_CONVERSATION_RECORDER
+            RecordAudio(kRecordUplink, frame);
+#endif
+            auto packet = protocol_->PackAudio(std::move(frame));
+            if (packet) {
+                Schedule([this, packet = std::move(packet)]() {
+                    protocol_->SendAudio(packet);
+                }, kTaskPriorityRealtime);
+            }
+            count++;
+        }
+        auto packet = protocol_->FlushAudio();
+        if (packet) {
+            Schedule([this, packet = std::move(packet)]() {
+                protocol_->SendAudio(packet);
+            }, kTaskPriorityRealtime);
+        }
+        uplink_buffering_ = false;
+        ESP_LOGI(TAG, "Sent %d frames buffered while connecting", count);
+    }, kBackgroundTaskWait, &uplink_tasks_);
+}
+
 void Application::Start() {
     auto& board = Board::GetInstance();
+    main_task_handle_ = xTaskGetCurrentTaskHandle();
+    TRACE_BEGIN(kTraceBoot);
+#if CONFIG_USE_IDLE_POWER_SAVE
+    power_manager_.Initialize(CONFIG_IDLE_POWER_SAVE_MIN_CPU_FREQ_MHZ);
+#endif
     SetDeviceState(kDeviceStateStarting);
 
     /* Setup the display */
     auto display = board.GetDisplay();
 
     /* Setup the audio codec */
+    TRACE_BEGIN(kTraceBootAudio);
     auto codec = board.GetAudioCodec();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+    codec_ = codec;
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    if (!codec->input_reference()) {
+        codec->EnableSoftwareReference(CONFIG_SOFTWARE_AEC_REFERENCE_OFFSET_MS);
+    }
+#endif
+    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, Protocol::PreferredFrameDuration());
+    // Starting complexity and the range the tuner may move it in
     if (realtime_chat_enabled_) {
         ESP_LOGI(TAG, "Realtime chat enabled, setting opus encoder complexity to 0");
-        opus_encoder_->SetComplexity(0);
+        encoder_tuner_.Configure(opus_encoder_.get(), 0, 0, 2);
     } else if (board.GetBoardType() == "ml307") {
         ESP_LOGI(TAG, "ML307 board detected, setting opus encoder complexity to 5");
-        opus_encoder_->SetComplexity(5);
+        encoder_tuner_.Configure(opus_encoder_.get(), 5, 2, 8);
     } else {
         ESP_LOGI(TAG, "WiFi board detected, setting opus encoder complexity to 3");
-        opus_encoder_->SetComplexity(3);
+        encoder_tuner_.Configure(opus_encoder_.get(), 3, 1, 6);
     }
 
+#if AUDIO_CODEC_INPUT_RESAMPLE
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
         reference_resampler_.Configure(codec->input_sample_rate(), 16000);
     }
+#else
+    // config.h fixed the input at 16 kHz, the input stage was built without a resampler
+    assert(codec->input_sample_rate() == 16000);
+#endif
+    PrepareInputStage();
     codec->Start();
+    AudioTelemetry::GetInstance().SetI2sDmaConfig(codec->dma_config().desc_num, codec->dma_config().frame_num);
+
+    // Capture and the AFE own core 1, playback shares core 0 with the network (task_topology.h)
+    playback_.OnBeforeDecode([this]() {
+        return !aborted_ && device_state_ != kDeviceStateListening;
+    });
+    playback_.Start(codec, codec->output_sample_rate(), OPUS_FRAME_DURATION_MS,
+        TASK_CORE(TASK_PLAYBACK_CORE), TASK_PLAYBACK_PRIORITY);
 
     xTaskCreatePinnedToCore([](void* arg) {
         Application* app = (Application*)arg;
         app->AudioLoop();
         vTaskDelete(NULL);
-    }, "audio_loop", 4096 * 2, this, 8, &audio_loop_task_handle_, realtime_chat_enabled_ ? 1 : 0);
+    }, "audio_loop", TASK_AUDIO_INPUT_STACK_SIZE, this, TASK_AUDIO_INPUT_PRIORITY, &audio_loop_task_handle_,
+        TASK_CORE(TASK_AUDIO_INPUT_CORE));
+    TRACE_END(kTraceBootAudio);
+
+    /* Load the audio front end and wake word models while the network comes up */
+    StartAudioFrontEnd(codec);
 
     /* Wait for the network to be ready */
+    TRACE_BEGIN(kTraceBootNetwork);
     board.StartNetwork();
+    TRACE_END(kTraceBootNetwork);
 
+    // 上次检查版本保存的服务器配置可以直接使用，检查版本放到后台执行，不再推迟唤醒
     ota_ = std::make_unique<Ota>();
-    
-    // Check for new firmware version
-    display->SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
-    for (int i = 0; i < 10; ++i) {
-        if (ota_->CheckVersion() == ESP_OK) {
-            break;
-        }
-        vTaskDelay(pdMS_TO_TICKS(1000));
-    }
-
-    if (ota_->HasNewVersion()) {
-        UpgradeFirmware(ota_->GetFirmwareUrl(), ota_->GetFirmwareVersion());
+    bool has_websocket_config = !Settings("websocket").GetString("url").empty();
+    bool has_mqtt_config = !Settings("mqtt").GetString("endpoint").empty();
+    if (has_websocket_config || has_mqtt_config) {
+        xTaskCreatePinnedToCore([](void* arg) {
+            Application* app = (Application*)arg;
+            app->CheckNewVersion();
+            app->check_new_version_task_handle_ = nullptr;
+            vTaskDelete(NULL);
+        }, "check_new_version", TASK_NETWORK_STACK_SIZE, this, TASK_NETWORK_PRIORITY, &check_new_version_task_handle_,
+            TASK_CORE(TASK_NETWORK_CORE));
+    } else {
+        // First boot, the protocol needs the config from the server
+        display->SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
+        CheckNewVersion();
+        has_websocket_config = ota_->HasWebsocketConfig();
+        has_mqtt_config = ota_->HasMqttConfig();
     }
-    
-    ota_->MarkCurrentVersionValid();
 
-    // Activation
-    while (ota_->HasActivationCode() || ota_->HasActivationChallenge()) {
-        display->SetStatus(Lang::Strings::ACTIVATION);
-        if (ota_->HasActivationCode()) {
-            ShowActivationCode(ota_->GetActivationCode(), ota_->GetActivationMessage());
-        }
-        if (ota_->Activate() == ESP_OK) {
-            break;
-        }
-        vTaskDelay(pdMS_TO_TICKS(3000));
-    }
+#if CONFIG_USE_TTS_CACHE
+    // Mount and index the cache now, not on the network task at the first hello
+    TtsCache::GetInstance();
+#endif
 
     // Initialize the protocol
+    TRACE_BEGIN(kTraceBootProtocol);
     display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
-    if (ota_->HasWebsocketConfig()) {
+    if (has_websocket_config) {
         protocol_ = std::make_unique<WebsocketProtocol>();
-    } else if (ota_->HasMqttConfig()) {
+    } else if (has_mqtt_config) {
         protocol_ = std::make_unique<MqttProtocol>();
     } else {
 #ifdef CONFIG_CONNECTION_TYPE_WEBSOCKET
@@ -265,53 +463,108 @@ void Application::Start() {
 #endif
     }
     protocol_->OnNetworkError([this](const std::string& message) {
-        SetDeviceState(kDeviceStateIdle);
-        Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
+        // Also raised on the channel open task
+        Schedule([this, message]() {
+            SetDeviceState(kDeviceStateIdle);
+            Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION());
+        });
     });
-    protocol_->OnIncomingAudio([this](std::vector<uint8_t>&& data) {
-        const int max_packets_in_queue = 300 / OPUS_FRAME_DURATION_MS;
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (audio_decode_queue_.size() < max_packets_in_queue) {
-            audio_decode_queue_.emplace_back(std::move(data));
+    protocol_->OnUplinkBatchTimeout([this](AudioPacket&& packet) {
+        // Same class as the sends of PackAudio's batches, so the order on the wire is kept
+        Schedule([this, packet = std::move(packet)]() {
+            protocol_->SendAudio(packet);
+        }, kTaskPriorityRealtime);
+    });
+    protocol_->OnIncomingAudio([this](AudioPacket&& packet, uint32_t sequence) {
+#if CONFIG_USE_CONVERSATION_RECORDER
+        RecordAudio(kRecordDownlink, packet);
+#endif
+#if CONFIG_USE_TTS_CACHE
+        if (tts_cache_skipping_) {
+            tts_cache_skipped_frames_++;
+            return;
         }
+        sequence -= tts_cache_skipped_frames_;
+        last_stream_sequence_ = sequence;
+        TtsCache::GetInstance().AddFrame(packet);
+#endif
+        playback_.PushStreamPacket(sequence, std::move(packet));
     });
+    // Fired on the open_channel task, everything below belongs to the main loop. It is queued
+    // ahead of the open completion, so the channel is set up before the listen start.
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
-        board.SetPowerSaveMode(false);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
-            ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
-                protocol_->server_sample_rate(), codec->output_sample_rate());
-        }
-        SetDecodeSampleRate(protocol_->server_sample_rate(), protocol_->server_frame_duration());
-        auto& thing_manager = iot::ThingManager::GetInstance();
-        protocol_->SendIotDescriptors(thing_manager.GetDescriptorsJson());
-        std::string states;
-        if (thing_manager.GetStatesJson(states, false)) {
-            protocol_->SendIotStates(states);
-        }
+        Schedule([this, codec, &board]() {
+            board.SetPowerSaveMode(false);
+            if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
+                ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
+                    protocol_->server_sample_rate(), codec->output_sample_rate());
+            }
+            playback_.SetDecodeSampleRate(protocol_->server_sample_rate(), protocol_->server_frame_duration());
+#if CONFIG_USE_CONVERSATION_RECORDER
+            ConversationRecorder::GetInstance().SetAudioParams(protocol_->uplink_frame_duration(),
+                protocol_->server_sample_rate(), protocol_->server_frame_duration());
+#endif
+#if CONFIG_USE_TTS_CACHE
+            // The protocol numbers the frames from 1 again
+            tts_cache_skipped_frames_ = 0;
+            last_stream_sequence_ = 0;
+#endif
+            int frame_duration = protocol_->uplink_frame_duration();
+            if (frame_duration != opus_encoder_->duration_ms()) {
+                // Frames buffered while connecting may be encoding, swap the encoder between two of them
+                background_task_->Schedule([this, frame_duration]() {
+                    ESP_LOGI(TAG, "Uplink frame duration %d -> %d ms", opus_encoder_->duration_ms(), frame_duration);
+                    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, frame_duration);
+                    encoder_tuner_.SetEncoder(opus_encoder_.get());
+                }, kBackgroundTaskWait, &uplink_tasks_);
+            }
+            auto& thing_manager = iot::ThingManager::GetInstance();
+            protocol_->SendIotDescriptors(thing_manager.GetDescriptorsJson());
+            std::string states;
+            if (thing_manager.GetStatesJson(states, false)) {
+                protocol_->SendIotStates(states);
+            }
+        });
     });
     protocol_->OnAudioChannelClosed([this, &board]() {
         board.SetPowerSaveMode(true);
+#if CONFIG_USE_TTS_CACHE
+        TtsCache::GetInstance().EndRecording(false);
+#endif
         Schedule([this]() {
             auto display = Board::GetInstance().GetDisplay();
             display->SetChatMessage("system", "");
             SetDeviceState(kDeviceStateIdle);
         });
     });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
+    protocol_->OnIncomingJson([this, display](const JsonMessage& json) {
+        // Fields are decoded from the frame on demand, no tree is built
+        auto type = json.type();
+        if (type == "tts") {
+            auto state = json.Get("state");
+            if (state == "start") {
+                TRACE_INSTANT(kTraceTtsStart);
                 Schedule([this]() {
                     aborted_ = false;
                     if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
                         SetDeviceState(kDeviceStateSpeaking);
                     }
                 });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
+            } else if (state == "stop") {
+                TRACE_INSTANT(kTraceTtsStop);
+#if CONFIG_USE_TTS_CACHE
+                TtsCache::GetInstance().EndRecording();
+                tts_cache_skipping_ = false;
+#endif
                 Schedule([this]() {
-                    background_task_->WaitForCompletion();
+                    playback_.WaitForIdle();
+#if CONFIG_AUDIO_TELEMETRY_REPORT
+                    // One window per turn, so builds can be compared turn by turn
+                    auto& telemetry = AudioTelemetry::GetInstance();
+                    ArenaBuffer report;
+                    protocol_->SendAudioTelemetry(telemetry.GetReportJson(report));
+                    telemetry.Reset();
+#endif
                     if (device_state_ == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
                             SetDeviceState(kDeviceStateIdle);
@@ -320,79 +573,165 @@ void Application::Start() {
                         }
                     }
                 });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (text != NULL) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
+            } else if (state == "sentence_start") {
+                TRACE_INSTANT(kTraceSentence);
+#if CONFIG_USE_TTS_CACHE
+                HandleTtsSentence(json);
+#endif
+                std::string text;
+                if (json.GetString("text", text)) {
+                    ESP_LOGI(TAG, "<< %s", text.c_str());
+                    Schedule([this, display, message = std::move(text)]() {
                         display->SetChatMessage("assistant", message.c_str());
                     });
                 }
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (text != NULL) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
+        } else if (type == "stt") {
+            TRACE_INSTANT(kTraceStt);
+            std::string text;
+            if (json.GetString("text", text)) {
+                ESP_LOGI(TAG, ">> %s", text.c_str());
+                Schedule([this, display, message = std::move(text)]() {
                     display->SetChatMessage("user", message.c_str());
                 });
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (emotion != NULL) {
-                Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
+        } else if (type == "llm") {
+            std::string emotion;
+            if (json.GetString("emotion", emotion)) {
+                Schedule([this, display, emotion_str = std::move(emotion)]() {
                     display->SetEmotion(emotion_str.c_str());
                 });
             }
-        } else if (strcmp(type->valuestring, "iot") == 0) {
-            auto commands = cJSON_GetObjectItem(root, "commands");
-            if (commands != NULL) {
-                auto& thing_manager = iot::ThingManager::GetInstance();
-                for (int i = 0; i < cJSON_GetArraySize(commands); ++i) {
-                    auto command = cJSON_GetArrayItem(commands, i);
-                    thing_manager.Invoke(command);
+        } else if (type == "iot") {
+            auto commands_json = json.Get("commands");
+            if (!commands_json.empty()) {
+                // Rare and user triggered, the things still take cJSON
+                auto commands = cJSON_ParseWithLength(commands_json.data(), commands_json.size());
+                std::vector<iot::MethodCall> calls;
+                if (cJSON_IsArray(commands)) {
+                    auto rejected = iot::ThingManager::GetInstance().ParseBatch(commands, calls);
+                    if (rejected > 0) {
+                        ESP_LOGW(TAG, "%u of %d iot commands rejected", rejected, cJSON_GetArraySize(commands));
+                    }
+                }
+                cJSON_Delete(commands);
+                // 一条消息中的所有命令在一个任务中按顺序执行, 最后只上报一次状态变化
+                if (!calls.empty()) {
+                    Schedule([this, calls = std::move(calls)]() {
+                        for (auto& call : calls) {
+                            call.Invoke();
+                        }
+                        UpdateIotStates();
+                    });
                 }
             }
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (command != NULL) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
+        } else if (type == "system") {
+            std::string command;
+            if (json.GetString("command", command)) {
+                ESP_LOGI(TAG, "System command: %s", command.c_str());
+                if (command == "reboot") {
                     // Do a reboot if user requests a OTA update
                     Schedule([this]() {
                         Reboot();
                     });
+#if CONFIG_USE_TRACE
+                } else if (command == "trace") {
+                    Schedule([this]() {
+                        auto& trace = Trace::GetInstance();
+                        trace.DumpToLog();
+                        protocol_->SendTrace(trace.SerializeBase64());
+                    });
+#endif
+#if CONFIG_USE_CONVERSATION_RECORDER
+                } else if (command == "upload_audio") {
+                    // A "url" in the command is ignored, the recording only goes to the OTA server
+                    Schedule([this]() {
+                        UploadRecording();
+                    });
+#endif
                 } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
+                    ESP_LOGW(TAG, "Unknown system command: %s", command.c_str());
                 }
             }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (status != NULL && message != NULL && emotion != NULL) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::P3_VIBRATION);
+#if CONFIG_USE_LATENCY_PROBE
+        } else if (type == "latency") {
+            int timestamp_ms;
+            if (json.GetInt("t", timestamp_ms)) {
+                int rtt_ms = (int)(esp_timer_get_time() / 1000) - timestamp_ms;
+                AudioTelemetry::GetInstance().Record(kAudioStageServerRtt, rtt_ms * 1000LL);
+                protocol_->metrics().RecordRtt(rtt_ms * 1000LL);
+                ESP_LOGI(TAG, "Server round trip: %d ms", rtt_ms);
+            }
+#endif
+        } else if (type == "alert") {
+            std::string status, message, emotion;
+            if (json.GetString("status", status) && json.GetString("message", message) && json.GetString("emotion", emotion)) {
+                Alert(status.c_str(), message.c_str(), emotion.c_str(), Lang::Sounds::P3_VIBRATION());
             } else {
                 ESP_LOGW(TAG, "Alert command requires status, message and emotion");
             }
         }
     });
     protocol_->Start();
+    TRACE_END(kTraceBootProtocol);
+
+    // The models are usually loaded by now, the network took longer
+    xEventGroupWaitBits(event_group_, AUDIO_FRONT_END_READY_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    SetDeviceState(kDeviceStateIdle);
+    std::string message = std::string(Lang::Strings::VERSION) + esp_app_get_description()->version;
+    display->ShowNotification(message.c_str());
+    display->SetChatMessage("system", "");
+    // Play the success sound to indicate the device is ready
+    ResetDecoder();
+    PlaySound(Lang::Sounds::P3_SUCCESS());
+    TRACE_END(kTraceBoot);
+
+    // Enter the main event loop
+    MainEventLoop();
+}
 
+void Application::StartAudioFrontEnd(AudioCodec* codec) {
+    // Creating the AFE and loading the wake word model takes a while, it runs next to the WiFi association
+    struct Context {
+        Application* app;
+        AudioCodec* codec;
+    };
+    auto context = new Context{this, codec};
+    xTaskCreate([](void* arg) {
+        auto context = (Context*)arg;
+        context->app->InitializeAudioFrontEnd(context->codec);
+        delete context;
+        vTaskDelete(NULL);
+    }, "audio_front_end", 4096 * 2, context, uxTaskPriorityGet(NULL), NULL);
+}
+
+void Application::InitializeAudioFrontEnd(AudioCodec* codec) {
+    TRACE_SCOPE(kTraceAudioFrontEnd);
+    int64_t start_time = esp_timer_get_time();
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+    audio_front_end_.Initialize(codec, realtime_chat_enabled_);
+#endif
 #if CONFIG_USE_AUDIO_PROCESSOR
-    audio_processor_.Initialize(codec, realtime_chat_enabled_);
+    audio_processor_.Initialize(&audio_front_end_);
     audio_processor_.OnOutput([this](std::vector<int16_t>&& data) {
+        // A stalled network must not pile up PCM, the oldest chunk is least worth sending
         background_task_->Schedule([this, data = std::move(data)]() mutable {
-            if (protocol_->IsAudioChannelBusy()) {
-                return;
-            }
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
-                });
-            });
-        });
+            EncodeUplink(std::move(data));
+        }, kBackgroundTaskDropOldest, &uplink_tasks_);
+    });
+#if CONFIG_USE_VAD_GATED_UPLINK
+    audio_processor_.OnUplinkGateChange([this](bool open) {
+        // Queued behind the chunks already given to the encoder, so the pause follows the last frame
+        background_task_->Schedule([this, open]() {
+            Schedule([this, open]() {
+                if (device_state_ == kDeviceStateListening && protocol_) {
+                    protocol_->SendVadState(open);
+                }
+            }, kTaskPriorityRealtime);
+        }, kBackgroundTaskWait, &uplink_tasks_);
     });
+#endif
     audio_processor_.OnVadStateChange([this](bool speaking) {
         if (device_state_ == kDeviceStateListening) {
             Schedule([this, speaking]() {
@@ -409,46 +748,115 @@ void Application::Start() {
 #endif
 
 #if CONFIG_USE_WAKE_WORD_DETECT
-    wake_word_detect_.Initialize(codec);
+    wake_word_detect_.Initialize(&audio_front_end_);
     wake_word_detect_.OnWakeWordDetected([this](const std::string& wake_word) {
-        Schedule([this, &wake_word]() {
+        Schedule([this, wake_word]() {
             if (device_state_ == kDeviceStateIdle) {
-                SetDeviceState(kDeviceStateConnecting);
-                wake_word_detect_.EncodeWakeWordData();
-
-                if (!protocol_->OpenAudioChannel()) {
-                    wake_word_detect_.StartDetection();
-                    return;
-                }
-                
-                std::vector<uint8_t> opus;
-                // Encode and send the wake word data to the server
-                while (wake_word_detect_.GetWakeWordOpus(opus)) {
-                    protocol_->SendAudio(opus);
-                }
-                // Set the chat state to wake word detected
-                protocol_->SendWakeWordDetected(wake_word);
-                ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
-                SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+                auto mode = realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop;
+                // Buffering waits for an idle uplink group, the pre-roll encode is queued right after
+                // it and ahead of the drain below, even when the channel is already open
+                StartUplinkBuffering();
+                wake_word_detect_.EncodeWakeWordData(background_task_, &uplink_tasks_);
+                OpenAndListen(mode, [this, wake_word]() {
+                    // Behind the pre-roll encode in the uplink group, the only user of PackAudio
+                    background_task_->Schedule([this, wake_word]() {
+                        AudioPacket opus;
+                        while (wake_word_detect_.GetWakeWordOpus(opus)) {
+#if CONFIG_USE_CONVERSATION_RECORDER
+                            RecordAudio(kRecordUplink, opus);
+#endif
+                            auto packet = protocol_->PackAudio(std::move(opus));
+                            if (packet) {
+                                Schedule([this, packet = std::move(packet)]() {
+                                    protocol_->SendAudio(packet);
+                                }, kTaskPriorityRealtime);
+                            }
+                        }
+                        auto packet = protocol_->FlushAudio();
+                        if (packet) {
+                            Schedule([this, packet = std::move(packet)]() {
+                                protocol_->SendAudio(packet);
+                            }, kTaskPriorityRealtime);
+                        }
+                        // Same class as the audio sends, so it follows the pre-roll and goes before the buffered uplink
+                        Schedule([this, wake_word]() {
+                            protocol_->SendWakeWordDetected(wake_word);
+                            ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
+                        }, kTaskPriorityRealtime);
+                    }, kBackgroundTaskWait, &uplink_tasks_);
+                });
+                return;
             } else if (device_state_ == kDeviceStateSpeaking) {
                 AbortSpeaking(kAbortReasonWakeWordDetected);
             }
+            // Realtime chat keeps listening for the wake word to interrupt the reply
+            if (KeepWakeWordDetection()) {
+                wake_word_detect_.StartDetection();
+            }
         });
     });
+#if CONFIG_USE_OFFLINE_COMMANDS
+    wake_word_detect_.OnCommandDetected([this](const std::string& text, const std::string& action) {
+        Schedule([this, text, action]() {
+            HandleOfflineCommand(text, action);
+        });
+    });
+#endif
     wake_word_detect_.StartDetection();
+    NotifyAudioInput();
 #endif
 
-    // Wait for the new version check to finish
-    SetDeviceState(kDeviceStateIdle);
-    std::string message = std::string(Lang::Strings::VERSION) + ota_->GetCurrentVersion();
-    display->ShowNotification(message.c_str());
-    display->SetChatMessage("system", "");
-    // Play the success sound to indicate the device is ready
-    ResetDecoder();
-    PlaySound(Lang::Sounds::P3_SUCCESS);
-    
-    // Enter the main event loop
-    MainEventLoop();
+    ESP_LOGI(TAG, "Audio front end ready in %lld ms", (esp_timer_get_time() - start_time) / 1000);
+    xEventGroupSetBits(event_group_, AUDIO_FRONT_END_READY_EVENT);
+}
+
+void Application::CheckNewVersion() {
+    auto display = Board::GetInstance().GetDisplay();
+
+    // Back off instead of retrying at a fixed interval, the server might be overloaded
+    int retry_delay_ms = 1000;
+    bool checked = false;
+    for (int i = 0; i < OTA_CHECK_VERSION_RETRIES; ++i) {
+        if (ota_->CheckVersion() == ESP_OK) {
+            checked = true;
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(retry_delay_ms));
+        retry_delay_ms = std::min(retry_delay_ms * 2, OTA_CHECK_VERSION_MAX_DELAY_MS);
+    }
+    if (!checked) {
+        ESP_LOGW(TAG, "Failed to check new version after %d retries", OTA_CHECK_VERSION_RETRIES);
+    }
+
+    if (ota_->HasNewVersion()) {
+        // Running in the background, don't cut off a conversation
+        UpgradeFirmware(ota_->GetFirmwareUrl(), ota_->GetFirmwareVersion(), ota_->GetFirmwarePatchUrl(), true);
+    }
+
+    ota_->MarkCurrentVersionValid();
+
+    // Activation
+    retry_delay_ms = 3000;
+    while (ota_->HasActivationCode() || ota_->HasActivationChallenge()) {
+        RunOnMainLoop([this, display]() {
+            display->SetStatus(Lang::Strings::ACTIVATION);
+            if (ota_->HasActivationCode()) {
+                ShowActivationCode(ota_->GetActivationCode(), ota_->GetActivationMessage());
+            }
+        });
+        auto err = ota_->Activate();
+        if (err == ESP_OK) {
+            break;
+        }
+        // 202 means the user hasn't confirmed yet, anything else is an error worth backing off for
+        vTaskDelay(pdMS_TO_TICKS(err == ESP_ERR_TIMEOUT ? 3000 : retry_delay_ms));
+        if (err != ESP_ERR_TIMEOUT) {
+            retry_delay_ms = std::min(retry_delay_ms * 2, OTA_CHECK_VERSION_MAX_DELAY_MS);
+        }
+    }
+    // The clients are kept only for the requests above
+    ota_->ReleaseHttp();
+    xEventGroupSetBits(event_group_, CHECK_NEW_VERSION_DONE_EVENT);
 }
 
 void Application::OnClockTimer() {
@@ -456,8 +864,12 @@ void Application::OnClockTimer() {
 
     // Print the debug info every 10 seconds
     if (clock_ticks_ % 10 == 0) {
-        // SystemInfo::PrintRealTimeStats(pdMS_TO_TICKS(1000));
-        
+        // Diffs against the snapshot taken 10 seconds ago, does not block
+        auto& task_monitor = TaskMonitor::GetInstance();
+        if (task_monitor.Sample() == ESP_OK) {
+            task_monitor.LogStats();
+        }
+
         // Print current stats and time
         time_t now;
         char strftime_buf[64];
@@ -475,15 +887,91 @@ void Application::OnClockTimer() {
         int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
         int min_free_sram = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
         ESP_LOGI(TAG, "Free internal: %u minimal internal: %u", free_sram, min_free_sram);
+        main_tasks_.LogStats();
+        background_task_->LogStats();
+        AudioTelemetry::GetInstance().LogStats();
+        MemoryArenas::GetInstance().LogStats();
+        TimerService::GetInstance().LogStats();
+    }
+
+    int64_t speculative_open_time = speculative_open_time_;
+    if (speculative_open_time > 0
+        && esp_timer_get_time() - speculative_open_time > SPECULATIVE_OPEN_TIMEOUT_SECONDS * 1000000LL) {
+        Schedule([this]() {
+            CancelSpeculativeOpen();
+        });
+    }
+
+    // Disable the output if there is no audio data for a long time
+    const int max_silence_seconds = 10;
+    if (device_state_ == kDeviceStateIdle && playback_.IsIdle()) {
+        auto duration = (esp_timer_get_time() - playback_.last_output_time()) / 1000000;
+        auto codec = codec_;
+        if (duration > max_silence_seconds && codec->output_enabled()) {
+            Schedule([this, codec]() {
+                if (device_state_ == kDeviceStateIdle && playback_.IsIdle()) {
+                    codec->EnableOutput(false);
+                }
+            });
+        }
+    }
+
+#if CONFIG_USE_IDLE_POWER_SAVE
+    if (CanEnterSleepMode() && playback_.IsIdle()) {
+        if (++idle_seconds_ == CONFIG_IDLE_POWER_SAVE_DELAY_SECONDS) {
+            Schedule([this]() {
+                EnterIdlePowerMode();
+            });
+        }
+    } else {
+        idle_seconds_ = 0;
+    }
+#endif
+}
+
+// Stops everything that wakes the chip periodically. The clock timer, the status refresh and
+// the LVGL tick stop, LEDs are static or off in the idle state and the background workers
+// block. Capture and the wake word keep running, waking up goes through SetDeviceState.
+void Application::EnterIdlePowerMode() {
+    if (power_manager_.idle() || !CanEnterSleepMode() || !playback_.IsIdle()) {
+        return;
     }
+    auto& board = Board::GetInstance();
+    TimerService::GetInstance().Stop(clock_timer_);
+    board.GetDisplay()->SetPowerSaveMode(true);
+    codec_->EnableOutput(false);
+    board.SetPowerSaveMode(true);
+    power_manager_.SetIdle(true);
+}
+
+// Runs on the main loop, like EnterIdlePowerMode
+void Application::ExitIdlePowerMode() {
+    if (!power_manager_.idle()) {
+        return;
+    }
+    power_manager_.SetIdle(false);
+    Board::GetInstance().GetDisplay()->SetPowerSaveMode(false);
+    idle_seconds_ = 0;
+    TimerService::GetInstance().StartPeriodic(clock_timer_, 1000);
 }
 
 // Add a async task to MainLoop
-void Application::Schedule(std::function<void()> callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
+void Application::RunOnMainLoop(MainTask&& task) {
+    if (xTaskGetCurrentTaskHandle() == main_task_handle_) {
+        task();
+        return;
     }
+    SemaphoreHandle_t done = xSemaphoreCreateBinary();
+    Schedule([&task, done]() {
+        task();
+        xSemaphoreGive(done);
+    });
+    xSemaphoreTake(done, portMAX_DELAY);
+    vSemaphoreDelete(done);
+}
+
+void Application::Schedule(MainTask&& task, TaskPriority priority) {
+    main_tasks_.Push(std::move(task), priority);
     xEventGroupSetBits(event_group_, SCHEDULE_EVENT);
 }
 
@@ -495,163 +983,259 @@ void Application::MainEventLoop() {
         auto bits = xEventGroupWaitBits(event_group_, SCHEDULE_EVENT, pdTRUE, pdFALSE, portMAX_DELAY);
 
         if (bits & SCHEDULE_EVENT) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            std::list<std::function<void()>> tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
+            // The queue is re-checked after every task, a realtime task waits for one task at most
+            while (main_tasks_.RunNext()) {
             }
         }
     }
 }
 
-// The Audio Loop is used to input and output audio data
+// The Audio Loop is used to input audio data, playback runs in AudioPlayback.
+// While a consumer is active the I2S read paces the loop, otherwise it sleeps until one starts.
 void Application::AudioLoop() {
-    auto codec = Board::GetInstance().GetAudioCodec();
     while (true) {
-        OnAudioInput();
-        if (codec->output_enabled()) {
-            OnAudioOutput();
+        if (!OnAudioInput()) {
+            xEventGroupWaitBits(event_group_, AUDIO_INPUT_READY_EVENT, pdTRUE, pdFALSE, portMAX_DELAY);
         }
     }
 }
 
-void Application::OnAudioOutput() {
-    if (busy_decoding_audio_) {
+// Runs on the background task, the only user of the encoder and its tuner
+void Application::EncodeUplink(std::vector<int16_t>&& data) {
+    if (protocol_->IsAudioChannelBusy()) {
+        AudioTelemetry::GetInstance().Count(kAudioCounterUplinkDropped);
+#if CONFIG_USE_OPUS_ADAPTATION
+        encoder_tuner_.OnFrameDropped();
+#endif
         return;
     }
+    int64_t encode_start = esp_timer_get_time();
+    opus_encoder_->Encode(std::move(data), [this, encode_start](std::vector<uint8_t>&& opus) {
+        int64_t encode_time = esp_timer_get_time() - encode_start;
+        AudioTelemetry::GetInstance().Record(kAudioStageEncode, encode_time);
+#if CONFIG_USE_OPUS_ADAPTATION
+        encoder_tuner_.OnFrameEncoded(encode_time);
+#endif
+        if (uplink_buffering_) {
+            // The channel is still opening, the frame goes out behind listen start
+            if (opus.size() > uplink_buffer_->slot_size() || !uplink_buffer_->Push(opus.data(), opus.size())) {
+                AudioTelemetry::GetInstance().Count(kAudioCounterUplinkDropped);
+            }
+            return;
+        }
+        // Only a full batch wakes up the main loop
+        auto frame = PacketPool::GetInstance().Allocate(opus.data(), opus.size());
+#if CONFIG_USE_CONVERSATION_RECORDER
+        RecordAudio(kRecordUplink, frame);
+#endif
+        auto packet = protocol_->PackAudio(std::move(frame));
+        if (!packet) {
+            return;
+        }
+        Schedule([this, packet = std::move(packet)]() {
+            ScopedAudioLatency latency(kAudioStageSend);
+            protocol_->SendAudio(packet);
+        }, kTaskPriorityRealtime);
+    });
+}
 
-    auto now = std::chrono::steady_clock::now();
-    auto codec = Board::GetInstance().GetAudioCodec();
-    const int max_silence_seconds = 10;
+// Called after a consumer of microphone audio may have started
+void Application::NotifyAudioInput() {
+    xEventGroupSetBits(event_group_, AUDIO_INPUT_READY_EVENT);
+}
+
+// Realtime chat keeps the wake word detection next to the uplink, both share one front end
+bool Application::KeepWakeWordDetection() const {
+#if CONFIG_USE_WAKE_WORD_DETECT && CONFIG_USE_AUDIO_PROCESSOR
+    return listening_mode_ == kListeningModeRealtime
+        && (device_state_ == kDeviceStateListening || device_state_ == kDeviceStateSpeaking);
+#else
+    return false;
+#endif
+}
 
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (audio_decode_queue_.empty()) {
-        // Disable the output if there is no audio data for a long time
-        if (device_state_ == kDeviceStateIdle) {
-            auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_output_time_).count();
-            if (duration > max_silence_seconds) {
-                codec->EnableOutput(false);
+// Returns false if nobody needs audio right now
+bool Application::OnAudioInput() {
+#if CONFIG_USE_LATENCY_PROBE
+    // The probe owns the codec, it waits until nothing plays; the consumers are served meanwhile
+    if (latency_probe_pending_ && playback_.IsIdle()) {
+        latency_probe_pending_ = false;
+        RunLatencyProbe();
+        return true;
+    }
+#endif
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+    // One feed serves the wake word detection and the audio processor
+    if (audio_front_end_.IsRunning()) {
+        // The codec writes straight into the front end's feed chunk
+        int samples = audio_front_end_.GetFeedSize();
+        int16_t* feed = audio_front_end_.GetFeedBuffer();
+        if (samples > 0 && feed != nullptr) {
+            int read = ReadAudio(feed, samples);
+            if (read == 0) {
+                // A failed read leaves the last chunk in the buffer, never feed it twice
+                return true;
             }
+            // The resampler phase may come up a frame short, the tail must not be stale samples
+            std::fill(feed + read, feed + samples, 0);
+            audio_front_end_.Feed(feed);
+            return true;
         }
-        return;
     }
-
-    if (device_state_ == kDeviceStateListening) {
-        audio_decode_queue_.clear();
-        audio_decode_cv_.notify_all();
-        return;
+#endif
+#if !CONFIG_USE_AUDIO_PROCESSOR
+    if (device_state_ == kDeviceStateListening || uplink_buffering_) {
+        // Moved into the encoder, so this path still allocates one chunk per read
+        std::vector<int16_t> data(30 * 16000 / 1000);
+        data.resize(ReadAudio(data.data(), data.size()));
+        if (data.empty()) {
+            return true;
+        }
+        // Same drop policy as the audio processor output above
+        background_task_->Schedule([this, data = std::move(data)]() mutable {
+            EncodeUplink(std::move(data));
+        }, kBackgroundTaskDropOldest, &uplink_tasks_);
+        return true;
     }
+#endif
+#if CONFIG_USE_LATENCY_PROBE
+    if (latency_probe_pending_) {
+        // Poll for the end of playback
+        vTaskDelay(pdMS_TO_TICKS(LATENCY_PROBE_CHUNK_MS));
+        return true;
+    }
+#endif
+    return false;
+}
 
-    auto opus = std::move(audio_decode_queue_.front());
-    audio_decode_queue_.pop_front();
-    lock.unlock();
-    audio_decode_cv_.notify_all();
+#if CONFIG_USE_LATENCY_PROBE
+void Application::MeasureLatency() {
+    latency_probe_pending_ = true;
+    NotifyAudioInput();
+}
 
-    busy_decoding_audio_ = true;
-    background_task_->Schedule([this, codec, opus = std::move(opus)]() mutable {
-        busy_decoding_audio_ = false;
-        if (aborted_) {
-            return;
-        }
+// Runs on the audio loop, the only reader of the codec
+void Application::RunLatencyProbe() {
+    auto codec = codec_;
+    bool output_enabled = codec->output_enabled();
+    if (!output_enabled) {
+        codec->EnableOutput(true);
+    }
 
-        std::vector<int16_t> pcm;
-        if (!opus_decoder_->Decode(std::move(opus), pcm)) {
-            return;
+    LatencyProbe probe(codec);
+    auto& telemetry = AudioTelemetry::GetInstance();
+    int detected = 0;
+    int64_t total_us = 0;
+    int64_t min_us = INT64_MAX;
+    int64_t max_us = 0;
+    for (int i = 0; i < LATENCY_PROBE_ROUNDS; i++) {
+        int64_t latency_us = probe.Measure();
+        if (latency_us < 0) {
+            continue;
         }
-        // Resample if the sample rate is different
-        if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-            int target_size = output_resampler_.GetOutputSamples(pcm.size());
-            std::vector<int16_t> resampled(target_size);
-            output_resampler_.Process(pcm.data(), pcm.size(), resampled.data());
-            pcm = std::move(resampled);
+        telemetry.Record(kAudioStageLoopback, latency_us);
+        detected++;
+        total_us += latency_us;
+        min_us = std::min(min_us, latency_us);
+        max_us = std::max(max_us, latency_us);
+    }
+
+    if (!output_enabled) {
+        codec->EnableOutput(false);
+    }
+    if (detected == 0) {
+        ESP_LOGW(TAG, "Loopback latency: chirp not detected, check the volume and the microphone");
+    } else {
+        ESP_LOGI(TAG, "Loopback latency: avg %lld ms, min %lld ms, max %lld ms (%d/%d rounds, TX DMA %d ms)",
+            total_us / detected / 1000, min_us / 1000, max_us / 1000, detected, LATENCY_PROBE_ROUNDS,
+            codec->output_dma_ms());
+    }
+
+    // The server leg over the control channel, recorded when the echo comes back
+    Schedule([this]() {
+        if (protocol_ && protocol_->IsAudioChannelOpened()) {
+            protocol_->SendLatencyProbe((int)(esp_timer_get_time() / 1000));
         }
-        codec->OutputData(pcm);
-        last_output_time_ = std::chrono::steady_clock::now();
     });
 }
+#endif
 
-void Application::OnAudioInput() {
-#if CONFIG_USE_WAKE_WORD_DETECT
-    if (wake_word_detect_.IsDetectionRunning()) {
-        std::vector<int16_t> data;
-        int samples = wake_word_detect_.GetFeedSize();
-        if (samples > 0) {
-            ReadAudio(data, 16000, samples);
-            wake_word_detect_.Feed(data);
-            return;
-        }
+// Reserve the scratch buffers for the largest frame any consumer asks for (60ms at the codec rate)
+void Application::PrepareInputStage() {
+#if AUDIO_CODEC_INPUT_RESAMPLE
+    const int max_frame = codec_->input_sample_rate() * 60 / 1000 * codec_->input_channels();
+    codec_frame_.reserve(max_frame);
+    if (codec_->input_sample_rate() != 16000 && codec_->input_channels() == 2) {
+        mic_channel_.reserve(max_frame / 2);
+        reference_channel_.reserve(max_frame / 2);
+        resampled_mic_.reserve(input_resampler_.GetOutputSamples(max_frame / 2));
+        resampled_reference_.reserve(reference_resampler_.GetOutputSamples(max_frame / 2));
+    } else if (codec_->input_sample_rate() != 16000) {
+        // Only used when a read would overrun the caller's buffer
+        resampled_mic_.reserve(input_resampler_.GetOutputSamples(max_frame));
     }
 #endif
-#if CONFIG_USE_AUDIO_PROCESSOR
-    if (audio_processor_.IsRunning()) {
-        std::vector<int16_t> data;
-        int samples = audio_processor_.GetFeedSize();
-        if (samples > 0) {
-            ReadAudio(data, 16000, samples);
-            audio_processor_.Feed(data);
-            return;
-        }
+}
+
+// Fills data with samples at 16kHz and returns how many were written, 0 if the read failed
+int Application::ReadAudio(int16_t* data, int samples) {
+    ScopedAudioLatency latency(kAudioStageCapture);
+    auto codec = codec_;
+    uint32_t overruns = codec->TakeInputOverruns();
+    if (overruns > 0) {
+        AudioTelemetry::GetInstance().Count(kAudioCounterI2sOverruns, overruns);
     }
+#if !AUDIO_CODEC_INPUT_RESAMPLE
+    return codec->InputData(data, samples) ? samples : 0;
 #else
-    if (device_state_ == kDeviceStateListening) {
-        std::vector<int16_t> data;
-        ReadAudio(data, 16000, 30 * 16000 / 1000);
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            if (protocol_->IsAudioChannelBusy()) {
-                return;
-            }
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
-                });
-            });
-        });
-        return;
+    if (codec->input_sample_rate() == 16000) {
+        return codec->InputData(data, samples) ? samples : 0;
     }
-#endif
-    vTaskDelay(pdMS_TO_TICKS(30));
-}
 
-void Application::ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples) {
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (codec->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec->input_sample_rate() / sample_rate);
-        if (!codec->InputData(data)) {
-            return;
-        }
-        if (codec->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
-        } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+    // Read at the codec rate, then resample straight into data
+    codec_frame_.resize(samples * codec->input_sample_rate() / 16000);
+    if (!codec->InputData(codec_frame_)) {
+        return 0;
+    }
+    if (codec->input_channels() == 2) {
+        size_t frames = codec_frame_.size() / 2;
+        mic_channel_.resize(frames);
+        reference_channel_.resize(frames);
+        for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+            mic_channel_[i] = codec_frame_[j];
+            reference_channel_[i] = codec_frame_[j + 1];
         }
-    } else {
-        data.resize(samples);
-        if (!codec->InputData(data)) {
-            return;
+        // Both channels share the kernel and advance in step, so they return the same count
+        resampled_mic_.resize(input_resampler_.GetOutputSamples(frames));
+        resampled_reference_.resize(reference_resampler_.GetOutputSamples(frames));
+        resampled_mic_.resize(input_resampler_.Process(mic_channel_.data(), frames, resampled_mic_.data()));
+        resampled_reference_.resize(reference_resampler_.Process(reference_channel_.data(), frames, resampled_reference_.data()));
+        // A phase carry may yield one frame more than asked for, data has no room for it
+        int output_frames = std::min((int)resampled_mic_.size(), samples / 2);
+        for (int i = 0, j = 0; i < output_frames; ++i, j += 2) {
+            data[j] = resampled_mic_[i];
+            data[j + 1] = resampled_reference_[i];
         }
+        return output_frames * 2;
+    }
+    int frames = codec_frame_.size();
+    if (input_resampler_.GetOutputSamples(frames) <= samples) {
+        return input_resampler_.Process(codec_frame_.data(), frames, data);
     }
+    resampled_mic_.resize(input_resampler_.GetOutputSamples(frames));
+    int output = std::min(input_resampler_.Process(codec_frame_.data(), frames, resampled_mic_.data()), samples);
+    std::copy_n(resampled_mic_.begin(), output, data);
+    return output;
+#endif
 }
 
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+#if CONFIG_USE_TTS_CACHE
+    // The rest of the sentence will not come
+    TtsCache::GetInstance().EndRecording(false);
+#endif
     protocol_->SendAbortSpeaking(reason);
 }
 
@@ -665,12 +1249,21 @@ void Application::SetDeviceState(DeviceState state) {
         return;
     }
     
+    // The power mode belongs to the main loop, other tasks change the state too
+    if (xTaskGetCurrentTaskHandle() == main_task_handle_) {
+        ExitIdlePowerMode();
+    } else {
+        Schedule([this]() {
+            ExitIdlePowerMode();
+        });
+    }
     clock_ticks_ = 0;
     auto previous_state = device_state_;
     device_state_ = state;
     ESP_LOGI(TAG, "STATE: %s", STATE_STRINGS[device_state_]);
-    // The state is changed, wait for all background tasks to finish
-    background_task_->WaitForCompletion();
+    TRACE_COUNTER(kTraceDeviceState, state);
+    // The state is changed, wait for the uplink audio of the previous state to finish
+    background_task_->WaitForCompletion(uplink_tasks_);
 
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
@@ -681,11 +1274,20 @@ void Application::SetDeviceState(DeviceState state) {
         case kDeviceStateIdle:
             display->SetStatus(Lang::Strings::STANDBY);
             display->SetEmotion("neutral");
+            StopUplinkBuffering();
 #if CONFIG_USE_AUDIO_PROCESSOR
             audio_processor_.Stop();
 #endif
 #if CONFIG_USE_WAKE_WORD_DETECT
             wake_word_detect_.StartDetection();
+#endif
+            // Connect in the background while waiting for the wake word
+            if (protocol_) {
+                protocol_->PrepareAudioChannel();
+            }
+#if CONFIG_USE_TTS_CACHE
+            // The new replies are written while no turn runs, around the entries that may still play
+            FlushTtsCache();
 #endif
             break;
         case kDeviceStateConnecting:
@@ -700,24 +1302,42 @@ void Application::SetDeviceState(DeviceState state) {
             // Update the IoT states before sending the start listening command
             UpdateIotStates();
 
-            // Make sure the audio processor is running
+            // Make sure the audio processor is running, it already is when the audio was buffered
 #if CONFIG_USE_AUDIO_PROCESSOR
-            if (!audio_processor_.IsRunning()) {
+            if (!audio_processor_.IsRunning() || uplink_buffering_) {
 #else
             if (true) {
 #endif
                 // Send the start listening command
                 protocol_->SendStartListening(listening_mode_);
-                if (listening_mode_ == kListeningModeAutoStop && previous_state == kDeviceStateSpeaking) {
-                    // FIXME: Wait for the speaker to empty the buffer
-                    vTaskDelay(pdMS_TO_TICKS(120));
+                if (uplink_buffering_) {
+                    // The encoder runs since the press, keep its state
+                    FlushUplinkBuffer();
+                } else {
+                    if (listening_mode_ == kListeningModeAutoStop && previous_state == kDeviceStateSpeaking) {
+                        // FIXME: Wait for the speaker to empty the buffer
+                        vTaskDelay(pdMS_TO_TICKS(120));
+                    }
+                    // Behind the chunks already queued, the encoder and its tuner belong to the uplink group
+                    background_task_->Schedule([this]() {
+                        opus_encoder_->ResetState();
+                        encoder_tuner_.Reset();
+                    }, kBackgroundTaskWait, &uplink_tasks_);
                 }
-                opus_encoder_->ResetState();
 #if CONFIG_USE_WAKE_WORD_DETECT
-                wake_word_detect_.StopDetection();
+                if (KeepWakeWordDetection()) {
+                    wake_word_detect_.StartDetection();
+                } else {
+                    wake_word_detect_.StopDetection();
+                }
 #endif
 #if CONFIG_USE_AUDIO_PROCESSOR
-                audio_processor_.Start();
+#if CONFIG_USE_VAD_GATED_UPLINK
+                audio_processor_.SetUplinkGate(listening_mode_ == kListeningModeAutoStop);
+#endif
+                if (!audio_processor_.IsRunning()) {
+                    audio_processor_.Start();
+                }
 #endif
             }
             break;
@@ -738,32 +1358,13 @@ void Application::SetDeviceState(DeviceState state) {
             // Do nothing
             break;
     }
+    // Detection or the audio processor may have started
+    NotifyAudioInput();
 }
 
 void Application::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    opus_decoder_->ResetState();
-    audio_decode_queue_.clear();
-    audio_decode_cv_.notify_all();
-    last_output_time_ = std::chrono::steady_clock::now();
-    
-    auto codec = Board::GetInstance().GetAudioCodec();
-    codec->EnableOutput(true);
-}
-
-void Application::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
-        return;
-    }
-
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
-
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
-        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
-    }
+    playback_.Reset();
+    codec_->EnableOutput(true);
 }
 
 void Application::UpdateIotStates() {
@@ -779,14 +1380,148 @@ void Application::Reboot() {
     esp_restart();
 }
 
+#if CONFIG_USE_OFFLINE_COMMANDS
+// Runs on the main loop. Nothing here waits for the server, the new states are reported right
+// away when the audio channel is open, otherwise they stay pending for the next conversation.
+void Application::HandleOfflineCommand(const std::string& text, const std::string& action) {
+    auto display = Board::GetInstance().GetDisplay();
+    if (action == "volume_up" || action == "volume_down") {
+        int volume = codec_->output_volume() + (action == "volume_up" ? 10 : -10);
+        volume = std::max(0, std::min(100, volume));
+        codec_->SetOutputVolume(volume);
+        display->ShowNotification(Lang::Strings::VOLUME + std::to_string(volume));
+    } else if (action == "stop") {
+        if (device_state_ == kDeviceStateSpeaking) {
+            AbortSpeaking(kAbortReasonNone);
+        } else if (device_state_ == kDeviceStateListening) {
+            StopListening();
+        }
+        display->ShowNotification(text);
+    } else {
+        auto command = cJSON_Parse(action.c_str());
+        if (command == nullptr) {
+            ESP_LOGE(TAG, "Invalid offline command action: %s", action.c_str());
+            return;
+        }
+        auto err = iot::ThingManager::GetInstance().Invoke(command);
+        cJSON_Delete(command);
+        if (err != ESP_OK) {
+            return;
+        }
+        display->ShowNotification(text);
+    }
+
+    if (protocol_ && protocol_->IsAudioChannelOpened()) {
+        UpdateIotStates();
+    }
+}
+#endif
+
+#if CONFIG_USE_CONVERSATION_RECORDER
+// Called on the audio paths: only the packet handle is queued, the copy into the ring runs on
+// the background task. The packet is dropped, not waited for, when the queue is full.
+void Application::RecordAudio(RecordDirection direction, const AudioPacket& packet) {
+    uint32_t timestamp_ms = esp_timer_get_time() / 1000;
+    background_task_->Schedule([direction, timestamp_ms, packet]() {
+        ConversationRecorder::GetInstance().Store(direction, timestamp_ms, packet);
+    }, kBackgroundTaskDropNewest, &recorder_tasks_);
+}
+
+// Runs on the main loop, the upload runs on its own task and keeps recording meanwhile
+void Application::UploadRecording() {
+    if (recording_uploading_) {
+        ESP_LOGW(TAG, "Recording upload already running");
+        return;
+    }
+    recording_uploading_ = true;
+    auto ret = xTaskCreatePinnedToCore([](void* arg) {
+        auto& app = Application::GetInstance();
+        auto& recorder = ConversationRecorder::GetInstance();
+        uint32_t begin, end;
+        recorder.GetRange(begin, end);
+        size_t parts = std::max<size_t>(1, (end - begin + CONVERSATION_RECORDER_UPLOAD_RECORDS - 1) / CONVERSATION_RECORDER_UPLOAD_RECORDS);
+        // Only one part is in memory at a time, the ring keeps recording meanwhile
+        app.ota_->UploadRecording(parts, [&recorder, begin, end](size_t part, std::string& data) {
+            uint32_t part_begin = begin + part * CONVERSATION_RECORDER_UPLOAD_RECORDS;
+            recorder.Serialize(part_begin, std::min<uint32_t>(part_begin + CONVERSATION_RECORDER_UPLOAD_RECORDS, end), data);
+        });
+        app.Schedule([&app]() {
+            app.recording_uploading_ = false;
+        });
+        vTaskDelete(NULL);
+    }, "upload_audio", TASK_NETWORK_STACK_SIZE, nullptr, TASK_NETWORK_PRIORITY, nullptr, TASK_CORE(TASK_NETWORK_CORE));
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the recording upload task");
+        recording_uploading_ = false;
+    }
+}
+#endif
+
+#if CONFIG_USE_TTS_CACHE
+// Runs on the network task. Only when the frames arrive in order with the JSON are they known
+// to belong to the sentence, otherwise the hash is ignored and the sentence streams as usual.
+void Application::HandleTtsSentence(const JsonMessage& json) {
+    auto& cache = TtsCache::GetInstance();
+    tts_cache_skipping_ = false;
+    std::string hash;
+    if (!cache.IsMounted() || !protocol_->IsAudioInOrderWithJson() || !json.GetString("hash", hash)) {
+        cache.EndRecording();
+        return;
+    }
+
+    auto sound = cache.Find(hash);
+    if (!sound.empty()) {
+        cache.EndRecording();
+        ESP_LOGI(TAG, "Reply %s from the cache", hash.c_str());
+        tts_cache_skipping_ = true;
+        protocol_->SendTtsCached(hash);
+        // Behind the tts start task, which resets the decoder when speaking starts
+        uint32_t sequence = last_stream_sequence_;
+        Schedule([this, sound, sequence]() {
+            if (!aborted_) {
+                playback_.PlayReply(sound, sequence);
+            }
+        });
+        return;
+    }
+    // The sound voices decode with a buffer of AUDIO_SOUND_MAX_FRAME_DURATION_MS
+    if (protocol_->server_frame_duration() <= AUDIO_SOUND_MAX_FRAME_DURATION_MS) {
+        cache.BeginRecording(hash, protocol_->server_sample_rate(), protocol_->server_frame_duration());
+    } else {
+        cache.EndRecording();
+    }
+}
+
+void Application::FlushTtsCache() {
+    if (tts_cache_flushing_) {
+        return;
+    }
+    tts_cache_flushing_ = true;
+    auto ret = xTaskCreatePinnedToCore([](void* arg) {
+        auto& app = Application::GetInstance();
+        TtsCache::GetInstance().Flush();
+        app.Schedule([&app]() {
+            app.tts_cache_flushing_ = false;
+        });
+        vTaskDelete(NULL);
+    }, "tts_cache", TASK_NETWORK_STACK_SIZE, nullptr, TASK_NETWORK_PRIORITY, nullptr, TASK_CORE(TASK_NETWORK_CORE));
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the TTS cache flush task");
+        tts_cache_flushing_ = false;
+    }
+}
+#endif
+
 void Application::WakeWordInvoke(const std::string& wake_word) {
     if (device_state_ == kDeviceStateIdle) {
-        ToggleChatState();
         Schedule([this, wake_word]() {
-            if (protocol_) {
-                protocol_->SendWakeWordDetected(wake_word); 
+            if (protocol_ && device_state_ == kDeviceStateIdle) {
+                auto mode = realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop;
+                OpenAndListen(mode, [this, wake_word]() {
+                    protocol_->SendWakeWordDetected(wake_word);
+                });
             }
-        }); 
+        });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
@@ -813,29 +1548,43 @@ bool Application::CanEnterSleepMode() {
     return true;
 }
 
-bool Application::UpgradeFirmware(const std::string& url, const std::string& version) {
+bool Application::UpgradeFirmware(const std::string& url, const std::string& version, const std::string& patch_url,
+    bool wait_for_idle) {
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
 
     std::string upgrade_url = url;
     std::string version_info = version.empty() ? "(Manual upgrade)" : version;
-
-    if (protocol_ && protocol_->IsAudioChannelOpened()) {
-        ESP_LOGI(TAG, "Closing audio channel before firmware upgrade");
-        protocol_->CloseAudioChannel();
-    }
-    ESP_LOGI(TAG, "Starting firmware upgrade from URL: %s", upgrade_url.c_str());
-
-    Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "download", Lang::Sounds::P3_UPGRADE);
-    
-    SetDeviceState(kDeviceStateUpgrading);
-
     std::string message = std::string(Lang::Strings::NEW_VERSION) + version_info;
-    display->SetChatMessage("system", message.c_str());
 
-    if (audio_loop_task_handle_) {
-        vTaskSuspend(audio_loop_task_handle_);
+    // The state is checked on the main loop, a wake word may come in at any time
+    bool started = false;
+    auto start = [this, display, &message, &started]() {
+        if (device_state_ != kDeviceStateIdle && device_state_ != kDeviceStateStarting) {
+            return;
+        }
+        started = true;
+        if (protocol_ && protocol_->IsAudioChannelOpened()) {
+            ESP_LOGI(TAG, "Closing audio channel before firmware upgrade");
+            protocol_->CloseAudioChannel();
+        }
+        Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "download", Lang::Sounds::P3_UPGRADE());
+        SetDeviceState(kDeviceStateUpgrading);
+        display->SetChatMessage("system", message.c_str());
+        if (audio_loop_task_handle_) {
+            vTaskSuspend(audio_loop_task_handle_);
+        }
+    };
+    RunOnMainLoop(start);
+    while (!started && wait_for_idle) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        RunOnMainLoop(start);
+    }
+    if (!started) {
+        ESP_LOGI(TAG, "Device busy, firmware upgrade postponed");
+        return false;
     }
+    ESP_LOGI(TAG, "Starting firmware upgrade from URL: %s", upgrade_url.c_str());
 
     vTaskDelay(pdMS_TO_TICKS(1000));
 
@@ -845,21 +1594,26 @@ bool Application::UpgradeFirmware(const std::string& url, const std::string& ver
         Application::GetInstance().Schedule([display, buffer_str = std::string(buffer)]() {
              display->SetChatMessage("system", buffer_str.c_str());
         });
-    });
-
-    if (audio_loop_task_handle_) {
-        vTaskResume(audio_loop_task_handle_);
-    }
+    }, patch_url);
 
     if (!upgrade_success) {
         ESP_LOGE(TAG, "Firmware upgrade failed");
-        Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "circle_xmark", Lang::Sounds::P3_EXCLAMATION);
+        RunOnMainLoop([this]() {
+            if (audio_loop_task_handle_) {
+                vTaskResume(audio_loop_task_handle_);
+            }
+            Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "circle_xmark", Lang::Sounds::P3_EXCLAMATION());
+        });
         vTaskDelay(pdMS_TO_TICKS(3000));
-        SetDeviceState(kDeviceStateIdle); 
+        RunOnMainLoop([this]() {
+            SetDeviceState(kDeviceStateIdle);
+        });
         return false;
     } else {
         ESP_LOGI(TAG, "Firmware upgrade successful, rebooting...");
-        display->SetChatMessage("system", "Upgrade successful, rebooting...");
+        RunOnMainLoop([display]() {
+            display->SetChatMessage("system", "Upgrade successful, rebooting...");
+        });
         vTaskDelay(pdMS_TO_TICKS(1000));
         Reboot();
         return true;
@@ -872,19 +1626,19 @@ void Application::ShowActivationCode(const std::string& code, const std::string&
         const std::string_view& sound;
     };
     static const std::array<digit_sound, 10> digit_sounds{{
-        digit_sound{'0', Lang::Sounds::P3_0},
-        digit_sound{'1', Lang::Sounds::P3_1}, 
-        digit_sound{'2', Lang::Sounds::P3_2},
-        digit_sound{'3', Lang::Sounds::P3_3},
-        digit_sound{'4', Lang::Sounds::P3_4},
-        digit_sound{'5', Lang::Sounds::P3_5},
-        digit_sound{'6', Lang::Sounds::P3_6},
-        digit_sound{'7', Lang::Sounds::P3_7},
-        digit_sound{'8', Lang::Sounds::P3_8},
-        digit_sound{'9', Lang::Sounds::P3_9}
+        digit_sound{'0', Lang::Sounds::P3_0()},
+        digit_sound{'1', Lang::Sounds::P3_1()}, 
+        digit_sound{'2', Lang::Sounds::P3_2()},
+        digit_sound{'3', Lang::Sounds::P3_3()},
+        digit_sound{'4', Lang::Sounds::P3_4()},
+        digit_sound{'5', Lang::Sounds::P3_5()},
+        digit_sound{'6', Lang::Sounds::P3_6()},
+        digit_sound{'7', Lang::Sounds::P3_7()},
+        digit_sound{'8', Lang::Sounds::P3_8()},
+        digit_sound{'9', Lang::Sounds::P3_9()}
     }};
 
-    Alert(Lang::Strings::ACTIVATION, message.c_str(), "link", Lang::Sounds::P3_ACTIVATION);
+    Alert(Lang::Strings::ACTIVATION, message.c_str(), "link", Lang::Sounds::P3_ACTIVATION());
 
     for (const auto& digit : code) {
         auto it = std::find_if(digit_sounds.begin(), digit_sounds.end(),
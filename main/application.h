@@ -7,19 +7,33 @@
 #include <esp_timer.h>
 
 #include <string>
+#include <atomic>
 #include <mutex>
-#include <list>
 #include <vector>
 #include <condition_variable>
+#include <functional>
+#include <memory>
 
 #include <opus_encoder.h>
 #include <opus_decoder.h>
-#include <opus_resampler.h>
 
 #include "protocol.h"
 #include "ota.h"
 #include "background_task.h"
-
+#include "main_task_queue.h"
+#include "audio_playback.h"
+#include "audio_packet_ring.h"
+#include "audio_codec.h"
+#include "encoder_tuner.h"
+#include "polyphase_resampler.h"
+#include "power_manager.h"
+#include "conversation_recorder.h"
+#include "tts_cache.h"
+#include "timer_service.h"
+
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+#include "audio_front_end.h"
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
 #include "wake_word_detect.h"
 #endif
@@ -29,7 +43,7 @@
 
 #define SCHEDULE_EVENT (1 << 0)
 #define AUDIO_INPUT_READY_EVENT (1 << 1)
-#define AUDIO_OUTPUT_READY_EVENT (1 << 2)
+#define AUDIO_FRONT_END_READY_EVENT (1 << 2)
 #define CHECK_NEW_VERSION_DONE_EVENT (1 << 3)
 
 enum DeviceState {
@@ -45,8 +59,6 @@ enum DeviceState {
     kDeviceStateFatalError
 };
 
-#define OPUS_FRAME_DURATION_MS 60
-
 class Application {
 public:
     static Application& GetInstance() {
@@ -60,7 +72,8 @@ public:
     void Start();
     DeviceState GetDeviceState() const { return device_state_; }
     bool IsVoiceDetected() const { return voice_detected_; }
-    void Schedule(std::function<void()> callback);
+    // Audio sends use kTaskPriorityRealtime so they never queue behind UI and JSON work
+    void Schedule(MainTask&& task, TaskPriority priority = kTaskPriorityNormal);
     void SetDeviceState(DeviceState state);
     void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
     void DismissAlert();
@@ -68,18 +81,33 @@ public:
     void ToggleChatState();
     void StartListening();
     void StopListening();
+    // Button press down, before the click is confirmed: starts opening the audio channel and
+    // buffering the microphone, the following ToggleChatState / StartListening takes both over
+    void PrepareListening();
     void UpdateIotStates();
     void Reboot();
     void WakeWordInvoke(const std::string& wake_word);
     void PlaySound(const std::string_view& sound);
     bool CanEnterSleepMode();
-    bool UpgradeFirmware(const std::string& url, const std::string& version = "");
+    // Downloads on the calling task, never the main loop; the state change and the UI run on the
+    // main loop, which refuses the upgrade unless the device is idle. `wait_for_idle` retries
+    // every second instead.
+    bool UpgradeFirmware(const std::string& url, const std::string& version = "", const std::string& patch_url = "",
+        bool wait_for_idle = false);
     void ShowActivationCode(const std::string& code, const std::string& message);
+#if CONFIG_USE_LATENCY_PROBE
+    // Measures the speaker to microphone latency once playback is idle, then the server round
+    // trip. Both are recorded in AudioTelemetry. Safe from any task.
+    void MeasureLatency();
+#endif
 
 private:
     Application();
     ~Application();
 
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+    AudioFrontEnd audio_front_end_;
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
     WakeWordDetect wake_word_detect_;
 #endif
@@ -87,11 +115,10 @@ private:
     AudioProcessor audio_processor_;
 #endif
     std::unique_ptr<Ota> ota_;
-    std::mutex mutex_;
-    std::list<std::function<void()>> main_tasks_;
+    MainTaskQueue main_tasks_;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
-    esp_timer_handle_t clock_timer_handle_ = nullptr;
+    ServiceTimer* clock_timer_ = nullptr;
     volatile DeviceState device_state_ = kDeviceStateUnknown;
     ListeningMode listening_mode_ = kListeningModeAutoStop;
 #if CONFIG_USE_REALTIME_CHAT
@@ -101,35 +128,104 @@ private:
 #endif
     bool aborted_ = false;
     bool voice_detected_ = false;
-    bool busy_decoding_audio_ = false;
     int clock_ticks_ = 0;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
+    TaskHandle_t main_task_handle_ = nullptr;
+
+    // Idle power mode, entered after IDLE_POWER_SAVE_DELAY_SECONDS in the idle state
+    PowerManager power_manager_;
+    int idle_seconds_ = 0;
 
     // Audio encode / decode
     TaskHandle_t audio_loop_task_handle_ = nullptr;
     BackgroundTask* background_task_ = nullptr;
-    std::chrono::steady_clock::time_point last_output_time_;
-    std::list<std::vector<uint8_t>> audio_decode_queue_;
-    std::condition_variable audio_decode_cv_;
+    // Encode and VAD gate tasks, in order, the only work a state change has to wait for
+    BackgroundTaskGroup uplink_tasks_;
+#if CONFIG_USE_CONVERSATION_RECORDER
+    // Recorder stores, serial so the ring has a single writer
+    BackgroundTaskGroup recorder_tasks_;
+    bool recording_uploading_ = false;
+#endif
+    AudioPlayback playback_;
 
     std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
-
-    OpusResampler input_resampler_;
-    OpusResampler reference_resampler_;
-    OpusResampler output_resampler_;
+    EncoderTuner encoder_tuner_;
+
+    // Resolved once in Start(), the board never changes its codec
+    AudioCodec* codec_ = nullptr;
+
+    // Input stage scratch buffers, reserved in Start() so the audio loop never allocates.
+    // The AFE path reads into the front end's feed buffer, these only exist for resampling.
+#if AUDIO_CODEC_INPUT_RESAMPLE
+    PolyphaseResampler input_resampler_;
+    PolyphaseResampler reference_resampler_;
+    std::vector<int16_t> codec_frame_;
+    std::vector<int16_t> mic_channel_;
+    std::vector<int16_t> reference_channel_;
+    std::vector<int16_t> resampled_mic_;
+    std::vector<int16_t> resampled_reference_;
+#endif
+#if CONFIG_USE_TTS_CACHE
+    // Network task only: the sentence plays from the cache and its frames still in flight are
+    // dropped; the dropped frames are taken out of the sequence so the jitter buffer sees no gap
+    bool tts_cache_skipping_ = false;
+    uint32_t tts_cache_skipped_frames_ = 0;
+    uint32_t last_stream_sequence_ = 0;
+    bool tts_cache_flushing_ = false;
+#endif
+#if CONFIG_USE_LATENCY_PROBE
+    std::atomic<bool> latency_probe_pending_{false};
+    void RunLatencyProbe();
+#endif
 
+    // Audio channel opening, runs on its own task; the main task only sees the result
+    bool channel_opening_ = false;
+    std::function<void(bool opened)> channel_open_callback_;
+    // Set by PrepareListening on the main task, the clock timer abandons it when no click follows
+    std::atomic<int64_t> speculative_open_time_{0};
+    // Press up arrived while connecting, stop right after the buffered audio went out
+    bool stop_after_open_ = false;
+    // Encoded uplink frames kept while the channel opens, sent right behind listen start
+    std::atomic<bool> uplink_buffering_{false};
+    std::unique_ptr<AudioPacketRing> uplink_buffer_;
+
+    void OpenAudioChannelAsync(std::function<void(bool opened)> callback);
+    void OpenAndListen(ListeningMode mode, std::function<void()> on_opened = nullptr);
+    void CancelSpeculativeOpen();
+    void StartUplinkBuffering();
+    void StopUplinkBuffering();
+    void FlushUplinkBuffer();
+    // Runs the task on the main loop and waits for it, in place when called from the main task
+    void RunOnMainLoop(MainTask&& task);
     void MainEventLoop();
-    void OnAudioInput();
-    void OnAudioOutput();
-    void ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples);
+    bool OnAudioInput();
+    void NotifyAudioInput();
+    bool KeepWakeWordDetection() const;
+    void EncodeUplink(std::vector<int16_t>&& data);
+    void PrepareInputStage();
+    // `samples` at 16 kHz, interleaved like the codec input
+    int ReadAudio(int16_t* data, int samples);
     void ResetDecoder();
-    void SetDecodeSampleRate(int sample_rate, int frame_duration);
+    void StartAudioFrontEnd(AudioCodec* codec);
+    void InitializeAudioFrontEnd(AudioCodec* codec);
     void CheckNewVersion();
     void ShowActivationCode();
     void OnClockTimer();
+    void EnterIdlePowerMode();
+    void ExitIdlePowerMode();
     void SetListeningMode(ListeningMode mode);
     void AudioLoop();
+#if CONFIG_USE_CONVERSATION_RECORDER
+    void RecordAudio(RecordDirection direction, const AudioPacket& packet);
+    void UploadRecording();
+#endif
+#if CONFIG_USE_TTS_CACHE
+    void HandleTtsSentence(const JsonMessage& json);
+    void FlushTtsCache();
+#endif
+#if CONFIG_USE_OFFLINE_COMMANDS
+    void HandleOfflineCommand(const std::string& text, const std::string& action);
+#endif
 };
 
 #endif // _APPLICATION_H_
@@ -0,0 +1,105 @@
+#include "asset_store.h"
+#include "assets/lang_config.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#define TAG "AssetStore"
+
+AssetStore::AssetStore() {
+    Mount("assets");
+}
+
+AssetStore::~AssetStore() {
+    if (data_ != nullptr) {
+        esp_partition_munmap(mmap_handle_);
+    }
+}
+
+bool AssetStore::Mount(const char* partition_label) {
+    auto partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (partition == nullptr) {
+        ESP_LOGW(TAG, "No %s partition", partition_label);
+        return false;
+    }
+
+    AssetStoreHeader header;
+    if (esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read the asset header");
+        return false;
+    }
+    if (header.magic != ASSET_STORE_MAGIC || header.version != ASSET_STORE_VERSION) {
+        ESP_LOGW(TAG, "No valid assets in the %s partition", partition_label);
+        return false;
+    }
+    if (header.total_size > partition->size ||
+        header.index_offset + header.entry_count * sizeof(AssetStoreEntry) > header.total_size) {
+        ESP_LOGE(TAG, "Asset header out of range");
+        return false;
+    }
+
+    // Only the used part is mapped, the MMU pages are shared with nothing else
+    const void* data = nullptr;
+    esp_err_t err = esp_partition_mmap(partition, 0, header.total_size, ESP_PARTITION_MMAP_DATA, &data, &mmap_handle_);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map the %s partition: %s", partition_label, esp_err_to_name(err));
+        return false;
+    }
+
+    auto entries = reinterpret_cast<const AssetStoreEntry*>(static_cast<const uint8_t*>(data) + header.index_offset);
+    for (uint16_t i = 0; i < header.entry_count; i++) {
+        if (entries[i].offset + entries[i].size > header.total_size) {
+            ESP_LOGE(TAG, "Asset %.*s out of range", ASSET_STORE_NAME_LENGTH, entries[i].name);
+            esp_partition_munmap(mmap_handle_);
+            return false;
+        }
+    }
+
+    partition_ = partition;
+    data_ = static_cast<const uint8_t*>(data);
+    entries_ = entries;
+    entry_count_ = header.entry_count;
+    ESP_LOGI(TAG, "Mapped %u assets, %lu bytes", entry_count_, header.total_size);
+    return true;
+}
+
+const AssetStoreEntry* AssetStore::Find(std::string_view name) const {
+    if (data_ == nullptr || name.size() > ASSET_STORE_NAME_LENGTH) {
+        return nullptr;
+    }
+    auto entry_name = [](const AssetStoreEntry& entry) {
+        return std::string_view(entry.name, strnlen(entry.name, ASSET_STORE_NAME_LENGTH));
+    };
+    auto end = entries_ + entry_count_;
+    auto it = std::lower_bound(entries_, end, name, [&](const AssetStoreEntry& entry, std::string_view value) {
+        return entry_name(entry) < value;
+    });
+    if (it == end || entry_name(*it) != name) {
+        return nullptr;
+    }
+    return it;
+}
+
+std::string_view AssetStore::Get(std::string_view name, AssetFormat format) const {
+    auto entry = Find(name);
+    if (entry == nullptr || entry->format != format) {
+        return {};
+    }
+    return std::string_view(reinterpret_cast<const char*>(data_ + entry->offset), entry->size);
+}
+
+std::string_view AssetStore::GetSound(std::string_view name) const {
+    std::string key = std::string(Lang::CODE) + "/" + std::string(name);
+    auto sound = Get(key, kAssetFormatP3);
+    if (sound.empty()) {
+        key = "common/" + std::string(name);
+        sound = Get(key, kAssetFormatP3);
+    }
+    if (sound.empty() && data_ != nullptr) {
+        ESP_LOGW(TAG, "Sound %.*s not found", (int)name.size(), name.data());
+    }
+    return sound;
+}
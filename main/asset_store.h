@@ -0,0 +1,71 @@
+#ifndef ASSET_STORE_H
+#define ASSET_STORE_H
+
+#include <esp_partition.h>
+
+#include <cstdint>
+#include <string_view>
+
+#define ASSET_STORE_MAGIC 0x53415a58  // "XZAS"
+#define ASSET_STORE_VERSION 1
+#define ASSET_STORE_NAME_LENGTH 32
+
+enum AssetFormat : uint8_t {
+    kAssetFormatRaw = 0,
+    kAssetFormatP3 = 1,
+    kAssetFormatFont = 2,       // PartitionFont image
+};
+
+// Layout written by scripts/pack_assets.py, all little endian
+struct AssetStoreHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_count;
+    uint32_t index_offset;          // Entries sorted by name
+    uint32_t total_size;            // Header, index and data
+} __attribute__((packed));
+
+struct AssetStoreEntry {
+    char name[ASSET_STORE_NAME_LENGTH];     // "<language>/<name>" or "common/<name>", zero padded
+    uint32_t offset;                        // From the start of the partition, 4 byte aligned
+    uint32_t size;
+    uint8_t format;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+// Read-only assets kept in the "assets" partition instead of the app image. The partition is
+// memory mapped once, so the views returned here point straight into flash and stay valid
+// until reboot, nothing is copied into RAM.
+class AssetStore {
+public:
+    static AssetStore& GetInstance() {
+        static AssetStore instance;
+        return instance;
+    }
+    // 删除拷贝构造函数和赋值运算符
+    AssetStore(const AssetStore&) = delete;
+    AssetStore& operator=(const AssetStore&) = delete;
+
+    bool IsMounted() const { return data_ != nullptr; }
+    const esp_partition_t* partition() const { return partition_; }
+
+    // Exact name lookup, nullptr when missing
+    const AssetStoreEntry* Find(std::string_view name) const;
+    // Empty when missing or stored in another format
+    std::string_view Get(std::string_view name, AssetFormat format) const;
+    // Sound of the current language, then the common one
+    std::string_view GetSound(std::string_view name) const;
+
+private:
+    const esp_partition_t* partition_ = nullptr;
+    esp_partition_mmap_handle_t mmap_handle_ = 0;
+    const uint8_t* data_ = nullptr;
+    const AssetStoreEntry* entries_ = nullptr;
+    uint16_t entry_count_ = 0;
+
+    AssetStore();
+    ~AssetStore();
+    bool Mount(const char* partition_label);
+};
+
+#endif // ASSET_STORE_H
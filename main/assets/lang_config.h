@@ -58,142 +58,202 @@ namespace Lang {
 
         extern const char p3_0_start[] asm("_binary_0_p3_start");
         extern const char p3_0_end[] asm("_binary_0_p3_end");
-        static const std::string_view P3_0 {
+        inline const std::string_view& P3_0() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_0_start),
         static_cast<size_t>(p3_0_end - p3_0_start)
         };
+        return sound;
+        }
 
         extern const char p3_1_start[] asm("_binary_1_p3_start");
         extern const char p3_1_end[] asm("_binary_1_p3_end");
-        static const std::string_view P3_1 {
+        inline const std::string_view& P3_1() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_1_start),
         static_cast<size_t>(p3_1_end - p3_1_start)
         };
+        return sound;
+        }
 
         extern const char p3_2_start[] asm("_binary_2_p3_start");
         extern const char p3_2_end[] asm("_binary_2_p3_end");
-        static const std::string_view P3_2 {
+        inline const std::string_view& P3_2() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_2_start),
         static_cast<size_t>(p3_2_end - p3_2_start)
         };
+        return sound;
+        }
 
         extern const char p3_3_start[] asm("_binary_3_p3_start");
         extern const char p3_3_end[] asm("_binary_3_p3_end");
-        static const std::string_view P3_3 {
+        inline const std::string_view& P3_3() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_3_start),
         static_cast<size_t>(p3_3_end - p3_3_start)
         };
+        return sound;
+        }
 
         extern const char p3_4_start[] asm("_binary_4_p3_start");
         extern const char p3_4_end[] asm("_binary_4_p3_end");
-        static const std::string_view P3_4 {
+        inline const std::string_view& P3_4() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_4_start),
         static_cast<size_t>(p3_4_end - p3_4_start)
         };
+        return sound;
+        }
 
         extern const char p3_5_start[] asm("_binary_5_p3_start");
         extern const char p3_5_end[] asm("_binary_5_p3_end");
-        static const std::string_view P3_5 {
+        inline const std::string_view& P3_5() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_5_start),
         static_cast<size_t>(p3_5_end - p3_5_start)
         };
+        return sound;
+        }
 
         extern const char p3_6_start[] asm("_binary_6_p3_start");
         extern const char p3_6_end[] asm("_binary_6_p3_end");
-        static const std::string_view P3_6 {
+        inline const std::string_view& P3_6() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_6_start),
         static_cast<size_t>(p3_6_end - p3_6_start)
         };
+        return sound;
+        }
 
         extern const char p3_7_start[] asm("_binary_7_p3_start");
         extern const char p3_7_end[] asm("_binary_7_p3_end");
-        static const std::string_view P3_7 {
+        inline const std::string_view& P3_7() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_7_start),
         static_cast<size_t>(p3_7_end - p3_7_start)
         };
+        return sound;
+        }
 
         extern const char p3_8_start[] asm("_binary_8_p3_start");
         extern const char p3_8_end[] asm("_binary_8_p3_end");
-        static const std::string_view P3_8 {
+        inline const std::string_view& P3_8() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_8_start),
         static_cast<size_t>(p3_8_end - p3_8_start)
         };
+        return sound;
+        }
 
         extern const char p3_9_start[] asm("_binary_9_p3_start");
         extern const char p3_9_end[] asm("_binary_9_p3_end");
-        static const std::string_view P3_9 {
+        inline const std::string_view& P3_9() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_9_start),
         static_cast<size_t>(p3_9_end - p3_9_start)
         };
+        return sound;
+        }
 
         extern const char p3_activation_start[] asm("_binary_activation_p3_start");
         extern const char p3_activation_end[] asm("_binary_activation_p3_end");
-        static const std::string_view P3_ACTIVATION {
+        inline const std::string_view& P3_ACTIVATION() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_activation_start),
         static_cast<size_t>(p3_activation_end - p3_activation_start)
         };
+        return sound;
+        }
 
         extern const char p3_err_pin_start[] asm("_binary_err_pin_p3_start");
         extern const char p3_err_pin_end[] asm("_binary_err_pin_p3_end");
-        static const std::string_view P3_ERR_PIN {
+        inline const std::string_view& P3_ERR_PIN() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_err_pin_start),
         static_cast<size_t>(p3_err_pin_end - p3_err_pin_start)
         };
+        return sound;
+        }
 
         extern const char p3_err_reg_start[] asm("_binary_err_reg_p3_start");
         extern const char p3_err_reg_end[] asm("_binary_err_reg_p3_end");
-        static const std::string_view P3_ERR_REG {
+        inline const std::string_view& P3_ERR_REG() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_err_reg_start),
         static_cast<size_t>(p3_err_reg_end - p3_err_reg_start)
         };
+        return sound;
+        }
 
         extern const char p3_exclamation_start[] asm("_binary_exclamation_p3_start");
         extern const char p3_exclamation_end[] asm("_binary_exclamation_p3_end");
-        static const std::string_view P3_EXCLAMATION {
+        inline const std::string_view& P3_EXCLAMATION() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_exclamation_start),
         static_cast<size_t>(p3_exclamation_end - p3_exclamation_start)
         };
+        return sound;
+        }
 
         extern const char p3_low_battery_start[] asm("_binary_low_battery_p3_start");
         extern const char p3_low_battery_end[] asm("_binary_low_battery_p3_end");
-        static const std::string_view P3_LOW_BATTERY {
+        inline const std::string_view& P3_LOW_BATTERY() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_low_battery_start),
         static_cast<size_t>(p3_low_battery_end - p3_low_battery_start)
         };
+        return sound;
+        }
 
         extern const char p3_success_start[] asm("_binary_success_p3_start");
         extern const char p3_success_end[] asm("_binary_success_p3_end");
-        static const std::string_view P3_SUCCESS {
+        inline const std::string_view& P3_SUCCESS() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_success_start),
         static_cast<size_t>(p3_success_end - p3_success_start)
         };
+        return sound;
+        }
 
         extern const char p3_upgrade_start[] asm("_binary_upgrade_p3_start");
         extern const char p3_upgrade_end[] asm("_binary_upgrade_p3_end");
-        static const std::string_view P3_UPGRADE {
+        inline const std::string_view& P3_UPGRADE() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_upgrade_start),
         static_cast<size_t>(p3_upgrade_end - p3_upgrade_start)
         };
+        return sound;
+        }
 
         extern const char p3_vibration_start[] asm("_binary_vibration_p3_start");
         extern const char p3_vibration_end[] asm("_binary_vibration_p3_end");
-        static const std::string_view P3_VIBRATION {
+        inline const std::string_view& P3_VIBRATION() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_vibration_start),
         static_cast<size_t>(p3_vibration_end - p3_vibration_start)
         };
+        return sound;
+        }
 
         extern const char p3_welcome_start[] asm("_binary_welcome_p3_start");
         extern const char p3_welcome_end[] asm("_binary_welcome_p3_end");
-        static const std::string_view P3_WELCOME {
+        inline const std::string_view& P3_WELCOME() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_welcome_start),
         static_cast<size_t>(p3_welcome_end - p3_welcome_start)
         };
+        return sound;
+        }
 
         extern const char p3_wificonfig_start[] asm("_binary_wificonfig_p3_start");
         extern const char p3_wificonfig_end[] asm("_binary_wificonfig_p3_end");
-        static const std::string_view P3_WIFICONFIG {
+        inline const std::string_view& P3_WIFICONFIG() {
+        static const std::string_view sound {
         static_cast<const char*>(p3_wificonfig_start),
         static_cast<size_t>(p3_wificonfig_end - p3_wificonfig_start)
         };
+        return sound;
+        }
     }
 }
@@ -0,0 +1,246 @@
+#include "audio_benchmark.h"
+#include "polyphase_resampler.h"
+#include "pcm_convert.h"
+#include "task_topology.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_cpu.h>
+#include <esp_timer.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <opus_encoder.h>
+#include <opus_decoder.h>
+#include <mbedtls/aes.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define TAG "AudioBenchmark"
+
+// 与实际链路一致: I2S 24kHz 输入, 16kHz 60ms 编码上行; 16kHz 下行解码后重采样到 24kHz 输出
+#define BENCH_CODEC_SAMPLE_RATE 24000
+#define BENCH_OPUS_SAMPLE_RATE 16000
+#define BENCH_FRAME_DURATION_MS 60
+#define BENCH_I2S_SHIFT 12
+#define BENCH_MAX_STAGES 8
+// Distinct fixture frames, the iterations cycle through them so the memory does not grow with the count
+#define BENCH_FIXTURE_FRAMES 4
+
+// Allocations seen by the heap hooks while a frame is measured, from any task.
+// The benchmark runs before the application starts its tasks, so they are the stage's own.
+static volatile bool counting_allocations = false;
+static volatile uint32_t allocation_count = 0;
+
+extern "C" void IRAM_ATTR esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+    if (counting_allocations) {
+        allocation_count = allocation_count + 1;
+    }
+}
+
+extern "C" void IRAM_ATTR esp_heap_trace_free_hook(void* ptr) {
+}
+
+// Speech like fixture: two tones under a slow envelope over deterministic noise
+static std::vector<int16_t> MakeFixture(int sample_rate, int samples) {
+    std::vector<int16_t> pcm(samples);
+    uint32_t seed = 0x12345678;
+    for (int i = 0; i < samples; i++) {
+        float t = (float)i / sample_rate;
+        float envelope = 0.5f + 0.5f * sinf(2 * M_PI * 3 * t);
+        float value = envelope * (0.4f * sinf(2 * M_PI * 220 * t) + 0.2f * sinf(2 * M_PI * 1250 * t));
+        seed = seed * 1664525 + 1013904223;
+        value += ((int32_t)(seed >> 16) - 32768) / 32768.0f * 0.05f;
+        pcm[i] = (int16_t)(value * INT16_MAX);
+    }
+    return pcm;
+}
+
+bool AudioBenchmark::Run(int iterations, int budget_percent) {
+    struct Context {
+        int iterations;
+        int budget_percent;
+        TaskHandle_t waiter;
+        bool passed;
+    } context = { std::max(iterations, 1), budget_percent, xTaskGetCurrentTaskHandle(), false };
+
+    // The encoder needs the stack of the encode task, app_main's is far too small
+    xTaskCreatePinnedToCore([](void* arg) {
+        auto context = (Context*)arg;
+        context->passed = RunStages(context->iterations, context->budget_percent);
+        xTaskNotifyGive(context->waiter);
+        vTaskDelete(NULL);
+    }, "audio_benchmark", TASK_ENCODE_STACK_SIZE, &context, TASK_ENCODE_PRIORITY, nullptr, TASK_CORE(TASK_ENCODE_CORE));
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return context.passed;
+}
+
+bool AudioBenchmark::RunStages(int iterations, int budget_percent) {
+    const int codec_frame = BENCH_CODEC_SAMPLE_RATE * BENCH_FRAME_DURATION_MS / 1000;
+    const int opus_frame = BENCH_OPUS_SAMPLE_RATE * BENCH_FRAME_DURATION_MS / 1000;
+    auto codec_pcm = MakeFixture(BENCH_CODEC_SAMPLE_RATE, codec_frame * BENCH_FIXTURE_FRAMES);
+    auto opus_pcm = MakeFixture(BENCH_OPUS_SAMPLE_RATE, opus_frame * BENCH_FIXTURE_FRAMES);
+    // Start of the fixture frame that iteration i measures
+    auto codec_at = [&](int i) { return codec_pcm.data() + (i % BENCH_FIXTURE_FRAMES) * codec_frame; };
+    auto opus_at = [&](int i) { return opus_pcm.data() + (i % BENCH_FIXTURE_FRAMES) * opus_frame; };
+
+    Result results[BENCH_MAX_STAGES];
+    int count = 0;
+    // `prepare(i)` sets up frame i and is not measured, `frame(i)` is
+    auto measure = [&](const char* stage, auto&& prepare, auto&& frame) {
+        auto& result = results[count++];
+        result.stage = stage;
+        for (int i = 0; i < iterations; i++) {
+            prepare(i);
+            allocation_count = 0;
+            counting_allocations = true;
+            int64_t start_us = esp_timer_get_time();
+            uint32_t start = esp_cpu_get_cycle_count();
+            frame(i);
+            uint32_t cycles = esp_cpu_get_cycle_count() - start;
+            int64_t elapsed_us = esp_timer_get_time() - start_us;
+            counting_allocations = false;
+            result.frames++;
+            result.total_cycles += cycles;
+            result.total_us += elapsed_us;
+            result.allocations += allocation_count;
+            result.min_cycles = std::min(result.min_cycles, cycles);
+            result.max_cycles = std::max(result.max_cycles, cycles);
+        }
+    };
+    auto nothing = [](int) {};
+
+    // ReadAudio: 32 bit slots to 16 bit, then down to the encoder rate.
+    // The slots are filled as the codec delivers them, left aligned 32 bit.
+    std::vector<int32_t> slots(codec_frame);
+    std::vector<int16_t> codec_frame_pcm(codec_frame);
+    measure("i2s_read_convert", [&](int i) {
+        const int16_t* pcm = codec_at(i);
+        for (int j = 0; j < codec_frame; j++) {
+            slots[j] = (int32_t)pcm[j] * (1 << BENCH_I2S_SHIFT);
+        }
+    }, [&](int i) {
+        ConvertToInt16(slots.data(), codec_frame_pcm.data(), codec_frame, BENCH_I2S_SHIFT);
+    });
+
+    PolyphaseResampler input_resampler;
+    input_resampler.Configure(BENCH_CODEC_SAMPLE_RATE, BENCH_OPUS_SAMPLE_RATE);
+    std::vector<int16_t> resampled(input_resampler.GetOutputSamples(codec_frame));
+    measure("input_resample", nothing, [&](int i) {
+        input_resampler.Process(codec_at(i), codec_frame, resampled.data());
+    });
+
+    // One packet per fixture frame is kept for the decoder and the cipher stages
+    std::vector<std::vector<uint8_t>> packets;
+    packets.reserve(BENCH_FIXTURE_FRAMES);
+    {
+        OpusEncoderWrapper encoder(BENCH_OPUS_SAMPLE_RATE, 1, BENCH_FRAME_DURATION_MS);
+        std::vector<int16_t> input;
+        measure("opus_encode", [&](int i) {
+            input.assign(opus_at(i), opus_at(i) + opus_frame);
+        }, [&](int i) {
+            encoder.Encode(std::move(input), [&](std::vector<uint8_t>&& opus) {
+                if (packets.size() < BENCH_FIXTURE_FRAMES) {
+                    packets.push_back(std::move(opus));
+                }
+            });
+        });
+    }
+    if (packets.empty()) {
+        ESP_LOGE(TAG, "The encoder produced no packets");
+        Report(results, count, budget_percent);
+        return false;
+    }
+
+    // Uplink cipher as MqttProtocol::SendAudio does it, header copied and payload encrypted
+    {
+        mbedtls_aes_context aes;
+        mbedtls_aes_init(&aes);
+        const uint8_t key[16] = {0x5a, 0x1f, 0x3c, 0x77, 0x91, 0x02, 0xe4, 0x6b, 0x28, 0xd0, 0x49, 0xa5, 0x13, 0xbe, 0x84, 0x6f};
+        const uint8_t nonce[16] = {0x01, 0x00, 0x00, 0x00};
+        mbedtls_aes_setkey_enc(&aes, key, 128);
+        std::vector<uint8_t> buffer;
+        buffer.reserve(sizeof(nonce) + 1500);
+        measure("mqtt_aes_ctr", nothing, [&](int i) {
+            auto& packet = packets[i % packets.size()];
+            buffer.resize(sizeof(nonce) + packet.size());
+            memcpy(buffer.data(), nonce, sizeof(nonce));
+            uint8_t counter[16];
+            memcpy(counter, buffer.data(), sizeof(counter));
+            size_t nc_off = 0;
+            uint8_t stream_block[16] = {0};
+            mbedtls_aes_crypt_ctr(&aes, packet.size(), &nc_off, counter, stream_block,
+                packet.data(), buffer.data() + sizeof(nonce));
+        });
+        mbedtls_aes_free(&aes);
+    }
+
+    // Playback: decode, then up to the codec rate and into 32 bit slots
+    std::vector<int16_t> decoded;
+    {
+        OpusDecoderWrapper decoder(BENCH_OPUS_SAMPLE_RATE, 1, BENCH_FRAME_DURATION_MS);
+        std::vector<uint8_t> packet;
+        decoded.reserve(opus_frame);
+        measure("opus_decode", [&](int i) {
+            packet = packets[i % packets.size()];
+        }, [&](int i) {
+            decoder.Decode(std::move(packet), decoded);
+        });
+    }
+    if (decoded.empty()) {
+        decoded.assign(opus_pcm.begin(), opus_pcm.begin() + opus_frame);
+    }
+
+    PolyphaseResampler output_resampler;
+    output_resampler.Configure(BENCH_OPUS_SAMPLE_RATE, BENCH_CODEC_SAMPLE_RATE);
+    std::vector<int16_t> output(output_resampler.GetOutputSamples(decoded.size()));
+    measure("output_resample", nothing, [&](int i) {
+        output_resampler.Process(decoded.data(), decoded.size(), output.data());
+    });
+
+    std::vector<int32_t> output_slots(codec_frame);
+    int32_t gain_q16 = VolumeToGainQ16(70);
+    measure("i2s_write_convert", nothing, [&](int i) {
+        ScaleToInt32(codec_at(i), output_slots.data(), codec_frame, gain_q16);
+    });
+
+    return Report(results, count, budget_percent);
+}
+
+bool AudioBenchmark::Report(const Result* results, int count, int budget_percent) {
+    std::string json = "{\"frame_ms\":" + std::to_string(BENCH_FRAME_DURATION_MS) + ",\"stages\":{";
+    uint32_t frame_us = 0;
+    ESP_LOGI(TAG, "%-18s %10s %10s %10s %8s %8s", "stage", "cycles", "min", "max", "us", "allocs");
+    for (int i = 0; i < count; i++) {
+        auto& result = results[i];
+        uint32_t avg_cycles = result.total_cycles / result.frames;
+        uint32_t avg_us = result.total_us / result.frames;
+        float allocations = (float)result.allocations / result.frames;
+        ESP_LOGI(TAG, "%-18s %10lu %10lu %10lu %8lu %8.2f", result.stage, avg_cycles, result.min_cycles,
+            result.max_cycles, avg_us, allocations);
+
+        char stage[160];
+        snprintf(stage, sizeof(stage), "%s\"%s\":{\"cycles\":%lu,\"min_cycles\":%lu,\"max_cycles\":%lu,\"us\":%lu,\"allocs\":%.2f}",
+            i > 0 ? "," : "", result.stage, avg_cycles, result.min_cycles, result.max_cycles, avg_us, allocations);
+        json += stage;
+        frame_us += avg_us;
+    }
+
+    // Every stage runs once per frame on the device, together they must leave room for the rest
+    uint32_t budget_us = BENCH_FRAME_DURATION_MS * 1000 * budget_percent / 100;
+    bool passed = frame_us <= budget_us;
+    json += "},\"frame_us\":" + std::to_string(frame_us) + ",\"budget_us\":" + std::to_string(budget_us) +
+        ",\"pass\":" + (passed ? "true" : "false") + "}";
+    // One line, so a script can pick it out of the console log
+    ESP_LOGI(TAG, "BENCH %s", json.c_str());
+    if (!passed) {
+        ESP_LOGE(TAG, "BENCH FAIL: %luus per frame, over the budget of %luus (%d%% of %dms)", frame_us, budget_us,
+            budget_percent, BENCH_FRAME_DURATION_MS);
+    }
+    return passed;
+}
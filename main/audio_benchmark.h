@@ -0,0 +1,31 @@
+#ifndef AUDIO_BENCHMARK_H
+#define AUDIO_BENCHMARK_H
+
+#include <cstdint>
+
+// Boot time benchmark of the audio pipeline stages on fixed PCM fixtures
+// (CONFIG_USE_AUDIO_BENCHMARK). Every stage runs on the same frames each boot, so the
+// cycles and heap allocations per frame can be compared between builds. The results are
+// logged as a table and as one "BENCH {...}" JSON line for scripts to parse from the console.
+// The run fails when the stages together take more than `budget_percent` of a frame.
+class AudioBenchmark {
+public:
+    // Blocks until every stage ran `iterations` frames, returns false if over the budget
+    static bool Run(int iterations, int budget_percent);
+
+private:
+    struct Result {
+        const char* stage;
+        int frames = 0;
+        uint64_t total_cycles = 0;
+        uint32_t min_cycles = UINT32_MAX;
+        uint32_t max_cycles = 0;
+        uint32_t allocations = 0;
+        int64_t total_us = 0;
+    };
+
+    static bool RunStages(int iterations, int budget_percent);
+    static bool Report(const Result* results, int count, int budget_percent);
+};
+
+#endif // AUDIO_BENCHMARK_H
@@ -1,28 +1,101 @@
 #include "audio_codec.h"
 #include "board.h"
 #include "settings.h"
+#include "memory_arena.h"
 
 #include <esp_log.h>
+#include <esp_attr.h>
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 #include <driver/i2s_common.h>
 
 #define TAG "AudioCodec"
 
+// i2s_dma 单个缓冲区不能超过 4092 字节，按双声道 32 位计算
+#define AUDIO_CODEC_DMA_FRAME_NUM_MAX 511
+
 AudioCodec::AudioCodec() {
+    // Settings, then the board's config.h, then the defaults
+#if CONFIG_USE_REALTIME_CHAT && !defined(AUDIO_CODEC_DMA_DESC_NUM_FROM_BOARD)
+    int desc_num = AUDIO_CODEC_REALTIME_DMA_DESC_NUM;
+#else
+    int desc_num = AUDIO_CODEC_DMA_DESC_NUM;
+#endif
+    Settings settings("audio", false);
+    dma_config_.desc_num = std::clamp((int)settings.GetInt("dma_desc_num", desc_num), 2, 16);
+    dma_config_.frame_num = std::clamp((int)settings.GetInt("dma_frame_num", AUDIO_CODEC_DMA_FRAME_NUM),
+        32, AUDIO_CODEC_DMA_FRAME_NUM_MAX);
+    ESP_LOGI(TAG, "I2S DMA: %d x %d frames", dma_config_.desc_num, dma_config_.frame_num);
 }
 
 AudioCodec::~AudioCodec() {
+    MemoryArenas::GetInstance().Free(input_scratch_);
+    MemoryArenas::GetInstance().Free(output_scratch_);
+}
+
+void AudioCodec::AllocateScratch(bool input, bool output) {
+    const size_t size = AUDIO_CODEC_SCRATCH_SAMPLES * sizeof(int32_t);
+    if (input && input_scratch_ == nullptr) {
+        input_scratch_ = (int32_t*)MemoryArenas::GetInstance().Allocate(kArenaAudioDma, size);
+        assert(input_scratch_ != nullptr);
+    }
+    if (output && output_scratch_ == nullptr) {
+        output_scratch_ = (int32_t*)MemoryArenas::GetInstance().Allocate(kArenaAudioDma, size);
+        assert(output_scratch_ != nullptr);
+    }
 }
 
 void AudioCodec::OutputData(std::vector<int16_t>& data) {
     Write(data.data(), data.size());
+    if (software_reference_) {
+        // Write returns once the chunk is queued in the DMA, it plays after the DMA depth
+        reference_.Write(data.data(), data.size());
+    }
 }
 
-bool AudioCodec::InputData(std::vector<int16_t>& data) {
-    int samples = Read(data.data(), data.size());
-    if (samples > 0) {
+bool AudioCodec::InputData(int16_t* data, int samples) {
+    if (software_reference_) {
+        int mics = input_channels_ - 1;
+        int frames = samples / input_channels_;
+        mic_buffer_.resize(frames * mics);
+        if (Read(mic_buffer_.data(), mic_buffer_.size()) <= 0) {
+            return false;
+        }
+        reference_buffer_.resize(frames);
+        reference_.Read(reference_buffer_.data(), frames);
+        for (int i = 0; i < frames; i++) {
+            memcpy(&data[i * input_channels_], &mic_buffer_[i * mics], mics * sizeof(int16_t));
+            data[i * input_channels_ + mics] = reference_buffer_[i];
+        }
         return true;
     }
+    return Read(data, samples) > 0;
+}
+
+void AudioCodec::EnableSoftwareReference(int delay_offset_ms) {
+    if (input_reference_) {
+        return;
+    }
+    // TX DMA depth converted to input samples
+    int delay_samples = dma_config_.desc_num * dma_config_.frame_num * input_sample_rate_ / output_sample_rate_
+        + input_sample_rate_ * delay_offset_ms / 1000;
+    reference_.Configure(output_sample_rate_, output_channels_, input_sample_rate_, delay_samples);
+    mic_buffer_.reserve(input_sample_rate_ * 60 / 1000 * input_channels_);
+    reference_buffer_.reserve(input_sample_rate_ * 60 / 1000);
+    input_channels_ += 1;
+    input_reference_ = true;
+    software_reference_ = true;
+}
+
+// 发送队列为空时 DMA 重复发送清零的缓冲区，即欠载
+static bool IRAM_ATTR OnSendQueueOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    static_cast<std::atomic<uint32_t>*>(user_ctx)->fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+static bool IRAM_ATTR OnReceiveQueueOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    static_cast<std::atomic<uint32_t>*>(user_ctx)->fetch_add(1, std::memory_order_relaxed);
     return false;
 }
 
@@ -34,6 +107,14 @@ void AudioCodec::Start() {
         output_volume_ = 10;
     }
 
+    // Callbacks can only be registered while the channels are disabled
+    i2s_event_callbacks_t tx_callbacks = {};
+    tx_callbacks.on_send_q_ovf = OnSendQueueOverflow;
+    ESP_ERROR_CHECK_WITHOUT_ABORT(i2s_channel_register_event_callback(tx_handle_, &tx_callbacks, &output_underruns_));
+    i2s_event_callbacks_t rx_callbacks = {};
+    rx_callbacks.on_recv_q_ovf = OnReceiveQueueOverflow;
+    ESP_ERROR_CHECK_WITHOUT_ABORT(i2s_channel_register_event_callback(rx_handle_, &rx_callbacks, &input_overruns_));
+
     ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
     ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
 
@@ -55,6 +136,8 @@ void AudioCodec::EnableInput(bool enable) {
         return;
     }
     input_enabled_ = enable;
+    // Buffers dropped while nobody was reading are not overruns
+    input_overruns_.store(0, std::memory_order_relaxed);
     ESP_LOGI(TAG, "Set input enable to %s", enable ? "true" : "false");
 }
 
@@ -5,14 +5,43 @@
 #include <freertos/event_groups.h>
 #include <driver/i2s_std.h>
 
+#include <atomic>
 #include <vector>
 #include <string>
 #include <functional>
 
 #include "board.h"
+#include "config.h"
+#include "software_reference.h"
 
+// I2S DMA 深度的默认值，板级 config.h 可以覆盖，Settings("audio") 中的 dma_desc_num / dma_frame_num 优先
+#ifndef AUDIO_CODEC_DMA_DESC_NUM
 #define AUDIO_CODEC_DMA_DESC_NUM 6
+#else
+// 板级给出的深度在实时对话模式下也生效
+#define AUDIO_CODEC_DMA_DESC_NUM_FROM_BOARD 1
+#endif
+#ifndef AUDIO_CODEC_DMA_FRAME_NUM
 #define AUDIO_CODEC_DMA_FRAME_NUM 240
+#endif
+// 实时对话模式下延迟优先，板级没有指定深度时使用更浅的 DMA
+#ifndef AUDIO_CODEC_REALTIME_DMA_DESC_NUM
+#define AUDIO_CODEC_REALTIME_DMA_DESC_NUM 4
+#endif
+// 32 bit samples converted per I2S call, a stereo DMA frame
+#define AUDIO_CODEC_SCRATCH_SAMPLES (AUDIO_CODEC_DMA_FRAME_NUM * 2)
+// 板级 config.h 在编译期确定输入采样率, 每个固件只编译一个板子;
+// 16kHz 输入的板子编译时去掉输入重采样路径
+#if defined(AUDIO_INPUT_SAMPLE_RATE) && AUDIO_INPUT_SAMPLE_RATE == 16000
+#define AUDIO_CODEC_INPUT_RESAMPLE 0
+#else
+#define AUDIO_CODEC_INPUT_RESAMPLE 1
+#endif
+
+struct AudioDmaConfig {
+    int desc_num;
+    int frame_num;
+};
 
 class AudioCodec {
 public:
@@ -24,8 +53,17 @@ public:
     virtual void EnableOutput(bool enable);
 
     void Start();
+    // Without a hardware loopback, adds the played PCM as the last input channel so the AFE
+    // can run AEC. Call before the input format is used.
+    void EnableSoftwareReference(int delay_offset_ms);
     void OutputData(std::vector<int16_t>& data);
-    bool InputData(std::vector<int16_t>& data);
+    bool InputData(std::vector<int16_t>& data) { return InputData(data.data(), data.size()); }
+    // Reads interleaved input straight into a caller owned buffer, such as the AFE feed chunk
+    bool InputData(int16_t* data, int samples);
+
+    // DMA buffers the TX or RX queue ran out of since the last call, counted by the I2S ISR
+    inline uint32_t TakeOutputUnderruns() { return output_underruns_.exchange(0, std::memory_order_relaxed); }
+    inline uint32_t TakeInputOverruns() { return input_overruns_.exchange(0, std::memory_order_relaxed); }
 
     inline bool duplex() const { return duplex_; }
     inline bool input_reference() const { return input_reference_; }
@@ -36,6 +74,9 @@ public:
     inline int output_volume() const { return output_volume_; }
     inline bool input_enabled() const { return input_enabled_; }
     inline bool output_enabled() const { return output_enabled_; }
+    inline const AudioDmaConfig& dma_config() const { return dma_config_; }
+    // Milliseconds of output the TX DMA holds
+    inline int output_dma_ms() const { return dma_config_.desc_num * dma_config_.frame_num * 1000 / output_sample_rate_; }
 
 protected:
     i2s_chan_handle_t tx_handle_ = nullptr;
@@ -50,6 +91,21 @@ protected:
     int input_channels_ = 1;
     int output_channels_ = 1;
     int output_volume_ = 70;
+    // Loaded before the subclass creates its channels
+    AudioDmaConfig dma_config_;
+    bool software_reference_ = false;
+    SoftwareReference reference_;
+    std::vector<int16_t> mic_buffer_;
+    std::vector<int16_t> reference_buffer_;
+
+    // DMA capable conversion buffers of AUDIO_CODEC_SCRATCH_SAMPLES, allocated once by the
+    // codecs that convert samples. Read and Write run on different tasks, one buffer each.
+    int32_t* input_scratch_ = nullptr;
+    int32_t* output_scratch_ = nullptr;
+    void AllocateScratch(bool input, bool output);
+
+    std::atomic<uint32_t> output_underruns_{0};
+    std::atomic<uint32_t> input_overruns_{0};
 
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
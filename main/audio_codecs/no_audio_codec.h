@@ -6,8 +6,13 @@
 #include <driver/gpio.h>
 #include <driver/i2s_pdm.h>
 
+#include <vector>
+
 class NoAudioCodec : public AudioCodec {
 private:
+    int gain_volume_ = -1;
+    int32_t gain_q16_ = 0;
+
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
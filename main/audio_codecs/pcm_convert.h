@@ -0,0 +1,32 @@
+#ifndef _PCM_CONVERT_H
+#define _PCM_CONVERT_H
+
+#include <cstdint>
+#include <algorithm>
+
+// Sample conversion kernels shared by the I2S codecs.
+// Kept branch free so the compiler can emit the Xtensa MIN/MAX instructions and pipeline the loop.
+
+// Volume 0-100 to a Q16 gain on a square law curve, 100 maps to exactly 1.0 (65536)
+inline int32_t VolumeToGainQ16(int volume) {
+    volume = std::clamp(volume, 0, 100);
+    return volume * volume * 65536 / 10000;
+}
+
+// 16 bit samples to left aligned 32 bit I2S slots with gain applied.
+// With gain <= 65536 the product always fits in int32, no saturation is needed.
+inline void ScaleToInt32(const int16_t* input, int32_t* output, int samples, int32_t gain_q16) {
+    for (int i = 0; i < samples; i++) {
+        output[i] = (int32_t)input[i] * gain_q16;
+    }
+}
+
+// 32 bit I2S slots to 16 bit samples, shifted right and saturated to +-INT16_MAX
+inline void ConvertToInt16(const int32_t* input, int16_t* output, int samples, int shift) {
+    for (int i = 0; i < samples; i++) {
+        int32_t value = input[i] >> shift;
+        output[i] = (int16_t)std::min(std::max(value, (int32_t)-INT16_MAX), (int32_t)INT16_MAX);
+    }
+}
+
+#endif // _PCM_CONVERT_H
@@ -0,0 +1,102 @@
+#include "software_reference.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "SoftwareReference"
+
+// 参考信号 FIFO 在目标延迟之外最多缓存的时长
+#define SOFTWARE_REFERENCE_EXTRA_MS 500
+// 超过目标延迟这么多时丢弃最旧的数据重新对齐，需大于读写两侧的块长之和
+#define SOFTWARE_REFERENCE_SLACK_MS 60
+
+void SoftwareReference::Configure(int output_sample_rate, int output_channels, int input_sample_rate, int delay_samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_channels_ = output_channels;
+    delay_samples_ = std::max(delay_samples, 0);
+    slack_samples_ = input_sample_rate * SOFTWARE_REFERENCE_SLACK_MS / 1000;
+    ring_.assign(delay_samples_ + input_sample_rate * SOFTWARE_REFERENCE_EXTRA_MS / 1000, 0);
+    head_ = 0;
+    count_ = 0;
+    primed_ = false;
+    resample_ = output_sample_rate != input_sample_rate;
+    if (resample_) {
+        resampler_.Configure(output_sample_rate, input_sample_rate);
+    }
+    ESP_LOGI(TAG, "Software AEC reference, %d -> %d Hz, delay %d samples", output_sample_rate, input_sample_rate, delay_samples_);
+}
+
+void SoftwareReference::Write(const int16_t* data, int samples) {
+    if (ring_.empty() || samples <= 0) {
+        return;
+    }
+    const int16_t* mono = data;
+    int frames = samples;
+    if (output_channels_ > 1) {
+        frames = samples / output_channels_;
+        mono_.resize(frames);
+        for (int i = 0; i < frames; i++) {
+            int32_t sum = 0;
+            for (int c = 0; c < output_channels_; c++) {
+                sum += data[i * output_channels_ + c];
+            }
+            mono_[i] = sum / output_channels_;
+        }
+        mono = mono_.data();
+    }
+    if (resample_) {
+        resampled_.resize(resampler_.GetOutputSamples(frames));
+        resampled_.resize(resampler_.Process(mono, frames, resampled_.data()));
+        mono = resampled_.data();
+        frames = resampled_.size();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!primed_) {
+        // Silence for the audio still ahead of this chunk in the DMA
+        static const int16_t zeros[256] = {};
+        for (int left = delay_samples_; left > 0; left -= 256) {
+            Push(zeros, std::min(left, 256));
+        }
+        primed_ = true;
+    }
+    Push(mono, frames);
+}
+
+void SoftwareReference::Push(const int16_t* data, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        ring_[(head_ + count_) % ring_.size()] = data[i];
+        if (count_ < ring_.size()) {
+            count_++;
+        } else {
+            head_ = (head_ + 1) % ring_.size();
+        }
+    }
+}
+
+void SoftwareReference::Read(int16_t* dest, int samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ring_.empty()) {
+        memset(dest, 0, samples * sizeof(int16_t));
+        return;
+    }
+    // The mic was not read for a while, keep only the newest delay worth of reference
+    if (count_ > (size_t)(delay_samples_ + samples + slack_samples_)) {
+        size_t drop = count_ - delay_samples_ - samples;
+        head_ = (head_ + drop) % ring_.size();
+        count_ -= drop;
+    }
+
+    size_t available = std::min<size_t>(count_, samples);
+    for (size_t i = 0; i < available; i++) {
+        dest[i] = ring_[head_];
+        head_ = (head_ + 1) % ring_.size();
+    }
+    count_ -= available;
+    if (available < (size_t)samples) {
+        memset(dest + available, 0, (samples - available) * sizeof(int16_t));
+        primed_ = false;
+    }
+}
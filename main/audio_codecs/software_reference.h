@@ -0,0 +1,42 @@
+#ifndef _SOFTWARE_REFERENCE_H
+#define _SOFTWARE_REFERENCE_H
+
+#include "polyphase_resampler.h"
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// AEC reference for codecs without a hardware loopback. The output task pushes every chunk
+// once the I2S driver took it, the input task pops as many samples as it reads from the mic.
+// The FIFO is kept at the TX DMA depth plus an offset, so a popped sample is the one the
+// speaker plays while the mic captures; the reference may lead the echo but never lag it.
+class SoftwareReference {
+public:
+    // `delay_samples` is at the input rate
+    void Configure(int output_sample_rate, int output_channels, int input_sample_rate, int delay_samples);
+    void Write(const int16_t* data, int samples);
+    // Zero filled while nothing is playing
+    void Read(int16_t* dest, int samples);
+
+private:
+    std::mutex mutex_;
+    std::vector<int16_t> ring_;
+    size_t head_ = 0;
+    size_t count_ = 0;
+    // Set once the delay is prefilled, cleared when the output ran dry
+    bool primed_ = false;
+    int delay_samples_ = 0;
+    int slack_samples_ = 0;
+    int output_channels_ = 1;
+
+    // Only used on the output task
+    bool resample_ = false;
+    PolyphaseResampler resampler_;
+    std::vector<int16_t> mono_;
+    std::vector<int16_t> resampled_;
+
+    void Push(const int16_t* data, size_t samples);
+};
+
+#endif // _SOFTWARE_REFERENCE_H
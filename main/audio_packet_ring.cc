@@ -0,0 +1,93 @@
+#include "audio_packet_ring.h"
+#include "memory_arena.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <cstdlib>
+#include <bit>
+
+#define TAG "AudioPacketRing"
+
+static void* AllocateSlab(size_t size) {
+    return MemoryArenas::GetInstance().Allocate(kArenaAudio, size);
+}
+
+AudioPacketRing::AudioPacketRing(size_t capacity, size_t slot_size)
+    : capacity_(std::bit_ceil(capacity)), slot_size_(slot_size) {
+    slab_ = (uint8_t*)AllocateSlab(capacity_ * slot_size_);
+    sizes_ = (uint16_t*)AllocateSlab(capacity_ * sizeof(uint16_t));
+    if (slab_ == nullptr || sizes_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u x %u bytes", capacity_, slot_size_);
+        capacity_ = 0;
+    }
+}
+
+AudioPacketRing::~AudioPacketRing() {
+    MemoryArenas::GetInstance().Free(slab_);
+    MemoryArenas::GetInstance().Free(sizes_);
+}
+
+bool AudioPacketRing::Push(const uint8_t* data, size_t size) {
+    if (size > slot_size_ || size > UINT16_MAX) {
+        ESP_LOGW(TAG, "Packet too large: %u > %u", size, slot_size_);
+        return false;
+    }
+
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    if (head - tail >= capacity_) {
+        return false;
+    }
+
+    size_t index = head & (capacity_ - 1);
+    memcpy(slab_ + index * slot_size_, data, size);
+    sizes_[index] = size;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool AudioPacketRing::Front(const uint8_t*& data, size_t& size) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t mark = clear_mark_.load(std::memory_order_acquire);
+    if ((ptrdiff_t)(mark - tail) > 0) {
+        // Skip the packets dropped by Clear
+        tail = mark;
+        tail_.store(tail, std::memory_order_release);
+    }
+
+    if (tail == head_.load(std::memory_order_acquire)) {
+        return false;
+    }
+
+    size_t index = tail & (capacity_ - 1);
+    data = slab_ + index * slot_size_;
+    size = sizes_[index];
+    return true;
+}
+
+void AudioPacketRing::Pop() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+        return;
+    }
+    tail_.store(tail + 1, std::memory_order_release);
+}
+
+void AudioPacketRing::Clear() {
+    clear_mark_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+size_t AudioPacketRing::ReadIndex() const {
+    size_t tail = tail_.load(std::memory_order_acquire);
+    size_t mark = clear_mark_.load(std::memory_order_acquire);
+    return (ptrdiff_t)(mark - tail) > 0 ? mark : tail;
+}
+
+size_t AudioPacketRing::Size() const {
+    size_t read_index = ReadIndex();
+    return head_.load(std::memory_order_acquire) - read_index;
+}
+
+size_t AudioPacketRing::Available() const {
+    return capacity_ - (head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire));
+}
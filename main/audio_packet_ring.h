@@ -0,0 +1,50 @@
+#ifndef AUDIO_PACKET_RING_H
+#define AUDIO_PACKET_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Fixed capacity single-producer / single-consumer ring of encoded audio packets.
+// All slots live in one slab allocated at construction (PSRAM when available),
+// so pushing and popping never touch the heap. The capacity is rounded up to a power of two.
+class AudioPacketRing {
+public:
+    AudioPacketRing(size_t capacity, size_t slot_size);
+    ~AudioPacketRing();
+
+    AudioPacketRing(const AudioPacketRing&) = delete;
+    AudioPacketRing& operator=(const AudioPacketRing&) = delete;
+
+    // Producer side
+    bool Push(const uint8_t* data, size_t size);
+
+    // Consumer side, the packet returned by Front stays valid until Pop
+    bool Front(const uint8_t*& data, size_t& size);
+    void Pop();
+
+    // Safe to call from any task, drops everything pushed before the call
+    void Clear();
+
+    size_t Size() const;
+    bool Empty() const { return Size() == 0; }
+    size_t Available() const;
+    inline size_t capacity() const { return capacity_; }
+    inline size_t slot_size() const { return slot_size_; }
+
+private:
+    size_t capacity_;
+    size_t slot_size_;
+    uint8_t* slab_ = nullptr;
+    uint16_t* sizes_ = nullptr;
+
+    // Free running counters, the slot index is counter & (capacity_ - 1) and stays in order
+    // when they wrap
+    std::atomic<size_t> head_{0};   // Written by the producer
+    std::atomic<size_t> tail_{0};   // Written by the consumer
+    std::atomic<size_t> clear_mark_{0};
+
+    size_t ReadIndex() const;
+};
+
+#endif // AUDIO_PACKET_RING_H
@@ -0,0 +1,571 @@
+#include "audio_playback.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+
+#include "protocol.h"
+#include "audio_telemetry.h"
+#include "task_topology.h"
+
+#define TAG "AudioPlayback"
+
+AudioPlayback::AudioPlayback()
+    : jitter_buffer_(AUDIO_JITTER_BUFFER_SLOTS) {
+    packet_.reserve(AUDIO_DECODE_SLOT_SIZE);
+    SetVoiceGain(kAudioVoiceStream, 100);
+    SetVoiceGain(kAudioVoicePrompt, AUDIO_PROMPT_GAIN_PERCENT);
+    SetVoiceGain(kAudioVoiceClick, AUDIO_PROMPT_GAIN_PERCENT);
+    SetVoiceGain(kAudioVoiceReply, 100);
+}
+
+AudioPlayback::~AudioPlayback() {
+    if (decode_task_handle_ != nullptr) {
+        vTaskDelete(decode_task_handle_);
+    }
+    if (output_task_handle_ != nullptr) {
+        vTaskDelete(output_task_handle_);
+    }
+    if (pcm_stream_ != nullptr) {
+        vStreamBufferDelete(pcm_stream_);
+    }
+}
+
+void AudioPlayback::Start(AudioCodec* codec, int sample_rate, int frame_duration, BaseType_t core_id, UBaseType_t priority) {
+    codec_ = codec;
+    SetDecodeSampleRate(sample_rate, frame_duration);
+    ConfigureDecoder(sample_rate, frame_duration);
+
+    chunk_samples_ = codec_->output_sample_rate() * AUDIO_PLAYBACK_CHUNK_MS / 1000 * codec_->output_channels();
+    output_chunk_.resize(chunk_samples_);
+    // A voice holds at most a chunk plus one decoded frame
+    size_t frame_samples = codec_->output_sample_rate() * AUDIO_SOUND_MAX_FRAME_DURATION_MS / 1000;
+    for (auto& pending : pending_) {
+        pending.reserve(chunk_samples_ + frame_samples);
+    }
+    mix_.reserve(chunk_samples_ + frame_samples);
+    size_t stream_size = codec_->output_sample_rate() * AUDIO_PLAYBACK_BUFFER_MS / 1000 * codec_->output_channels() * sizeof(int16_t);
+    pcm_stream_ = xStreamBufferCreate(stream_size, 1);
+    if (pcm_stream_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create PCM stream buffer (%u bytes)", stream_size);
+        return;
+    }
+    last_output_time_ = esp_timer_get_time();
+
+    // The writer feeds the I2S DMA and must never wait behind the decoder
+    xTaskCreatePinnedToCore([](void* arg) {
+        auto playback = (AudioPlayback*)arg;
+        playback->OutputLoop();
+        vTaskDelete(NULL);
+    }, "audio_output", TASK_PLAYBACK_OUTPUT_STACK_SIZE, this, priority, &output_task_handle_, core_id);
+
+    xTaskCreatePinnedToCore([](void* arg) {
+        auto playback = (AudioPlayback*)arg;
+        playback->DecodeLoop();
+        vTaskDelete(NULL);
+    }, "audio_decode", TASK_PLAYBACK_DECODE_STACK_SIZE, this, priority - 1, &decode_task_handle_, core_id);
+}
+
+void AudioPlayback::PlaySound(std::string_view sound, AudioVoice voice) {
+    if (sound.empty() || voice < kAudioVoicePrompt || voice >= kAudioVoiceCount) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        sound_voices_[voice - kAudioVoicePrompt].sounds.push_back(sound);
+    }
+    if (decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(decode_task_handle_);
+    }
+}
+
+void AudioPlayback::PlayReply(std::string_view sound, uint32_t after_sequence) {
+    if (sound.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        auto& voice = sound_voices_[kAudioVoiceReply - kAudioVoicePrompt];
+        voice.sounds.push_back(sound);
+        voice.sequences.push_back(after_sequence);
+    }
+    if (decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(decode_task_handle_);
+    }
+}
+
+bool AudioPlayback::PushStreamPacket(uint32_t sequence, AudioPacket&& packet) {
+    if (!jitter_buffer_.Put(sequence, std::move(packet))) {
+        return false;
+    }
+    if (decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(decode_task_handle_);
+    }
+    return true;
+}
+
+void AudioPlayback::SetVoiceGain(AudioVoice voice, int gain_percent) {
+    gain_q15_[voice] = std::clamp(gain_percent, 0, 100) * 32768 / 100;
+}
+
+void AudioPlayback::OnBeforeDecode(std::function<bool()> callback) {
+    on_before_decode_ = callback;
+}
+
+// The decode task switches the decoder over when the next stream frame arrives
+void AudioPlayback::SetDecodeSampleRate(int sample_rate, int frame_duration) {
+    stream_sample_rate_ = sample_rate;
+    stream_frame_duration_ = frame_duration;
+    jitter_buffer_.SetFrameDuration(frame_duration);
+    jitter_buffer_.SetDepthLimits(1, AUDIO_JITTER_MAX_DELAY_MS / frame_duration);
+}
+
+void AudioPlayback::ConfigureDecoder(int sample_rate, int frame_duration) {
+    std::lock_guard<std::mutex> lock(decoder_mutex_);
+    auto matches = [&](const DecoderSlot& slot) {
+        return slot.decoder && slot.decoder->sample_rate() == sample_rate && slot.decoder->duration_ms() == frame_duration;
+    };
+    if (decoder_ != nullptr && matches(*decoder_)) {
+        return;
+    }
+
+    DecoderSlot* slot = nullptr;
+    for (auto& candidate : decoders_) {
+        if (matches(candidate)) {
+            slot = &candidate;
+            break;
+        }
+    }
+    if (slot != nullptr) {
+        // Its state belongs to an earlier stream
+        slot->decoder->ResetState();
+        slot->resampler.Reset();
+    } else {
+        // Take an empty slot, or evict the least recently used one
+        slot = &decoders_[0];
+        for (auto& candidate : decoders_) {
+            if (!candidate.decoder) {
+                slot = &candidate;
+                break;
+            }
+            if (candidate.last_used < slot->last_used) {
+                slot = &candidate;
+            }
+        }
+        slot->decoder.reset();
+        slot->decoder = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+        slot->resample = codec_ != nullptr && sample_rate != codec_->output_sample_rate();
+        if (slot->resample) {
+            ESP_LOGI(TAG, "Resampling audio from %d to %d", sample_rate, codec_->output_sample_rate());
+            slot->resampler.Configure(sample_rate, codec_->output_sample_rate());
+        }
+        pcm_.reserve(sample_rate * frame_duration / 1000);
+    }
+    slot->last_used = ++decoder_uses_;
+    decoder_ = slot;
+}
+
+void AudioPlayback::Reset() {
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        for (auto& voice : sound_voices_) {
+            voice.sounds.clear();
+            voice.sequences.clear();
+        }
+    }
+    jitter_buffer_.Reset();
+    {
+        std::lock_guard<std::mutex> lock(decoder_mutex_);
+        if (decoder_ != nullptr) {
+            decoder_->decoder->ResetState();
+            decoder_->resampler.Reset();
+        }
+    }
+    // The decode task drops the sounds it is playing and the unmixed PCM when it sees the new generation
+    generation_++;
+    last_output_time_ = esp_timer_get_time();
+}
+
+bool AudioPlayback::IsIdle() const {
+    if (!jitter_buffer_.Empty() || decoding_ || writing_) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        for (auto& voice : sound_voices_) {
+            if (voice.playing || !voice.sounds.empty()) {
+                return false;
+            }
+        }
+    }
+    return pcm_stream_ == nullptr || xStreamBufferIsEmpty(pcm_stream_) == pdTRUE;
+}
+
+void AudioPlayback::WaitForIdle() {
+    while (!IsIdle()) {
+        vTaskDelay(pdMS_TO_TICKS(AUDIO_PLAYBACK_CHUNK_MS));
+    }
+}
+
+void AudioPlayback::DecodeLoop() {
+    while (true) {
+        decoding_ = true;
+        uint32_t generation = generation_;
+        if (mixer_generation_ != generation) {
+            // Do not mix new audio with the PCM that Reset is about to drop
+            while (flushed_generation_ != generation) {
+                vTaskDelay(pdMS_TO_TICKS(5));
+                generation = generation_;
+            }
+            for (auto& pending : pending_) {
+                pending.clear();
+            }
+            for (auto& voice : sound_voices_) {
+                voice.reader = P3Reader();
+                if (voice.decoder) {
+                    voice.decoder->ResetState();
+                    voice.resampler.Reset();
+                }
+            }
+            mixer_generation_ = generation;
+        }
+
+        // Top up every voice that has less than a chunk decoded, then mix what is there
+        bool decoded = false;
+        // A reply takes the place of stream frames: it waits for the frames before it to play
+        // out, and the frames after it wait for it
+        auto& reply = sound_voices_[kAudioVoiceReply - kAudioVoicePrompt];
+        bool reply_queued = false;
+        uint32_t reply_sequence = 0;
+        {
+            std::lock_guard<std::mutex> lock(sound_mutex_);
+            if (!reply.sequences.empty()) {
+                reply_queued = true;
+                reply_sequence = reply.sequences.front();
+            }
+        }
+        bool stream_before_reply = reply_queued && !jitter_buffer_.Empty() &&
+            (int32_t)(jitter_buffer_.NextSequence() - reply_sequence) <= 0;
+        bool stream_after_reply = reply_queued && !stream_before_reply;
+        for (int i = kAudioVoicePrompt; i < kAudioVoiceCount; i++) {
+            auto& voice = sound_voices_[i - kAudioVoicePrompt];
+            if (&voice == &reply && voice.reader.AtEnd() &&
+                (stream_before_reply || (reply_queued && !pending_[kAudioVoiceStream].empty()))) {
+                // Between two replies, let the stream go on
+                reply.playing = false;
+                continue;
+            }
+            if (pending_[i].size() < chunk_samples_ && NextSoundFrame(voice)) {
+                if (!on_before_decode_ || on_before_decode_()) {
+                    DecodeSoundFrame(voice, pending_[i]);
+                }
+                decoded = true;
+            }
+        }
+        bool stream_held = reply.playing || !pending_[kAudioVoiceReply].empty() || stream_after_reply;
+        if (!stream_held && pending_[kAudioVoiceStream].size() < chunk_samples_ && NextPacket()) {
+            if (!on_before_decode_ || on_before_decode_()) {
+                DecodePacket();
+            }
+            decoded = true;
+        }
+        if (MixPending(generation) || decoded) {
+            continue;
+        }
+
+        decoding_ = false;
+        // The jitter buffer may release a frame without a new arrival, so poll while it holds any
+        ulTaskNotifyTake(pdTRUE, jitter_buffer_.Empty() ? portMAX_DELAY : pdMS_TO_TICKS(AUDIO_PLAYBACK_CHUNK_MS));
+    }
+}
+
+// The network stream, an empty packet_ asks the decoder for concealment
+bool AudioPlayback::NextPacket() {
+    AudioPacket packet;
+    switch (jitter_buffer_.Get(packet)) {
+        case JitterBuffer::kPacket:
+            // The decoder takes a vector, the pooled block is released on return
+            packet_.assign(packet.data(), packet.data() + packet.size());
+            break;
+        case JitterBuffer::kLost:
+            packet_.clear();
+            break;
+        default:
+            return false;
+    }
+    ConfigureDecoder(stream_sample_rate_, stream_frame_duration_);
+    return true;
+}
+
+// Next frame of the voice's current sound into packet_, the next queued sound starts once
+// the current one has played to the end
+bool AudioPlayback::NextSoundFrame(SoundVoice& voice) {
+    std::string_view payload;
+    while (!voice.reader.Next(payload)) {
+        std::string_view sound;
+        {
+            std::lock_guard<std::mutex> lock(sound_mutex_);
+            if (voice.sounds.empty()) {
+                voice.playing = false;
+                return false;
+            }
+            sound = voice.sounds.front();
+            voice.sounds.pop_front();
+            if (!voice.sequences.empty()) {
+                voice.sequences.pop_front();
+            }
+            voice.playing = true;
+        }
+        voice.reader = P3Reader(sound);
+        if (!voice.reader.valid() || !ConfigureVoice(voice)) {
+            voice.reader = P3Reader();
+            continue;
+        }
+        voice.preroll = voice.reader.preroll_frames();
+    }
+    // The decoder takes a vector, this is the only copy of the frame
+    packet_.assign(payload.begin(), payload.end());
+    return true;
+}
+
+static inline bool IsOpusSampleRate(int sample_rate) {
+    return sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000 || sample_rate == 24000 || sample_rate == 48000;
+}
+
+// Opus decodes to any of its rates whatever the rate it was encoded at, so the sound is decoded
+// straight at the output rate when possible. The decoder is only rebuilt when the frame
+// duration changes, the resampler only runs for output rates Opus does not have.
+bool AudioPlayback::ConfigureVoice(SoundVoice& voice) {
+    auto& reader = voice.reader;
+    if (reader.frame_duration() > AUDIO_SOUND_MAX_FRAME_DURATION_MS) {
+        ESP_LOGW(TAG, "Skipping a sound with %d ms frames", reader.frame_duration());
+        return false;
+    }
+    int output_rate = codec_->output_sample_rate();
+    int decode_rate = output_rate;
+    if (!IsOpusSampleRate(decode_rate)) {
+        decode_rate = IsOpusSampleRate(reader.sample_rate()) ? reader.sample_rate() : 48000;
+    }
+    if (voice.decoder && voice.decoder->sample_rate() == decode_rate && voice.decoder->duration_ms() == reader.frame_duration()) {
+        return true;
+    }
+    voice.decoder.reset();
+    voice.decoder = std::make_unique<OpusDecoderWrapper>(decode_rate, 1, reader.frame_duration());
+    voice.resample = decode_rate != output_rate;
+    if (voice.resample) {
+        voice.resampler.Configure(decode_rate, output_rate);
+    }
+    return true;
+}
+
+void AudioPlayback::DecodeSoundFrame(SoundVoice& voice, std::vector<int16_t>& pending) {
+    ScopedAudioLatency latency(kAudioStageDecode);
+    if (!voice.decoder->Decode(std::move(packet_), pcm_)) {
+        return;
+    }
+    if (voice.preroll > 0) {
+        // Only there to settle the decoder
+        voice.preroll--;
+        return;
+    }
+    size_t offset = pending.size();
+    if (voice.resample) {
+        pending.resize(offset + voice.resampler.GetOutputSamples(pcm_.size()));
+        pending.resize(offset + voice.resampler.Process(pcm_.data(), pcm_.size(), pending.data() + offset));
+    } else {
+        pending.insert(pending.end(), pcm_.begin(), pcm_.end());
+    }
+}
+
+void AudioPlayback::DecodePacket() {
+    ScopedAudioLatency latency(kAudioStageDecode);
+    std::lock_guard<std::mutex> lock(decoder_mutex_);
+    // opus_decode runs packet loss concealment when given no data
+    if (!decoder_->decoder->Decode(std::move(packet_), pcm_)) {
+        return;
+    }
+    auto& pending = pending_[kAudioVoiceStream];
+    size_t offset = pending.size();
+    // Resample if the sample rate is different
+    if (decoder_->resample) {
+        auto& resampler = decoder_->resampler;
+        pending.resize(offset + resampler.GetOutputSamples(pcm_.size()));
+        pending.resize(offset + resampler.Process(pcm_.data(), pcm_.size(), pending.data() + offset));
+    } else {
+        pending.insert(pending.end(), pcm_.begin(), pcm_.end());
+    }
+}
+
+// Sums the voices that have PCM, with gain and saturation, and writes the result. A voice
+// that is playing but has nothing decoded yet does not hold the others back, so a single
+// voice passes straight through.
+bool AudioPlayback::MixPending(uint32_t generation) {
+    size_t count = 0;
+    int voices = 0;
+    for (auto& pending : pending_) {
+        if (!pending.empty()) {
+            count = voices == 0 ? pending.size() : std::min(count, pending.size());
+            voices++;
+        }
+    }
+    if (voices == 0) {
+        return false;
+    }
+
+    mix_.assign(count, 0);
+    for (int i = 0; i < kAudioVoiceCount; i++) {
+        auto& pending = pending_[i];
+        if (pending.empty()) {
+            continue;
+        }
+        int32_t gain = gain_q15_[i];
+        if (voices == 1 && gain == 32768) {
+            mix_.assign(pending.begin(), pending.begin() + count);
+        } else {
+            for (size_t j = 0; j < count; j++) {
+                int32_t value = mix_[j] + ((pending[j] * gain) >> 15);
+                mix_[j] = (int16_t)std::clamp(value, (int32_t)INT16_MIN, (int32_t)INT16_MAX);
+            }
+        }
+        pending.erase(pending.begin(), pending.begin() + count);
+    }
+    WritePcm(mix_.data(), count, generation);
+    return true;
+}
+
+void AudioPlayback::WritePcm(const int16_t* samples, size_t count, uint32_t generation) {
+    auto data = (const uint8_t*)samples;
+    size_t bytes = count * sizeof(int16_t);
+    while (bytes > 0 && generation_ == generation) {
+        size_t sent = xStreamBufferSend(pcm_stream_, data, bytes, pdMS_TO_TICKS(AUDIO_PLAYBACK_CHUNK_MS));
+        data += sent;
+        bytes -= sent;
+    }
+}
+
+// Ramps the first frames up from zero, after comfort silence
+void AudioPlayback::FadeIn(std::vector<int16_t>& chunk, int fade_frames) {
+    int channels = codec_->output_channels();
+    int frames = std::min<int>(fade_frames, chunk.size() / channels);
+    for (int i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++) {
+            chunk[i * channels + c] = chunk[i * channels + c] * i / frames;
+        }
+    }
+}
+
+// A silence chunk that starts at the last played frame and ramps down, so the gap does not click
+void AudioPlayback::FadeOutSilence(std::vector<int16_t>& chunk, const int16_t* last_frame, int fade_frames) {
+    int channels = codec_->output_channels();
+    std::fill(chunk.begin(), chunk.end(), 0);
+    int frames = std::min<int>(fade_frames, chunk.size() / channels);
+    for (int i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++) {
+            chunk[i * channels + c] = last_frame[c] * (frames - i) / frames;
+        }
+    }
+}
+
+// Writes PCM chunks to the codec. The time buffered in the TX DMA is estimated from the
+// writes; when the stream runs dry in the middle of playback, silence is written before
+// the DMA empties, so the speaker never replays stale DMA buffers.
+void AudioPlayback::OutputLoop() {
+    const size_t chunk_bytes = chunk_samples_ * sizeof(int16_t);
+    const int channels = codec_->output_channels();
+    const int fade_frames = codec_->output_sample_rate() * AUDIO_PLAYBACK_FADE_MS / 1000;
+    const int64_t chunk_us = AUDIO_PLAYBACK_CHUNK_MS * 1000;
+    const int64_t dma_us = codec_->output_dma_ms() * 1000LL;
+    // The DMA running dry after a longer gap is the end of a stream, not an underrun
+    const int64_t underrun_window_us = 2 * dma_us;
+    int64_t last_write_time = 0;
+    int64_t last_audio_time = 0;
+    int64_t dma_fill_us = 0;
+    // Comfort silence was written since the last audio chunk
+    bool filling = false;
+    int16_t last_frame[2] = {0, 0};
+
+    auto write = [&](std::vector<int16_t>& chunk) {
+        codec_->OutputData(chunk);
+        // Write returns once the chunk is queued, the DMA holds at most its depth
+        int64_t now = esp_timer_get_time();
+        int64_t fill = std::max<int64_t>(0, dma_fill_us - (now - last_write_time));
+        int64_t duration = (int64_t)(chunk.size() / channels) * 1000000 / codec_->output_sample_rate();
+        dma_fill_us = std::min(dma_us, fill + duration);
+        last_write_time = now;
+    };
+
+    while (true) {
+        uint32_t generation = generation_;
+        if (flushed_generation_ != generation) {
+            // Drop the PCM buffered before Reset
+            output_chunk_.resize(chunk_samples_);
+            while (xStreamBufferReceive(pcm_stream_, output_chunk_.data(), chunk_bytes, 0) > 0) {
+            }
+            flushed_generation_ = generation;
+            last_audio_time = 0;
+            filling = false;
+        }
+
+        if (!codec_->output_enabled()) {
+            vTaskDelay(pdMS_TO_TICKS(AUDIO_PLAYBACK_CHUNK_MS));
+            dma_fill_us = 0;
+            last_audio_time = 0;
+            filling = false;
+            continue;
+        }
+
+        // While a stream plays, wait only until one chunk is left in the DMA
+        int64_t now = esp_timer_get_time();
+        bool streaming = last_audio_time > 0 && now - last_audio_time < AUDIO_PLAYBACK_COMFORT_SILENCE_MS * 1000;
+        TickType_t wait = pdMS_TO_TICKS(AUDIO_PLAYBACK_CHUNK_MS);
+        if (streaming) {
+            int64_t fill = std::max<int64_t>(0, dma_fill_us - (now - last_write_time));
+            // At least a tick, so a wait rounded down to zero does not spin
+            wait = std::max<TickType_t>(1, pdMS_TO_TICKS(std::max<int64_t>(0, fill - chunk_us) / 1000));
+        }
+
+        output_chunk_.resize(chunk_samples_);
+        size_t bytes = xStreamBufferReceive(pcm_stream_, output_chunk_.data(), chunk_bytes, wait);
+        if (generation_ != generation) {
+            continue;
+        }
+        if (bytes == 0) {
+            if (streaming && esp_timer_get_time() - last_write_time + chunk_us >= dma_fill_us) {
+                if (filling) {
+                    std::fill(output_chunk_.begin(), output_chunk_.end(), 0);
+                } else {
+                    FadeOutSilence(output_chunk_, last_frame, fade_frames);
+                    filling = true;
+                }
+                write(output_chunk_);
+            }
+            continue;
+        }
+
+        uint32_t underruns = codec_->TakeOutputUnderruns();
+        if (underruns > 0 && esp_timer_get_time() - last_write_time < underrun_window_us) {
+            AudioTelemetry::GetInstance().Count(kAudioCounterI2sUnderruns, underruns);
+        }
+
+        writing_ = true;
+        output_chunk_.resize(bytes / sizeof(int16_t));
+        if (filling) {
+            // The stream resumed after a gap that was covered with silence
+            AudioTelemetry::GetInstance().Count(kAudioCounterOutputGaps);
+            FadeIn(output_chunk_, fade_frames);
+            filling = false;
+        }
+        if (output_chunk_.size() >= (size_t)channels) {
+            std::copy(output_chunk_.end() - channels, output_chunk_.end(), last_frame);
+        }
+        {
+            ScopedAudioLatency latency(kAudioStageOutput);
+            write(output_chunk_);
+        }
+        last_output_time_ = esp_timer_get_time();
+        last_audio_time = last_output_time_;
+        writing_ = false;
+    }
+}
@@ -0,0 +1,156 @@
+#ifndef AUDIO_PLAYBACK_H
+#define AUDIO_PLAYBACK_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/stream_buffer.h>
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <string_view>
+
+#include <opus_decoder.h>
+
+#include "audio_codec.h"
+#include "polyphase_resampler.h"
+#include "jitter_buffer.h"
+#include "p3_reader.h"
+
+#define AUDIO_DECODE_SLOT_SIZE 1024
+// 本地音频 (P3) 的最长帧, 决定每个声部的 PCM 缓冲大小
+#define AUDIO_SOUND_MAX_FRAME_DURATION_MS 60
+// 网络音频抖动缓冲: 容量与最大缓冲延迟
+#define AUDIO_JITTER_BUFFER_SLOTS 32  // 2 的幂
+#define AUDIO_JITTER_MAX_DELAY_MS 300
+// 解码任务与 I2S 写任务之间的 PCM 缓冲时长
+#define AUDIO_PLAYBACK_BUFFER_MS 120
+#define AUDIO_PLAYBACK_CHUNK_MS 20
+// 流中断时补静音的最长时间，超过后认为播放结束，由 DMA 自动清零
+#define AUDIO_PLAYBACK_COMFORT_SILENCE_MS 300
+// 插入静音前的淡出与恢复播放时的淡入
+#define AUDIO_PLAYBACK_FADE_MS 5
+// 服务器音频流缓存的解码器数量, 切换格式时不重建
+#define AUDIO_DECODER_CACHE_SIZE 2
+// 提示音的默认音量 (百分比), 与 TTS 叠加时不至于削波
+#define AUDIO_PROMPT_GAIN_PERCENT 80
+
+// Mixer inputs, each with its own decoder state and gain
+enum AudioVoice {
+    kAudioVoiceStream,      // Server TTS through the jitter buffer
+    kAudioVoicePrompt,      // Local P3 prompts and alerts
+    kAudioVoiceClick,       // Short UI sounds
+    kAudioVoiceReply,       // Cached sentences of the stream, see PlayReply
+    kAudioVoiceCount
+};
+
+// Playback pipeline: jitter buffer / P3 sounds -> decode task, one decoder per voice -> mixer
+// -> PCM stream buffer -> I2S writer task. Voices play at the same time, a prompt no longer
+// waits for the stream to drain or interrupts it.
+class AudioPlayback {
+public:
+    AudioPlayback();
+    ~AudioPlayback();
+
+    void Start(AudioCodec* codec, int sample_rate, int frame_duration, BaseType_t core_id, UBaseType_t priority);
+
+    // Queues a P3 asset on a sound voice and returns at once. Sounds on one voice play in
+    // order, mixed over the other voices. The decode task reads the frames straight from
+    // the flash mapped data, so `sound` must stay valid until it has played.
+    void PlaySound(std::string_view sound, AudioVoice voice = kAudioVoicePrompt);
+    // A sentence of the network stream played from local P3 data instead, on kAudioVoiceReply.
+    // `after_sequence` is the last stream frame received before it: it starts once the stream
+    // has played up to that frame, and the later frames wait in the jitter buffer until it ends.
+    void PlayReply(std::string_view sound, uint32_t after_sequence);
+    // 0-100, applied in the mixer
+    void SetVoiceGain(AudioVoice voice, int gain_percent);
+    // Network stream, reordered and concealed by the jitter buffer
+    bool PushStreamPacket(uint32_t sequence, AudioPacket&& packet);
+    size_t QueuedPackets() const { return jitter_buffer_.Depth(); }
+
+    // Return false to drop the packet instead of playing it
+    void OnBeforeDecode(std::function<bool()> callback);
+
+    // Format of the network stream, sounds carry their own in the P3 header
+    void SetDecodeSampleRate(int sample_rate, int frame_duration);
+    // Drops queued sounds and packets and buffered PCM, and resets the decoder state
+    void Reset();
+    bool IsIdle() const;
+    void WaitForIdle();
+
+    inline int64_t last_output_time() const { return last_output_time_; }
+
+private:
+    AudioCodec* codec_ = nullptr;
+    JitterBuffer jitter_buffer_;
+    std::atomic<int> stream_sample_rate_{24000};
+    std::atomic<int> stream_frame_duration_{60};
+    std::function<bool()> on_before_decode_;
+
+    // A P3 voice, its queue is shared with PlaySound, the rest is only touched by the decode task
+    struct SoundVoice {
+        std::deque<std::string_view> sounds;
+        // Reply voice only, the stream frame each queued sound follows
+        std::deque<uint32_t> sequences;
+        // The sound being played, at its end between two sounds
+        P3Reader reader;
+        uint32_t preroll = 0;
+        std::atomic<bool> playing{false};
+        std::unique_ptr<OpusDecoderWrapper> decoder;
+        PolyphaseResampler resampler;
+        bool resample = false;
+    };
+    mutable std::mutex sound_mutex_;
+    SoundVoice sound_voices_[kAudioVoiceCount - kAudioVoicePrompt];
+
+    // One decoder and resampler per stream format, switching formats only swaps the pointer
+    struct DecoderSlot {
+        std::unique_ptr<OpusDecoderWrapper> decoder;
+        PolyphaseResampler resampler;
+        bool resample = false;
+        uint32_t last_used = 0;
+    };
+
+    mutable std::mutex decoder_mutex_;
+    DecoderSlot decoders_[AUDIO_DECODER_CACHE_SIZE];
+    DecoderSlot* decoder_ = nullptr;
+    uint32_t decoder_uses_ = 0;
+    std::vector<uint8_t> packet_;
+    std::vector<int16_t> pcm_;
+    std::vector<int16_t> output_chunk_;
+    size_t chunk_samples_ = 0;
+
+    // Decoded PCM at the output rate waiting to be mixed, one per voice
+    std::vector<int16_t> pending_[kAudioVoiceCount];
+    std::vector<int16_t> mix_;
+    std::atomic<int32_t> gain_q15_[kAudioVoiceCount];
+    uint32_t mixer_generation_ = 0;
+
+    StreamBufferHandle_t pcm_stream_ = nullptr;
+    TaskHandle_t decode_task_handle_ = nullptr;
+    TaskHandle_t output_task_handle_ = nullptr;
+    std::atomic<bool> decoding_{false};
+    std::atomic<bool> writing_{false};
+    // Reset bumps the generation, the writer drains stale PCM before acknowledging it
+    std::atomic<uint32_t> generation_{0};
+    std::atomic<uint32_t> flushed_generation_{0};
+    std::atomic<int64_t> last_output_time_{0};
+
+    void DecodeLoop();
+    void OutputLoop();
+    bool NextPacket();
+    bool NextSoundFrame(SoundVoice& voice);
+    void DecodePacket();
+    void DecodeSoundFrame(SoundVoice& voice, std::vector<int16_t>& pending);
+    bool ConfigureVoice(SoundVoice& voice);
+    bool MixPending(uint32_t generation);
+    void WritePcm(const int16_t* samples, size_t count, uint32_t generation);
+    void FadeIn(std::vector<int16_t>& chunk, int fade_frames);
+    void FadeOutSilence(std::vector<int16_t>& chunk, const int16_t* last_frame, int fade_frames);
+    void ConfigureDecoder(int sample_rate, int frame_duration);
+};
+
+#endif // AUDIO_PLAYBACK_H
@@ -0,0 +1,196 @@
+#include "audio_front_end.h"
+#include "audio_telemetry.h"
+#include "task_topology.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_nsn_models.h>
+
+#include <string>
+
+static const char* TAG = "AudioFrontEnd";
+
+AudioFrontEnd::AudioFrontEnd() {
+    event_group_ = xEventGroupCreate();
+}
+
+AudioFrontEnd::~AudioFrontEnd() {
+    if (afe_data_ != nullptr) {
+        afe_iface_->destroy(afe_data_);
+    }
+    if (fetch_task_stack_ != nullptr) {
+        heap_caps_free(fetch_task_stack_);
+    }
+    if (feed_buffer_ != nullptr) {
+        heap_caps_free(feed_buffer_);
+    }
+    vEventGroupDelete(event_group_);
+}
+
+void AudioFrontEnd::Initialize(AudioCodec* codec, bool realtime_chat) {
+    codec_ = codec;
+    int ref_num = codec_->input_reference() ? 1 : 0;
+
+    std::string input_format;
+    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
+        input_format.push_back('M');
+    }
+    for (int i = 0; i < ref_num; i++) {
+        input_format.push_back('R');
+    }
+
+    models_ = esp_srmodel_init("model");
+
+#if CONFIG_USE_WAKE_WORD_DETECT
+    // The SR pipeline also carries the uplink, wakenet is switched off while nobody waits for the wake word
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models_, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
+    afe_config->aec_init = codec_->input_reference();
+    afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
+#ifdef CONFIG_USE_CUSTOM_WAKE_WORD
+    afe_config->wakenet_init = false;
+    afe_config->wakenet_model_name = NULL;
+#endif
+    wakenet_enabled_ = afe_config->wakenet_init;
+#else
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
+    afe_config->aec_init = realtime_chat;
+    afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
+#endif
+
+#if CONFIG_USE_AUDIO_PROCESSOR
+    afe_config->ns_init = true;
+    afe_config->ns_model_name = esp_srmodel_filter(models_, ESP_NSNET_PREFIX, NULL);
+    afe_config->afe_ns_mode = AFE_NS_MODE_NET;
+    // Realtime chat leaves the end of speech to the server
+    vad_enabled_ = !realtime_chat;
+#endif
+    afe_config->vad_init = vad_enabled_;
+    if (vad_enabled_) {
+        afe_config->vad_mode = VAD_MODE_0;
+        afe_config->vad_min_noise_ms = 100;
+    }
+    afe_config->afe_perferred_core = TASK_CORE(TASK_AFE_CORE);
+    afe_config->afe_perferred_priority = TASK_AFE_PRIORITY;
+    afe_config->agc_init = false;
+    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+
+    afe_iface_ = const_cast<esp_afe_sr_iface_t*>(esp_afe_handle_from_config(afe_config));
+    afe_data_ = afe_iface_->create_from_config(afe_config);
+    if (wakenet_enabled_) {
+        afe_iface_->disable_wakenet(afe_data_);
+        wakenet_enabled_ = false;
+    }
+    // Read every 32ms on the always on path, kept out of PSRAM
+    feed_buffer_ = (int16_t*)heap_caps_malloc(GetFeedSize() * sizeof(int16_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (feed_buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the feed buffer");
+    }
+
+    fetch_task_stack_ = (StackType_t*)heap_caps_malloc(TASK_AFE_FETCH_STACK_SIZE, MALLOC_CAP_SPIRAM);
+    xTaskCreateStaticPinnedToCore([](void* arg) {
+        auto this_ = (AudioFrontEnd*)arg;
+        this_->AudioFetchTask();
+        vTaskDelete(NULL);
+    }, "audio_front_end", TASK_AFE_FETCH_STACK_SIZE, this, TASK_AFE_FETCH_PRIORITY, fetch_task_stack_, &fetch_task_buffer_,
+        TASK_CORE(TASK_AFE_FETCH_CORE));
+}
+
+size_t AudioFrontEnd::GetFeedSize() {
+    if (afe_data_ == nullptr) {
+        return 0;
+    }
+    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
+}
+
+void AudioFrontEnd::Feed(const int16_t* data) {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    uint32_t n = feed_count_.load(std::memory_order_relaxed);
+    feed_times_[n % 8] = esp_timer_get_time();
+    feed_count_.store(n + 1, std::memory_order_release);
+    afe_iface_->feed(afe_data_, data);
+}
+
+bool AudioFrontEnd::IsRunning() {
+    return xEventGroupGetBits(event_group_) != 0;
+}
+
+bool AudioFrontEnd::IsConsumerActive(AudioFrontEndConsumer consumer) {
+    return xEventGroupGetBits(event_group_) & (1 << consumer);
+}
+
+void AudioFrontEnd::SetConsumerActive(AudioFrontEndConsumer consumer, bool active) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EventBits_t bits = xEventGroupGetBits(event_group_);
+    EventBits_t new_bits = active ? (bits | (1 << consumer)) : (bits & ~(1 << consumer));
+    if (new_bits == bits || afe_data_ == nullptr) {
+        return;
+    }
+
+    // Stale audio is only dropped when the microphone starts again, not on every hand over
+    if (bits == 0) {
+        afe_iface_->reset_buffer(afe_data_);
+        fetch_count_.store(feed_count_.load());
+    }
+#if CONFIG_USE_WAKE_WORD_DETECT && !defined(CONFIG_USE_CUSTOM_WAKE_WORD)
+    if (consumer == kAudioConsumerWakeWord) {
+        if (active && !wakenet_enabled_) {
+            afe_iface_->enable_wakenet(afe_data_);
+            wakenet_enabled_ = true;
+        } else if (!active && wakenet_enabled_) {
+            afe_iface_->disable_wakenet(afe_data_);
+            wakenet_enabled_ = false;
+        }
+    }
+#endif
+
+    if (active) {
+        xEventGroupSetBits(event_group_, 1 << consumer);
+    } else {
+        xEventGroupClearBits(event_group_, 1 << consumer);
+    }
+}
+
+void AudioFrontEnd::OnFetch(AudioFrontEndConsumer consumer, std::function<void(afe_fetch_result_t* result)> callback) {
+    callbacks_[consumer] = callback;
+}
+
+void AudioFrontEnd::AudioFetchTask() {
+    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
+    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
+    ESP_LOGI(TAG, "Audio front end task started, feed size: %d fetch size: %d",
+        feed_size, fetch_size);
+
+    const EventBits_t all_consumers = (1 << kAudioConsumerCount) - 1;
+    while (true) {
+        xEventGroupWaitBits(event_group_, all_consumers, pdFALSE, pdFALSE, portMAX_DELAY);
+
+        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
+        if (res == nullptr || res->ret_value == ESP_FAIL) {
+            if (res != nullptr) {
+                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
+            }
+            continue;
+        }
+
+        // Feed and fetch chunks are the same length, so the oldest unmatched feed produced this one
+        uint32_t fed = feed_count_.load(std::memory_order_acquire);
+        uint32_t fetched = fetch_count_.load(std::memory_order_relaxed);
+        if (fed - fetched > 8) {
+            fetched = fed - 8;
+        }
+        if (fetched != fed && feed_size == fetch_size) {
+            AudioTelemetry::GetInstance().Record(kAudioStageAfe, esp_timer_get_time() - feed_times_[fetched % 8]);
+            fetch_count_.store(fetched + 1, std::memory_order_relaxed);
+        }
+
+        // Bits are re-read for every consumer, the wake word consumer stops itself on detection
+        for (int i = 0; i < kAudioConsumerCount; i++) {
+            if ((xEventGroupGetBits(event_group_) & (1 << i)) && callbacks_[i]) {
+                callbacks_[i](res);
+            }
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef AUDIO_FRONT_END_H
+#define AUDIO_FRONT_END_H
+
+#include <esp_afe_sr_models.h>
+#include <model_path.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "audio_codec.h"
+
+enum AudioFrontEndConsumer {
+    kAudioConsumerWakeWord,
+    kAudioConsumerCommunication,
+    kAudioConsumerCount
+};
+
+// One AFE instance shared by wake word detection and voice communication. NS and AEC run
+// once, every fetched chunk is handed to each active consumer on the fetch task.
+class AudioFrontEnd {
+public:
+    AudioFrontEnd();
+    ~AudioFrontEnd();
+
+    void Initialize(AudioCodec* codec, bool realtime_chat);
+    // Samples of one feed chunk, interleaved over all input channels
+    size_t GetFeedSize();
+    // Preallocated chunk in internal RAM, the codec reads into it and Feed hands it to the AFE
+    int16_t* GetFeedBuffer() { return feed_buffer_; }
+    void Feed(const int16_t* data);
+    // True while any consumer needs microphone audio
+    bool IsRunning();
+    bool IsConsumerActive(AudioFrontEndConsumer consumer);
+    void SetConsumerActive(AudioFrontEndConsumer consumer, bool active);
+    // Runs on the fetch task, which has a big stack for the wake word encoder and multinet
+    void OnFetch(AudioFrontEndConsumer consumer, std::function<void(afe_fetch_result_t* result)> callback);
+
+    srmodel_list_t* models() const { return models_; }
+    bool vad_enabled() const { return vad_enabled_; }
+
+private:
+    EventGroupHandle_t event_group_ = nullptr;
+    esp_afe_sr_iface_t* afe_iface_ = nullptr;
+    esp_afe_sr_data_t* afe_data_ = nullptr;
+    srmodel_list_t* models_ = nullptr;
+    AudioCodec* codec_ = nullptr;
+    bool wakenet_enabled_ = false;
+    bool vad_enabled_ = false;
+    std::mutex mutex_;
+    std::function<void(afe_fetch_result_t* result)> callbacks_[kAudioConsumerCount];
+
+    int16_t* feed_buffer_ = nullptr;
+
+    StaticTask_t fetch_task_buffer_;
+    StackType_t* fetch_task_stack_ = nullptr;
+
+    // Feed timestamps, matched to fetched chunks in order for the AFE latency
+    int64_t feed_times_[8] = {};
+    std::atomic<uint32_t> feed_count_{0};
+    std::atomic<uint32_t> fetch_count_{0};
+
+    void AudioFetchTask();
+};
+
+#endif
@@ -1,96 +1,53 @@
 #include "audio_processor.h"
+#include "audio_telemetry.h"
+#include "trace.h"
 #include <esp_log.h>
 
-#define PROCESSOR_RUNNING 0x01
+#ifdef CONFIG_VAD_GATE_HANGOVER_MS
+#define VAD_GATE_HANGOVER_MS CONFIG_VAD_GATE_HANGOVER_MS
+#define VAD_GATE_PREROLL_MS CONFIG_VAD_GATE_PREROLL_MS
+#else
+#define VAD_GATE_HANGOVER_MS 600
+#define VAD_GATE_PREROLL_MS 320
+#endif
+// AFE 输出固定为 16kHz
+#define VAD_GATE_SAMPLES_PER_MS 16
 
 static const char* TAG = "AudioProcessor";
 
-AudioProcessor::AudioProcessor()
-    : afe_data_(nullptr) {
-    event_group_ = xEventGroupCreate();
-}
-
-void AudioProcessor::Initialize(AudioCodec* codec, bool realtime_chat) {
-    codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
-
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
-    }
-
-    srmodel_list_t *models = esp_srmodel_init("model");
-    char* ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
-
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
-    if (realtime_chat) {
-        afe_config->aec_init = true;
-        afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
-    } else {
-        afe_config->aec_init = false;
-    }
-    afe_config->ns_init = true;
-    afe_config->ns_model_name = ns_model_name;
-    afe_config->afe_ns_mode = AFE_NS_MODE_NET;
-    if (realtime_chat) {
-        afe_config->vad_init = false;
-    } else {
-        afe_config->vad_init = true;
-        afe_config->vad_mode = VAD_MODE_0;
-        afe_config->vad_min_noise_ms = 100;
-    }
-    afe_config->afe_perferred_core = 1;
-    afe_config->afe_perferred_priority = 1;
-    afe_config->agc_init = false;
-    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
-
-    afe_iface_ = const_cast<esp_afe_sr_iface_t*>(esp_afe_handle_from_config(afe_config));
-    afe_data_ = afe_iface_->create_from_config(afe_config);
-    
-    xTaskCreate([](void* arg) {
-        auto this_ = (AudioProcessor*)arg;
-        this_->AudioProcessorTask();
-        vTaskDelete(NULL);
-    }, "audio_communication", 4096, this, 3, NULL);
+AudioProcessor::AudioProcessor() {
 }
 
 AudioProcessor::~AudioProcessor() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
-    }
-    vEventGroupDelete(event_group_);
-}
-
-size_t AudioProcessor::GetFeedSize() {
-    if (afe_data_ == nullptr) {
-        return 0;
-    }
-    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
 }
 
-void AudioProcessor::Feed(const std::vector<int16_t>& data) {
-    if (afe_data_ == nullptr) {
-        return;
-    }
-    afe_iface_->feed(afe_data_, data.data());
+void AudioProcessor::Initialize(AudioFrontEnd* front_end) {
+    TRACE_SCOPE(kTraceAudioProcessorInit);
+    front_end_ = front_end;
+    front_end_->OnFetch(kAudioConsumerCommunication, [this](afe_fetch_result_t* res) {
+        OnFetch(res);
+    });
+    ESP_LOGI(TAG, "Audio processor initialized, vad: %d", front_end_->vad_enabled());
 }
 
 void AudioProcessor::Start() {
-    xEventGroupSetBits(event_group_, PROCESSOR_RUNNING);
+    if (front_end_ != nullptr) {
+        // The consumer is not called while stopped, the gate state belongs to this task until it starts
+        gate_open_ = true;
+        gate_hangover_ = VAD_GATE_HANGOVER_MS * VAD_GATE_SAMPLES_PER_MS;
+        gate_preroll_.clear();
+        front_end_->SetConsumerActive(kAudioConsumerCommunication, true);
+    }
 }
 
 void AudioProcessor::Stop() {
-    xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
-    if (afe_data_ != nullptr) {
-        afe_iface_->reset_buffer(afe_data_);
+    if (front_end_ != nullptr) {
+        front_end_->SetConsumerActive(kAudioConsumerCommunication, false);
     }
 }
 
 bool AudioProcessor::IsRunning() {
-    return xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING;
+    return front_end_ != nullptr && front_end_->IsConsumerActive(kAudioConsumerCommunication);
 }
 
 void AudioProcessor::OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) {
@@ -101,39 +58,85 @@ void AudioProcessor::OnVadStateChange(std::function<void(bool speaking)> callbac
     vad_state_change_callback_ = callback;
 }
 
-void AudioProcessor::AudioProcessorTask() {
-    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
-    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
-    ESP_LOGI(TAG, "Audio communication task started, feed size: %d fetch size: %d",
-        feed_size, fetch_size);
+void AudioProcessor::SetUplinkGate(bool enabled) {
+    if (enabled && front_end_ != nullptr && !front_end_->vad_enabled()) {
+        ESP_LOGW(TAG, "VAD is disabled, the uplink gate stays open");
+        enabled = false;
+    }
+    gate_enabled_ = enabled;
+}
 
-    while (true) {
-        xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING, pdFALSE, pdTRUE, portMAX_DELAY);
+void AudioProcessor::OnUplinkGateChange(std::function<void(bool open)> callback) {
+    gate_change_callback_ = callback;
+}
 
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if ((xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING) == 0) {
-            continue;
-        }
-        if (res == nullptr || res->ret_value == ESP_FAIL) {
-            if (res != nullptr) {
-                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
+// The hangover and pre-roll are counted in samples, the AFE chunk size does not matter then
+bool AudioProcessor::UpdateGate(afe_fetch_result_t* res) {
+    int samples = res->data_size / sizeof(int16_t);
+    if (res->vad_state == VAD_SPEECH) {
+        gate_hangover_ = VAD_GATE_HANGOVER_MS * VAD_GATE_SAMPLES_PER_MS;
+        if (!gate_open_) {
+            gate_open_ = true;
+            ESP_LOGD(TAG, "Uplink gate open, pre-roll %u chunks", gate_preroll_.size());
+            if (gate_change_callback_) {
+                gate_change_callback_(true);
+            }
+            // The word onset is in the audio VAD needed to decide
+            while (!gate_preroll_.empty()) {
+                if (output_callback_) {
+                    output_callback_(std::move(gate_preroll_.front()));
+                }
+                gate_preroll_.pop_front();
             }
-            continue;
         }
+        return true;
+    }
 
-        // VAD state change
-        if (vad_state_change_callback_) {
-            if (res->vad_state == VAD_SPEECH && !is_speaking_) {
-                is_speaking_ = true;
-                vad_state_change_callback_(true);
-            } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
-                is_speaking_ = false;
-                vad_state_change_callback_(false);
-            }
+    if (gate_open_) {
+        gate_hangover_ -= samples;
+        if (gate_hangover_ > 0) {
+            return true;
+        }
+        gate_open_ = false;
+        ESP_LOGD(TAG, "Uplink gate closed");
+        if (gate_change_callback_) {
+            gate_change_callback_(false);
         }
+    }
 
-        if (output_callback_) {
-            output_callback_(std::vector<int16_t>(res->data, res->data + res->data_size / sizeof(int16_t)));
+    AudioTelemetry::GetInstance().Count(kAudioCounterUplinkSilent);
+    gate_preroll_.emplace_back(res->data, res->data + samples);
+    size_t preroll_samples = 0;
+    for (auto& chunk : gate_preroll_) {
+        preroll_samples += chunk.size();
+    }
+    while (!gate_preroll_.empty() && preroll_samples > VAD_GATE_PREROLL_MS * VAD_GATE_SAMPLES_PER_MS) {
+        preroll_samples -= gate_preroll_.front().size();
+        gate_preroll_.pop_front();
+    }
+    return false;
+}
+
+// Runs on the front end task
+void AudioProcessor::OnFetch(afe_fetch_result_t* res) {
+    // VAD state change
+    if (vad_state_change_callback_ && front_end_->vad_enabled()) {
+        if (res->vad_state == VAD_SPEECH && !is_speaking_) {
+            is_speaking_ = true;
+            TRACE_COUNTER(kTraceVad, 1);
+            vad_state_change_callback_(true);
+        } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
+            is_speaking_ = false;
+            TRACE_COUNTER(kTraceVad, 0);
+            vad_state_change_callback_(false);
         }
     }
+
+    if (gate_enabled_ && !UpdateGate(res)) {
+        return;
+    }
+
+    if (output_callback_) {
+        output_callback_(std::vector<int16_t>(res->data, res->data + res->data_size / sizeof(int16_t)));
+    }
 }
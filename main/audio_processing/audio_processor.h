@@ -1,41 +1,47 @@
 #ifndef AUDIO_PROCESSOR_H
 #define AUDIO_PROCESSOR_H
 
-#include <esp_afe_sr_models.h>
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <freertos/event_groups.h>
-
 #include <string>
 #include <vector>
+#include <deque>
 #include <functional>
+#include <atomic>
 
-#include "audio_codec.h"
+#include "audio_front_end.h"
 
+// Voice communication consumer of the shared front end: cleaned audio for the uplink and VAD
 class AudioProcessor {
 public:
     AudioProcessor();
     ~AudioProcessor();
 
-    void Initialize(AudioCodec* codec, bool realtime_chat);
-    void Feed(const std::vector<int16_t>& data);
+    void Initialize(AudioFrontEnd* front_end);
     void Start();
     void Stop();
     bool IsRunning();
     void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback);
     void OnVadStateChange(std::function<void(bool speaking)> callback);
-    size_t GetFeedSize();
+    // Holds back the output during VAD silence, needs VAD (not realtime chat). Takes effect on Start.
+    void SetUplinkGate(bool enabled);
+    // Called on the front end task when the gate closes after the hangover or opens on speech
+    void OnUplinkGateChange(std::function<void(bool open)> callback);
 
 private:
-    EventGroupHandle_t event_group_ = nullptr;
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
+    AudioFrontEnd* front_end_ = nullptr;
     std::function<void(std::vector<int16_t>&& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
-    AudioCodec* codec_ = nullptr;
     bool is_speaking_ = false;
 
-    void AudioProcessorTask();
+    // VAD gate, only touched on the front end task once started
+    std::atomic<bool> gate_enabled_{false};
+    std::function<void(bool open)> gate_change_callback_;
+    bool gate_open_ = true;
+    int gate_hangover_ = 0;
+    std::deque<std::vector<int16_t>> gate_preroll_;
+
+    void OnFetch(afe_fetch_result_t* res);
+    // Returns false if the chunk was held back
+    bool UpdateGate(afe_fetch_result_t* res);
 };
 
 #endif
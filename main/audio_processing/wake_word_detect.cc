@@ -1,41 +1,71 @@
 #include "wake_word_detect.h"
 #include "application.h"
+#include "memory_arena.h"
+#include "trace.h"
+#include "config.h"
+#include "iot/thing_manager.h"
 
 #include <esp_log.h>
 #include <model_path.h>
 #include <arpa/inet.h>
 #include <sstream>
+#include <algorithm>
+#include <cstring>
 #include <esp_mn_speech_commands.h>
+#include <cJSON.h>
 
-#define DETECTION_RUNNING_EVENT 1
+// 唤醒词前的音频预录时长
+#define WAKE_WORD_PREROLL_MS 2000
+#define WAKE_WORD_OPUS_SLOT_SIZE 512
+// 检测到唤醒词后每次送入编码器的采样数
+#define WAKE_WORD_ENCODE_CHUNK (16000 * 60 / 1000)
 
 static const char* TAG = "WakeWordDetect";
 
-WakeWordDetect::WakeWordDetect()
-    : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
-
-    event_group_ = xEventGroupCreate();
-}
-
-WakeWordDetect::~WakeWordDetect() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
-    }
+#if CONFIG_USE_OFFLINE_COMMANDS
+// 离线命令词, action 为 Application 处理的本地动作或者直接交给 ThingManager 的 iot 命令
+struct OfflineCommand {
+    const char* command;
+    const char* text;
+    const char* action;
+};
+#ifdef OFFLINE_COMMANDS
+// 板级 config.h 给出的命令词表, 命令词须与该板的 Multinet 模型语言一致
+static const OfflineCommand kOfflineCommands[] = { OFFLINE_COMMANDS };
+static const char* const kOfflineCommandsModel = nullptr;
+#else
+// 默认命令词是拼音, 只在中文 Multinet 模型下加载
+static const OfflineCommand kOfflineCommands[] = {
+    {"yin liang da yi dian", "音量大一点", "volume_up"},
+    {"yin liang xiao yi dian", "音量小一点", "volume_down"},
+};
+static const char* const kOfflineCommandsModel = "_cn";
+#endif
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
+// An iot action is only worth listening for when its thing is registered on this board
+static bool IsOfflineActionAvailable(const char* action) {
+    if (action[0] != '{') {
+        return true;
     }
+    auto command = cJSON_Parse(action);
+    auto name = cJSON_GetObjectItem(command, "name");
+    bool available = cJSON_IsString(name) && iot::ThingManager::GetInstance().HasThing(name->valuestring);
+    cJSON_Delete(command);
+    return available;
+}
+#endif
 
-    vEventGroupDelete(event_group_);
+WakeWordDetect::WakeWordDetect() {
 }
 
-void WakeWordDetect::Initialize(AudioCodec* codec) {
-    codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
+WakeWordDetect::~WakeWordDetect() {
+    MemoryArenas::GetInstance().Free(preroll_pcm_);
+}
 
-    srmodel_list_t *models = esp_srmodel_init("model");
+void WakeWordDetect::Initialize(AudioFrontEnd* front_end) {
+    TRACE_SCOPE(kTraceWakeWordInit);
+    front_end_ = front_end;
+    srmodel_list_t *models = front_end_->models();
 
 #ifdef CONFIG_USE_CUSTOM_WAKE_WORD
     use_multinet_ = true;
@@ -47,6 +77,19 @@ void WakeWordDetect::Initialize(AudioCodec* codec) {
         multinet_->set_det_threshold(multinet_model_data_, threshold);
 
         commands_.push_back({CONFIG_CUSTOM_WAKE_WORD, CONFIG_CUSTOM_WAKE_WORD_DISPLAY, "wake"});
+#if CONFIG_USE_OFFLINE_COMMANDS
+        if (kOfflineCommandsModel != nullptr && strstr(mn_name_, kOfflineCommandsModel) == nullptr) {
+            ESP_LOGW(TAG, "Default offline commands do not match model %s, define OFFLINE_COMMANDS", mn_name_);
+        } else {
+            for (auto& command : kOfflineCommands) {
+                if (!IsOfflineActionAvailable(command.action)) {
+                    ESP_LOGW(TAG, "Offline command %s skipped, its target is not registered", command.command);
+                    continue;
+                }
+                commands_.push_back({command.command, command.text, command.action});
+            }
+        }
+#endif
         esp_mn_commands_clear();
         for (int i = 0; i < commands_.size(); i++) {
             esp_mn_commands_add(i + 1, const_cast<char*>(commands_[i].command.c_str()));
@@ -72,162 +115,172 @@ void WakeWordDetect::Initialize(AudioCodec* codec) {
         }
     }
 
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
+    // The pre-roll is sent before the hello answer, so it uses the frame duration asked for
+    int frame_duration = Protocol::PreferredFrameDuration();
+    wake_word_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, frame_duration);
+    wake_word_encoder_->SetComplexity(0); // 0 is the fastest
+    wake_word_opus_ = std::make_unique<AudioPacketRing>(WAKE_WORD_PREROLL_MS / frame_duration + 1, WAKE_WORD_OPUS_SLOT_SIZE);
+    // Copying PCM is all the idle path does, the encoder only runs once the wake word is heard
+    preroll_capacity_ = 16000 * WAKE_WORD_PREROLL_MS / 1000;
+    preroll_pcm_ = (int16_t*)MemoryArenas::GetInstance().Allocate(kArenaAudio, preroll_capacity_ * sizeof(int16_t));
+    if (preroll_pcm_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the pre-roll buffer");
+        preroll_capacity_ = 0;
     }
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
-    afe_config->aec_init = codec_->input_reference();
-    afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
-    afe_config->afe_perferred_core = 1;
-    afe_config->afe_perferred_priority = 1;
-    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
 
-#ifdef CONFIG_USE_CUSTOM_WAKE_WORD
-    afe_config->wakenet_init = false;
-    afe_config->wakenet_model_name = NULL;
-#endif
-    
-    afe_iface_ = const_cast<esp_afe_sr_iface_t*>(esp_afe_handle_from_config(afe_config));
-    afe_data_ = afe_iface_->create_from_config(afe_config);
-
-    xTaskCreate([](void* arg) {
-        auto this_ = (WakeWordDetect*)arg;
-        this_->AudioDetectionTask();
-        vTaskDelete(NULL);
-    }, "audio_detection", 4096, this, 3, nullptr);
+    front_end_->OnFetch(kAudioConsumerWakeWord, [this](afe_fetch_result_t* res) {
+        OnFetch(res);
+    });
 }
 
 void WakeWordDetect::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
     wake_word_detected_callback_ = callback;
 }
 
+void WakeWordDetect::OnCommandDetected(std::function<void(const std::string& text, const std::string& action)> callback) {
+    command_detected_callback_ = callback;
+}
+
 void WakeWordDetect::StartDetection() {
-    xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
+    if (front_end_ == nullptr) {
+        return;
+    }
+    // The consumer is not called while stopped, start the pre-roll over with fresh audio.
+    // The PCM ring belongs to the front end task, which drops it on the next fetch.
+    if (!IsDetectionRunning()) {
+        preroll_reset_ = true;
+    }
+    front_end_->SetConsumerActive(kAudioConsumerWakeWord, true);
 }
 
 void WakeWordDetect::StopDetection() {
-    xEventGroupClearBits(event_group_, DETECTION_RUNNING_EVENT);
-    if (afe_data_ != nullptr) {
-        afe_iface_->reset_buffer(afe_data_);
+    if (front_end_ != nullptr) {
+        front_end_->SetConsumerActive(kAudioConsumerWakeWord, false);
     }
 }
 
 bool WakeWordDetect::IsDetectionRunning() {
-    return xEventGroupGetBits(event_group_) & DETECTION_RUNNING_EVENT;
+    return front_end_ != nullptr && front_end_->IsConsumerActive(kAudioConsumerWakeWord);
 }
 
-void WakeWordDetect::Feed(const std::vector<int16_t>& data) {
-    if (afe_data_ == nullptr) {
-        return;
+// Runs on the front end task
+void WakeWordDetect::OnFetch(afe_fetch_result_t* res) {
+    // Store the wake word data for voice recognition, like who is speaking. Nothing is stored
+    // while a background task still encodes the last pre-roll.
+    if (!preroll_encoding_) {
+        if (preroll_reset_.exchange(false)) {
+            preroll_size_ = 0;
+            preroll_paused_ = false;
+        }
+        if (front_end_->IsConsumerActive(kAudioConsumerCommunication)) {
+            preroll_paused_ = true;
+        } else {
+            if (preroll_paused_) {
+                preroll_size_ = 0;
+                preroll_paused_ = false;
+            }
+            StoreWakeWordData(res->data, res->data_size / sizeof(int16_t));
+        }
     }
-    afe_iface_->feed(afe_data_, data.data());
-}
 
-size_t WakeWordDetect::GetFeedSize() {
-    if (afe_data_ == nullptr) {
-        return 0;
+    if (use_multinet_ && multinet_model_data_) {
+        esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, (int16_t*)res->data);
+        if (mn_state == ESP_MN_STATE_DETECTED) {
+             esp_mn_results_t *mn_result = multinet_->get_results(multinet_model_data_);
+             for (int i = 0; i < mn_result->num; i++) {
+                int id = mn_result->command_id[i] - 1;
+                if (id < 0 || id >= commands_.size()) {
+                    continue;
+                }
+                if (commands_[id].action == "wake") {
+                    ESP_LOGI(TAG, "Custom wake word detected: %s", commands_[id].text.c_str());
+                    OnDetected(commands_[id].text);
+                } else {
+                    // Handled locally, the same utterance must not be detected again on the next chunk
+                    ESP_LOGI(TAG, "Offline command detected: %s", commands_[id].text.c_str());
+                    multinet_->clean(multinet_model_data_);
+                    if (command_detected_callback_) {
+                        command_detected_callback_(commands_[id].text, commands_[id].action);
+                    }
+                    break;
+                }
+             }
+        }
+    } 
+    else if (res->wakeup_state == WAKENET_DETECTED) {
+        OnDetected(wake_words_[res->wake_word_index - 1]);
     }
-    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
 }
 
-void WakeWordDetect::AudioDetectionTask() {
-    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
-    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
-    ESP_LOGI(TAG, "Audio detection task started, feed size: %d fetch size: %d",
-        feed_size, fetch_size);
-
-    while (true) {
-        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+// Runs on the front end task. Detection stops, so the PCM ring stays as it is until the
+// main loop hands it to EncodeWakeWordData or starts the detection again.
+void WakeWordDetect::OnDetected(const std::string& wake_word) {
+    StopDetection();
+    TRACE_INSTANT(kTraceWakeWordDetected);
+    last_detected_wake_word_ = wake_word;
 
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if (res == nullptr || res->ret_value == ESP_FAIL) {
-            continue;;
-        }
-
-        // Store the wake word data for voice recognition, like who is speaking
-        StoreWakeWordData((uint16_t*)res->data, res->data_size / sizeof(uint16_t));
-
-        if (use_multinet_ && multinet_model_data_) {
-            esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, (int16_t*)res->data);
-            if (mn_state == ESP_MN_STATE_DETECTED) {
-                 esp_mn_results_t *mn_result = multinet_->get_results(multinet_model_data_);
-                 for (int i = 0; i < mn_result->num; i++) {
-                    int id = mn_result->command_id[i] - 1;
-                    if (id >= 0 && id < commands_.size() && commands_[id].action == "wake") {
-                        ESP_LOGI(TAG, "Custom wake word detected: %s", commands_[id].text.c_str());
-                        StopDetection();
-                        last_detected_wake_word_ = commands_[id].text;
-
-                        if (wake_word_detected_callback_) {
-                            wake_word_detected_callback_(last_detected_wake_word_);
-                        }
-                    }
-                 }
-            }
-        } 
-        else if (res->wakeup_state == WAKENET_DETECTED) {
-            StopDetection();
-            last_detected_wake_word_ = wake_words_[res->wake_word_index - 1];
-
-            if (wake_word_detected_callback_) {
-                wake_word_detected_callback_(last_detected_wake_word_);
-            }
-        }
+    if (wake_word_detected_callback_) {
+        wake_word_detected_callback_(last_detected_wake_word_);
     }
 }
 
-void WakeWordDetect::StoreWakeWordData(uint16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 32ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 32) {
-        wake_word_pcm_.pop_front();
+// Runs on the front end task for every fetched chunk, the oldest samples are overwritten
+void WakeWordDetect::StoreWakeWordData(const int16_t* data, size_t samples) {
+    if (preroll_capacity_ == 0) {
+        return;
+    }
+    if (samples > preroll_capacity_) {
+        data += samples - preroll_capacity_;
+        samples = preroll_capacity_;
     }
+    size_t first = std::min(samples, preroll_capacity_ - preroll_write_);
+    memcpy(preroll_pcm_ + preroll_write_, data, first * sizeof(int16_t));
+    memcpy(preroll_pcm_, data + first, (samples - first) * sizeof(int16_t));
+    preroll_write_ = (preroll_write_ + samples) % preroll_capacity_;
+    preroll_size_ = std::min(preroll_size_ + samples, preroll_capacity_);
 }
 
-void WakeWordDetect::EncodeWakeWordData() {
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
+void WakeWordDetect::EncodeWakeWordData(BackgroundTask* task, BackgroundTaskGroup* group) {
+    if (!wake_word_opus_) {
+        return;
     }
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (WakeWordDetect*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-            }
-            this_->wake_word_pcm_.clear();
-
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %zu packets in %lld ms",
-                this_->wake_word_opus_.size(), (end_time - start_time) / 1000);
+    // Set before the detection can start again, the front end task then stores nothing
+    preroll_encoding_ = true;
+    task->Schedule([this]() {
+        EncodePreroll();
+    }, kBackgroundTaskWait, group);
+}
 
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_detect_packets", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+// Runs on the background task, one chunk at a time like the uplink. The Opus ring has a slot
+// for every frame of the pre-roll and only this task clears it.
+void WakeWordDetect::EncodePreroll() {
+    wake_word_opus_->Clear();
+    wake_word_encoder_->ResetState();
+    size_t position = preroll_capacity_ == 0 ? 0 : (preroll_write_ + preroll_capacity_ - preroll_size_) % preroll_capacity_;
+    size_t remaining = preroll_size_;
+    while (remaining > 0) {
+        size_t samples = std::min({remaining, preroll_capacity_ - position, (size_t)WAKE_WORD_ENCODE_CHUNK});
+        std::vector<int16_t> pcm(preroll_pcm_ + position, preroll_pcm_ + position + samples);
+        wake_word_encoder_->Encode(std::move(pcm), [this](std::vector<uint8_t>&& opus) {
+            if (opus.size() <= wake_word_opus_->slot_size()) {
+                wake_word_opus_->Push(opus.data(), opus.size());
+            }
+        });
+        position = (position + samples) % preroll_capacity_;
+        remaining -= samples;
+    }
+    // The front end task drops the encoded PCM on its next fetch
+    preroll_reset_ = true;
+    preroll_encoding_ = false;
 }
 
-bool WakeWordDetect::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+bool WakeWordDetect::GetWakeWordOpus(AudioPacket& opus) {
+    const uint8_t* data;
+    size_t size;
+    if (!wake_word_opus_ || !wake_word_opus_->Front(data, size)) {
+        return false;
+    }
+    opus = PacketPool::GetInstance().Allocate(data, size);
+    wake_word_opus_->Pop();
+    return (bool)opus;
 }
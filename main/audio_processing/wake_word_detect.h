@@ -1,48 +1,50 @@
 #ifndef WAKE_WORD_DETECT_H
 #define WAKE_WORD_DETECT_H
 
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <freertos/event_groups.h>
-
-#include <esp_afe_sr_models.h>
-#include <esp_nsn_models.h>
 #include <esp_mn_iface.h>
 #include <esp_mn_models.h>
+#include <freertos/FreeRTOS.h>
 
-#include <list>
 #include <string>
 #include <vector>
+#include <memory>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
+#include <atomic>
+
+#include <opus_encoder.h>
 
-#include "audio_codec.h"
+#include "audio_front_end.h"
+#include "audio_packet_ring.h"
+#include "background_task.h"
+#include "packet_pool.h"
 
+// Wake word consumer of the shared front end, wakenet or multinet plus the pre-roll encoder
 class WakeWordDetect {
 public:
     WakeWordDetect();
     ~WakeWordDetect();
 
-    void Initialize(AudioCodec* codec);
-    void Feed(const std::vector<int16_t>& data);
+    void Initialize(AudioFrontEnd* front_end);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    // Multinet command words other than the wake word, detection keeps running after them
+    void OnCommandDetected(std::function<void(const std::string& text, const std::string& action)> callback);
     void StartDetection();
     void StopDetection();
     bool IsDetectionRunning();
-    size_t GetFeedSize();
-    void EncodeWakeWordData();
-    bool GetWakeWordOpus(std::vector<uint8_t>& opus);
+    // Call on the main loop after a detection. The pre-roll kept as PCM is encoded in small
+    // steps by a task of `group`, the front end leaves the PCM alone until it is done.
+    void EncodeWakeWordData(BackgroundTask* task, BackgroundTaskGroup* group);
+    // Pops the oldest encoded pre-roll packet without waiting, call it from a later task of
+    // the same group
+    bool GetWakeWordOpus(AudioPacket& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
 
 private:
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
+    AudioFrontEnd* front_end_ = nullptr;
     char* wakenet_model_ = NULL;
     std::vector<std::string> wake_words_;
-    EventGroupHandle_t event_group_;
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
-    AudioCodec* codec_ = nullptr;
+    std::function<void(const std::string& text, const std::string& action)> command_detected_callback_;
     std::string last_detected_wake_word_;
 
     // Multinet support
@@ -57,16 +59,24 @@ private:
     };
     std::vector<Command> commands_;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t wake_word_encode_task_buffer_;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::list<std::vector<int16_t>> wake_word_pcm_;
-    std::list<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    std::unique_ptr<OpusEncoderWrapper> wake_word_encoder_;
+    // Filled and cleared by the encode task only, drained by the same task group
+    std::unique_ptr<AudioPacketRing> wake_word_opus_;
+    // Fixed PCM ring of the last WAKE_WORD_PREROLL_MS, only the front end task writes it
+    int16_t* preroll_pcm_ = nullptr;
+    size_t preroll_capacity_ = 0;
+    size_t preroll_write_ = 0;
+    size_t preroll_size_ = 0;
+    // No pre-roll is needed while the uplink runs too (realtime barge-in)
+    bool preroll_paused_ = false;
+    std::atomic<bool> preroll_reset_{false};
+    // Set while a background task reads the PCM ring
+    std::atomic<bool> preroll_encoding_{false};
 
-    void StoreWakeWordData(uint16_t* data, size_t size);
-    void AudioDetectionTask();
+    void StoreWakeWordData(const int16_t* data, size_t samples);
+    void EncodePreroll();
+    void OnDetected(const std::string& wake_word);
+    void OnFetch(afe_fetch_result_t* res);
 };
 
 #endif
@@ -0,0 +1,159 @@
+#include "audio_telemetry.h"
+#include "protocols/json_message.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstdio>
+
+#define TAG "AudioTelemetry"
+
+// 首桶上限 2^7 = 128us
+#define AUDIO_TELEMETRY_FIRST_BUCKET_SHIFT 7
+
+static const char* const kStageNames[kAudioStageCount] = {
+    "capture", "afe", "encode", "send", "receive", "decode", "output", "loopback", "server_rtt"
+};
+static const char* const kCounterNames[kAudioCounterCount] = {
+    "uplink_dropped", "uplink_silent", "downlink_lost", "downlink_late", "downlink_dropped", "underruns",
+    "i2s_underruns", "i2s_overruns", "output_gaps"
+};
+static const char* const kGaugeNames[kAudioGaugeCount] = {
+    "jitter_depth"
+};
+
+static void UpdateMax(std::atomic<int64_t>& target, int64_t value) {
+    int64_t current = target.load(std::memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::Record(int64_t duration_us) {
+    if (duration_us < 0) {
+        duration_us = 0;
+    }
+    int index = 0;
+    uint64_t value = (uint64_t)duration_us >> AUDIO_TELEMETRY_FIRST_BUCKET_SHIFT;
+    while (value > 0 && index < AUDIO_TELEMETRY_BUCKETS - 1) {
+        value >>= 1;
+        index++;
+    }
+    buckets_[index].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_us_.fetch_add(duration_us, std::memory_order_relaxed);
+    UpdateMax(max_us_, duration_us);
+}
+
+void LatencyHistogram::Reset() {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    total_us_.store(0, std::memory_order_relaxed);
+    max_us_.store(0, std::memory_order_relaxed);
+}
+
+int64_t LatencyHistogram::average_us() const {
+    uint32_t n = count();
+    return n > 0 ? total_us_.load(std::memory_order_relaxed) / n : 0;
+}
+
+int64_t LatencyHistogram::percentile_us(int percentile) const {
+    uint32_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t rank = ((uint64_t)n * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < AUDIO_TELEMETRY_BUCKETS - 1; i++) {
+        uint32_t in_bucket = bucket(i);
+        if (seen + in_bucket >= rank) {
+            // Linear inside the bucket, never past the largest sample recorded
+            int64_t low = i == 0 ? 0 : 1LL << (i + AUDIO_TELEMETRY_FIRST_BUCKET_SHIFT - 1);
+            int64_t high = 1LL << (i + AUDIO_TELEMETRY_FIRST_BUCKET_SHIFT);
+            int64_t value = low + (int64_t)((high - low) * (rank - seen) / in_bucket);
+            return std::min(value, max_us());
+        }
+        seen += in_bucket;
+    }
+    // The last bucket is open ended
+    return max_us();
+}
+
+void AudioTelemetry::UpdateHighWater(AudioGauge gauge, uint32_t value) {
+    auto& target = high_water_[gauge];
+    uint32_t current = target.load(std::memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+std::string_view AudioTelemetry::GetReportJson(ArenaBuffer& buffer) const {
+    // A stage takes under 240 bytes even with every bucket in the millions
+    buffer.Reset(kArenaProtocol, kAudioStageCount * 240 + JSON_CONTROL_MESSAGE_SIZE);
+    if (buffer.size() == 0) {
+        return std::string_view();
+    }
+    JsonWriter json(buffer.data(), buffer.size());
+    for (int i = 0; i < kAudioStageCount; i++) {
+        auto& stage = stages_[i];
+        if (stage.count() == 0) {
+            continue;
+        }
+        json.BeginObject(kStageNames[i]).AddInt("count", stage.count()).AddInt("avg", stage.average_us())
+            .AddInt("p50", stage.percentile_us(50)).AddInt("p99", stage.percentile_us(99)).AddInt("max", stage.max_us());
+        json.BeginArray("buckets");
+        for (int b = 0; b < AUDIO_TELEMETRY_BUCKETS; b++) {
+            char digits[12];
+            int length = snprintf(digits, sizeof(digits), "%lu", (unsigned long)stage.bucket(b));
+            json.AddRawItem(std::string_view(digits, length));
+        }
+        json.EndArray().EndObject();
+    }
+    json.BeginObject("counters");
+    for (int i = 0; i < kAudioCounterCount; i++) {
+        json.AddInt(kCounterNames[i], counters_[i].load(std::memory_order_relaxed));
+    }
+    json.EndObject().BeginObject("high_water");
+    for (int i = 0; i < kAudioGaugeCount; i++) {
+        json.AddInt(kGaugeNames[i], high_water_[i].load(std::memory_order_relaxed));
+    }
+    json.EndObject().BeginObject("i2s");
+    json.AddInt("dma_desc_num", dma_desc_num_);
+    json.AddInt("dma_frame_num", dma_frame_num_);
+    json.EndObject();
+    return json.Finish();
+}
+
+void AudioTelemetry::LogStats() const {
+    for (int i = 0; i < kAudioStageCount; i++) {
+        auto& stage = stages_[i];
+        if (stage.count() == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: %lu samples, avg %lldus p50 %lldus p99 %lldus max %lldus", kStageNames[i],
+            stage.count(), stage.average_us(), stage.percentile_us(50), stage.percentile_us(99), stage.max_us());
+    }
+    ESP_LOGI(TAG, "uplink dropped: %lu, lost: %lu, late: %lu, dropped: %lu, underruns: %lu, jitter depth max: %lu",
+        counters_[kAudioCounterUplinkDropped].load(), counters_[kAudioCounterDownlinkLost].load(),
+        counters_[kAudioCounterDownlinkLate].load(), counters_[kAudioCounterDownlinkDropped].load(),
+        counters_[kAudioCounterUnderruns].load(), high_water_[kAudioGaugeJitterDepth].load());
+    ESP_LOGI(TAG, "i2s dma %d x %d, underruns: %lu, overruns: %lu, output gaps: %lu", dma_desc_num_, dma_frame_num_,
+        counters_[kAudioCounterI2sUnderruns].load(), counters_[kAudioCounterI2sOverruns].load(),
+        counters_[kAudioCounterOutputGaps].load());
+}
+
+void AudioTelemetry::SetI2sDmaConfig(int desc_num, int frame_num) {
+    dma_desc_num_ = desc_num;
+    dma_frame_num_ = frame_num;
+}
+
+void AudioTelemetry::Reset() {
+    for (auto& stage : stages_) {
+        stage.Reset();
+    }
+    for (auto& counter : counters_) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for (auto& high_water : high_water_) {
+        high_water.store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef AUDIO_TELEMETRY_H
+#define AUDIO_TELEMETRY_H
+
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "memory_arena.h"
+
+// 延迟直方图桶数: 第 i 个桶为 [2^(i+6), 2^(i+7)) us, 首桶包含更短的, 末桶包含更长的
+#define AUDIO_TELEMETRY_BUCKETS 14
+
+enum AudioStage {
+    kAudioStageCapture,     // ReadAudio, I2S read and resampling
+    kAudioStageAfe,         // AFE feed until the processed chunk is fetched
+    kAudioStageEncode,      // Opus encode of one frame
+    kAudioStageSend,        // Protocol::SendAudio
+    kAudioStageReceive,     // Time a downlink packet waits in the jitter buffer
+    kAudioStageDecode,      // Opus decode and resampling
+    kAudioStageOutput,      // I2S write of one chunk
+    kAudioStageLoopback,    // Chirp submitted to OutputData until captured, by LatencyProbe
+    kAudioStageServerRtt,   // Latency probe control message echoed by the server
+    kAudioStageCount
+};
+
+enum AudioCounter {
+    kAudioCounterUplinkDropped,     // Frames not sent, channel busy or oversized
+    kAudioCounterUplinkSilent,      // AFE chunks held back by the VAD gate
+    kAudioCounterDownlinkLost,      // Frames concealed by the decoder
+    kAudioCounterDownlinkLate,      // Frames that arrived after their slot was played
+    kAudioCounterDownlinkDropped,   // Frames outside the jitter buffer window
+    kAudioCounterUnderruns,         // Jitter buffer ran dry while playing
+    kAudioCounterI2sUnderruns,      // TX DMA buffers played as silence inside continuous playback
+    kAudioCounterI2sOverruns,       // RX DMA buffers lost because the audio loop read too late
+    kAudioCounterOutputGaps,        // Stream gaps covered with comfort silence before the DMA ran dry
+    kAudioCounterCount
+};
+
+enum AudioGauge {
+    kAudioGaugeJitterDepth,         // Frames held by the jitter buffer
+    kAudioGaugeCount
+};
+
+// Fixed size, lock free latency histogram
+class LatencyHistogram {
+public:
+    void Record(int64_t duration_us);
+    void Reset();
+
+    inline uint32_t count() const { return count_.load(std::memory_order_relaxed); }
+    inline int64_t max_us() const { return max_us_.load(std::memory_order_relaxed); }
+    int64_t average_us() const;
+    // Upper bound of the bucket holding the given percentile
+    int64_t percentile_us(int percentile) const;
+    inline uint32_t bucket(int index) const { return buckets_[index].load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> buckets_[AUDIO_TELEMETRY_BUCKETS] = {};
+    std::atomic<uint32_t> count_{0};
+    std::atomic<int64_t> total_us_{0};
+    std::atomic<int64_t> max_us_{0};
+};
+
+// Per stage audio latency histograms, counters and high-water marks. Recording is
+// a few relaxed atomics, safe from any task; the report resets the window.
+class AudioTelemetry {
+public:
+    static AudioTelemetry& GetInstance() {
+        static AudioTelemetry instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    AudioTelemetry(const AudioTelemetry&) = delete;
+    AudioTelemetry& operator=(const AudioTelemetry&) = delete;
+
+    inline void Record(AudioStage stage, int64_t duration_us) { stages_[stage].Record(duration_us); }
+    inline void Count(AudioCounter counter, uint32_t n = 1) { counters_[counter].fetch_add(n, std::memory_order_relaxed); }
+    void UpdateHighWater(AudioGauge gauge, uint32_t value);
+    // Reported with every window, so underruns can be read against the DMA depth
+    void SetI2sDmaConfig(int desc_num, int frame_num);
+
+    // {"capture":{"count":..,"avg":..,"p50":..,"p99":..,"max":..,"buckets":[..]},..,"counters":{..},"high_water":{..}}
+    // Written into `buffer`, which it sizes from kArenaProtocol. Empty if that failed.
+    std::string_view GetReportJson(ArenaBuffer& buffer) const;
+    // One line per stage with samples
+    void LogStats() const;
+    void Reset();
+
+private:
+    AudioTelemetry() = default;
+    ~AudioTelemetry() = default;
+
+    LatencyHistogram stages_[kAudioStageCount];
+    std::atomic<uint32_t> counters_[kAudioCounterCount] = {};
+    std::atomic<uint32_t> high_water_[kAudioGaugeCount] = {};
+    int dma_desc_num_ = 0;
+    int dma_frame_num_ = 0;
+};
+
+// Records the lifetime of the scope into a stage
+class ScopedAudioLatency {
+public:
+    explicit ScopedAudioLatency(AudioStage stage) : stage_(stage), start_(esp_timer_get_time()) {}
+    ~ScopedAudioLatency() {
+        AudioTelemetry::GetInstance().Record(stage_, esp_timer_get_time() - start_);
+    }
+
+private:
+    AudioStage stage_;
+    int64_t start_;
+};
+
+#endif // AUDIO_TELEMETRY_H
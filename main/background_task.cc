@@ -3,61 +3,214 @@
 #include <esp_log.h>
 #include <esp_task_wdt.h>
 
+#include <algorithm>
+#include <cstdio>
+
 #define TAG "BackgroundTask"
 
-BackgroundTask::BackgroundTask(uint32_t stack_size) {
-    xTaskCreate([](void* arg) {
-        BackgroundTask* task = (BackgroundTask*)arg;
-        task->BackgroundTaskLoop();
-    }, "background_task", stack_size, this, 2, &background_task_handle_);
+BackgroundTask::BackgroundTask(uint32_t stack_size, UBaseType_t priority, BaseType_t core_id, size_t capacity, size_t workers)
+    : workers_(std::max<size_t>(workers, 1)) {
+    for (size_t i = 0; i < workers_.size(); i++) {
+        auto& worker = workers_[i];
+        worker.ring.resize(std::max<size_t>(capacity, 1));
+        worker.owner = this;
+    }
+    // Start the workers only after every queue exists, they steal from each other
+    for (size_t i = 0; i < workers_.size(); i++) {
+        char name[16];
+        if (i == 0) {
+            snprintf(name, sizeof(name), "background_task");
+        } else {
+            snprintf(name, sizeof(name), "background_%u", (unsigned)i);
+        }
+        BaseType_t core = core_id == tskNO_AFFINITY ? tskNO_AFFINITY : (BaseType_t)((core_id + i) % portNUM_PROCESSORS);
+        xTaskCreatePinnedToCore([](void* arg) {
+            auto worker = (Worker*)arg;
+            worker->owner->BackgroundTaskLoop(worker - worker->owner->workers_.data());
+        }, name, stack_size, &workers_[i], priority, &workers_[i].handle, core);
+    }
 }
 
 BackgroundTask::~BackgroundTask() {
-    if (background_task_handle_ != nullptr) {
-        vTaskDelete(background_task_handle_);
+    for (auto& worker : workers_) {
+        if (worker.handle != nullptr) {
+            vTaskDelete(worker.handle);
+        }
     }
 }
 
-void BackgroundTask::Schedule(std::function<void()> callback) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (active_tasks_ >= 30) {
-        int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
-        if (free_sram < 10000) {
-            ESP_LOGW(TAG, "active_tasks_ == %u, free_sram == %u", active_tasks_.load(), free_sram);
-        }
-    }
-    active_tasks_++;
-    main_tasks_.emplace_back([this, cb = std::move(callback)]() {
-        cb();
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
-            active_tasks_--;
-            if (main_tasks_.empty() && active_tasks_ == 0) {
-                condition_variable_.notify_all();
+// Removes entry i and closes the gap towards the head, the rings are small
+BackgroundTask::Entry BackgroundTask::Worker::Remove(size_t i) {
+    Entry entry = std::move(at(i));
+    for (size_t j = i; j > 0; j--) {
+        at(j) = std::move(at(j - 1));
+    }
+    at(0).task = MainTask();
+    head = (head + 1) % ring.size();
+    count--;
+    return entry;
+}
+
+int BackgroundTask::CurrentWorker() const {
+    auto current = xTaskGetCurrentTaskHandle();
+    for (size_t i = 0; i < workers_.size(); i++) {
+        if (workers_[i].handle == current) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+size_t BackgroundTask::PickWorker(BackgroundTaskGroup* group) {
+    if (group != nullptr && group->serial_ && group->home_ >= 0) {
+        return group->home_;
+    }
+    // Least loaded, ties go round robin
+    size_t best = next_worker_ % workers_.size();
+    for (size_t n = 1; n < workers_.size(); n++) {
+        size_t i = (next_worker_ + n) % workers_.size();
+        if (workers_[i].count + workers_[i].running < workers_[best].count + workers_[best].running) {
+            best = i;
+        }
+    }
+    next_worker_ = best + 1;
+    if (group != nullptr && group->serial_) {
+        group->home_ = best;
+    }
+    return best;
+}
+
+bool BackgroundTask::Schedule(MainTask&& callback, BackgroundTaskPolicy policy, BackgroundTaskGroup* group) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stats_.scheduled++;
+    auto& worker = workers_[PickWorker(group)];
+    if (worker.count == worker.ring.size()) {
+        bool self = CurrentWorker() >= 0;
+        if (policy == kBackgroundTaskWait && !self) {
+            stats_.waited++;
+            space_available_.wait(lock, [&worker]() { return worker.count < worker.ring.size(); });
+        } else if (policy != kBackgroundTaskDropOldest || !DropOldest(worker)) {
+            // A worker waiting for a worker could never return
+            if (self) {
+                ESP_LOGE(TAG, "Queue full, task scheduled from a background worker is dropped");
             }
+            stats_.dropped++;
+            return false;
         }
-    });
-    condition_variable_.notify_all();
+    }
+
+    auto& entry = worker.at(worker.count);
+    entry.task = std::move(callback);
+    entry.group = group;
+    entry.droppable = policy == kBackgroundTaskDropOldest;
+    worker.count++;
+    if (group != nullptr) {
+        group->pending_++;
+    }
+    stats_.max_depth = std::max(stats_.max_depth, worker.count);
+    // Every idle worker may take it
+    task_available_.notify_all();
+    return true;
+}
+
+bool BackgroundTask::DropOldest(Worker& worker) {
+    for (size_t i = 0; i < worker.count; i++) {
+        if (!worker.at(i).droppable) {
+            continue;
+        }
+        auto entry = worker.Remove(i);
+        if (entry.group != nullptr) {
+            entry.group->pending_--;
+            completed_.notify_all();
+        }
+        stats_.dropped++;
+        return true;
+    }
+    return false;
+}
+
+// Own queue first, then the others, oldest runnable task of each
+bool BackgroundTask::TakeTask(size_t self, Entry& entry) {
+    for (size_t n = 0; n < workers_.size(); n++) {
+        auto& worker = workers_[(self + n) % workers_.size()];
+        for (size_t i = 0; i < worker.count; i++) {
+            auto group = worker.at(i).group;
+            if (group != nullptr && group->serial_ && group->running_ > 0) {
+                continue;
+            }
+            entry = worker.Remove(i);
+            if (group != nullptr) {
+                group->running_++;
+            }
+            if (n > 0) {
+                stats_.stolen++;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void BackgroundTask::Complete(BackgroundTaskGroup* group) {
+    if (group != nullptr) {
+        group->running_--;
+        group->pending_--;
+        if (group->serial_) {
+            // The next task of the group may be waiting for this one
+            task_available_.notify_all();
+        }
+    }
+    completed_.notify_all();
 }
 
 void BackgroundTask::WaitForCompletion() {
     std::unique_lock<std::mutex> lock(mutex_);
-    condition_variable_.wait(lock, [this]() {
-        return main_tasks_.empty() && active_tasks_ == 0;
+    completed_.wait(lock, [this]() {
+        for (auto& worker : workers_) {
+            if (worker.count > 0 || worker.running) {
+                return false;
+            }
+        }
+        return true;
     });
 }
 
-void BackgroundTask::BackgroundTaskLoop() {
-    ESP_LOGI(TAG, "background_task started");
+void BackgroundTask::WaitForCompletion(BackgroundTaskGroup& group) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    completed_.wait(lock, [&group]() { return group.pending_ == 0; });
+}
+
+void BackgroundTask::LogStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stats_.scheduled == 0) {
+        return;
+    }
+    size_t queued = 0;
+    for (auto& worker : workers_) {
+        queued += worker.count;
+    }
+    ESP_LOGI(TAG, "%lu tasks, %lu dropped, %lu waited, %lu stolen, depth max %u/%u, queued %u", stats_.scheduled,
+        stats_.dropped, stats_.waited, stats_.stolen, stats_.max_depth, workers_[0].ring.size(), queued);
+    stats_ = Stats();
+}
+
+void BackgroundTask::BackgroundTaskLoop(size_t index) {
+    ESP_LOGI(TAG, "background worker %u started", (unsigned)index);
+    auto& worker = workers_[index];
+    Entry entry;
     while (true) {
         std::unique_lock<std::mutex> lock(mutex_);
-        condition_variable_.wait(lock, [this]() { return !main_tasks_.empty(); });
-        
-        std::list<std::function<void()>> tasks = std::move(main_tasks_);
+        task_available_.wait(lock, [this, index, &entry]() { return TakeTask(index, entry); });
+        worker.running = true;
+        space_available_.notify_all();
         lock.unlock();
 
-        for (auto& task : tasks) {
-            task();
-        }
+        entry.task();
+        // Destroyed before the next task, so the captured buffers are freed early
+        entry.task = MainTask();
+
+        lock.lock();
+        worker.running = false;
+        Complete(entry.group);
     }
 }
@@ -4,26 +4,98 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <mutex>
-#include <list>
+#include <vector>
 #include <condition_variable>
-#include <atomic>
 
+#include "main_task_queue.h"
+
+#define BACKGROUND_TASK_DEFAULT_CAPACITY 16
+
+// What Schedule does when the worker's queue is full
+enum BackgroundTaskPolicy {
+    kBackgroundTaskWait,        // Block the producer until a slot is free, for work that must not be lost
+    kBackgroundTaskDropOldest,  // Discard the oldest queued task of this policy, for streaming data
+    kBackgroundTaskDropNewest,  // Reject the new task
+};
+
+// Tasks scheduled with the same group can be waited for on their own. A serial group also
+// keeps them in order and never runs two at once, which is what stateful work like the
+// opus encoder needs. Groups must outlive their tasks.
+class BackgroundTaskGroup {
+public:
+    explicit BackgroundTaskGroup(bool serial = true) : serial_(serial) {}
+    BackgroundTaskGroup(const BackgroundTaskGroup&) = delete;
+    BackgroundTaskGroup& operator=(const BackgroundTaskGroup&) = delete;
+
+private:
+    friend class BackgroundTask;
+    const bool serial_;
+    size_t pending_ = 0;    // Queued and running
+    size_t running_ = 0;
+    int home_ = -1;         // Worker whose queue holds all tasks of a serial group
+};
+
+// Pool of workers, each with a fixed ring of inline-storage tasks. Nothing is allocated per
+// Schedule unless the capture is larger than MainTask::kInlineSize. An idle worker takes
+// the oldest runnable task from the other queues, a serial group task is runnable only when
+// it is the oldest of its group and none of the group is running.
 class BackgroundTask {
 public:
-    BackgroundTask(uint32_t stack_size = 4096 * 2);
+    // Worker i runs on core (core_id + i) unless core_id is tskNO_AFFINITY
+    BackgroundTask(uint32_t stack_size = 4096 * 2, UBaseType_t priority = 2, BaseType_t core_id = tskNO_AFFINITY,
+        size_t capacity = BACKGROUND_TASK_DEFAULT_CAPACITY, size_t workers = 1);
     ~BackgroundTask();
 
-    void Schedule(std::function<void()> callback);
+    // Returns false if the new task was not queued
+    bool Schedule(MainTask&& callback, BackgroundTaskPolicy policy = kBackgroundTaskWait,
+        BackgroundTaskGroup* group = nullptr);
+    // Waits for every task, or only for the tasks of one group
     void WaitForCompletion();
+    void WaitForCompletion(BackgroundTaskGroup& group);
+    // Logs and resets the counters collected since the last call
+    void LogStats();
 
 private:
+    struct Entry {
+        MainTask task;
+        BackgroundTaskGroup* group = nullptr;
+        bool droppable = false;
+    };
+
+    struct Worker {
+        std::vector<Entry> ring;
+        size_t head = 0;
+        size_t count = 0;
+        bool running = false;
+        TaskHandle_t handle = nullptr;
+        BackgroundTask* owner = nullptr;
+
+        Entry& at(size_t i) { return ring[(head + i) % ring.size()]; }
+        Entry Remove(size_t i);
+    };
+
+    struct Stats {
+        uint32_t scheduled = 0;
+        uint32_t dropped = 0;       // Either the new task or a queued one
+        uint32_t waited = 0;        // Producers blocked on a full queue
+        uint32_t stolen = 0;        // Run by another worker than the one it was queued on
+        size_t max_depth = 0;
+    };
+
     std::mutex mutex_;
-    std::list<std::function<void()>> main_tasks_;
-    std::condition_variable condition_variable_;
-    TaskHandle_t background_task_handle_ = nullptr;
-    std::atomic<size_t> active_tasks_{0};
+    std::condition_variable task_available_;
+    std::condition_variable space_available_;
+    std::condition_variable completed_;
+    std::vector<Worker> workers_;
+    size_t next_worker_ = 0;
+    Stats stats_;
 
-    void BackgroundTaskLoop();
+    int CurrentWorker() const;
+    size_t PickWorker(BackgroundTaskGroup* group);
+    bool DropOldest(Worker& worker);
+    bool TakeTask(size_t self, Entry& entry);
+    void Complete(BackgroundTaskGroup* group);
+    void BackgroundTaskLoop(size_t index);
 };
 
 #endif
@@ -104,13 +104,21 @@ private:
     }
 
     void InitializeButtons() {
+        boot_button_.OnPressDown([this]() {
+            Application::GetInstance().PrepareListening();
+        });
         boot_button_.OnClick([this]() {
             auto& app = Application::GetInstance();
-            if (app.GetDeviceState() == kDeviceStateStarting && !WifiManager::GetInstance().IsConnected()) {
+            if (app.GetDeviceState() == kDeviceStateStarting && !IsWifiConnected()) {
                 ResetWifiConfiguration();
             }
             app.ToggleChatState();
         });
+#if CONFIG_USE_LATENCY_PROBE
+        boot_button_.OnLongPress([this]() {
+            Application::GetInstance().MeasureLatency();
+        });
+#endif
         touch_button_.OnPressDown([this]() {
             Application::GetInstance().StartListening();
         });
@@ -0,0 +1,165 @@
+#include "adc_service.h"
+
+#if SOC_ADC_SUPPORTED
+
+#include "timer_service.h"
+
+#include <esp_log.h>
+#include <esp_adc/adc_cali_scheme.h>
+
+#include <algorithm>
+
+#define TAG "AdcService"
+
+// 采样定时器允许的延迟, 与其他定时器合并到同一次唤醒
+#define ADC_SERVICE_SLACK_MS 10
+
+#ifndef ADC_SERVICE_BATTERY_PERIOD_MS
+#define ADC_SERVICE_BATTERY_PERIOD_MS 1000
+#endif
+
+AdcService::~AdcService() {
+    if (timer_ != nullptr) {
+        TimerService::GetInstance().Delete(timer_);
+    }
+    if (handle_ != nullptr) {
+        adc_oneshot_del_unit(handle_);
+    }
+}
+
+bool AdcService::AddChannel(adc_channel_t channel, uint32_t period_ms, adc_atten_t atten) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (handle_ == nullptr) {
+        adc_oneshot_unit_init_cfg_t unit_config = {
+            .unit_id = ADC_UNIT_1,
+            .ulp_mode = ADC_ULP_MODE_DISABLE,
+        };
+        if (adc_oneshot_new_unit(&unit_config, &handle_) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create the ADC unit");
+            handle_ = nullptr;
+            return false;
+        }
+        timer_ = TimerService::GetInstance().Create("adc_service", [this]() {
+            Sample();
+        }, ADC_SERVICE_SLACK_MS);
+    }
+
+    if (Find(channel) == nullptr) {
+        adc_oneshot_chan_cfg_t channel_config = {
+            .atten = atten,
+            .bitwidth = ADC_BITWIDTH_DEFAULT,
+        };
+        if (adc_oneshot_config_channel(handle_, channel, &channel_config) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to configure channel %d", channel);
+            return false;
+        }
+
+        Channel c = {.channel = channel, .atten = atten};
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+        adc_cali_curve_fitting_config_t cali_config = {
+            .unit_id = ADC_UNIT_1,
+            .chan = channel,
+            .atten = atten,
+            .bitwidth = ADC_BITWIDTH_DEFAULT,
+        };
+        adc_cali_create_scheme_curve_fitting(&cali_config, &c.cali);
+#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+        adc_cali_line_fitting_config_t cali_config = {
+            .unit_id = ADC_UNIT_1,
+            .atten = atten,
+            .bitwidth = ADC_BITWIDTH_DEFAULT,
+        };
+        adc_cali_create_scheme_line_fitting(&cali_config, &c.cali);
+#endif
+        if (c.cali == nullptr) {
+            ESP_LOGW(TAG, "No calibration for channel %d, using the nominal range", channel);
+        }
+        channels_.push_back(c);
+    }
+
+    // The tick follows the most demanding channel, a battery never slows down a button
+    if (period_ms_ == 0 || period_ms < period_ms_) {
+        period_ms_ = period_ms;
+        TimerService::GetInstance().StartPeriodic(timer_, period_ms_);
+        ESP_LOGI(TAG, "Sampling %u channels every %lu ms", channels_.size(), period_ms_);
+    }
+    return true;
+}
+
+// Runs on the timer task, a conversion per channel takes some tens of us
+void AdcService::Sample() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& c : channels_) {
+        int raw;
+        if (adc_oneshot_read(handle_, c.channel, &raw) != ESP_OK) {
+            continue;
+        }
+        if (c.filtered < 0) {
+            c.filtered = raw * (1 << ADC_SERVICE_FILTER_SHIFT);
+        } else {
+            c.filtered += raw - (c.filtered >> ADC_SERVICE_FILTER_SHIFT);
+        }
+        c.latest[c.latest_next] = raw;
+        c.latest_next = (c.latest_next + 1) % ADC_SERVICE_MEDIAN_SAMPLES;
+        c.latest_count = std::min(c.latest_count + 1, ADC_SERVICE_MEDIAN_SAMPLES);
+    }
+}
+
+// Called with mutex_ held
+AdcService::Channel* AdcService::Find(adc_channel_t channel) {
+    for (auto& c : channels_) {
+        if (c.channel == channel) {
+            return &c;
+        }
+    }
+    return nullptr;
+}
+
+int AdcService::ToMillivolts(const Channel& channel, int raw) {
+    int millivolts;
+    if (channel.cali == nullptr || adc_cali_raw_to_voltage(channel.cali, raw, &millivolts) != ESP_OK) {
+        // 12 dB attenuation covers about 0 - 3100 mV
+        millivolts = raw * 3100 / ((1 << SOC_ADC_RTC_MAX_BITWIDTH) - 1);
+    }
+    return millivolts;
+}
+
+bool AdcService::GetMillivolts(adc_channel_t channel, int& millivolts) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto c = Find(channel);
+    if (c == nullptr || c->filtered < 0) {
+        return false;
+    }
+    millivolts = ToMillivolts(*c, c->filtered >> ADC_SERVICE_FILTER_SHIFT);
+    return true;
+}
+
+bool AdcService::GetLatestMillivolts(adc_channel_t channel, int& millivolts) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto c = Find(channel);
+    if (c == nullptr || c->filtered < 0) {
+        return false;
+    }
+    uint16_t samples[ADC_SERVICE_MEDIAN_SAMPLES];
+    std::copy_n(c->latest, c->latest_count, samples);
+    std::nth_element(samples, samples + c->latest_count / 2, samples + c->latest_count);
+    millivolts = ToMillivolts(*c, samples[c->latest_count / 2]);
+    return true;
+}
+
+AdcBattery::AdcBattery(adc_channel_t channel, float divider, int empty_mv, int full_mv)
+    : channel_(channel), divider_(divider), empty_mv_(empty_mv), full_mv_(full_mv) {
+    AdcService::GetInstance().AddChannel(channel, ADC_SERVICE_BATTERY_PERIOD_MS);
+}
+
+bool AdcBattery::GetLevel(int& level) {
+    int millivolts;
+    if (!AdcService::GetInstance().GetMillivolts(channel_, millivolts)) {
+        return false;
+    }
+    int battery_mv = millivolts * divider_;
+    level = std::clamp((battery_mv - empty_mv_) * 100 / (full_mv_ - empty_mv_), 0, 100);
+    return true;
+}
+
+#endif // SOC_ADC_SUPPORTED
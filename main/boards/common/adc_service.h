@@ -0,0 +1,89 @@
+#ifndef ADC_SERVICE_H
+#define ADC_SERVICE_H
+
+#include <soc/soc_caps.h>
+
+#if SOC_ADC_SUPPORTED
+
+#include <esp_adc/adc_oneshot.h>
+#include <esp_adc/adc_cali.h>
+
+#include <mutex>
+#include <vector>
+
+struct ServiceTimer;
+
+// 平滑系数, 每个新采样占 1/2^ADC_SERVICE_FILTER_SHIFT, 用于电池等慢变化的电压
+#define ADC_SERVICE_FILTER_SHIFT 3
+// 按键读取最近几个采样的中值
+#define ADC_SERVICE_MEDIAN_SAMPLES 3
+
+// Samples every registered ADC1 channel with one oneshot conversion per channel on a
+// TimerService tick, at the fastest period any channel asked for. Readers get the moving
+// average or the latest samples, nothing is converted on demand, so ADC buttons and battery
+// monitors no longer stall the caller.
+// The continuous DMA driver is not used on purpose: it holds an APB_FREQ_MAX PM lock from start
+// to stop and so keeps the chip out of light sleep for as long as it runs. Between two ticks
+// this service holds no lock at all.
+class AdcService {
+public:
+    static AdcService& GetInstance() {
+        static AdcService instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    AdcService(const AdcService&) = delete;
+    AdcService& operator=(const AdcService&) = delete;
+
+    // `period_ms` is how often the channel needs a new sample, call it while setting up the board
+    bool AddChannel(adc_channel_t channel, uint32_t period_ms, adc_atten_t atten = ADC_ATTEN_DB_12);
+    // Averaged voltage, for slow signals like a battery. False before the first sample of the
+    // channel arrived. Safe from any task.
+    bool GetMillivolts(adc_channel_t channel, int& millivolts);
+    // Median of the latest samples, follows steps like a resistor ladder button within a few
+    // ticks without passing through the levels in between
+    bool GetLatestMillivolts(adc_channel_t channel, int& millivolts);
+
+private:
+    AdcService() = default;
+    ~AdcService();
+
+    struct Channel {
+        adc_channel_t channel;
+        adc_atten_t atten;
+        adc_cali_handle_t cali = nullptr;
+        int filtered = -1;  // Raw value << ADC_SERVICE_FILTER_SHIFT, -1 until the first sample
+        uint16_t latest[ADC_SERVICE_MEDIAN_SAMPLES] = {};
+        uint8_t latest_count = 0;
+        uint8_t latest_next = 0;
+    };
+
+    std::mutex mutex_;
+    adc_oneshot_unit_handle_t handle_ = nullptr;
+    ServiceTimer* timer_ = nullptr;
+    uint32_t period_ms_ = 0;
+    std::vector<Channel> channels_;
+
+    void Sample();
+    Channel* Find(adc_channel_t channel);
+    int ToMillivolts(const Channel& channel, int raw);
+};
+
+// Battery level from a resistor divider on an ADC1 pin, for Board::GetBatteryLevel
+class AdcBattery {
+public:
+    // `divider` is battery voltage / pin voltage
+    AdcBattery(adc_channel_t channel, float divider, int empty_mv = 3300, int full_mv = 4200);
+
+    bool GetLevel(int& level);
+
+private:
+    adc_channel_t channel_;
+    float divider_;
+    int empty_mv_;
+    int full_mv_;
+};
+
+#endif // SOC_ADC_SUPPORTED
+
+#endif // ADC_SERVICE_H
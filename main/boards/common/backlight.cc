@@ -1,32 +1,25 @@
 #include "backlight.h"
 #include "settings.h"
+#include "led/ledc_fade.h"
 
 #include <esp_log.h>
 #include <driver/ledc.h>
 
 #define TAG "Backlight"
 
+// 渐变速度，每 1% 亮度 5ms
+#define BACKLIGHT_STEP_MS 5
+
 
 Backlight::Backlight() {
     // 创建背光渐变定时器
-    const esp_timer_create_args_t timer_args = {
-        .callback = [](void* arg) {
-            auto self = static_cast<Backlight*>(arg);
-            self->OnTransitionTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "backlight_timer",
-        .skip_unhandled_events = true,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &transition_timer_));
+    transition_timer_ = TimerService::GetInstance().Create("backlight_timer", [this]() {
+        OnTransitionTimer();
+    });
 }
 
 Backlight::~Backlight() {
-    if (transition_timer_ != nullptr) {
-        esp_timer_stop(transition_timer_);
-        esp_timer_delete(transition_timer_);
-    }
+    TimerService::GetInstance().Delete(transition_timer_);
 }
 
 void Backlight::RestoreBrightness() {
@@ -60,16 +53,20 @@ void Backlight::SetBrightness(uint8_t brightness, bool permanent) {
     target_brightness_ = brightness;
     step_ = (target_brightness_ > brightness_) ? 1 : -1;
 
-    if (transition_timer_ != nullptr) {
+    int time_ms = abs(target_brightness_ - brightness_) * BACKLIGHT_STEP_MS;
+    if (StartFade(target_brightness_, time_ms)) {
+        TimerService::GetInstance().Stop(transition_timer_);
+        brightness_ = target_brightness_;
+    } else if (transition_timer_ != nullptr) {
         // 启动定时器，每 5ms 更新一次
-        esp_timer_start_periodic(transition_timer_, 5 * 1000);
+        TimerService::GetInstance().StartPeriodic(transition_timer_, BACKLIGHT_STEP_MS);
     }
     ESP_LOGI(TAG, "Set brightness to %d", brightness);
 }
 
 void Backlight::OnTransitionTimer() {
     if (brightness_ == target_brightness_) {
-        esp_timer_stop(transition_timer_);
+        TimerService::GetInstance().Stop(transition_timer_);
         return;
     }
 
@@ -77,7 +74,7 @@ void Backlight::OnTransitionTimer() {
     SetBrightnessImpl(brightness_);
 
     if (brightness_ == target_brightness_) {
-        esp_timer_stop(transition_timer_);
+        TimerService::GetInstance().Stop(transition_timer_);
     }
 }
 
@@ -106,16 +103,22 @@ PwmBacklight::PwmBacklight(gpio_num_t pin, bool output_invert) : Backlight() {
         }
     };
     ESP_ERROR_CHECK(ledc_channel_config(&backlight_channel));
+    // No fade end callback, the fade only has to reach its target
+    LedcFade::GetInstance().Attach(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
 }
 
 PwmBacklight::~PwmBacklight() {
+    LedcFade::GetInstance().Detach(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
     ledc_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, 0);
 }
 
 void PwmBacklight::SetBrightnessImpl(uint8_t brightness) {
     // LEDC resolution set to 10bits, thus: 100% = 1023
     uint32_t duty_cycle = (1023 * brightness) / 100;
-    ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty_cycle);
-    ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
+    LedcFade::GetInstance().SetDuty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty_cycle);
+}
+
+bool PwmBacklight::StartFade(uint8_t brightness, int time_ms) {
+    return LedcFade::GetInstance().Start(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, (1023 * brightness) / 100, time_ms);
 }
 
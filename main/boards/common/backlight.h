@@ -4,7 +4,7 @@
 #include <functional>
 
 #include <driver/gpio.h>
-#include <esp_timer.h>
+#include "timer_service.h"
 
 
 class Backlight {
@@ -19,8 +19,10 @@ public:
 protected:
     void OnTransitionTimer();
     virtual void SetBrightnessImpl(uint8_t brightness) = 0;
+    // Fades to brightness in hardware, returns false to step it with the transition timer
+    virtual bool StartFade(uint8_t brightness, int time_ms) { return false; }
 
-    esp_timer_handle_t transition_timer_ = nullptr;
+    ServiceTimer* transition_timer_ = nullptr;
     uint8_t brightness_ = 0;
     uint8_t target_brightness_ = 0;
     uint8_t step_ = 1;
@@ -33,4 +35,5 @@ public:
     ~PwmBacklight();
 
     void SetBrightnessImpl(uint8_t brightness) override;
+    bool StartFade(uint8_t brightness, int time_ms) override;
 };
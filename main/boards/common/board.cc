@@ -1,4 +1,6 @@
 #include "board.h"
+#include "adc_service.h"
+#include "config.h"
 #include "system_info.h"
 #include "settings.h"
 #include "display/display.h"
@@ -9,6 +11,7 @@
 #include <esp_random.h>
 #include <esp_app_desc.h>
 #include <esp_partition.h>
+#include <esp_ota_ops.h>
 
 #define TAG "Board"
 
@@ -45,8 +48,18 @@ std::string Board::GenerateUuid() {
     return std::string(uuid_str);
 }
 
+// A board with a plain resistor divider only defines BATTERY_ADC_CHANNEL and BATTERY_ADC_DIVIDER
+// in config.h, the level then comes from AdcService like the ADC buttons
 bool Board::GetBatteryLevel(int &level, bool& charging, bool& discharging) {
+#if defined(BATTERY_ADC_CHANNEL) && SOC_ADC_SUPPORTED
+    static AdcBattery battery(BATTERY_ADC_CHANNEL, BATTERY_ADC_DIVIDER);
+    // No charger status on such boards
+    charging = false;
+    discharging = false;
+    return battery.GetLevel(level);
+#else
     return false;
+#endif
 }
 
 Display* Board::GetDisplay() {
@@ -92,7 +105,8 @@ std::string Board::GetJson() {
                 }
             ],
             "ota": {
-                "label": "ota_0"
+                "label": "ota_0",
+                "patch_formats": ["xzdp"]
             },
             "board": {
                 ...
@@ -147,6 +161,14 @@ std::string Board::GetJson() {
     json.pop_back(); // Remove the last comma
     json += "],";
 
+    json += "\"ota\":{";
+    auto running_partition = esp_ota_get_running_partition();
+    json += "\"label\":\"" + std::string(running_partition->label) + "\"";
+#if CONFIG_OTA_DELTA_UPDATE
+    json += ",\"patch_formats\":[\"xzdp\"]";
+#endif
+    json += "},";
+
     json += "\"board\":" + GetBoardJson();
 
     // Close the JSON object
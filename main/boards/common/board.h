@@ -46,6 +46,8 @@ public:
     virtual void StartNetwork() = 0;
     virtual const char* GetNetworkStateIcon() = 0;
     virtual bool GetBatteryLevel(int &level, bool& charging, bool& discharging);
+    // RSSI in dBm, false if the network has no such measure
+    virtual bool GetSignalStrength(int& rssi) { return false; }
     virtual std::string GetJson();
     virtual void SetPowerSaveMode(bool enabled) = 0;
 };
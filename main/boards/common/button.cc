@@ -1,15 +1,48 @@
 #include "button.h"
+#include "adc_service.h"
 
 #include <esp_log.h>
 
 static const char* TAG = "Button";
+
+// ADC 按键电压范围两端的回差
+#ifndef BUTTON_ADC_HYSTERESIS_MV
+#define BUTTON_ADC_HYSTERESIS_MV 20
+#endif
+// ADC 按键的采样周期, 按下后约两个周期内识别
+#ifndef BUTTON_ADC_SAMPLE_PERIOD_MS
+#define BUTTON_ADC_SAMPLE_PERIOD_MS 50
+#endif
+
 #if CONFIG_SOC_ADC_SUPPORTED
-Button::Button(const button_adc_config_t& adc_cfg) {
+Button::Button(const button_adc_config_t& adc_cfg) : gpio_num_(GPIO_NUM_NC) {
+    adc_channel_ = adc_cfg.adc_channel;
+    adc_min_mv_ = adc_cfg.min;
+    adc_max_mv_ = adc_cfg.max;
+    AdcService::GetInstance().AddChannel((adc_channel_t)adc_channel_, BUTTON_ADC_SAMPLE_PERIOD_MS);
+    // Polled by the button timer, the level is the median of the latest samples of AdcService
     button_config_t button_config = {
-        .type = BUTTON_TYPE_ADC,
+        .type = BUTTON_TYPE_CUSTOM,
         .long_press_time = 1000,
         .short_press_time = 50,
-        .adc_button_config = adc_cfg
+        .custom_button_config = {
+            .active_level = 1,
+            .button_custom_init = nullptr,
+            .button_custom_get_key_value = [](void* arg) -> uint8_t {
+                auto button = static_cast<Button*>(arg);
+                int millivolts;
+                if (!AdcService::GetInstance().GetLatestMillivolts((adc_channel_t)button->adc_channel_, millivolts)) {
+                    return 0;
+                }
+                // A press has to reach inside the range and ends only well outside of it, so a
+                // level near the border of two ladder steps does not flip between the buttons
+                int margin = button->adc_pressed_ ? -BUTTON_ADC_HYSTERESIS_MV : BUTTON_ADC_HYSTERESIS_MV;
+                button->adc_pressed_ = millivolts >= button->adc_min_mv_ + margin && millivolts <= button->adc_max_mv_ - margin;
+                return button->adc_pressed_;
+            },
+            .button_custom_deinit = nullptr,
+            .priv = this,
+        },
     };
     button_handle_ = iot_button_create(&button_config);
     if (button_handle_ == NULL) {
@@ -21,6 +21,13 @@ public:
 private:
     gpio_num_t gpio_num_;
     button_handle_t button_handle_ = nullptr;
+#if CONFIG_SOC_ADC_SUPPORTED
+    // ADC buttons read AdcService instead of a oneshot conversion per poll
+    int adc_channel_ = -1;
+    int adc_min_mv_ = 0;
+    int adc_max_mv_ = 0;
+    bool adc_pressed_ = false;
+#endif
 
 
     std::function<void()> on_press_down_;
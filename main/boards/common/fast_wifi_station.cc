@@ -0,0 +1,254 @@
+#include "fast_wifi_station.h"
+#include "settings.h"
+#include "timer_service.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#define TAG "FastWifiStation"
+
+#define FAST_WIFI_CONNECTED_EVENT (1 << 0)
+#define FAST_WIFI_FAILED_EVENT    (1 << 1)
+
+// 直连失败的重试次数，之后交给 WifiManager 扫描
+#define FAST_WIFI_START_RETRIES 2
+// 连接过之后断线, 直连缓存的 AP 失败几次后改为全信道扫描
+#define FAST_WIFI_DIRECTED_RETRIES 3
+// 断线重连的退避, 每次失败翻倍
+#define FAST_WIFI_BACKOFF_MIN_MS 250
+#define FAST_WIFI_BACKOFF_MAX_MS 30000
+
+FastWifiStation::FastWifiStation() {
+    event_group_ = xEventGroupCreate();
+    reconnect_timer_ = TimerService::GetInstance().Create("wifi_reconnect", []() {
+        esp_wifi_connect();
+    }, 100);
+}
+
+FastWifiStation::~FastWifiStation() {
+    Stop();
+    TimerService::GetInstance().Delete(reconnect_timer_);
+    if (event_group_ != nullptr) {
+        vEventGroupDelete(event_group_);
+    }
+}
+
+bool FastWifiStation::Load(const std::vector<SsidItem>& ssid_list) {
+    Settings settings("wifi");
+    std::string ssid = settings.GetString("last_ssid");
+    std::string bssid = settings.GetString("last_bssid");
+    int channel = settings.GetInt("last_channel");
+    if (ssid.empty() || bssid.size() != 12 || channel <= 0 || channel > 14) {
+        return false;
+    }
+    if (sscanf(bssid.c_str(), "%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx",
+            &bssid_[0], &bssid_[1], &bssid_[2], &bssid_[3], &bssid_[4], &bssid_[5]) != 6) {
+        return false;
+    }
+    // The password may have changed since, always take it from the configured list
+    for (const auto& item : ssid_list) {
+        if (item.ssid == ssid) {
+            ssid_ = item.ssid;
+            password_ = item.password;
+            channel_ = channel;
+            return true;
+        }
+    }
+    ESP_LOGI(TAG, "Cached AP %s is no longer configured", ssid.c_str());
+    ClearCachedAp();
+    return false;
+}
+
+void FastWifiStation::Configure(bool directed) {
+    wifi_config_t config = {};
+    strncpy((char*)config.sta.ssid, ssid_.c_str(), sizeof(config.sta.ssid));
+    strncpy((char*)config.sta.password, password_.c_str(), sizeof(config.sta.password));
+    config.sta.pmf_cfg.capable = true;
+    if (directed) {
+        // Probe only the cached channel and stop at the cached BSSID
+        config.sta.scan_method = WIFI_FAST_SCAN;
+        config.sta.bssid_set = true;
+        memcpy(config.sta.bssid, bssid_, sizeof(bssid_));
+        config.sta.channel = channel_;
+    } else {
+        config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+}
+
+bool FastWifiStation::Start(int timeout_ms) {
+    ESP_LOGI(TAG, "Connecting to %s on channel %u, bssid %02x:%02x:%02x:%02x:%02x:%02x", ssid_.c_str(), channel_,
+        bssid_[0], bssid_[1], bssid_[2], bssid_[3], bssid_[4], bssid_[5]);
+    int64_t start_time = esp_timer_get_time();
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    netif_ = esp_netif_create_default_wifi_sta();
+    wifi_init_config_t init_config = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&init_config));
+    started_ = true;
+
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+        &FastWifiStation::WifiEventHandler, this, &wifi_event_instance_));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
+        &FastWifiStation::IpEventHandler, this, &ip_event_instance_));
+
+    esp_wifi_set_storage(WIFI_STORAGE_RAM);
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    Configure(true);
+    ESP_ERROR_CHECK(esp_wifi_start());
+
+    EventBits_t bits = xEventGroupWaitBits(event_group_, FAST_WIFI_CONNECTED_EVENT | FAST_WIFI_FAILED_EVENT,
+        pdFALSE, pdFALSE, pdMS_TO_TICKS(timeout_ms));
+    if (!(bits & FAST_WIFI_CONNECTED_EVENT)) {
+        ESP_LOGW(TAG, "Directed connect failed, falling back to scanning");
+        Stop();
+        ClearCachedAp();
+        return false;
+    }
+    ESP_LOGI(TAG, "Connected to %s in %lld ms", ssid_.c_str(), (esp_timer_get_time() - start_time) / 1000);
+    return true;
+}
+
+void FastWifiStation::Stop() {
+    if (!started_) {
+        return;
+    }
+    // Unregister first, so the disconnect below does not trigger a reconnect
+    TimerService::GetInstance().Stop(reconnect_timer_);
+    if (wifi_event_instance_ != nullptr) {
+        esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event_instance_);
+        wifi_event_instance_ = nullptr;
+    }
+    if (ip_event_instance_ != nullptr) {
+        esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, ip_event_instance_);
+        ip_event_instance_ = nullptr;
+    }
+    esp_wifi_disconnect();
+    esp_wifi_stop();
+    esp_wifi_deinit();
+    if (netif_ != nullptr) {
+        esp_netif_destroy_default_wifi(netif_);
+        netif_ = nullptr;
+    }
+    xEventGroupClearBits(event_group_, FAST_WIFI_CONNECTED_EVENT | FAST_WIFI_FAILED_EVENT);
+    started_ = false;
+}
+
+bool FastWifiStation::IsConnected() const {
+    return started_ && (xEventGroupGetBits(event_group_) & FAST_WIFI_CONNECTED_EVENT);
+}
+
+int8_t FastWifiStation::GetRssi() {
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        return 0;
+    }
+    return ap_info.rssi;
+}
+
+uint8_t FastWifiStation::GetChannel() {
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        return 0;
+    }
+    return ap_info.primary;
+}
+
+std::string FastWifiStation::GetIpAddress() {
+    esp_netif_ip_info_t ip_info;
+    if (netif_ == nullptr || esp_netif_get_ip_info(netif_, &ip_info) != ESP_OK) {
+        return "";
+    }
+    char ip[16];
+    snprintf(ip, sizeof(ip), IPSTR, IP2STR(&ip_info.ip));
+    return ip;
+}
+
+void FastWifiStation::SetPowerSaveMode(bool enabled) {
+    esp_wifi_set_ps(enabled ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE);
+}
+
+void FastWifiStation::SaveCurrentAp() {
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        return;
+    }
+    char bssid[13];
+    snprintf(bssid, sizeof(bssid), "%02x%02x%02x%02x%02x%02x",
+        ap_info.bssid[0], ap_info.bssid[1], ap_info.bssid[2], ap_info.bssid[3], ap_info.bssid[4], ap_info.bssid[5]);
+    std::string ssid((const char*)ap_info.ssid);
+
+    // 没有变化时不写 NVS
+    Settings settings("wifi", true);
+    if (settings.GetString("last_ssid") == ssid && settings.GetString("last_bssid") == bssid &&
+        settings.GetInt("last_channel") == ap_info.primary) {
+        return;
+    }
+    settings.SetString("last_ssid", ssid);
+    settings.SetString("last_bssid", bssid);
+    settings.SetInt("last_channel", ap_info.primary);
+    ESP_LOGI(TAG, "Cached AP %s, bssid %s, channel %u", ssid.c_str(), bssid, ap_info.primary);
+}
+
+void FastWifiStation::ClearCachedAp() {
+    Settings settings("wifi", true);
+    settings.EraseKey("last_ssid");
+    settings.EraseKey("last_bssid");
+    settings.EraseKey("last_channel");
+}
+
+void FastWifiStation::WifiEventHandler(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    auto self = static_cast<FastWifiStation*>(arg);
+    if (id == WIFI_EVENT_STA_START) {
+        esp_wifi_connect();
+    } else if (id == WIFI_EVENT_STA_DISCONNECTED) {
+        xEventGroupClearBits(self->event_group_, FAST_WIFI_CONNECTED_EVENT);
+        self->retries_++;
+        if (!self->ever_connected_) {
+            // Start() is waiting, retry at once
+            if (self->retries_ >= FAST_WIFI_START_RETRIES) {
+                xEventGroupSetBits(self->event_group_, FAST_WIFI_FAILED_EVENT);
+                return;
+            }
+            esp_wifi_connect();
+            return;
+        }
+        if (self->retries_ == 1 && self->scanning_) {
+            // Connected through a scan before, try the AP it found first
+            self->Configure(true);
+            self->scanning_ = false;
+        } else if (self->retries_ > FAST_WIFI_DIRECTED_RETRIES && !self->scanning_) {
+            // The AP is gone from the cached channel, let the driver scan for the SSID
+            ESP_LOGI(TAG, "Reconnect to the cached AP failed, scanning for %s", self->ssid_.c_str());
+            self->Configure(false);
+            self->scanning_ = true;
+        }
+        // A missing AP is not hammered with connects, the scan keeps going at the longest delay
+        uint32_t delay_ms = std::min<uint32_t>(FAST_WIFI_BACKOFF_MIN_MS << std::min(self->retries_ - 1, 7),
+            FAST_WIFI_BACKOFF_MAX_MS);
+        ESP_LOGI(TAG, "Reconnecting in %lu ms, attempt %d", delay_ms, self->retries_);
+        TimerService::GetInstance().StartOnce(self->reconnect_timer_, delay_ms);
+    }
+}
+
+void FastWifiStation::IpEventHandler(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    auto self = static_cast<FastWifiStation*>(arg);
+    auto event = static_cast<ip_event_got_ip_t*>(data);
+    ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+    self->ever_connected_ = true;
+    self->retries_ = 0;
+    if (self->scanning_) {
+        wifi_ap_record_t ap_info;
+        if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+            memcpy(self->bssid_, ap_info.bssid, sizeof(self->bssid_));
+            self->channel_ = ap_info.primary;
+        }
+        SaveCurrentAp();
+    }
+    xEventGroupSetBits(self->event_group_, FAST_WIFI_CONNECTED_EVENT);
+}
@@ -0,0 +1,66 @@
+#ifndef FAST_WIFI_STATION_H
+#define FAST_WIFI_STATION_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <esp_event.h>
+#include <esp_netif.h>
+#include <esp_wifi.h>
+
+#include <ssid_manager.h>
+
+#include <string>
+#include <vector>
+
+struct ServiceTimer;
+
+// Reconnects to the access point of the last successful connection without a scan.
+// The BSSID and channel are kept in NVS, the station connects to them directly and only
+// falls back to the driver's all channel scan when the AP has moved or disappeared.
+// The DHCP lease is restored by lwIP (LWIP_DHCP_RESTORE_LAST_IP). A lost connection is
+// retried with an exponential backoff, the cached AP first and then the scan.
+class FastWifiStation {
+public:
+    FastWifiStation();
+    ~FastWifiStation();
+
+    // Loads the cached AP, false when there is none or its SSID is no longer configured
+    bool Load(const std::vector<SsidItem>& ssid_list);
+    // Directed connect, blocks until an IP is assigned or the timeout expires
+    bool Start(int timeout_ms);
+    // Releases the driver so WifiManager can take over
+    void Stop();
+
+    bool IsConnected() const;
+    const std::string& GetSsid() const { return ssid_; }
+    int8_t GetRssi();
+    uint8_t GetChannel();
+    std::string GetIpAddress();
+    void SetPowerSaveMode(bool enabled);
+
+    // Stores the AP the station is connected to now, whoever connected it
+    static void SaveCurrentAp();
+    static void ClearCachedAp();
+
+private:
+    std::string ssid_;
+    std::string password_;
+    uint8_t bssid_[6] = {0};
+    uint8_t channel_ = 0;
+    bool started_ = false;
+    bool ever_connected_ = false;
+    bool scanning_ = false;     // Config falls back to the all channel scan
+    int retries_ = 0;
+    ServiceTimer* reconnect_timer_ = nullptr;
+
+    EventGroupHandle_t event_group_ = nullptr;
+    esp_netif_t* netif_ = nullptr;
+    esp_event_handler_instance_t wifi_event_instance_ = nullptr;
+    esp_event_handler_instance_t ip_event_instance_ = nullptr;
+
+    void Configure(bool directed);
+    static void WifiEventHandler(void* arg, esp_event_base_t base, int32_t id, void* data);
+    static void IpEventHandler(void* arg, esp_event_base_t base, int32_t id, void* data);
+};
+
+#endif // FAST_WIFI_STATION_H
@@ -24,6 +24,9 @@
 
 static const char *TAG = "WifiBoard";
 
+// 直连上次的 AP 的超时，包含 DHCP
+#define FAST_CONNECT_TIMEOUT_MS 5000
+
 WifiBoard::WifiBoard() {
     Settings settings("wifi", true);
     wifi_config_mode_ = settings.GetInt("force_ap") == 1;
@@ -58,7 +61,7 @@ void WifiBoard::EnterWifiConfigMode() {
     hint += "\n\n";
     
     // 播报配置 WiFi 的提示
-    application.Alert(Lang::Strings::WIFI_CONFIG_MODE, hint.c_str(), "", Lang::Sounds::P3_WIFICONFIG);
+    application.Alert(Lang::Strings::WIFI_CONFIG_MODE, hint.c_str(), "", Lang::Sounds::P3_WIFICONFIG());
     
     // Wait forever until reset after configuration
     while (true) {
@@ -85,6 +88,11 @@ void WifiBoard::StartNetwork() {
         return;
     }
 
+    if (StartFastStation(ssid_list)) {
+        StartSntp();
+        return;
+    }
+
     auto& wifi_manager = WifiManager::GetInstance();
     WifiManagerConfig config;
     config.ssid_prefix = "XiaoTun";
@@ -107,6 +115,9 @@ void WifiBoard::StartNetwork() {
                 notification = Lang::Strings::CONNECTED_TO;
                 notification += WifiManager::GetInstance().GetSsid();
                 display->ShowNotification(notification.c_str(), 30000);
+#if CONFIG_USE_WIFI_FAST_CONNECT
+                FastWifiStation::SaveCurrentAp();
+#endif
                 break;
             default:
                 break;
@@ -133,6 +144,34 @@ void WifiBoard::StartNetwork() {
         return;
     }
 
+    StartSntp();
+}
+
+bool WifiBoard::StartFastStation(const std::vector<SsidItem>& ssid_list) {
+#if CONFIG_USE_WIFI_FAST_CONNECT
+    auto station = std::make_unique<FastWifiStation>();
+    if (!station->Load(ssid_list)) {
+        return false;
+    }
+    auto display = Board::GetInstance().GetDisplay();
+    std::string notification = Lang::Strings::CONNECT_TO;
+    notification += station->GetSsid();
+    notification += "...";
+    display->ShowNotification(notification.c_str(), 30000);
+    if (!station->Start(FAST_CONNECT_TIMEOUT_MS)) {
+        return false;
+    }
+    notification = Lang::Strings::CONNECTED_TO;
+    notification += station->GetSsid();
+    display->ShowNotification(notification.c_str(), 30000);
+    fast_station_ = std::move(station);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void WifiBoard::StartSntp() {
     // Initialize SNTP
     esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
     esp_sntp_setservername(0, "pool.ntp.org");
@@ -172,11 +211,10 @@ const char* WifiBoard::GetNetworkStateIcon() {
     if (wifi_config_mode_) {
         return FONT_AWESOME_WIFI;
     }
-    auto& wifi_manager = WifiManager::GetInstance();
-    if (!wifi_manager.IsConnected()) {
+    int rssi;
+    if (!GetSignalStrength(rssi)) {
         return FONT_AWESOME_WIFI_OFF;
     }
-    int rssi = wifi_manager.GetRssi();
     if (rssi >= -60) {
         return FONT_AWESOME_WIFI;
     } else if (rssi >= -70) {
@@ -186,12 +224,40 @@ const char* WifiBoard::GetNetworkStateIcon() {
     }
 }
 
+bool WifiBoard::IsWifiConnected() {
+    if (fast_station_) {
+        return fast_station_->IsConnected();
+    }
+    return WifiManager::GetInstance().IsConnected();
+}
+
+bool WifiBoard::GetSignalStrength(int& rssi) {
+    if (fast_station_) {
+        if (!fast_station_->IsConnected()) {
+            return false;
+        }
+        rssi = fast_station_->GetRssi();
+        return true;
+    }
+    auto& wifi_manager = WifiManager::GetInstance();
+    if (wifi_config_mode_ || !wifi_manager.IsConnected()) {
+        return false;
+    }
+    rssi = wifi_manager.GetRssi();
+    return true;
+}
+
 std::string WifiBoard::GetBoardJson() {
     // Set the board type for OTA
     auto& wifi_manager = WifiManager::GetInstance();
     std::string board_json = std::string("{\"type\":\"" BOARD_TYPE "\",");
     board_json += "\"name\":\"" BOARD_NAME "\",";
-    if (!wifi_config_mode_) {
+    if (fast_station_) {
+        board_json += "\"ssid\":\"" + fast_station_->GetSsid() + "\",";
+        board_json += "\"rssi\":" + std::to_string(fast_station_->GetRssi()) + ",";
+        board_json += "\"channel\":" + std::to_string(fast_station_->GetChannel()) + ",";
+        board_json += "\"ip\":\"" + fast_station_->GetIpAddress() + "\",";
+    } else if (!wifi_config_mode_) {
         board_json += "\"ssid\":\"" + wifi_manager.GetSsid() + "\",";
         board_json += "\"rssi\":" + std::to_string(wifi_manager.GetRssi()) + ",";
         board_json += "\"channel\":" + std::to_string(wifi_manager.GetChannel()) + ",";
@@ -202,6 +268,10 @@ std::string WifiBoard::GetBoardJson() {
 }
 
 void WifiBoard::SetPowerSaveMode(bool enabled) {
+    if (fast_station_) {
+        fast_station_->SetPowerSaveMode(enabled);
+        return;
+    }
     auto& wifi_manager = WifiManager::GetInstance();
     wifi_manager.SetPowerSaveLevel(enabled ? WifiPowerSaveLevel::BALANCED : WifiPowerSaveLevel::PERFORMANCE);
 }
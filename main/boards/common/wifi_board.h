@@ -2,17 +2,27 @@
 #define WIFI_BOARD_H
 
 #include "board.h"
+#include "fast_wifi_station.h"
+
+#include <memory>
 
 class WifiBoard : public Board {
 protected:
     bool wifi_config_mode_ = false;
+    // Set when the cached AP was reached without WifiManager
+    std::unique_ptr<FastWifiStation> fast_station_;
 
     WifiBoard();
     void EnterWifiConfigMode();
+    bool StartFastStation(const std::vector<SsidItem>& ssid_list);
+    void StartSntp();
+    // Either station, for the boot button check while starting
+    bool IsWifiConnected();
     virtual std::string GetBoardJson() override;
 
 public:
     virtual std::string GetBoardType() override;
+    virtual bool GetSignalStrength(int& rssi) override;
     virtual void StartNetwork() override;
     virtual Http* CreateHttp() override;
     virtual WebSocket* CreateWebSocket() override;
@@ -31,6 +31,11 @@
 #define DISPLAY_OFFSET_X  0
 #define DISPLAY_OFFSET_Y  0
 
+// LVGL 绘制缓冲区: 双缓冲, 放在内部 DMA 内存, 渲染与 SPI 传输并行 (240x24x2 字节 x 2)
+#define DISPLAY_BUFFER_LINES    24
+#define DISPLAY_DOUBLE_BUFFER   true
+#define DISPLAY_BUFFER_PSRAM    false
+
 #define DISPLAY_BACKLIGHT_PIN GPIO_NUM_16
 #define DISPLAY_BACKLIGHT_OUTPUT_INVERT false
 
@@ -90,13 +90,22 @@ private:
                                         .text_font = &font_puhui_16_4,
                                         .icon_font = &font_awesome_16_4,
                                         .emoji_font = font_emoji_64_init(),
+                                    },
+                                    {
+                                        .mode = kLcdRenderPartial,
+                                        .buffer_lines = DISPLAY_BUFFER_LINES,
+                                        .double_buffer = DISPLAY_DOUBLE_BUFFER,
+                                        .buffer_in_psram = DISPLAY_BUFFER_PSRAM,
                                     });
     }
 
     void InitializeButtons() {
+        boot_button_.OnPressDown([this]() {
+            Application::GetInstance().PrepareListening();
+        });
         boot_button_.OnClick([this]() {
             auto& app = Application::GetInstance();
-            if (app.GetDeviceState() == kDeviceStateStarting && !WifiManager::GetInstance().IsConnected()) {
+            if (app.GetDeviceState() == kDeviceStateStarting && !IsWifiConnected()) {
                 ResetWifiConfiguration();
             }
             app.ToggleChatState();
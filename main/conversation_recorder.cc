@@ -0,0 +1,109 @@
+#include "conversation_recorder.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include <bit>
+#include <cstring>
+
+#define TAG "ConversationRecorder"
+
+#ifdef CONFIG_CONVERSATION_RECORDER_SECONDS
+#define CONVERSATION_RECORDER_SECONDS CONFIG_CONVERSATION_RECORDER_SECONDS
+#else
+#define CONVERSATION_RECORDER_SECONDS 10
+#endif
+
+// 按 60ms 帧估算, 上下行各一半; 帧更短时保存的时长相应变短
+#define CONVERSATION_RECORDER_PACKETS (CONVERSATION_RECORDER_SECONDS * 1000 / 60 * 2)
+#define CONVERSATION_RECORDER_STRIDE (sizeof(RecordHeader) + CONVERSATION_RECORDER_SLOT_SIZE)
+
+struct __attribute__((packed)) RecordingDumpHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slot_size;
+    uint32_t record_count;
+    uint32_t dropped;       // Older records not in this dump
+    uint32_t skipped;       // Larger than a slot
+    uint32_t uplink_sample_rate;
+    uint32_t downlink_sample_rate;
+    uint16_t uplink_frame_duration;     // ms, since version 2
+    uint16_t downlink_frame_duration;
+};
+
+ConversationRecorder::ConversationRecorder() {
+    // Allocated once for the lifetime of the firmware, straight from PSRAM. A power of two, so
+    // the free running record counter maps to the same slot across its wrap.
+    capacity_ = std::bit_ceil((size_t)CONVERSATION_RECORDER_PACKETS);
+    slots_ = (uint8_t*)heap_caps_calloc(capacity_, CONVERSATION_RECORDER_STRIDE, MALLOC_CAP_SPIRAM);
+    if (slots_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u recording slots, recording disabled", capacity_);
+        capacity_ = 0;
+    }
+}
+
+ConversationRecorder::~ConversationRecorder() {
+    heap_caps_free(slots_);
+}
+
+void ConversationRecorder::Store(RecordDirection direction, uint32_t timestamp_ms, const AudioPacket& packet) {
+    if (slots_ == nullptr || !packet) {
+        return;
+    }
+    if (packet.size() > CONVERSATION_RECORDER_SLOT_SIZE) {
+        skipped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    uint32_t index = next_.load(std::memory_order_relaxed);
+    auto slot = slots_ + (index & (capacity_ - 1)) * CONVERSATION_RECORDER_STRIDE;
+    RecordHeader header = {
+        .timestamp_ms = timestamp_ms,
+        .size = (uint16_t)packet.size(),
+        .direction = direction,
+        .reserved = 0,
+    };
+    memcpy(slot, &header, sizeof(header));
+    memcpy(slot + sizeof(header), packet.data(), packet.size());
+    next_.store(index + 1, std::memory_order_release);
+}
+
+void ConversationRecorder::GetRange(uint32_t& begin, uint32_t& end) const {
+    end = next_.load(std::memory_order_acquire);
+    begin = end - (end < capacity_ ? end : capacity_);
+}
+
+void ConversationRecorder::Serialize(uint32_t begin, uint32_t end, std::string& data) const {
+    // Skip what the writer overwrote since the range was taken. A write racing the copy may
+    // still leave one torn record, the converter skips invalid ones.
+    uint32_t next = next_.load(std::memory_order_acquire);
+    if (next - begin > capacity_) {
+        begin = next - capacity_;
+    }
+    uint32_t count = (int32_t)(end - begin) > 0 ? end - begin : 0;
+
+    RecordingDumpHeader header = {
+        .magic = RECORDING_DUMP_MAGIC,
+        .version = RECORDING_DUMP_VERSION,
+        .slot_size = CONVERSATION_RECORDER_SLOT_SIZE,
+        .record_count = count,
+        .dropped = begin,
+        .skipped = skipped_.load(std::memory_order_relaxed),
+        .uplink_sample_rate = 16000,
+        .downlink_sample_rate = (uint32_t)downlink_sample_rate_.load(),
+        .uplink_frame_duration = (uint16_t)uplink_frame_duration_.load(),
+        .downlink_frame_duration = (uint16_t)downlink_frame_duration_.load(),
+    };
+    data.clear();
+    data.reserve(sizeof(header) + count * CONVERSATION_RECORDER_STRIDE);
+    data.append((const char*)&header, sizeof(header));
+    for (uint32_t i = begin; i != begin + count; i++) {
+        auto slot = slots_ + (i & (capacity_ - 1)) * CONVERSATION_RECORDER_STRIDE;
+        RecordHeader record;
+        memcpy(&record, slot, sizeof(record));
+        if (record.size > CONVERSATION_RECORDER_SLOT_SIZE) {
+            record.size = 0;
+        }
+        data.append((const char*)&record, sizeof(record));
+        data.append((const char*)slot + sizeof(record), record.size);
+    }
+}
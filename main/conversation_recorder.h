@@ -0,0 +1,80 @@
+#ifndef CONVERSATION_RECORDER_H
+#define CONVERSATION_RECORDER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "packet_pool.h"
+
+// 每个槽位可保存的最大 Opus 包, 更大的包不记录
+#ifndef CONVERSATION_RECORDER_SLOT_SIZE
+#define CONVERSATION_RECORDER_SLOT_SIZE 320
+#endif
+
+// 上传时每个请求包含的记录数, 约 16KB
+#ifndef CONVERSATION_RECORDER_UPLOAD_RECORDS
+#define CONVERSATION_RECORDER_UPLOAD_RECORDS 48
+#endif
+
+enum RecordDirection : uint8_t {
+    kRecordUplink,
+    kRecordDownlink,
+};
+
+// 8 bytes, followed by the packet in the same slot
+struct __attribute__((packed)) RecordHeader {
+    uint32_t timestamp_ms;
+    uint16_t size;
+    uint8_t direction;
+    uint8_t reserved;
+};
+
+#define RECORDING_DUMP_MAGIC 0x43525a58 // "XZRC"
+#define RECORDING_DUMP_VERSION 2
+
+// Fixed ring of the last CONFIG_CONVERSATION_RECORDER_SECONDS of uplink and downlink Opus
+// packets in PSRAM, for diagnosing bad recognition. Store copies one packet into the next
+// slot and overwrites the oldest, it is meant to run off the audio path: the audio tasks only
+// hand the pooled packet over. A dump is split into p3 files by scripts/recording_to_p3.py.
+class ConversationRecorder {
+public:
+    static ConversationRecorder& GetInstance() {
+        static ConversationRecorder instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    ConversationRecorder(const ConversationRecorder&) = delete;
+    ConversationRecorder& operator=(const ConversationRecorder&) = delete;
+
+    // Single writer, packets are stored in call order
+    void Store(RecordDirection direction, uint32_t timestamp_ms, const AudioPacket& packet);
+    // Frame lengths of both directions and the downlink rate, as negotiated when the channel opened
+    inline void SetAudioParams(int uplink_frame_duration, int downlink_sample_rate, int downlink_frame_duration) {
+        uplink_frame_duration_ = uplink_frame_duration;
+        downlink_sample_rate_ = downlink_sample_rate;
+        downlink_frame_duration_ = downlink_frame_duration;
+    }
+
+    // Indices of the records held now, [begin, end)
+    void GetRange(uint32_t& begin, uint32_t& end) const;
+    // A dump of its own for the records [begin, end), header first and oldest to newest, so a
+    // long recording is uploaded in pieces instead of one copy of the whole ring. Records
+    // overwritten since GetRange are left out.
+    void Serialize(uint32_t begin, uint32_t end, std::string& data) const;
+
+private:
+    ConversationRecorder();
+    ~ConversationRecorder();
+
+    uint8_t* slots_ = nullptr;
+    size_t capacity_ = 0;
+    std::atomic<uint32_t> next_{0};
+    std::atomic<uint32_t> skipped_{0};
+    std::atomic<int> downlink_sample_rate_{16000};
+    std::atomic<int> uplink_frame_duration_{60};
+    std::atomic<int> downlink_frame_duration_{60};
+};
+
+#endif // CONVERSATION_RECORDER_H
@@ -0,0 +1,100 @@
+#include "deferred_log.h"
+#include "task_topology.h"
+
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#define TAG "DeferredLog"
+
+#ifdef CONFIG_DEFERRED_LOG_QUEUE_SIZE
+#define DEFERRED_LOG_QUEUE_SIZE CONFIG_DEFERRED_LOG_QUEUE_SIZE
+#else
+#define DEFERRED_LOG_QUEUE_SIZE 32
+#endif
+
+// 格式化后的单行最大长度
+#define DEFERRED_LOG_LINE_SIZE 256
+
+DeferredLog::DeferredLog() {
+    queue_ = xQueueCreate(DEFERRED_LOG_QUEUE_SIZE, sizeof(DeferredLogRecord));
+    if (queue_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create the log queue, deferred logs are dropped");
+        return;
+    }
+    xTaskCreatePinnedToCore([](void* arg) {
+        auto log = static_cast<DeferredLog*>(arg);
+        DeferredLogRecord record;
+        uint32_t reported_dropped = 0;
+        while (true) {
+            if (xQueueReceive(log->queue_, &record, portMAX_DELAY) != pdTRUE) {
+                continue;
+            }
+            log->Print(record);
+            uint32_t dropped = log->dropped();
+            if (dropped != reported_dropped) {
+                ESP_LOGW(TAG, "%lu deferred logs dropped, queue full", (unsigned long)(dropped - reported_dropped));
+                reported_dropped = dropped;
+            }
+        }
+    }, "deferred_log", TASK_LOG_STACK_SIZE, this, TASK_LOG_PRIORITY, nullptr, TASK_CORE(TASK_LOG_CORE));
+}
+
+DeferredLog::~DeferredLog() {
+    if (queue_ != nullptr) {
+        vQueueDelete(queue_);
+    }
+}
+
+void DeferredLog::WriteText(esp_log_level_t level, const char* tag, uint32_t suppressed, const char* format,
+    const char* text, size_t length) {
+    DeferredLogRecord record;
+    size_t copied = std::min<size_t>(length, DEFERRED_LOG_TEXT_SIZE);
+    memcpy(record.text, text, copied);
+    record.text_length = std::min<size_t>(length, UINT16_MAX);
+    record.args[0] = copied;
+    record.has_text = true;
+    Push(record, level, tag, suppressed, format);
+}
+
+void DeferredLog::Push(DeferredLogRecord& record, esp_log_level_t level, const char* tag, uint32_t suppressed, const char* format) {
+    if (queue_ == nullptr) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    record.timestamp_ms = esp_log_timestamp();
+    record.level = level;
+    record.tag = tag;
+    record.format = format;
+    record.suppressed = suppressed;
+    // Never block the caller, this is called from network and audio callbacks
+    if (xQueueSend(queue_, &record, 0) != pdTRUE) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void DeferredLog::Print(const DeferredLogRecord& record) {
+    static const char kLevelLetters[] = {'N', 'E', 'W', 'I', 'D', 'V'};
+    char line[DEFERRED_LOG_LINE_SIZE];
+    int length;
+    if (record.has_text) {
+        length = snprintf(line, sizeof(line), "%s: %.*s%s", record.format, (int)record.args[0], record.text,
+            record.text_length > record.args[0] ? "..." : "");
+    } else {
+        length = snprintf(line, sizeof(line), record.format,
+            record.args[0], record.args[1], record.args[2], record.args[3]);
+    }
+    if (length < 0) {
+        return;
+    }
+    if (record.suppressed > 0 && (size_t)length < sizeof(line)) {
+        snprintf(line + length, sizeof(line) - length, " (+%lu)", (unsigned long)record.suppressed);
+    }
+
+    esp_log_level_t level = (esp_log_level_t)record.level;
+    char letter = level < sizeof(kLevelLetters) ? kLevelLetters[level] : '?';
+    // Timestamp of the call, not of the print
+    esp_log_write(level, record.tag, "%c (%lu) %s: %s\n", letter, (unsigned long)record.timestamp_ms, record.tag, line);
+}
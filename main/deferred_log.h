@@ -0,0 +1,150 @@
+#ifndef DEFERRED_LOG_H
+#define DEFERRED_LOG_H
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// 单条记录可携带的文本字节数，超出部分截断
+#define DEFERRED_LOG_TEXT_SIZE 96
+#define DEFERRED_LOG_MAX_ARGS 4
+
+struct DeferredLogRecord {
+    uint32_t timestamp_ms;
+    uint32_t args[DEFERRED_LOG_MAX_ARGS];
+    uint32_t suppressed;        // Calls skipped by the rate limit since the previous record
+    const char* tag;            // Must be a string literal
+    const char* format;         // Must be a string literal
+    uint16_t text_length;       // Original length, may exceed DEFERRED_LOG_TEXT_SIZE
+    uint8_t level;
+    uint8_t has_text;
+    char text[DEFERRED_LOG_TEXT_SIZE];
+};
+
+// Logging for hot paths. The caller copies a fixed size record into a queue and returns,
+// a low priority task formats it and writes it to the console. Arguments are stored as
+// 32 bit words, so only integers and pointers to string literals can be passed, payloads
+// go through WriteText. Records are dropped rather than blocking when the queue is full.
+class DeferredLog {
+public:
+    static DeferredLog& GetInstance() {
+        static DeferredLog instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    DeferredLog(const DeferredLog&) = delete;
+    DeferredLog& operator=(const DeferredLog&) = delete;
+
+    template <typename... Args>
+    void Write(esp_log_level_t level, const char* tag, uint32_t suppressed, const char* format, Args... args) {
+        static_assert(sizeof...(Args) <= DEFERRED_LOG_MAX_ARGS, "Too many deferred log arguments");
+        DeferredLogRecord record;
+        record.args[0] = record.args[1] = record.args[2] = record.args[3] = 0;
+        size_t index = 0;
+        ((record.args[index++] = ToWord(args)), ...);
+        record.has_text = false;
+        Push(record, level, tag, suppressed, format);
+    }
+
+    // Logs "<format>: <text>", the text is copied, not formatted
+    void WriteText(esp_log_level_t level, const char* tag, uint32_t suppressed, const char* format,
+        const char* text, size_t length);
+
+    uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    DeferredLog();
+    ~DeferredLog();
+
+    template <typename T>
+    static uint32_t ToWord(T value) {
+        static_assert(std::is_integral_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>,
+            "Deferred log arguments must be integers or string literals");
+        static_assert(sizeof(T) <= sizeof(uint32_t), "Deferred log arguments must fit 32 bits");
+        if constexpr (std::is_pointer_v<T>) {
+            return (uint32_t)(uintptr_t)value;
+        } else {
+            return (uint32_t)value;
+        }
+    }
+
+    void Push(DeferredLogRecord& record, esp_log_level_t level, const char* tag, uint32_t suppressed, const char* format);
+    void Print(const DeferredLogRecord& record);
+
+    QueueHandle_t queue_ = nullptr;
+    std::atomic<uint32_t> dropped_{0};
+};
+
+// Per call site limiter, lets one call through every interval and counts the rest
+class LogRateLimit {
+public:
+    bool Allow(uint32_t interval_ms, uint32_t& suppressed) {
+        int64_t now = esp_timer_get_time();
+        int64_t last = last_time_.load(std::memory_order_relaxed);
+        if (last != 0 && now - last < (int64_t)interval_ms * 1000) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (!last_time_.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        suppressed = skipped_.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    std::atomic<int64_t> last_time_{0};
+    std::atomic<uint32_t> skipped_{0};
+};
+
+#define DLOG_ENABLED(level, tag) (LOG_LOCAL_LEVEL >= (level) && esp_log_level_get(tag) >= (level))
+
+#if CONFIG_USE_DEFERRED_LOG
+#define DLOG_LEVEL(level, tag, suppressed, format, ...) \
+    DeferredLog::GetInstance().Write(level, tag, suppressed, format, ##__VA_ARGS__)
+#define DLOG_TEXT_LEVEL(level, tag, suppressed, format, text, length) \
+    DeferredLog::GetInstance().WriteText(level, tag, suppressed, format, text, length)
+#else
+// 关闭时在调用处直接输出，仍然保留限流
+#define DLOG_LEVEL(level, tag, suppressed, format, ...) \
+    ESP_LOG_LEVEL(level, tag, format, ##__VA_ARGS__)
+#define DLOG_TEXT_LEVEL(level, tag, suppressed, format, text, length) \
+    ESP_LOG_LEVEL(level, tag, format ": %.*s", (int)((length) < DEFERRED_LOG_TEXT_SIZE ? (length) : DEFERRED_LOG_TEXT_SIZE), text)
+#endif
+
+// Deferred logs, the level check is done before anything is copied
+#define DLOGE(tag, format, ...) do { if (DLOG_ENABLED(ESP_LOG_ERROR, tag)) DLOG_LEVEL(ESP_LOG_ERROR, tag, 0, format, ##__VA_ARGS__); } while (0)
+#define DLOGW(tag, format, ...) do { if (DLOG_ENABLED(ESP_LOG_WARN, tag)) DLOG_LEVEL(ESP_LOG_WARN, tag, 0, format, ##__VA_ARGS__); } while (0)
+#define DLOGI(tag, format, ...) do { if (DLOG_ENABLED(ESP_LOG_INFO, tag)) DLOG_LEVEL(ESP_LOG_INFO, tag, 0, format, ##__VA_ARGS__); } while (0)
+#define DLOGD(tag, format, ...) do { if (DLOG_ENABLED(ESP_LOG_DEBUG, tag)) DLOG_LEVEL(ESP_LOG_DEBUG, tag, 0, format, ##__VA_ARGS__); } while (0)
+
+#define DLOG_TEXT(level, tag, format, text, length) \
+    do { if (DLOG_ENABLED(level, tag)) DLOG_TEXT_LEVEL(level, tag, 0, format, text, length); } while (0)
+
+// At most one record per interval from this call site, the skipped count is appended
+#define DLOG_EVERY(interval_ms, level, tag, format, ...) \
+    do { \
+        static LogRateLimit dlog_limit_; \
+        uint32_t dlog_suppressed_ = 0; \
+        if (DLOG_ENABLED(level, tag) && dlog_limit_.Allow(interval_ms, dlog_suppressed_)) { \
+            DLOG_LEVEL(level, tag, dlog_suppressed_, format, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define DLOG_TEXT_EVERY(interval_ms, level, tag, format, text, length) \
+    do { \
+        static LogRateLimit dlog_limit_; \
+        uint32_t dlog_suppressed_ = 0; \
+        if (DLOG_ENABLED(level, tag) && dlog_limit_.Allow(interval_ms, dlog_suppressed_)) { \
+            DLOG_TEXT_LEVEL(level, tag, dlog_suppressed_, format, text, length); \
+        } \
+    } while (0)
+
+#endif // DEFERRED_LOG_H
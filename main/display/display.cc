@@ -1,5 +1,6 @@
 #include <esp_log.h>
 #include <esp_err.h>
+#include <esp_lvgl_port.h>
 #include <string>
 #include <cstdlib>
 #include <cstring>
@@ -19,34 +20,12 @@ Display::Display() {
     Settings settings("display", false);
     current_theme_name_ = settings.GetString("theme", "light");
 
-    // Notification timer
-    esp_timer_create_args_t notification_timer_args = {
-        .callback = [](void *arg) {
-            Display *display = static_cast<Display*>(arg);
-            DisplayLockGuard lock(display);
-            lv_obj_add_flag(display->notification_label_, LV_OBJ_FLAG_HIDDEN);
-            lv_obj_clear_flag(display->status_label_, LV_OBJ_FLAG_HIDDEN);
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "notification_timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&notification_timer_args, &notification_timer_));
-
-    // Update display timer
-    esp_timer_create_args_t update_display_timer_args = {
-        .callback = [](void *arg) {
-            Display *display = static_cast<Display*>(arg);
-            display->Update();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "display_update_timer",
-        .skip_unhandled_events = true,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&update_display_timer_args, &update_timer_));
-    ESP_ERROR_CHECK(esp_timer_start_periodic(update_timer_, 1000000));
+    // Update display timer, on whole seconds like the clock timer
+    auto& timers = TimerService::GetInstance();
+    update_timer_ = timers.Create("display_update_timer", [this]() {
+        Update();
+    }, 1000);
+    timers.StartPeriodic(update_timer_, 1000);
 
     // Create a power management lock
     auto ret = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "display_update", &pm_lock_);
@@ -58,15 +37,11 @@ Display::Display() {
 }
 
 Display::~Display() {
-    if (notification_timer_ != nullptr) {
-        esp_timer_stop(notification_timer_);
-        esp_timer_delete(notification_timer_);
-    }
-    if (update_timer_ != nullptr) {
-        esp_timer_stop(update_timer_);
-        esp_timer_delete(update_timer_);
-    }
+    TimerService::GetInstance().Delete(update_timer_);
 
+    if (command_timer_ != nullptr) {
+        lv_timer_delete(command_timer_);
+    }
     if (network_label_ != nullptr) {
         lv_obj_del(network_label_);
         lv_obj_del(notification_label_);
@@ -83,14 +58,38 @@ Display::~Display() {
     }
 }
 
-void Display::SetStatus(const char* status) {
+void Display::StartCommandTimer() {
     DisplayLockGuard lock(this);
-    if (status_label_ == nullptr) {
+    command_timer_ = lv_timer_create([](lv_timer_t* timer) {
+        static_cast<Display*>(lv_timer_get_user_data(timer))->FlushCommands();
+    }, DISPLAY_COMMAND_INTERVAL_MS, this);
+}
+
+void Display::SetPowerSaveMode(bool enabled) {
+    if (power_save_ == enabled) {
         return;
     }
-    lv_label_set_text(status_label_, status);
-    lv_obj_clear_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
-    lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
+    power_save_ = enabled;
+    if (enabled) {
+        TimerService::GetInstance().Stop(update_timer_);
+        // Only displays driven by the LVGL port have a tick to stop
+        if (display_ != nullptr) {
+            lvgl_port_stop();
+        }
+    } else {
+        if (display_ != nullptr) {
+            lvgl_port_resume();
+        }
+        TimerService::GetInstance().StartPeriodic(update_timer_, 1000);
+        Update();
+    }
+}
+
+void Display::SetStatus(const char* status) {
+    std::lock_guard<std::mutex> lock(command_mutex_);
+    pending_.status = true;
+    pending_.status_text = status;
+    pending_.notification_last = false;
 }
 
 void Display::ShowNotification(const std::string &notification, int duration_ms) {
@@ -98,46 +97,144 @@ void Display::ShowNotification(const std::string &notification, int duration_ms)
 }
 
 void Display::ShowNotification(const char* notification, int duration_ms) {
-    DisplayLockGuard lock(this);
+    std::lock_guard<std::mutex> lock(command_mutex_);
+    pending_.notification = true;
+    pending_.notification_text = notification;
+    pending_.notification_duration_ms = duration_ms;
+    pending_.notification_last = true;
+}
+
+void Display::SetEmotion(const char* emotion) {
+    std::lock_guard<std::mutex> lock(command_mutex_);
+    pending_.emotion = true;
+    pending_.emotion_is_icon = false;
+    pending_.emotion_text = emotion;
+}
+
+void Display::SetIcon(const char* icon) {
+    std::lock_guard<std::mutex> lock(command_mutex_);
+    pending_.emotion = true;
+    pending_.emotion_is_icon = true;
+    pending_.emotion_text = icon;
+}
+
+void Display::SetChatMessage(const char* role, const char* content) {
+    std::lock_guard<std::mutex> lock(command_mutex_);
+    auto& messages = pending_.chat_messages;
+    // Messages beyond the visible history would be recycled in the same frame anyway
+    while (!messages.empty() && messages.size() >= chat_history_size()) {
+        messages.pop_front();
+    }
+    messages.emplace_back(role, content != nullptr ? content : "");
+}
+
+void Display::FlushCommands() {
+    PendingCommands commands;
+    {
+        std::lock_guard<std::mutex> lock(command_mutex_);
+        std::swap(commands, pending_);
+    }
+
+    if (commands.status) {
+        // Showing the status hides any notification
+        ApplyStatus(commands.status_text.c_str());
+        notification_deadline_ = 0;
+    }
+    if (commands.notification && commands.notification_last) {
+        ApplyNotification(commands.notification_text.c_str());
+        notification_deadline_ = esp_timer_get_time() + commands.notification_duration_ms * 1000LL;
+    } else if (notification_deadline_ != 0 && esp_timer_get_time() >= notification_deadline_) {
+        notification_deadline_ = 0;
+        HideNotification();
+    }
+    if (commands.emotion) {
+        if (commands.emotion_is_icon) {
+            ApplyIcon(commands.emotion_text.c_str());
+        } else {
+            ApplyEmotion(commands.emotion_text.c_str());
+        }
+    }
+    for (auto& [role, content] : commands.chat_messages) {
+        ApplyChatMessage(role.c_str(), content.c_str());
+    }
+    if (commands.indicators) {
+        ApplyIndicators(commands);
+    }
+}
+
+void Display::ApplyIndicators(const PendingCommands& commands) {
+    // 如果静音状态改变，则更新图标
+    if (mute_label_ != nullptr && commands.muted != muted_) {
+        muted_ = commands.muted;
+        lv_label_set_text(mute_label_, muted_ ? FONT_AWESOME_VOLUME_MUTE : "");
+    }
+
+    if (commands.battery_icon != nullptr) {
+        if (battery_label_ != nullptr && battery_icon_ != commands.battery_icon) {
+            battery_icon_ = commands.battery_icon;
+            lv_label_set_text(battery_label_, battery_icon_);
+        }
+        if (low_battery_popup_ != nullptr) {
+            bool hidden = lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
+            if (commands.low_battery && hidden) {
+                lv_obj_clear_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
+            } else if (!commands.low_battery && !hidden) {
+                lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
+            }
+        }
+    }
+
+    if (network_label_ != nullptr && commands.network_icon != nullptr && network_icon_ != commands.network_icon) {
+        network_icon_ = commands.network_icon;
+        lv_label_set_text(network_label_, network_icon_);
+    }
+}
+
+void Display::ApplyStatus(const char* status) {
+    if (status_label_ == nullptr) {
+        return;
+    }
+    lv_label_set_text(status_label_, status);
+    lv_obj_clear_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
+    lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
+}
+
+void Display::ApplyNotification(const char* notification) {
     if (notification_label_ == nullptr) {
         return;
     }
     lv_label_set_text(notification_label_, notification);
     lv_obj_clear_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
     lv_obj_add_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
+}
 
-    esp_timer_stop(notification_timer_);
-    ESP_ERROR_CHECK(esp_timer_start_once(notification_timer_, duration_ms * 1000));
+void Display::HideNotification() {
+    if (notification_label_ == nullptr) {
+        return;
+    }
+    lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
+    lv_obj_clear_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
 }
 
 void Display::Update() {
+    // Widgets are created once by the subclass, nothing to update before
+    if (mute_label_ == nullptr) {
+        return;
+    }
+
     auto& board = Board::GetInstance();
     auto codec = board.GetAudioCodec();
-
-    {
-        DisplayLockGuard lock(this);
-        if (mute_label_ == nullptr) {
-            return;
-        }
-
-        // 如果静音状态改变，则更新图标
-        if (codec->output_volume() == 0 && !muted_) {
-            muted_ = true;
-            lv_label_set_text(mute_label_, FONT_AWESOME_VOLUME_MUTE);
-        } else if (codec->output_volume() > 0 && muted_) {
-            muted_ = false;
-            lv_label_set_text(mute_label_, "");
-        }
-    }
+    bool muted = codec->output_volume() == 0;
 
     esp_pm_lock_acquire(pm_lock_);
     // 更新电池图标
     int battery_level;
     bool charging, discharging;
-    const char* icon = nullptr;
+    const char* battery_icon = nullptr;
+    bool low_battery = false;
     if (board.GetBatteryLevel(battery_level, charging, discharging)) {
         if (charging) {
-            icon = FONT_AWESOME_BATTERY_CHARGING;
+            battery_icon = FONT_AWESOME_BATTERY_CHARGING;
         } else {
             const char* levels[] = {
                 FONT_AWESOME_BATTERY_EMPTY, // 0-19%
@@ -147,31 +244,20 @@ void Display::Update() {
                 FONT_AWESOME_BATTERY_FULL, // 80-99%
                 FONT_AWESOME_BATTERY_FULL, // 100%
             };
-            icon = levels[battery_level / 20];
-        }
-        DisplayLockGuard lock(this);
-        if (battery_label_ != nullptr && battery_icon_ != icon) {
-            battery_icon_ = icon;
-            lv_label_set_text(battery_label_, battery_icon_);
+            battery_icon = levels[battery_level / 20];
         }
 
-        if (low_battery_popup_ != nullptr) {
-            if (strcmp(icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging) {
-                if (lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // 如果低电量提示框隐藏，则显示
-                    lv_obj_clear_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
-                    auto& app = Application::GetInstance();
-                    app.PlaySound(Lang::Sounds::P3_LOW_BATTERY);
-                }
-            } else {
-                // Hide the low battery popup when the battery is not empty
-                if (!lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // 如果低电量提示框显示，则隐藏
-                    lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
-                }
-            }
+        // 低电量提示框出现时播放一次提示音
+        low_battery = strcmp(battery_icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging;
+        if (low_battery && !low_battery_ && low_battery_popup_ != nullptr) {
+            auto& app = Application::GetInstance();
+            app.PlaySound(Lang::Sounds::P3_LOW_BATTERY());
         }
+        low_battery_ = low_battery;
     }
 
     // 升级固件时，不读取 4G 网络状态，避免占用 UART 资源
+    const char* network_icon = nullptr;
     auto device_state = Application::GetInstance().GetDeviceState();
     static const std::vector<DeviceState> allowed_states = {
         kDeviceStateIdle,
@@ -180,19 +266,21 @@ void Display::Update() {
         kDeviceStateListening,
     };
     if (std::find(allowed_states.begin(), allowed_states.end(), device_state) != allowed_states.end()) {
-        icon = board.GetNetworkStateIcon();
-        if (network_label_ != nullptr && icon != nullptr && network_icon_ != icon) {
-            DisplayLockGuard lock(this);
-            network_icon_ = icon;
-            lv_label_set_text(network_label_, network_icon_);
-        }
+        network_icon = board.GetNetworkStateIcon();
     }
 
     esp_pm_lock_release(pm_lock_);
+
+    std::lock_guard<std::mutex> lock(command_mutex_);
+    pending_.indicators = true;
+    pending_.muted = muted;
+    pending_.battery_icon = battery_icon;
+    pending_.low_battery = low_battery;
+    pending_.network_icon = network_icon;
 }
 
 
-void Display::SetEmotion(const char* emotion) {
+void Display::ApplyEmotion(const char* emotion) {
     struct Emotion {
         const char* icon;
         const char* text;
@@ -227,7 +315,6 @@ void Display::SetEmotion(const char* emotion) {
     auto it = std::find_if(emotions.begin(), emotions.end(),
         [&emotion_view](const Emotion& e) { return e.text == emotion_view; });
     
-    DisplayLockGuard lock(this);
     if (emotion_label_ == nullptr) {
         return;
     }
@@ -240,16 +327,14 @@ void Display::SetEmotion(const char* emotion) {
     }
 }
 
-void Display::SetIcon(const char* icon) {
-    DisplayLockGuard lock(this);
+void Display::ApplyIcon(const char* icon) {
     if (emotion_label_ == nullptr) {
         return;
     }
     lv_label_set_text(emotion_label_, icon);
 }
 
-void Display::SetChatMessage(const char* role, const char* content) {
-    DisplayLockGuard lock(this);
+void Display::ApplyChatMessage(const char* role, const char* content) {
     if (chat_message_label_ == nullptr) {
         return;
     }
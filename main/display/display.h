@@ -7,6 +7,14 @@
 #include <esp_pm.h>
 
 #include <string>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+#include "timer_service.h"
+
+// 界面更新在 LVGL 任务中合并执行的间隔, 即最高 10 帧/秒
+#define DISPLAY_COMMAND_INTERVAL_MS 100
 
 struct DisplayFonts {
     const lv_font_t* text_font = nullptr;
@@ -19,14 +27,18 @@ public:
     Display();
     virtual ~Display();
 
-    virtual void SetStatus(const char* status);
-    virtual void ShowNotification(const char* notification, int duration_ms = 3000);
-    virtual void ShowNotification(const std::string &notification, int duration_ms = 3000);
-    virtual void SetEmotion(const char* emotion);
-    virtual void SetChatMessage(const char* role, const char* content);
-    virtual void SetIcon(const char* icon);
+    // These only queue the update and return at once. The LVGL task applies them every
+    // DISPLAY_COMMAND_INTERVAL_MS, keeping the latest value per widget.
+    void SetStatus(const char* status);
+    void ShowNotification(const char* notification, int duration_ms = 3000);
+    void ShowNotification(const std::string &notification, int duration_ms = 3000);
+    void SetEmotion(const char* emotion);
+    void SetChatMessage(const char* role, const char* content);
+    void SetIcon(const char* icon);
     virtual void SetTheme(const std::string& theme_name);
     virtual std::string GetTheme() { return current_theme_name_; }
+    // Stops the status refresh timer and the LVGL tick, queued updates are applied on resume
+    virtual void SetPowerSaveMode(bool enabled);
 
     inline int width() const { return width_; }
     inline int height() const { return height_; }
@@ -53,14 +65,56 @@ protected:
     bool muted_ = false;
     std::string current_theme_name_;
 
-    esp_timer_handle_t notification_timer_ = nullptr;
-    esp_timer_handle_t update_timer_ = nullptr;
+    ServiceTimer* update_timer_ = nullptr;
+    lv_timer_t* command_timer_ = nullptr;
 
     friend class DisplayLockGuard;
     virtual bool Lock(int timeout_ms = 0) = 0;
     virtual void Unlock() = 0;
 
     virtual void Update();
+
+    // Subclasses start the command timer once LVGL and the widgets exist
+    void StartCommandTimer();
+
+    // Called on the LVGL task with the display locked
+    virtual void ApplyStatus(const char* status);
+    virtual void ApplyNotification(const char* notification);
+    virtual void HideNotification();
+    virtual void ApplyEmotion(const char* emotion);
+    virtual void ApplyIcon(const char* icon);
+    virtual void ApplyChatMessage(const char* role, const char* content);
+    // Chat messages that are kept when several arrive within one interval
+    virtual size_t chat_history_size() const { return 1; }
+
+private:
+    // Written by any task under command_mutex_, taken by FlushCommands
+    struct PendingCommands {
+        bool status = false;
+        bool notification = false;
+        bool notification_last = false;     // Queued after the status, so it is shown on top
+        bool emotion = false;
+        bool emotion_is_icon = false;       // Emotion and icon share one label
+        bool indicators = false;
+        std::string status_text;
+        std::string notification_text;
+        int notification_duration_ms = 0;
+        std::string emotion_text;
+        std::deque<std::pair<std::string, std::string>> chat_messages;
+        bool muted = false;
+        bool low_battery = false;
+        const char* battery_icon = nullptr;
+        const char* network_icon = nullptr;
+    };
+
+    std::mutex command_mutex_;
+    PendingCommands pending_;
+    int64_t notification_deadline_ = 0;
+    bool low_battery_ = false;
+    bool power_save_ = false;
+
+    void FlushCommands();
+    void ApplyIndicators(const PendingCommands& commands);
 };
 
 
@@ -1,18 +1,27 @@
 #include "lcd_display.h"
 
 #include <vector>
+#include <algorithm>
 #include <font_awesome_symbols.h>
 #include <esp_log.h>
 #include <esp_err.h>
 #include <esp_lvgl_port.h>
+#include <esp_heap_caps.h>
 #include "assets/lang_config.h"
 #include <cstring>
 #include "settings.h"
+#include "asset_store.h"
+#include "task_topology.h"
 
 #include "board.h"
 
 #define TAG "LcdDisplay"
 
+// PSRAM 绘制缓冲区经内部 DMA 缓冲区分段发送, 每段的行数
+#define LCD_TRANS_LINES 10
+// 清屏时每次 DMA 传输的大小
+#define LCD_FILL_CHUNK_SIZE (16 * 1024)
+
 // Color definitions for dark theme
 #define DARK_BACKGROUND_COLOR       lv_color_hex(0x121212)     // Dark background
 #define DARK_TEXT_COLOR             lv_color_white()           // White text
@@ -80,18 +89,87 @@ static ThemeColors current_theme = LIGHT_THEME;
 
 LV_FONT_DECLARE(font_awesome_30_4);
 
+LcdDisplay::LcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel, DisplayFonts fonts)
+    : panel_io_(panel_io), panel_(panel), fonts_(fonts) {
+#if CONFIG_USE_FONT_PARTITION
+    // 优先使用 font 分区中的字体, 缺少的字形回退到内置字体
+    partition_font_ = PartitionFont::Load("font", CONFIG_FONT_PARTITION_CACHE_SIZE, fonts_.text_font);
+    if (partition_font_ == nullptr) {
+        // 没有 font 分区时尝试 assets 分区中的字体
+        auto& assets = AssetStore::GetInstance();
+        auto entry = assets.Find("font");
+        if (entry != nullptr && entry->format == kAssetFormatFont) {
+            partition_font_ = PartitionFont::Load(assets.partition(), entry->offset, entry->size,
+                CONFIG_FONT_PARTITION_CACHE_SIZE, fonts_.text_font);
+        }
+    }
+    if (partition_font_ != nullptr) {
+        fonts_.text_font = partition_font_->font();
+    }
+#endif
+}
+
+void LcdDisplay::ApplyRenderConfig(lvgl_port_display_cfg_t& display_cfg, const LcdRenderConfig& render) {
+    int lines = height_;
+    if (render.mode == kLcdRenderPartial && render.buffer_lines > 0 && render.buffer_lines < height_) {
+        lines = render.buffer_lines;
+    }
+    display_cfg.buffer_size = static_cast<uint32_t>(width_ * lines);
+    display_cfg.double_buffer = render.double_buffer;
+    display_cfg.flags.buff_dma = !render.buffer_in_psram;
+    display_cfg.flags.buff_spiram = render.buffer_in_psram;
+    display_cfg.flags.full_refresh = render.mode == kLcdRenderFull;
+    display_cfg.flags.direct_mode = render.mode == kLcdRenderDirect;
+    ESP_LOGI(TAG, "Render mode %d, %d lines x %d buffer(s) in %s", render.mode, lines,
+        render.double_buffer ? 2 : 1, render.buffer_in_psram ? "PSRAM" : "internal DMA RAM");
+}
+
+void LcdDisplay::FillPanel(lv_color_t color, bool swap_bytes) {
+    uint16_t pixel = lv_color_to_u16(color);
+    if (swap_bytes) {
+        pixel = (pixel >> 8) | (pixel << 8);
+    }
+
+    // As many lines per transfer as fit the chunk, fewer if internal DMA memory is short
+    int lines = std::max(1, std::min<int>(height_, LCD_FILL_CHUNK_SIZE / (width_ * sizeof(uint16_t))));
+    uint16_t* buffer = nullptr;
+    while (buffer == nullptr) {
+        buffer = (uint16_t*)heap_caps_malloc(width_ * lines * sizeof(uint16_t), MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (buffer == nullptr) {
+            if (lines == 1) {
+                ESP_LOGE(TAG, "Failed to allocate the fill buffer");
+                return;
+            }
+            lines /= 2;
+        }
+    }
+    std::fill_n(buffer, width_ * lines, pixel);
+
+    // Every transfer reads the same buffer, so they can all be queued at once
+    for (int y = 0; y < height_; y += lines) {
+        esp_lcd_panel_draw_bitmap(panel_, 0, y, width_, std::min(y + lines, height_), buffer);
+    }
+    // A parameter transfer waits for the queued color transfers before the buffer is freed
+    if (panel_io_ != nullptr) {
+        esp_lcd_panel_io_tx_param(panel_io_, -1, nullptr, 0);
+    }
+    heap_caps_free(buffer);
+}
+
 SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                            int width, int height, int offset_x, int offset_y, bool mirror_x, bool mirror_y, bool swap_xy,
-                           DisplayFonts fonts)
+                           DisplayFonts fonts, LcdRenderConfig render)
     : LcdDisplay(panel_io, panel, fonts) {
     width_ = width;
     height_ = height;
 
-    // draw white
-    std::vector<uint16_t> buffer(width_, 0xFFFF);
-    for (int y = 0; y < height_; y++) {
-        esp_lcd_panel_draw_bitmap(panel_, 0, y, width_, y + 1, buffer.data());
+    // Update the theme, the panel is cleared to its background so the UI doesn't flash white
+    if (current_theme_name_ == "dark") {
+        current_theme = DARK_THEME;
+    } else if (current_theme_name_ == "light") {
+        current_theme = LIGHT_THEME;
     }
+    FillPanel(current_theme.background, true);
 
     // Set the display to on
     ESP_LOGI(TAG, "Turning display on");
@@ -102,18 +180,25 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
+    port_cfg.task_priority = TASK_LVGL_PRIORITY;
+    port_cfg.task_stack = TASK_LVGL_STACK_SIZE;
+    port_cfg.task_affinity = TASK_CORE(TASK_LVGL_CORE);
     port_cfg.timer_period_ms = 50;
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding LCD screen");
-    const lvgl_port_display_cfg_t display_cfg = {
+    if (render.mode == kLcdRenderDirect) {
+        ESP_LOGW(TAG, "Direct mode needs a frame buffer, using partial refresh");
+        render.mode = kLcdRenderPartial;
+    }
+    lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
         .panel_handle = panel_,
         .control_handle = nullptr,
-        .buffer_size = static_cast<uint32_t>(width_ * 10),
+        .buffer_size = 0,
         .double_buffer = false,
-        .trans_size = 0,
+        // SPI DMA can't read PSRAM directly, send through a small internal buffer
+        .trans_size = render.buffer_in_psram ? static_cast<uint32_t>(width_ * LCD_TRANS_LINES) : 0,
         .hres = static_cast<uint32_t>(width_),
         .vres = static_cast<uint32_t>(height_),
         .monochrome = false,
@@ -132,6 +217,7 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
             .direct_mode = 0,
         },
     };
+    ApplyRenderConfig(display_cfg, render);
 
     display_ = lvgl_port_add_disp(&display_cfg);
     if (display_ == nullptr) {
@@ -143,46 +229,42 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         lv_display_set_offset(display_, offset_x, offset_y);
     }
 
-    // Update the theme
-    if (current_theme_name_ == "dark") {
-        current_theme = DARK_THEME;
-    } else if (current_theme_name_ == "light") {
-        current_theme = LIGHT_THEME;
-    }
-
     SetupUI();
+    StartCommandTimer();
 }
 
 // RGB LCD实现
 RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                            int width, int height, int offset_x, int offset_y,
                            bool mirror_x, bool mirror_y, bool swap_xy,
-                           DisplayFonts fonts)
+                           DisplayFonts fonts, LcdRenderConfig render)
     : LcdDisplay(panel_io, panel, fonts) {
     width_ = width;
     height_ = height;
     
-    // draw white
-    std::vector<uint16_t> buffer(width_, 0xFFFF);
-    for (int y = 0; y < height_; y++) {
-        esp_lcd_panel_draw_bitmap(panel_, 0, y, width_, y + 1, buffer.data());
+    // Update the theme, the panel is cleared to its background so the UI doesn't flash white
+    if (current_theme_name_ == "dark") {
+        current_theme = DARK_THEME;
+    } else if (current_theme_name_ == "light") {
+        current_theme = LIGHT_THEME;
     }
+    FillPanel(current_theme.background, false);
 
     ESP_LOGI(TAG, "Initialize LVGL library");
     lv_init();
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
+    port_cfg.task_priority = TASK_LVGL_PRIORITY;
+    port_cfg.task_stack = TASK_LVGL_STACK_SIZE;
+    port_cfg.task_affinity = TASK_CORE(TASK_LVGL_CORE);
     port_cfg.timer_period_ms = 50;
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding LCD screen");
-    const lvgl_port_display_cfg_t display_cfg = {
+    lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
         .panel_handle = panel_,
-        .buffer_size = static_cast<uint32_t>(width_ * 10),
-        .double_buffer = true,
         .hres = static_cast<uint32_t>(width_),
         .vres = static_cast<uint32_t>(height_),
         .rotation = {
@@ -193,15 +275,15 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         .flags = {
             .buff_dma = 1,
             .swap_bytes = 0,
-            .full_refresh = 1,
-            .direct_mode = 1,
         },
     };
+    ApplyRenderConfig(display_cfg, render);
 
+    // Tearing is only avoided when LVGL renders straight into the panel frame buffers
     const lvgl_port_display_rgb_cfg_t rgb_cfg = {
         .flags = {
             .bb_mode = true,
-            .avoid_tearing = true,
+            .avoid_tearing = render.mode == kLcdRenderDirect,
         }
     };
     
@@ -215,14 +297,8 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         lv_display_set_offset(display_, offset_x, offset_y);
     }
 
-    // Update the theme
-    if (current_theme_name_ == "dark") {
-        current_theme = DARK_THEME;
-    } else if (current_theme_name_ == "light") {
-        current_theme = LIGHT_THEME;
-    }
-
     SetupUI();
+    StartCommandTimer();
 }
 
 LcdDisplay::~LcdDisplay() {
@@ -242,6 +318,7 @@ LcdDisplay::~LcdDisplay() {
     if (display_ != nullptr) {
         lv_display_delete(display_);
     }
+    delete partition_font_;
 
     if (panel_ != nullptr) {
         esp_lcd_panel_del(panel_);
@@ -370,170 +447,97 @@ void LcdDisplay::SetupUI() {
     lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
 }
 
-#define  MAX_MESSAGES 20
-void LcdDisplay::SetChatMessage(const char* role, const char* content) {
-    DisplayLockGuard lock(this);
+LcdDisplay::ChatRow& LcdDisplay::NextChatRow() {
+    if (chat_row_count_ < LCD_CHAT_HISTORY_SIZE) {
+        auto& row = chat_rows_[chat_row_count_++];
+        // Create a full-width transparent row so the bubble can be aligned inside it
+        row.row = lv_obj_create(content_);
+        lv_obj_set_width(row.row, LV_HOR_RES);
+        lv_obj_set_height(row.row, LV_SIZE_CONTENT);
+        lv_obj_set_style_bg_opa(row.row, LV_OPA_TRANSP, 0);
+        lv_obj_set_style_border_width(row.row, 0, 0);
+        lv_obj_set_style_pad_all(row.row, 0, 0);
+        lv_obj_set_scrollbar_mode(row.row, LV_SCROLLBAR_MODE_OFF);
+
+        row.bubble = lv_obj_create(row.row);
+        lv_obj_set_style_radius(row.bubble, 8, 0);
+        lv_obj_set_scrollbar_mode(row.bubble, LV_SCROLLBAR_MODE_OFF);
+        lv_obj_set_style_border_width(row.bubble, 1, 0);
+        lv_obj_set_style_pad_all(row.bubble, 8, 0);
+        lv_obj_set_size(row.bubble, LV_SIZE_CONTENT, LV_SIZE_CONTENT);
+        lv_obj_set_style_flex_grow(row.bubble, 0, 0);
+
+        row.text = lv_label_create(row.bubble);
+        lv_label_set_long_mode(row.text, LV_LABEL_LONG_WRAP);
+        lv_obj_set_style_text_font(row.text, fonts_.text_font, 0);
+        return row;
+    }
+
+    // 历史已满: 把最早的一行移到末尾复用, 对象数量和布局开销保持不变
+    auto& row = chat_rows_[oldest_chat_row_];
+    oldest_chat_row_ = (oldest_chat_row_ + 1) % LCD_CHAT_HISTORY_SIZE;
+    lv_obj_move_to_index(row.row, -1);
+    return row;
+}
+
+void LcdDisplay::StyleChatRow(ChatRow& row) {
+    lv_obj_set_style_border_color(row.bubble, current_theme.border, 0);
+    switch (row.role) {
+    case kChatRoleUser:
+        // User messages are right-aligned with green background
+        lv_obj_set_style_bg_color(row.bubble, current_theme.user_bubble, 0);
+        lv_obj_set_style_text_color(row.text, current_theme.text, 0);
+        lv_obj_align(row.bubble, LV_ALIGN_RIGHT_MID, -25, 0);
+        break;
+    case kChatRoleSystem:
+        // System messages are center-aligned with light gray background
+        lv_obj_set_style_bg_color(row.bubble, current_theme.system_bubble, 0);
+        lv_obj_set_style_text_color(row.text, current_theme.system_text, 0);
+        lv_obj_align(row.bubble, LV_ALIGN_CENTER, 0, 0);
+        break;
+    default:
+        // Assistant messages are left-aligned with white background
+        lv_obj_set_style_bg_color(row.bubble, current_theme.assistant_bubble, 0);
+        lv_obj_set_style_text_color(row.text, current_theme.text, 0);
+        lv_obj_align(row.bubble, LV_ALIGN_LEFT_MID, 0, 0);
+        break;
+    }
+}
+
+void LcdDisplay::ApplyChatMessage(const char* role, const char* content) {
     if (content_ == nullptr) {
         return;
     }
     
     //避免出现空的消息框
     if(strlen(content) == 0) return;
-    
-    // 检查消息数量是否超过限制
-    uint32_t child_count = lv_obj_get_child_cnt(content_);
-    if (child_count >= MAX_MESSAGES) {
-        // 删除最早的消息（第一个子对象）
-        lv_obj_t* first_child = lv_obj_get_child(content_, 0);
-        lv_obj_t* last_child = lv_obj_get_child(content_, child_count - 1);
-        if (first_child != nullptr) {
-            lv_obj_del(first_child);
-        }
-        // Scroll to the last message immediately
-        if (last_child != nullptr) {
-            lv_obj_scroll_to_view_recursive(last_child, LV_ANIM_OFF);
-        }
-    }
-    
-    // Create a message bubble
-    lv_obj_t* msg_bubble = lv_obj_create(content_);
-    lv_obj_set_style_radius(msg_bubble, 8, 0);
-    lv_obj_set_scrollbar_mode(msg_bubble, LV_SCROLLBAR_MODE_OFF);
-    lv_obj_set_style_border_width(msg_bubble, 1, 0);
-    lv_obj_set_style_border_color(msg_bubble, current_theme.border, 0);
-    lv_obj_set_style_pad_all(msg_bubble, 8, 0);
-
-    // Create the message text
-    lv_obj_t* msg_text = lv_label_create(msg_bubble);
-    lv_label_set_text(msg_text, content);
-    
-    // 计算文本实际宽度
-    lv_coord_t text_width = lv_txt_get_width(content, strlen(content), fonts_.text_font, 0);
 
-    // 计算气泡宽度
-    lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;  // 屏幕宽度的85%
-    lv_coord_t min_width = 20;  
-    lv_coord_t bubble_width;
-    
-    // 确保文本宽度不小于最小宽度
-    if (text_width < min_width) {
-        text_width = min_width;
-    }
-
-    // 如果文本宽度小于最大宽度，使用文本宽度
-    if (text_width < max_width) {
-        bubble_width = text_width; 
+    auto& row = NextChatRow();
+    if (strcmp(role, "user") == 0) {
+        row.role = kChatRoleUser;
+    } else if (strcmp(role, "system") == 0) {
+        row.role = kChatRoleSystem;
     } else {
-        bubble_width = max_width;
+        row.role = kChatRoleAssistant;
     }
+    lv_label_set_text(row.text, content);
     
-    // 设置消息文本的宽度
-    lv_obj_set_width(msg_text, bubble_width);  // 减去padding
-    lv_label_set_long_mode(msg_text, LV_LABEL_LONG_WRAP);
-    lv_obj_set_style_text_font(msg_text, fonts_.text_font, 0);
+    // 计算文本实际宽度
+    lv_coord_t text_width = lv_txt_get_width(content, strlen(content), fonts_.text_font, 0);
 
-    // 设置气泡宽度
-    lv_obj_set_width(msg_bubble, bubble_width);
-    lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
+    // 计算气泡宽度: 不小于最小宽度, 不超过屏幕宽度的85%
+    lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;
+    lv_coord_t min_width = 20;
+    lv_coord_t bubble_width = std::clamp(text_width, min_width, max_width);
+    lv_obj_set_width(row.text, bubble_width);
 
-    // Set alignment and style based on message role
-    if (strcmp(role, "user") == 0) {
-        // User messages are right-aligned with green background
-        lv_obj_set_style_bg_color(msg_bubble, current_theme.user_bubble, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, current_theme.text, 0);
-        
-        // 设置自定义属性标记气泡类型
-        lv_obj_set_user_data(msg_bubble, (void*)"user");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    } else if (strcmp(role, "assistant") == 0) {
-        // Assistant messages are left-aligned with white background
-        lv_obj_set_style_bg_color(msg_bubble, current_theme.assistant_bubble, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, current_theme.text, 0);
-        
-        // 设置自定义属性标记气泡类型
-        lv_obj_set_user_data(msg_bubble, (void*)"assistant");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    } else if (strcmp(role, "system") == 0) {
-        // System messages are center-aligned with light gray background
-        lv_obj_set_style_bg_color(msg_bubble, current_theme.system_bubble, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, current_theme.system_text, 0);
-        
-        // 设置自定义属性标记气泡类型
-        lv_obj_set_user_data(msg_bubble, (void*)"system");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    }
-    
-    // Create a full-width container for user messages to ensure right alignment
-    if (strcmp(role, "user") == 0) {
-        // Create a full-width container
-        lv_obj_t* container = lv_obj_create(content_);
-        lv_obj_set_width(container, LV_HOR_RES);
-        lv_obj_set_height(container, LV_SIZE_CONTENT);
-        
-        // Make container transparent and borderless
-        lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
-        lv_obj_set_style_border_width(container, 0, 0);
-        lv_obj_set_style_pad_all(container, 0, 0);
-        
-        // Move the message bubble into this container
-        lv_obj_set_parent(msg_bubble, container);
-        
-        // Right align the bubble in the container
-        lv_obj_align(msg_bubble, LV_ALIGN_RIGHT_MID, -25, 0);
-        
-        // Auto-scroll to this container
-        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
-    } else if (strcmp(role, "system") == 0) {
-        // 为系统消息创建全宽容器以确保居中对齐
-        lv_obj_t* container = lv_obj_create(content_);
-        lv_obj_set_width(container, LV_HOR_RES);
-        lv_obj_set_height(container, LV_SIZE_CONTENT);
-        
-        // 使容器透明且无边框
-        lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
-        lv_obj_set_style_border_width(container, 0, 0);
-        lv_obj_set_style_pad_all(container, 0, 0);
-        
-        // 将消息气泡移入此容器
-        lv_obj_set_parent(msg_bubble, container);
-        
-        // 将气泡居中对齐在容器中
-        lv_obj_align(msg_bubble, LV_ALIGN_CENTER, 0, 0);
-        
-        // 自动滚动底部
-        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
-    } else {
-        // For assistant messages
-        // Left align assistant messages
-        lv_obj_align(msg_bubble, LV_ALIGN_LEFT_MID, 0, 0);
+    StyleChatRow(row);
 
-        // Auto-scroll to the message bubble
-        lv_obj_scroll_to_view_recursive(msg_bubble, LV_ANIM_ON);
-    }
+    // Auto-scroll to the new message
+    lv_obj_scroll_to_view_recursive(row.row, LV_ANIM_ON);
     
     // Store reference to the latest message label
-    chat_message_label_ = msg_text;
+    chat_message_label_ = row.text;
 }
 #else
 void LcdDisplay::SetupUI() {
@@ -636,7 +640,7 @@ void LcdDisplay::SetupUI() {
 }
 #endif
 
-void LcdDisplay::SetEmotion(const char* emotion) {
+void LcdDisplay::ApplyEmotion(const char* emotion) {
     struct Emotion {
         const char* icon;
         const char* text;
@@ -671,7 +675,6 @@ void LcdDisplay::SetEmotion(const char* emotion) {
     auto it = std::find_if(emotions.begin(), emotions.end(),
         [&emotion_view](const Emotion& e) { return e.text == emotion_view; });
 
-    DisplayLockGuard lock(this);
     if (emotion_label_ == nullptr) {
         return;
     }
@@ -685,8 +688,7 @@ void LcdDisplay::SetEmotion(const char* emotion) {
     }
 }
 
-void LcdDisplay::SetIcon(const char* icon) {
-    DisplayLockGuard lock(this);
+void LcdDisplay::ApplyIcon(const char* icon) {
     if (emotion_label_ == nullptr) {
         return;
     }
@@ -753,118 +755,8 @@ void LcdDisplay::SetTheme(const std::string& theme_name) {
         
         // If we have the chat message style, update all message bubbles
 #if CONFIG_USE_WECHAT_MESSAGE_STYLE
-        // Iterate through all children of content (message containers or bubbles)
-        uint32_t child_count = lv_obj_get_child_cnt(content_);
-        for (uint32_t i = 0; i < child_count; i++) {
-            lv_obj_t* obj = lv_obj_get_child(content_, i);
-            if (obj == nullptr) continue;
-            
-            lv_obj_t* bubble = nullptr;
-            
-            // 检查这个对象是容器还是气泡
-            // 如果是容器（用户或系统消息），则获取其子对象作为气泡
-            // 如果是气泡（助手消息），则直接使用
-            if (lv_obj_get_child_cnt(obj) > 0) {
-                // 可能是容器，检查它是否为用户或系统消息容器
-                // 用户和系统消息容器是透明的
-                lv_opa_t bg_opa = lv_obj_get_style_bg_opa(obj, 0);
-                if (bg_opa == LV_OPA_TRANSP) {
-                    // 这是用户或系统消息的容器
-                    bubble = lv_obj_get_child(obj, 0);
-                } else {
-                    // 这可能是助手消息的气泡自身
-                    bubble = obj;
-                }
-            } else {
-                // 没有子元素，可能是其他UI元素，跳过
-                continue;
-            }
-            
-            if (bubble == nullptr) continue;
-            
-            // 使用保存的用户数据来识别气泡类型
-            void* bubble_type_ptr = lv_obj_get_user_data(bubble);
-            if (bubble_type_ptr != nullptr) {
-                const char* bubble_type = static_cast<const char*>(bubble_type_ptr);
-                
-                // 根据气泡类型应用正确的颜色
-                if (strcmp(bubble_type, "user") == 0) {
-                    lv_obj_set_style_bg_color(bubble, current_theme.user_bubble, 0);
-                } else if (strcmp(bubble_type, "assistant") == 0) {
-                    lv_obj_set_style_bg_color(bubble, current_theme.assistant_bubble, 0); 
-                } else if (strcmp(bubble_type, "system") == 0) {
-                    lv_obj_set_style_bg_color(bubble, current_theme.system_bubble, 0);
-                }
-                
-                // Update border color
-                lv_obj_set_style_border_color(bubble, current_theme.border, 0);
-                
-                // Update text color for the message
-                if (lv_obj_get_child_cnt(bubble) > 0) {
-                    lv_obj_t* text = lv_obj_get_child(bubble, 0);
-                    if (text != nullptr) {
-                        // 根据气泡类型设置文本颜色
-                        if (strcmp(bubble_type, "system") == 0) {
-                            lv_obj_set_style_text_color(text, current_theme.system_text, 0);
-                        } else {
-                            lv_obj_set_style_text_color(text, current_theme.text, 0);
-                        }
-                    }
-                }
-            } else {
-                // 如果没有标记，回退到之前的逻辑（颜色比较）
-                // ...保留原有的回退逻辑...
-                lv_color_t bg_color = lv_obj_get_style_bg_color(bubble, 0);
-            
-                // 改进bubble类型检测逻辑，不仅使用颜色比较
-                bool is_user_bubble = false;
-                bool is_assistant_bubble = false;
-                bool is_system_bubble = false;
-            
-                // 检查用户bubble
-                if (lv_color_eq(bg_color, DARK_USER_BUBBLE_COLOR) || 
-                    lv_color_eq(bg_color, LIGHT_USER_BUBBLE_COLOR) ||
-                    lv_color_eq(bg_color, current_theme.user_bubble)) {
-                    is_user_bubble = true;
-                }
-                // 检查系统bubble
-                else if (lv_color_eq(bg_color, DARK_SYSTEM_BUBBLE_COLOR) || 
-                         lv_color_eq(bg_color, LIGHT_SYSTEM_BUBBLE_COLOR) ||
-                         lv_color_eq(bg_color, current_theme.system_bubble)) {
-                    is_system_bubble = true;
-                }
-                // 剩余的都当作助手bubble处理
-                else {
-                    is_assistant_bubble = true;
-                }
-            
-                // 根据bubble类型应用正确的颜色
-                if (is_user_bubble) {
-                    lv_obj_set_style_bg_color(bubble, current_theme.user_bubble, 0);
-                } else if (is_assistant_bubble) {
-                    lv_obj_set_style_bg_color(bubble, current_theme.assistant_bubble, 0);
-                } else if (is_system_bubble) {
-                    lv_obj_set_style_bg_color(bubble, current_theme.system_bubble, 0);
-                }
-                
-                // Update border color
-                lv_obj_set_style_border_color(bubble, current_theme.border, 0);
-                
-                // Update text color for the message
-                if (lv_obj_get_child_cnt(bubble) > 0) {
-                    lv_obj_t* text = lv_obj_get_child(bubble, 0);
-                    if (text != nullptr) {
-                        // 回退到颜色检测逻辑
-                        if (lv_color_eq(bg_color, current_theme.system_bubble) ||
-                            lv_color_eq(bg_color, DARK_SYSTEM_BUBBLE_COLOR) || 
-                            lv_color_eq(bg_color, LIGHT_SYSTEM_BUBBLE_COLOR)) {
-                            lv_obj_set_style_text_color(text, current_theme.system_text, 0);
-                        } else {
-                            lv_obj_set_style_text_color(text, current_theme.text, 0);
-                        }
-                    }
-                }
-            }
+        for (size_t i = 0; i < chat_row_count_; i++) {
+            StyleChatRow(chat_rows_[i]);
         }
 #else
         // Simple UI mode - just update the main chat message
@@ -2,13 +2,33 @@
 #define LCD_DISPLAY_H
 
 #include "display.h"
+#include "partition_font.h"
 
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
+#include <esp_lvgl_port.h>
 #include <font_emoji.h>
 
 #include <atomic>
 
+// LVGL 刷新方式
+enum LcdRenderMode {
+    kLcdRenderPartial,  // Only invalidated areas are rendered and flushed, through draw buffers
+    kLcdRenderFull,     // Screen sized buffers, the whole screen is flushed every frame
+    kLcdRenderDirect,   // Screen sized buffers, LVGL renders dirty areas in place (RGB frame buffers)
+};
+
+// 绘制缓冲区配置, 板级 config.h 决定
+struct LcdRenderConfig {
+    LcdRenderMode mode = kLcdRenderPartial;
+    int buffer_lines = 10;          // Lines per draw buffer in partial mode
+    bool double_buffer = false;     // Render into one buffer while the other is being flushed
+    bool buffer_in_psram = false;   // Saves internal RAM, SPI then copies through a DMA bounce buffer
+};
+
+// 聊天记录保留的消息数, 超出后复用最早的气泡
+#define LCD_CHAT_HISTORY_SIZE 20
+
 class LcdDisplay : public Display {
 protected:
     esp_lcd_panel_io_handle_t panel_io_ = nullptr;
@@ -21,23 +41,50 @@ protected:
     lv_obj_t* side_bar_ = nullptr;
 
     DisplayFonts fonts_;
+    PartitionFont* partition_font_ = nullptr;
+
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+    enum ChatRole {
+        kChatRoleUser,
+        kChatRoleAssistant,
+        kChatRoleSystem,
+    };
+
+    // A full width row holding one bubble, allocated once and then recycled oldest first
+    struct ChatRow {
+        lv_obj_t* row = nullptr;
+        lv_obj_t* bubble = nullptr;
+        lv_obj_t* text = nullptr;
+        ChatRole role = kChatRoleAssistant;
+    };
+
+    ChatRow chat_rows_[LCD_CHAT_HISTORY_SIZE];
+    size_t chat_row_count_ = 0;
+    size_t oldest_chat_row_ = 0;
+
+    ChatRow& NextChatRow();
+    void StyleChatRow(ChatRow& row);
+#endif
 
     void SetupUI();
+    virtual void ApplyEmotion(const char* emotion) override;
+    virtual void ApplyIcon(const char* icon) override;
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+    virtual void ApplyChatMessage(const char* role, const char* content) override;
+    virtual size_t chat_history_size() const override { return LCD_CHAT_HISTORY_SIZE; }
+#endif
+    // Clears the panel with large DMA transfers, only before LVGL owns the panel
+    void FillPanel(lv_color_t color, bool swap_bytes);
+    void ApplyRenderConfig(lvgl_port_display_cfg_t& display_cfg, const LcdRenderConfig& render);
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
 
 protected:
     // 添加protected构造函数
-    LcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel, DisplayFonts fonts)
-        : panel_io_(panel_io), panel_(panel), fonts_(fonts) {}
+    LcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel, DisplayFonts fonts);
     
 public:
     ~LcdDisplay();
-    virtual void SetEmotion(const char* emotion) override;
-    virtual void SetIcon(const char* icon) override;
-#if CONFIG_USE_WECHAT_MESSAGE_STYLE
-    virtual void SetChatMessage(const char* role, const char* content) override; 
-#endif  
 
     // Add theme switching function
     virtual void SetTheme(const std::string& theme_name) override;
@@ -49,7 +96,8 @@ public:
     RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                   int width, int height, int offset_x, int offset_y,
                   bool mirror_x, bool mirror_y, bool swap_xy,
-                  DisplayFonts fonts);
+                  DisplayFonts fonts,
+                  LcdRenderConfig render = {.mode = kLcdRenderDirect, .double_buffer = true});
 };
 
 // MIPI LCD显示器
@@ -64,10 +112,11 @@ public:
 // // SPI LCD显示器
 class SpiLcdDisplay : public LcdDisplay {
 public:
+    // Direct mode is not supported over SPI and falls back to partial
     SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                   int width, int height, int offset_x, int offset_y,
                   bool mirror_x, bool mirror_y, bool swap_xy,
-                  DisplayFonts fonts);
+                  DisplayFonts fonts, LcdRenderConfig render = {});
 };
 
 // QSPI LCD显示器
@@ -1,9 +1,11 @@
 #include "oled_display.h"
 #include "font_awesome_symbols.h"
 #include "assets/lang_config.h"
+#include "task_topology.h"
 
 #include <string>
 #include <algorithm>
+#include <cstring>
 
 #include <esp_log.h>
 #include <esp_err.h>
@@ -11,6 +13,11 @@
 
 #define TAG "OledDisplay"
 
+// LVGL 合并这段时间内的所有界面变化再刷新一次, 减少 I2C 总线占用
+#ifndef OLED_REFRESH_PERIOD_MS
+#define OLED_REFRESH_PERIOD_MS 100
+#endif
+
 LV_FONT_DECLARE(font_awesome_30_1);
 
 OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
@@ -21,7 +28,9 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
 
     ESP_LOGI(TAG, "Initialize LVGL");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
+    port_cfg.task_priority = TASK_LVGL_PRIORITY;
+    port_cfg.task_stack = TASK_LVGL_STACK_SIZE;
+    port_cfg.task_affinity = TASK_CORE(TASK_LVGL_CORE);
     port_cfg.timer_period_ms = 50;
     lvgl_port_init(&port_cfg);
 
@@ -56,11 +65,24 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
         return;
     }
 
+    // The port renders monochrome panels in full mode and sends the whole frame on every
+    // refresh. Take the flush over and send only the 8 row pages that changed, so a status
+    // text update does not hold the I2C bus the codec control interface may share.
+    pages_.resize(width_ * height_ / 8);
+    shown_.resize(pages_.size());
+    {
+        DisplayLockGuard lock(this);
+        lv_display_set_user_data(display_, this);
+        lv_display_set_flush_cb(display_, FlushCallback);
+        lv_timer_set_period(lv_display_get_refr_timer(display_), OLED_REFRESH_PERIOD_MS);
+    }
+
     if (height_ == 64) {
         SetupUI_128x64();
     } else {
         SetupUI_128x32();
     }
+    StartCommandTimer();
 }
 
 OledDisplay::~OledDisplay() {
@@ -86,6 +108,45 @@ OledDisplay::~OledDisplay() {
     lvgl_port_deinit();
 }
 
+// Runs on the LVGL task, the frame is complete since the render mode is full
+void OledDisplay::FlushCallback(lv_display_t* display, const lv_area_t* area, uint8_t* px_map) {
+    auto self = (OledDisplay*)lv_display_get_user_data(display);
+    self->FlushDirtyPages(px_map);
+    lv_display_flush_ready(display);
+}
+
+void OledDisplay::FlushDirtyPages(const uint8_t* px_map) {
+    // I1 frame: 8 byte palette, then rows of width / 8 bytes, most significant bit first.
+    // The panel wants one byte per column holding 8 rows, a set bit is a lit pixel.
+    const uint8_t* src = px_map + 8;
+    int stride = width_ / 8;
+    std::fill(pages_.begin(), pages_.end(), 0);
+    for (int y = 0; y < height_; y++) {
+        const uint8_t* row = src + stride * y;
+        uint8_t* page = pages_.data() + width_ * (y / 8);
+        uint8_t bit = 1 << (y % 8);
+        for (int x = 0; x < width_; x++) {
+            if (!(row[x / 8] & (0x80 >> (x % 8)))) {
+                page[x] |= bit;
+            }
+        }
+    }
+
+    // One transfer per page, the SH1106 cannot wrap a transfer into the next page
+    int count = 0;
+    for (int page = 0; page < height_ / 8; page++) {
+        size_t offset = width_ * page;
+        if (shown_valid_ && memcmp(pages_.data() + offset, shown_.data() + offset, width_) == 0) {
+            continue;
+        }
+        esp_lcd_panel_draw_bitmap(panel_, 0, page * 8, width_, page * 8 + 8, pages_.data() + offset);
+        memcpy(shown_.data() + offset, pages_.data() + offset, width_);
+        count++;
+    }
+    shown_valid_ = true;
+    ESP_LOGD(TAG, "Flushed %d of %d pages", count, height_ / 8);
+}
+
 bool OledDisplay::Lock(int timeout_ms) {
     return lvgl_port_lock(timeout_ms);
 }
@@ -94,8 +155,7 @@ void OledDisplay::Unlock() {
     lvgl_port_unlock();
 }
 
-void OledDisplay::SetChatMessage(const char* role, const char* content) {
-    DisplayLockGuard lock(this);
+void OledDisplay::ApplyChatMessage(const char* role, const char* content) {
     if (chat_message_label_ == nullptr) {
         return;
     }
@@ -6,6 +6,8 @@
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
 
+#include <vector>
+
 class OledDisplay : public Display {
 private:
     esp_lcd_panel_io_handle_t panel_io_ = nullptr;
@@ -20,18 +22,26 @@ private:
 
     DisplayFonts fonts_;
 
+    // Frame in the panel's page layout, and what the panel shows now
+    std::vector<uint8_t> pages_;
+    std::vector<uint8_t> shown_;
+    bool shown_valid_ = false;
+
+    static void FlushCallback(lv_display_t* display, const lv_area_t* area, uint8_t* px_map);
+    void FlushDirtyPages(const uint8_t* px_map);
+
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
 
     void SetupUI_128x64();
     void SetupUI_128x32();
 
+    virtual void ApplyChatMessage(const char* role, const char* content) override;
+
 public:
     OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel, int width, int height, bool mirror_x, bool mirror_y,
                 DisplayFonts fonts);
     ~OledDisplay();
-
-    virtual void SetChatMessage(const char* role, const char* content) override;
 };
 
 #endif // OLED_DISPLAY_H
@@ -0,0 +1,205 @@
+#include "partition_font.h"
+#include "memory_arena.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "PartitionFont"
+
+// 缓存槽位数量范围
+#define PARTITION_FONT_MIN_SLOTS 16
+#define PARTITION_FONT_MAX_SLOTS 4096
+
+PartitionFont* PartitionFont::Load(const char* partition_label, size_t cache_size, const lv_font_t* fallback) {
+    auto partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (partition == nullptr) {
+        ESP_LOGI(TAG, "No %s partition", partition_label);
+        return nullptr;
+    }
+    return Load(partition, 0, partition->size, cache_size, fallback);
+}
+
+PartitionFont* PartitionFont::Load(const esp_partition_t* partition, size_t offset, size_t size, size_t cache_size,
+    const lv_font_t* fallback) {
+    PartitionFontHeader header;
+    if (size < sizeof(header) || offset + size > partition->size ||
+        esp_partition_read(partition, offset, &header, sizeof(header)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read the font header");
+        return nullptr;
+    }
+    if (header.magic != PARTITION_FONT_MAGIC || header.version != PARTITION_FONT_VERSION || header.bpp != 4) {
+        ESP_LOGW(TAG, "No valid font in the %s partition", partition->label);
+        return nullptr;
+    }
+    if (header.glyph_count == 0 || header.index_offset + header.glyph_count * sizeof(PartitionFontGlyph) > size
+        || header.bitmap_offset > size) {
+        ESP_LOGE(TAG, "Font header out of range");
+        return nullptr;
+    }
+
+    auto font = new PartitionFont(partition, offset, header);
+    if (!font->Initialize(cache_size, fallback)) {
+        delete font;
+        return nullptr;
+    }
+    ESP_LOGI(TAG, "Loaded %lu glyphs, line height %u, %u cache slots", header.glyph_count, header.line_height,
+        font->slot_count_);
+    return font;
+}
+
+PartitionFont::PartitionFont(const esp_partition_t* partition, size_t offset, const PartitionFontHeader& header)
+    : partition_(partition), offset_(offset), header_(header) {
+}
+
+PartitionFont::~PartitionFont() {
+    auto& arenas = MemoryArenas::GetInstance();
+    arenas.Free(glyphs_);
+    arenas.Free(cache_data_);
+    arenas.Free(slots_);
+}
+
+bool PartitionFont::Initialize(size_t cache_size, const lv_font_t* fallback) {
+    size_t index_size = header_.glyph_count * sizeof(PartitionFontGlyph);
+    auto& arenas = MemoryArenas::GetInstance();
+    glyphs_ = (PartitionFontGlyph*)arenas.Allocate(kArenaDisplay, index_size);
+    if (glyphs_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the glyph index (%u bytes)", index_size);
+        return false;
+    }
+    if (esp_partition_read(partition_, offset_ + header_.index_offset, glyphs_, index_size) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read the glyph index");
+        return false;
+    }
+
+    // Every slot holds the largest glyph, so a slot can be reused for any glyph
+    slot_size_ = std::max<size_t>(1, ((header_.max_box_w + 1) / 2) * header_.max_box_h);
+    size_t slots = std::clamp<size_t>(cache_size / slot_size_, PARTITION_FONT_MIN_SLOTS, PARTITION_FONT_MAX_SLOTS);
+    slot_count_ = std::min<size_t>(slots, header_.glyph_count);
+    cache_data_ = (uint8_t*)arenas.Allocate(kArenaDisplay, slot_count_ * slot_size_);
+    slots_ = (CacheSlot*)arenas.Allocate(kArenaDisplay, slot_count_ * sizeof(CacheSlot));
+    if (cache_data_ == nullptr || slots_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the glyph cache");
+        return false;
+    }
+    for (uint16_t i = 0; i < slot_count_; i++) {
+        slots_[i].glyph = UINT32_MAX;
+        slots_[i].prev = (i + slot_count_ - 1) % slot_count_;
+        slots_[i].next = (i + 1) % slot_count_;
+    }
+    lru_head_ = 0;
+    cache_index_.reserve(slot_count_);
+
+    font_.get_glyph_dsc = GetGlyphDsc;
+    font_.get_glyph_bitmap = GetGlyphBitmap;
+    font_.release_glyph = nullptr;
+    font_.line_height = header_.line_height;
+    font_.base_line = header_.base_line;
+    font_.subpx = LV_FONT_SUBPX_NONE;
+    font_.underline_position = header_.underline_position;
+    font_.underline_thickness = header_.underline_thickness;
+    font_.dsc = this;
+    font_.fallback = fallback;
+    return true;
+}
+
+const PartitionFontGlyph* PartitionFont::FindGlyph(uint32_t codepoint) const {
+    auto end = glyphs_ + header_.glyph_count;
+    auto it = std::lower_bound(glyphs_, end, codepoint, [](const PartitionFontGlyph& glyph, uint32_t value) {
+        return glyph.codepoint < value;
+    });
+    if (it == end || it->codepoint != codepoint) {
+        return nullptr;
+    }
+    return it;
+}
+
+void PartitionFont::MoveToFront(uint16_t slot) {
+    if (slot == lru_head_) {
+        return;
+    }
+    // Unlink, then insert before the current head
+    slots_[slots_[slot].prev].next = slots_[slot].next;
+    slots_[slots_[slot].next].prev = slots_[slot].prev;
+    uint16_t tail = slots_[lru_head_].prev;
+    slots_[slot].prev = tail;
+    slots_[slot].next = lru_head_;
+    slots_[tail].next = slot;
+    slots_[lru_head_].prev = slot;
+    lru_head_ = slot;
+}
+
+const uint8_t* PartitionFont::GetBitmap(uint32_t glyph) {
+    auto it = cache_index_.find(glyph);
+    if (it != cache_index_.end()) {
+        cache_hits_++;
+        MoveToFront(it->second);
+        return cache_data_ + it->second * slot_size_;
+    }
+
+    // Evict the least recently used slot
+    cache_misses_++;
+    uint16_t slot = slots_[lru_head_].prev;
+    if (slots_[slot].glyph != UINT32_MAX) {
+        cache_index_.erase(slots_[slot].glyph);
+        slots_[slot].glyph = UINT32_MAX;
+    }
+
+    auto& entry = glyphs_[glyph];
+    size_t size = ((entry.box_w + 1) / 2) * entry.box_h;
+    uint8_t* bitmap = cache_data_ + slot * slot_size_;
+    if (size > slot_size_ ||
+        esp_partition_read(partition_, offset_ + header_.bitmap_offset + entry.bitmap_offset, bitmap, size) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read glyph U+%04lX", entry.codepoint);
+        return nullptr;
+    }
+    slots_[slot].glyph = glyph;
+    cache_index_[glyph] = slot;
+    MoveToFront(slot);
+    return bitmap;
+}
+
+bool PartitionFont::GetGlyphDsc(const lv_font_t* font, lv_font_glyph_dsc_t* dsc, uint32_t letter, uint32_t letter_next) {
+    auto self = static_cast<const PartitionFont*>(font->dsc);
+    auto glyph = self->FindGlyph(letter);
+    if (glyph == nullptr) {
+        // LVGL tries the fallback font next
+        return false;
+    }
+    dsc->adv_w = glyph->adv_w;
+    dsc->box_w = glyph->box_w;
+    dsc->box_h = glyph->box_h;
+    dsc->ofs_x = glyph->ofs_x;
+    dsc->ofs_y = glyph->ofs_y;
+    dsc->format = LV_FONT_GLYPH_FORMAT_A4;
+    dsc->is_placeholder = false;
+    dsc->gid.index = glyph - self->glyphs_;
+    return true;
+}
+
+const void* PartitionFont::GetGlyphBitmap(lv_font_glyph_dsc_t* dsc, lv_draw_buf_t* draw_buf) {
+    auto self = const_cast<PartitionFont*>(static_cast<const PartitionFont*>(dsc->resolved_font->dsc));
+    if (draw_buf == nullptr) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    const uint8_t* bitmap = self->GetBitmap(dsc->gid.index);
+    if (bitmap == nullptr) {
+        return nullptr;
+    }
+
+    // Expand 4 bpp, high nibble first, to the A8 buffer LVGL renders from
+    int width = dsc->box_w;
+    int src_stride = (width + 1) / 2;
+    uint32_t dst_stride = draw_buf->header.stride;
+    for (int y = 0; y < dsc->box_h; y++) {
+        const uint8_t* src = bitmap + y * src_stride;
+        uint8_t* dst = draw_buf->data + y * dst_stride;
+        for (int x = 0; x < width; x++) {
+            uint8_t value = (x & 1) ? (src[x / 2] & 0x0F) : (src[x / 2] >> 4);
+            dst[x] = value * 17;
+        }
+    }
+    return draw_buf;
+}
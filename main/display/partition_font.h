@@ -0,0 +1,96 @@
+#ifndef PARTITION_FONT_H
+#define PARTITION_FONT_H
+
+#include <lvgl.h>
+#include <esp_partition.h>
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#define PARTITION_FONT_MAGIC 0x54465a58  // "XZFT"
+#define PARTITION_FONT_VERSION 1
+
+// Layout written by scripts/Font_Converter/font_to_partition.py, all little endian
+struct PartitionFontHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t bpp;                    // Only 4 is supported
+    uint8_t reserved;
+    uint16_t line_height;
+    int16_t base_line;
+    int16_t underline_position;
+    uint16_t underline_thickness;
+    uint16_t max_box_w;
+    uint16_t max_box_h;
+    uint32_t glyph_count;
+    uint32_t index_offset;          // Glyphs sorted by code point
+    uint32_t bitmap_offset;
+} __attribute__((packed));
+
+struct PartitionFontGlyph {
+    uint32_t codepoint;
+    uint32_t bitmap_offset;         // From the header's bitmap_offset, rows are byte aligned
+    uint16_t adv_w;
+    uint8_t box_w;
+    uint8_t box_h;
+    int8_t ofs_x;
+    int8_t ofs_y;
+    uint16_t reserved;
+} __attribute__((packed));
+
+// A font read from a flash partition instead of being linked into the app. The glyph index
+// is loaded into PSRAM once, bitmaps are read on first use and kept in an LRU cache.
+class PartitionFont {
+public:
+    // Returns nullptr if the partition is missing or holds no valid font.
+    // Glyphs the partition doesn't have are drawn with `fallback`.
+    static PartitionFont* Load(const char* partition_label, size_t cache_size, const lv_font_t* fallback);
+    // A font stored at `offset` inside another partition, e.g. an entry of the asset store
+    static PartitionFont* Load(const esp_partition_t* partition, size_t offset, size_t size, size_t cache_size,
+        const lv_font_t* fallback);
+    ~PartitionFont();
+
+    PartitionFont(const PartitionFont&) = delete;
+    PartitionFont& operator=(const PartitionFont&) = delete;
+
+    inline const lv_font_t* font() const { return &font_; }
+    inline uint32_t cache_hits() const { return cache_hits_; }
+    inline uint32_t cache_misses() const { return cache_misses_; }
+
+private:
+    // Cache slots form a doubly linked list, most recently used first
+    struct CacheSlot {
+        uint32_t glyph = UINT32_MAX;
+        uint16_t prev = 0;
+        uint16_t next = 0;
+    };
+
+    const esp_partition_t* partition_;
+    size_t offset_;
+    PartitionFontHeader header_;
+    PartitionFontGlyph* glyphs_ = nullptr;
+    lv_font_t font_ = {};
+
+    std::mutex mutex_;
+    uint8_t* cache_data_ = nullptr;
+    size_t slot_size_ = 0;
+    uint16_t slot_count_ = 0;
+    CacheSlot* slots_ = nullptr;
+    uint16_t lru_head_ = 0;
+    std::unordered_map<uint32_t, uint16_t> cache_index_;
+    uint32_t cache_hits_ = 0;
+    uint32_t cache_misses_ = 0;
+
+    PartitionFont(const esp_partition_t* partition, size_t offset, const PartitionFontHeader& header);
+    bool Initialize(size_t cache_size, const lv_font_t* fallback);
+
+    const PartitionFontGlyph* FindGlyph(uint32_t codepoint) const;
+    const uint8_t* GetBitmap(uint32_t glyph);
+    void MoveToFront(uint16_t slot);
+
+    static bool GetGlyphDsc(const lv_font_t* font, lv_font_glyph_dsc_t* dsc, uint32_t letter, uint32_t letter_next);
+    static const void* GetGlyphBitmap(lv_font_glyph_dsc_t* dsc, lv_draw_buf_t* draw_buf);
+};
+
+#endif // PARTITION_FONT_H
@@ -0,0 +1,111 @@
+#include "encoder_tuner.h"
+#include "board.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+
+#define TAG "EncoderTuner"
+
+// 每个统计窗口的时长
+#define ENCODER_TUNER_WINDOW_MS 3000
+// 编码耗时占帧时长的比例 (%)
+#define ENCODER_TUNER_HIGH_LOAD 50
+#define ENCODER_TUNER_LOW_LOAD 20
+#define ENCODER_TUNER_COOLDOWN_WINDOWS 3
+// RSSI (dBm)
+#define ENCODER_TUNER_WEAK_SIGNAL -75
+#define ENCODER_TUNER_GOOD_SIGNAL -65
+
+void EncoderTuner::Configure(OpusEncoderWrapper* encoder, int complexity, int min_complexity, int max_complexity) {
+    encoder_ = encoder;
+    min_complexity_ = min_complexity;
+    max_complexity_ = max_complexity;
+    complexity_ = -1;
+    SetComplexity(complexity);
+    dtx_ = false;
+    encoder_->SetDtx(false);
+    Reset();
+}
+
+void EncoderTuner::SetEncoder(OpusEncoderWrapper* encoder) {
+    encoder_ = encoder;
+    encoder_->SetComplexity(complexity_);
+    encoder_->SetDtx(dtx_);
+    Reset();
+}
+
+void EncoderTuner::Reset() {
+    frames_ = 0;
+    dropped_ = 0;
+    encode_us_ = 0;
+}
+
+void EncoderTuner::OnFrameEncoded(int64_t encode_us) {
+    frames_++;
+    encode_us_ += encode_us;
+    if ((frames_ + dropped_) * encoder_->duration_ms() >= ENCODER_TUNER_WINDOW_MS) {
+        Adapt();
+    }
+}
+
+void EncoderTuner::OnFrameDropped() {
+    dropped_++;
+    if ((frames_ + dropped_) * encoder_->duration_ms() >= ENCODER_TUNER_WINDOW_MS) {
+        Adapt();
+    }
+}
+
+void EncoderTuner::Adapt() {
+    if (encoder_ == nullptr) {
+        return;
+    }
+    int64_t window_us = (int64_t)frames_ * encoder_->duration_ms() * 1000;
+    int load = window_us > 0 ? encode_us_ * 100 / window_us : 0;
+    int rssi = 0;
+    bool has_signal = Board::GetInstance().GetSignalStrength(rssi);
+    bool weak_signal = has_signal && rssi < ENCODER_TUNER_WEAK_SIGNAL;
+
+    if (dropped_ > 0 || load >= ENCODER_TUNER_HIGH_LOAD) {
+        SetComplexity(complexity_ - 2);
+        cooldown_ = ENCODER_TUNER_COOLDOWN_WINDOWS;
+    } else if (cooldown_ > 0) {
+        cooldown_--;
+    } else if (load < ENCODER_TUNER_LOW_LOAD && !weak_signal) {
+        SetComplexity(complexity_ + 1);
+    }
+
+    // DTX goes on at once and only off after a few clean windows
+    if (dropped_ > 0 || weak_signal) {
+        clean_windows_ = 0;
+        SetDtx(true);
+    } else if (!has_signal || rssi >= ENCODER_TUNER_GOOD_SIGNAL) {
+        if (++clean_windows_ >= ENCODER_TUNER_COOLDOWN_WINDOWS) {
+            SetDtx(false);
+        }
+    }
+
+    ESP_LOGD(TAG, "Load %d%%, dropped %d, rssi %d, complexity %d, dtx %d", load, dropped_, rssi, complexity_, dtx_);
+    Reset();
+}
+
+void EncoderTuner::SetComplexity(int complexity) {
+    complexity = std::clamp(complexity, min_complexity_, max_complexity_);
+    if (complexity == complexity_) {
+        return;
+    }
+    if (complexity_ >= 0) {
+        ESP_LOGI(TAG, "Opus encoder complexity %d -> %d", complexity_, complexity);
+    }
+    complexity_ = complexity;
+    encoder_->SetComplexity(complexity);
+}
+
+void EncoderTuner::SetDtx(bool enable) {
+    if (enable == dtx_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Opus encoder DTX %s", enable ? "on" : "off");
+    dtx_ = enable;
+    encoder_->SetDtx(enable);
+}
@@ -0,0 +1,41 @@
+#ifndef ENCODER_TUNER_H
+#define ENCODER_TUNER_H
+
+#include <opus_encoder.h>
+
+#include <cstdint>
+
+// Adjusts the uplink opus encoder from the measured encode time, dropped frames and the
+// signal strength. Lowers the complexity at once under load and raises it slowly when idle,
+// DTX is switched on while the link is weak. Only used on the task that encodes.
+class EncoderTuner {
+public:
+    void Configure(OpusEncoderWrapper* encoder, int complexity, int min_complexity, int max_complexity);
+    // Keeps the current complexity and DTX on a rebuilt encoder
+    void SetEncoder(OpusEncoderWrapper* encoder);
+    void OnFrameEncoded(int64_t encode_us);
+    void OnFrameDropped();
+    void Reset();
+
+    int complexity() const { return complexity_; }
+
+private:
+    OpusEncoderWrapper* encoder_ = nullptr;
+    int complexity_ = 0;
+    int min_complexity_ = 0;
+    int max_complexity_ = 0;
+    bool dtx_ = false;
+
+    int frames_ = 0;
+    int dropped_ = 0;
+    int64_t encode_us_ = 0;
+    // Windows to wait before raising the complexity again
+    int cooldown_ = 0;
+    int clean_windows_ = 0;
+
+    void Adapt();
+    void SetComplexity(int complexity);
+    void SetDtx(bool enable);
+};
+
+#endif // ENCODER_TUNER_H
@@ -1,5 +1,4 @@
 #include "thing.h"
-#include "application.h"
 
 #include <esp_log.h>
 
@@ -8,16 +7,20 @@
 
 namespace iot {
 
-static std::map<std::string, std::function<Thing*()>>* thing_creators = nullptr;
+static std::unordered_map<std::string, std::function<Thing*()>>* thing_creators = nullptr;
 
 void RegisterThing(const std::string& type, std::function<Thing*()> creator) {
     if (thing_creators == nullptr) {
-        thing_creators = new std::map<std::string, std::function<Thing*()>>();
+        thing_creators = new std::unordered_map<std::string, std::function<Thing*()>>();
     }
     (*thing_creators)[type] = creator;
 }
 
 Thing* CreateThing(const std::string& type) {
+    if (thing_creators == nullptr) {
+        ESP_LOGE(TAG, "No thing types registered");
+        return nullptr;
+    }
     auto creator = thing_creators->find(type);
     if (creator == thing_creators->end()) {
         ESP_LOGE(TAG, "Thing type not found: %s", type.c_str());
@@ -36,6 +39,10 @@ std::string Thing::GetDescriptorJson() {
     return json_str;
 }
 
+bool Thing::RefreshState() {
+    return properties_.Refresh();
+}
+
 std::string Thing::GetStateJson() {
     std::string json_str = "{";
     json_str += "\"name\":\"" + name_ + "\",";
@@ -44,34 +51,54 @@ std::string Thing::GetStateJson() {
     return json_str;
 }
 
-void Thing::Invoke(const cJSON* command) {
+esp_err_t Thing::Parse(const cJSON* command, MethodCall& call) {
     auto method_name = cJSON_GetObjectItem(command, "method");
-    auto input_params = cJSON_GetObjectItem(command, "parameters");
+    if (!cJSON_IsString(method_name)) {
+        ESP_LOGE(TAG, "%s: command without method", name_.c_str());
+        return ESP_ERR_INVALID_ARG;
+    }
+    auto method = methods_.Find(method_name->valuestring);
+    if (method == nullptr) {
+        ESP_LOGE(TAG, "%s: method not found: %s", name_.c_str(), method_name->valuestring);
+        return ESP_ERR_NOT_FOUND;
+    }
 
-    try {
-        auto& method = methods_[method_name->valuestring];
-        for (auto& param : method.parameters()) {
-            auto input_param = cJSON_GetObjectItem(input_params, param.name().c_str());
-            if (param.required() && input_param == nullptr) {
-                throw std::runtime_error("Parameter " + param.name() + " is required");
-            }
-            if (param.type() == kValueTypeNumber) {
-                param.set_number(input_param->valueint);
-            } else if (param.type() == kValueTypeString) {
-                param.set_string(input_param->valuestring);
-            } else if (param.type() == kValueTypeBoolean) {
-                param.set_boolean(input_param->valueint == 1);
+    // The values go into a copy, the declared parameters are shared by every call of the method
+    ParameterList params = method->parameters();
+    auto input_params = cJSON_GetObjectItem(command, "parameters");
+    for (auto& param : params) {
+        auto input_param = cJSON_GetObjectItem(input_params, param.name().c_str());
+        if (input_param == nullptr) {
+            if (param.required()) {
+                ESP_LOGE(TAG, "%s.%s: parameter %s is required", name_.c_str(), method->name().c_str(), param.name().c_str());
+                return ESP_ERR_INVALID_ARG;
             }
+            continue;
+        }
+        if (param.type() == kValueTypeNumber && cJSON_IsNumber(input_param)) {
+            param.set_number(input_param->valueint);
+        } else if (param.type() == kValueTypeString && cJSON_IsString(input_param)) {
+            param.set_string(input_param->valuestring);
+        } else if (param.type() == kValueTypeBoolean && (cJSON_IsBool(input_param) || cJSON_IsNumber(input_param))) {
+            param.set_boolean(cJSON_IsTrue(input_param) || input_param->valueint == 1);
+        } else {
+            ESP_LOGE(TAG, "%s.%s: parameter %s has the wrong type", name_.c_str(), method->name().c_str(), param.name().c_str());
+            return ESP_ERR_INVALID_ARG;
         }
-
-        Application::GetInstance().Schedule([&method]() {
-            method.Invoke();
-        });
-    } catch (const std::runtime_error& e) {
-        ESP_LOGE(TAG, "Method not found: %s", method_name->valuestring);
-        return;
     }
+
+    call.method = method;
+    call.parameters = std::move(params);
+    return ESP_OK;
 }
 
+esp_err_t Thing::Invoke(const cJSON* command) {
+    MethodCall call;
+    auto err = Parse(command, call);
+    if (err == ESP_OK) {
+        call.Invoke();
+    }
+    return err;
+}
 
 } // namespace iot
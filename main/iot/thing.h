@@ -2,10 +2,11 @@
 #define THING_H
 
 #include <string>
-#include <map>
 #include <functional>
 #include <vector>
-#include <stdexcept>
+#include <unordered_map>
+#include <esp_err.h>
+#include <esp_log.h>
 #include <cJSON.h>
 
 namespace iot {
@@ -25,6 +26,12 @@ private:
     std::function<int()> number_getter_;
     std::function<std::string()> string_getter_;
 
+    // 最近一次读取的值, 用于判断状态是否变化
+    bool boolean_value_ = false;
+    int number_value_ = 0;
+    std::string string_value_;
+    bool has_value_ = false;
+
 public:
     Property(const std::string& name, const std::string& description, std::function<bool()> getter) :
         name_(name), description_(description), type_(kValueTypeBoolean), boolean_getter_(getter) {}
@@ -55,13 +62,36 @@ public:
         return json_str;
     }
 
+    // Reads the getter into the cached value, returns true if it differs from the previous read
+    bool Refresh() {
+        bool changed = !has_value_;
+        has_value_ = true;
+        if (type_ == kValueTypeBoolean) {
+            bool value = boolean_getter_();
+            changed = changed || value != boolean_value_;
+            boolean_value_ = value;
+        } else if (type_ == kValueTypeNumber) {
+            int value = number_getter_();
+            changed = changed || value != number_value_;
+            number_value_ = value;
+        } else if (type_ == kValueTypeString) {
+            std::string value = string_getter_();
+            if (changed || value != string_value_) {
+                changed = true;
+                string_value_ = std::move(value);
+            }
+        }
+        return changed;
+    }
+
+    // Serializes the value cached by the last Refresh()
     std::string GetStateJson() {
         if (type_ == kValueTypeBoolean) {
-            return boolean_getter_() ? "true" : "false";
+            return boolean_value_ ? "true" : "false";
         } else if (type_ == kValueTypeNumber) {
-            return std::to_string(number_getter_());
+            return std::to_string(number_value_);
         } else if (type_ == kValueTypeString) {
-            return "\"" + string_getter_() + "\"";
+            return "\"" + string_value_ + "\"";
         }
         return "null";
     }
@@ -70,28 +100,34 @@ public:
 class PropertyList {
 private:
     std::vector<Property> properties_;
+    std::unordered_map<std::string, size_t> index_;
 
 public:
     PropertyList() = default;
-    PropertyList(const std::vector<Property>& properties) : properties_(properties) {}
+    PropertyList(const std::vector<Property>& properties) {
+        for (auto& property : properties) {
+            AddProperty(property);
+        }
+    }
 
+    void AddProperty(const Property& property) {
+        index_[property.name()] = properties_.size();
+        properties_.push_back(property);
+    }
     void AddBooleanProperty(const std::string& name, const std::string& description, std::function<bool()> getter) {
-        properties_.push_back(Property(name, description, getter));
+        AddProperty(Property(name, description, getter));
     }
     void AddNumberProperty(const std::string& name, const std::string& description, std::function<int()> getter) {
-        properties_.push_back(Property(name, description, getter));
+        AddProperty(Property(name, description, getter));
     }
     void AddStringProperty(const std::string& name, const std::string& description, std::function<std::string()> getter) {
-        properties_.push_back(Property(name, description, getter));
+        AddProperty(Property(name, description, getter));
     }
 
-    const Property& operator[](const std::string& name) const {
-        for (auto& property : properties_) {
-            if (property.name() == name) {
-                return property;
-            }
-        }
-        throw std::runtime_error("Property not found: " + name);
+    // Returns nullptr if there is no such property
+    const Property* Find(const std::string& name) const {
+        auto it = index_.find(name);
+        return it != index_.end() ? &properties_[it->second] : nullptr;
     }
 
     std::string GetDescriptorJson() {
@@ -106,6 +142,15 @@ public:
         return json_str;
     }
 
+    // Refreshes every property, returns true if any of them changed
+    bool Refresh() {
+        bool changed = false;
+        for (auto& property : properties_) {
+            changed = property.Refresh() || changed;
+        }
+        return changed;
+    }
+
     std::string GetStateJson() {
         std::string json_str = "{";
         for (auto& property : properties_) {
@@ -125,8 +170,8 @@ private:
     std::string description_;
     ValueType type_;
     bool required_;
-    bool boolean_;
-    int number_;
+    bool boolean_ = false;
+    int number_ = 0;
     std::string string_;
 
 public:
@@ -172,18 +217,24 @@ public:
         parameters_.push_back(parameter);
     }
 
+    // Methods only have a few parameters, a linear scan beats hashing here.
+    // The names are the ones the method declared, a miss is a bug and reads as a zero value.
     const Parameter& operator[](const std::string& name) const {
+        static const Parameter missing("", "", kValueTypeString, false);
         for (auto& parameter : parameters_) {
             if (parameter.name() == name) {
                 return parameter;
             }
         }
-        throw std::runtime_error("Parameter not found: " + name);
+        ESP_LOGE("Thing", "Parameter not found: %s", name.c_str());
+        return missing;
     }
 
     // iterator
     auto begin() { return parameters_.begin(); }
     auto end() { return parameters_.end(); }
+    auto begin() const { return parameters_.begin(); }
+    auto end() const { return parameters_.end(); }
 
     std::string GetDescriptorJson() {
         std::string json_str = "{";
@@ -211,7 +262,8 @@ public:
 
     const std::string& name() const { return name_; }
     const std::string& description() const { return description_; }
-    ParameterList& parameters() { return parameters_; }
+    // The declared parameters, never written: each call gets its own copy with the values
+    const ParameterList& parameters() const { return parameters_; }
 
     std::string GetDescriptorJson() {
         std::string json_str = "{";
@@ -221,30 +273,44 @@ public:
         return json_str;
     }
 
-    void Invoke() {
-        callback_(parameters_);
+    void Invoke(const ParameterList& parameters) const {
+        callback_(parameters);
+    }
+};
+
+// A method with the parameter values of one command, parsed off the main loop and run on it
+struct MethodCall {
+    const Method* method = nullptr;
+    ParameterList parameters;
+
+    void Invoke() const {
+        method->Invoke(parameters);
     }
 };
 
 class MethodList {
 private:
     std::vector<Method> methods_;
+    std::unordered_map<std::string, size_t> index_;
 
 public:
     MethodList() = default;
-    MethodList(const std::vector<Method>& methods) : methods_(methods) {}
+    MethodList(const std::vector<Method>& methods) {
+        for (auto& method : methods) {
+            index_[method.name()] = methods_.size();
+            methods_.push_back(method);
+        }
+    }
 
     void AddMethod(const std::string& name, const std::string& description, const ParameterList& parameters, std::function<void(const ParameterList&)> callback) {
+        index_[name] = methods_.size();
         methods_.push_back(Method(name, description, parameters, callback));
     }
 
-    Method& operator[](const std::string& name) {
-        for (auto& method : methods_) {
-            if (method.name() == name) {
-                return method;
-            }
-        }
-        throw std::runtime_error("Method not found: " + name);
+    // Returns nullptr if there is no such method
+    Method* Find(const std::string& name) {
+        auto it = index_.find(name);
+        return it != index_.end() ? &methods_[it->second] : nullptr;
     }
 
     std::string GetDescriptorJson() {
@@ -267,8 +333,14 @@ public:
     virtual ~Thing() = default;
 
     virtual std::string GetDescriptorJson();
+    // Re-reads the properties, returns true if the state changed since the last refresh
+    virtual bool RefreshState();
+    // Serializes the state read by the last RefreshState()
     virtual std::string GetStateJson();
-    virtual void Invoke(const cJSON* command);
+    // ESP_ERR_NOT_FOUND for an unknown method, ESP_ERR_INVALID_ARG for missing or mistyped parameters
+    virtual esp_err_t Parse(const cJSON* command, MethodCall& call);
+    // Parses and runs the command at once, call it on the main loop
+    esp_err_t Invoke(const cJSON* command);
 
     const std::string& name() const { return name_; }
     const std::string& description() const { return description_; }
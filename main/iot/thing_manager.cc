@@ -1,16 +1,35 @@
 #include "thing_manager.h"
+#include "memory_arena.h"
 
 #include <esp_log.h>
+#include <cstring>
 
 #define TAG "ThingManager"
 
 namespace iot {
 
 void ThingManager::AddThing(Thing* thing) {
+    if (thing == nullptr) {
+        return;
+    }
     things_.push_back(thing);
+    things_by_name_[thing->name()] = thing;
+    ClearDescriptorsJson();
 }
 
-std::string ThingManager::GetDescriptorsJson() {
+void ThingManager::ClearDescriptorsJson() {
+    if (descriptors_json_ != nullptr) {
+        MemoryArenas::GetInstance().Free(descriptors_json_);
+        descriptors_json_ = nullptr;
+        descriptors_json_size_ = 0;
+    }
+}
+
+std::string_view ThingManager::GetDescriptorsJson() {
+    if (descriptors_json_ != nullptr) {
+        return std::string_view(descriptors_json_, descriptors_json_size_);
+    }
+
     std::string json_str = "[";
     for (auto& thing : things_) {
         json_str += thing->GetDescriptorJson() + ",";
@@ -19,45 +38,74 @@ std::string ThingManager::GetDescriptorsJson() {
         json_str.pop_back();
     }
     json_str += "]";
-    return json_str;
+
+    // 描述信息不会再变化, 放到 PSRAM 中节省内部 RAM
+    descriptors_json_ = (char*)MemoryArenas::GetInstance().Allocate(kArenaIot, json_str.size());
+    if (descriptors_json_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the descriptors", json_str.size());
+        return std::string_view();
+    }
+    memcpy(descriptors_json_, json_str.data(), json_str.size());
+    descriptors_json_size_ = json_str.size();
+    ESP_LOGI(TAG, "Cached %u bytes of descriptors", descriptors_json_size_);
+    return std::string_view(descriptors_json_, descriptors_json_size_);
 }
 
 bool ThingManager::GetStatesJson(std::string& json, bool delta) {
-    if (!delta) {
-        last_states_.clear();
-    }
+    // 逐个读取属性值并与上次的值比较, 只有发生变化的 thing 才会被序列化
     bool changed = false;
-    json = "[";
-    // 枚举thing，获取每个thing的state，如果发生变化，则更新，保存到last_states_
-    // 如果delta为true，则只返回变化的部分
     for (auto& thing : things_) {
-        std::string state = thing->GetStateJson();
-        if (delta) {
-            // 如果delta为true，则只返回变化的部分
-            auto it = last_states_.find(thing->name());
-            if (it != last_states_.end() && it->second == state) {
-                continue;
+        if (thing->RefreshState() || !delta) {
+            if (!changed) {
+                json = "[";
+                changed = true;
             }
-            changed = true;
-            last_states_[thing->name()] = state;
+            json += thing->GetStateJson() + ",";
         }
-        json += state + ",";
     }
-    if (json.back() == ',') {
-        json.pop_back();
+    if (!changed) {
+        return false;
     }
-    json += "]";
-    return changed;
+    json.back() = ']';
+    return true;
 }
 
-void ThingManager::Invoke(const cJSON* command) {
+esp_err_t ThingManager::Parse(const cJSON* command, MethodCall& call) {
     auto name = cJSON_GetObjectItem(command, "name");
-    for (auto& thing : things_) {
-        if (thing->name() == name->valuestring) {
-            thing->Invoke(command);
-            return;
+    if (!cJSON_IsString(name)) {
+        ESP_LOGE(TAG, "Command without thing name");
+        return ESP_ERR_INVALID_ARG;
+    }
+    auto it = things_by_name_.find(name->valuestring);
+    if (it == things_by_name_.end()) {
+        ESP_LOGE(TAG, "Thing not found: %s", name->valuestring);
+        return ESP_ERR_NOT_FOUND;
+    }
+    return it->second->Parse(command, call);
+}
+
+size_t ThingManager::ParseBatch(const cJSON* commands, std::vector<MethodCall>& calls) {
+    size_t rejected = 0;
+    int size = cJSON_GetArraySize(commands);
+    calls.reserve(calls.size() + size);
+    for (int i = 0; i < size; ++i) {
+        MethodCall call;
+        if (Parse(cJSON_GetArrayItem(commands, i), call) == ESP_OK) {
+            calls.push_back(std::move(call));
+        } else {
+            rejected++;
         }
     }
+    return rejected;
+}
+
+esp_err_t ThingManager::Invoke(const cJSON* command) {
+    MethodCall call;
+    auto err = Parse(command, call);
+    if (err == ESP_OK) {
+        call.Invoke();
+    }
+    return err;
 }
 
 } // namespace iot
@@ -9,7 +9,8 @@
 #include <vector>
 #include <memory>
 #include <functional>
-#include <map>
+#include <string_view>
+#include <unordered_map>
 
 namespace iot {
 
@@ -23,17 +24,31 @@ public:
     ThingManager& operator=(const ThingManager&) = delete;
 
     void AddThing(Thing* thing);
+    bool HasThing(const std::string& name) const { return things_by_name_.count(name) > 0; }
 
-    std::string GetDescriptorsJson();
+    // Built on first use and kept in PSRAM until another thing is added
+    std::string_view GetDescriptorsJson();
+    // With `delta` only the things whose state changed since the last call are included.
+    // Returns false, leaving `json` untouched, if there is nothing to report.
     bool GetStatesJson(std::string& json, bool delta = false);
-    void Invoke(const cJSON* command);
+    // ESP_ERR_NOT_FOUND for an unknown thing, otherwise the result of Thing::Parse
+    esp_err_t Parse(const cJSON* command, MethodCall& call);
+    // Parses every command of an iot message in order, appending the valid ones to `calls`.
+    // Returns the number of commands that were rejected.
+    size_t ParseBatch(const cJSON* commands, std::vector<MethodCall>& calls);
+    // Parses and runs one command at once, call it on the main loop
+    esp_err_t Invoke(const cJSON* command);
 
 private:
     ThingManager() = default;
     ~ThingManager() = default;
 
     std::vector<Thing*> things_;
-    std::map<std::string, std::string> last_states_;
+    std::unordered_map<std::string, Thing*> things_by_name_;
+    char* descriptors_json_ = nullptr;
+    size_t descriptors_json_size_ = 0;
+
+    void ClearDescriptorsJson();
 };
 
 
@@ -1,6 +1,7 @@
 #include "iot/thing.h"
 #include "board.h"
 #include "audio_codec.h"
+#include "application.h"
 
 #include <esp_log.h>
 
@@ -25,6 +26,11 @@ public:
             auto codec = Board::GetInstance().GetAudioCodec();
             codec->SetOutputVolume(static_cast<uint8_t>(parameters["volume"].number()));
         });
+#if CONFIG_USE_LATENCY_PROBE
+        methods_.AddMethod("MeasureLatency", "测量扬声器到麦克风的音频延迟", ParameterList(), [this](const ParameterList& parameters) {
+            Application::GetInstance().MeasureLatency();
+        });
+#endif
     }
 };
 
@@ -0,0 +1,185 @@
+#include "jitter_buffer.h"
+#include "audio_telemetry.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cassert>
+
+#define TAG "JitterBuffer"
+
+// An arrival gap longer than this starts a new talk spurt instead of counting as jitter
+#define JITTER_MAX_GAP_US 1000000
+
+JitterBuffer::JitterBuffer(size_t capacity) : capacity_(capacity), slots_(capacity) {
+    assert((capacity_ & (capacity_ - 1)) == 0);
+}
+
+void JitterBuffer::SetFrameDuration(int frame_duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frame_duration_us_ = frame_duration_ms * 1000;
+}
+
+void JitterBuffer::SetDepthLimits(int min_depth, int max_depth) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    min_depth_ = std::max(min_depth, 1);
+    max_depth_ = std::min(std::max(max_depth, min_depth_), (int)capacity_);
+    target_depth_ = std::clamp(target_depth_, min_depth_, max_depth_);
+}
+
+void JitterBuffer::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (lost_packets_ > 0 || late_packets_ > 0 || reordered_packets_ > 0 || dropped_packets_ > 0) {
+        ESP_LOGI(TAG, "lost: %lu, late: %lu, reordered: %lu, dropped: %lu, underruns: %lu, jitter: %dms, depth: %d",
+            lost_packets_, late_packets_, reordered_packets_, dropped_packets_, underruns_, jitter_us_ / 1000, target_depth_);
+    }
+    // Return the buffered packets to the pool
+    for (auto& slot : slots_) {
+        slot.packet = AudioPacket();
+    }
+    count_ = 0;
+    playing_ = false;
+    // Keep the jitter estimate, the network does not change between turns
+    last_arrival_time_ = 0;
+    lost_packets_ = 0;
+    late_packets_ = 0;
+    reordered_packets_ = 0;
+    dropped_packets_ = 0;
+    underruns_ = 0;
+}
+
+size_t JitterBuffer::Depth() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_;
+}
+
+uint32_t JitterBuffer::NextSequence() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return next_sequence_;
+}
+
+bool JitterBuffer::Put(uint32_t sequence, AudioPacket&& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& telemetry = AudioTelemetry::GetInstance();
+    if (!packet || capacity_ == 0) {
+        dropped_packets_++;
+        telemetry.Count(kAudioCounterDownlinkDropped);
+        return false;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int32_t offset = (int32_t)(sequence - next_sequence_);
+    // Start over on an empty buffer when prebuffering or when the sequence jumped out of the window
+    bool resync = count_ == 0 && (!playing_ || offset >= (int32_t)capacity_ || offset <= -(int32_t)capacity_);
+    if (resync) {
+        next_sequence_ = sequence;
+        highest_sequence_ = sequence;
+        first_buffered_time_ = now;
+    } else {
+        if (offset < 0) {
+            if (playing_) {
+                // Its slot was already concealed or played
+                late_packets_++;
+                telemetry.Count(kAudioCounterDownlinkLate);
+                return false;
+            }
+            // Still prebuffering, an earlier frame just arrived out of order
+            if ((int32_t)(highest_sequence_ - sequence) >= (int32_t)capacity_) {
+                dropped_packets_++;
+                telemetry.Count(kAudioCounterDownlinkDropped);
+                return false;
+            }
+            next_sequence_ = sequence;
+        } else if (offset >= (int32_t)capacity_) {
+            dropped_packets_++;
+            telemetry.Count(kAudioCounterDownlinkDropped);
+            return false;
+        }
+    }
+
+    Slot& slot = slots_[sequence & (capacity_ - 1)];
+    if (slot.packet) {
+        // Duplicate
+        return false;
+    }
+    slot.packet = std::move(packet);
+    slot.sequence = sequence;
+    slot.arrival_time = now;
+    count_++;
+    telemetry.UpdateHighWater(kAudioGaugeJitterDepth, count_);
+
+    if ((int32_t)(sequence - highest_sequence_) > 0) {
+        highest_sequence_ = sequence;
+    } else if (sequence != highest_sequence_) {
+        reordered_packets_++;
+    }
+    UpdateJitter(sequence, now);
+    return true;
+}
+
+void JitterBuffer::UpdateJitter(uint32_t sequence, int64_t now) {
+    if (last_arrival_time_ != 0 && (int32_t)(sequence - last_arrival_sequence_) <= 0) {
+        return;
+    }
+
+    if (last_arrival_time_ != 0) {
+        int64_t expected = (int64_t)(sequence - last_arrival_sequence_) * frame_duration_us_;
+        int64_t delay = (now - last_arrival_time_) - expected;
+        // Only late arrivals count, a burst ahead of schedule never causes an underrun
+        if (delay < 0) {
+            delay = 0;
+        }
+        if (delay < JITTER_MAX_GAP_US) {
+            jitter_us_ += (int)((delay - jitter_us_) / 16);
+            int depth = 1 + (2 * jitter_us_ + frame_duration_us_ - 1) / frame_duration_us_;
+            target_depth_ = std::clamp(depth, min_depth_, max_depth_);
+        }
+    }
+    last_arrival_sequence_ = sequence;
+    last_arrival_time_ = now;
+}
+
+JitterBuffer::Result JitterBuffer::Get(AudioPacket& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (count_ == 0 && !playing_) {
+        return kNoData;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int64_t wait_us = (int64_t)target_depth_ * frame_duration_us_;
+    if (!playing_) {
+        if ((int)count_ < target_depth_ && now - first_buffered_time_ < wait_us) {
+            return kNoData;
+        }
+        playing_ = true;
+        last_release_time_ = now;
+    }
+
+    Slot& slot = slots_[next_sequence_ & (capacity_ - 1)];
+    if (slot.packet && slot.sequence == next_sequence_) {
+        packet = std::move(slot.packet);
+        count_--;
+        next_sequence_++;
+        last_release_time_ = now;
+        AudioTelemetry::GetInstance().Record(kAudioStageReceive, now - slot.arrival_time);
+        return kPacket;
+    }
+
+    if (count_ == 0) {
+        // Drained, prebuffer again before the next frame
+        playing_ = false;
+        underruns_++;
+        AudioTelemetry::GetInstance().Count(kAudioCounterUnderruns);
+        return kNoData;
+    }
+
+    // A later frame is already here, wait for the missing one until it is overdue
+    if ((int32_t)(highest_sequence_ - next_sequence_) >= target_depth_ || now - last_release_time_ >= wait_us) {
+        next_sequence_++;
+        lost_packets_++;
+        last_release_time_ = now;
+        AudioTelemetry::GetInstance().Count(kAudioCounterDownlinkLost);
+        return kLost;
+    }
+    return kNoData;
+}
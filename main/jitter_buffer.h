@@ -0,0 +1,79 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "packet_pool.h"
+
+// Reorders incoming opus packets by sequence number and releases them at a depth
+// derived from the measured inter-arrival jitter (RFC 3550 estimator).
+// Missing frames are reported as lost so the decoder can conceal them.
+class JitterBuffer {
+public:
+    enum Result {
+        kNoData,    // Nothing to play yet, try again later
+        kPacket,    // `packet` holds the next frame
+        kLost,      // The next frame is missing, conceal it
+    };
+
+    // `capacity` must be a power of two, the uint32 sequence then maps to the same slot across its wrap
+    explicit JitterBuffer(size_t capacity);
+
+    JitterBuffer(const JitterBuffer&) = delete;
+    JitterBuffer& operator=(const JitterBuffer&) = delete;
+
+    void SetFrameDuration(int frame_duration_ms);
+    void SetDepthLimits(int min_depth, int max_depth);
+    void Reset();
+
+    // Holds on to the pooled packet, no copy is made
+    bool Put(uint32_t sequence, AudioPacket&& packet);
+    Result Get(AudioPacket& packet);
+
+    size_t Depth() const;
+    bool Empty() const { return Depth() == 0; }
+    // Sequence of the frame Get releases next, meaningful while frames are buffered
+    uint32_t NextSequence() const;
+    inline int target_depth() const { return target_depth_; }
+    inline int jitter_ms() const { return jitter_us_ / 1000; }
+
+private:
+    struct Slot {
+        AudioPacket packet;
+        uint32_t sequence = 0;
+        int64_t arrival_time = 0;
+    };
+
+    mutable std::mutex mutex_;
+    size_t capacity_;
+    std::vector<Slot> slots_;
+    size_t count_ = 0;
+
+    int frame_duration_us_ = 60000;
+    int min_depth_ = 1;
+    int max_depth_ = 5;
+    int target_depth_ = 1;
+    int jitter_us_ = 0;
+
+    bool playing_ = false;
+    // Sequence of the next frame to play, or of the lowest buffered frame while prebuffering
+    uint32_t next_sequence_ = 0;
+    uint32_t highest_sequence_ = 0;
+    uint32_t last_arrival_sequence_ = 0;
+    int64_t last_arrival_time_ = 0;
+    int64_t first_buffered_time_ = 0;
+    int64_t last_release_time_ = 0;
+
+    uint32_t lost_packets_ = 0;
+    uint32_t late_packets_ = 0;
+    uint32_t reordered_packets_ = 0;
+    uint32_t dropped_packets_ = 0;
+    uint32_t underruns_ = 0;
+
+    void UpdateJitter(uint32_t sequence, int64_t now);
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,128 @@
+#include "latency_probe.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <cmath>
+
+#define TAG "LatencyProbe"
+
+// 1.5kHz 到 4.5kHz 线性扫频, 大部分扬声器和麦克风在此频段响应平坦
+#define LATENCY_PROBE_START_HZ 1500
+#define LATENCY_PROBE_END_HZ 4500
+#define LATENCY_PROBE_AMPLITUDE 0.5f
+// Normalized correlation the peak must reach to count as detected
+#define LATENCY_PROBE_MIN_SCORE 0.3f
+
+LatencyProbe::LatencyProbe(AudioCodec* codec) : codec_(codec) {
+    std::vector<int16_t> mono;
+    MakeChirp(codec_->output_sample_rate(), mono);
+    int channels = codec_->output_channels();
+    chirp_.resize(mono.size() * channels);
+    for (size_t i = 0; i < mono.size(); i++) {
+        for (int c = 0; c < channels; c++) {
+            chirp_[i * channels + c] = mono[i];
+        }
+    }
+    MakeChirp(codec_->input_sample_rate(), template_);
+}
+
+// Hann windowed, so the onset has no click that would smear the correlation peak
+void LatencyProbe::MakeChirp(int sample_rate, std::vector<int16_t>& chirp) {
+    int samples = sample_rate * LATENCY_PROBE_CHIRP_MS / 1000;
+    float duration = (float)LATENCY_PROBE_CHIRP_MS / 1000;
+    float sweep = (LATENCY_PROBE_END_HZ - LATENCY_PROBE_START_HZ) / duration;
+    chirp.resize(samples);
+    for (int i = 0; i < samples; i++) {
+        float t = (float)i / sample_rate;
+        float phase = 2 * M_PI * (LATENCY_PROBE_START_HZ * t + sweep * t * t / 2);
+        float window = 0.5f - 0.5f * cosf(2 * M_PI * i / (samples - 1));
+        chirp[i] = (int16_t)(sinf(phase) * window * LATENCY_PROBE_AMPLITUDE * INT16_MAX);
+    }
+}
+
+int64_t LatencyProbe::Measure() {
+    const int sample_rate = codec_->input_sample_rate();
+    const int channels = codec_->input_channels();
+    const int chunk = sample_rate * LATENCY_PROBE_CHUNK_MS / 1000;
+    frame_.resize(chunk * channels);
+
+    // Drop what the RX DMA buffered before, the reads below then block on fresh samples
+    for (int i = 0; i < LATENCY_PROBE_SETTLE_MS / LATENCY_PROBE_CHUNK_MS; i++) {
+        if (!codec_->InputData(frame_)) {
+            return -1;
+        }
+    }
+
+    // Returns once queued, the DMA ran silence before so the chirp is next to play
+    output_ = chirp_;
+    int64_t submit_time = esp_timer_get_time();
+    codec_->OutputData(output_);
+
+    capture_.clear();
+    capture_.reserve(sample_rate * LATENCY_PROBE_CAPTURE_MS / 1000);
+    int64_t last_read_time = 0;
+    for (int i = 0; i < LATENCY_PROBE_CAPTURE_MS / LATENCY_PROBE_CHUNK_MS; i++) {
+        if (!codec_->InputData(frame_)) {
+            return -1;
+        }
+        last_read_time = esp_timer_get_time();
+        for (int j = 0; j < chunk; j++) {
+            capture_.push_back(frame_[j * channels]);
+        }
+    }
+
+    int onset = FindOnset();
+    if (onset < 0) {
+        return -1;
+    }
+    // A blocking read returns as its last sample is captured, count back from the last one
+    int64_t onset_time = last_read_time - (int64_t)(capture_.size() - onset) * 1000000 / sample_rate;
+    return onset_time - submit_time;
+}
+
+// Lag of the highest normalized correlation with the chirp, -1 below LATENCY_PROBE_MIN_SCORE
+int LatencyProbe::FindOnset() const {
+    const int taps = template_.size();
+    const int lags = (int)capture_.size() - taps;
+    if (lags <= 0) {
+        return -1;
+    }
+    int64_t template_energy = 0;
+    for (int j = 0; j < taps; j++) {
+        template_energy += template_[j] * template_[j];
+    }
+
+    // Energy of the capture under the template, slid along with the lag
+    int64_t window_energy = 0;
+    for (int j = 0; j < taps; j++) {
+        window_energy += capture_[j] * capture_[j];
+    }
+
+    float best_score = 0;
+    int best_lag = -1;
+    for (int lag = 0; lag < lags; lag++) {
+        if (lag > 0) {
+            window_energy += capture_[lag + taps - 1] * capture_[lag + taps - 1] - capture_[lag - 1] * capture_[lag - 1];
+        }
+        if (window_energy <= 0) {
+            continue;
+        }
+        int64_t correlation = 0;
+        const int16_t* x = capture_.data() + lag;
+        for (int j = 0; j < taps; j++) {
+            correlation += x[j] * template_[j];
+        }
+        float score = correlation / sqrtf((float)window_energy * (float)template_energy);
+        if (score > best_score) {
+            best_score = score;
+            best_lag = lag;
+        }
+    }
+    ESP_LOGD(TAG, "Peak score %.2f at %d", best_score, best_lag);
+    if (best_score < LATENCY_PROBE_MIN_SCORE) {
+        ESP_LOGW(TAG, "Chirp not detected, peak score %.2f", best_score);
+        return -1;
+    }
+    return best_lag;
+}
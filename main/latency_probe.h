@@ -0,0 +1,40 @@
+#ifndef LATENCY_PROBE_H
+#define LATENCY_PROBE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "audio_codec.h"
+
+// 扫频信号时长与采集窗口
+#define LATENCY_PROBE_CHIRP_MS 20
+#define LATENCY_PROBE_CAPTURE_MS 600
+#define LATENCY_PROBE_SETTLE_MS 100
+#define LATENCY_PROBE_CHUNK_MS 10
+#define LATENCY_PROBE_ROUNDS 5
+
+// Plays a chirp through the codec and finds it in the captured microphone input with a
+// matched filter. The result is the time from submitting the chirp to OutputData until its
+// first sample was captured, which covers the TX DMA, the speaker to microphone path and the
+// codec's analog stages. The RX DMA is excluded, the input timeline is anchored on the reads.
+// The caller must be the only user of the codec while it runs.
+class LatencyProbe {
+public:
+    explicit LatencyProbe(AudioCodec* codec);
+
+    // Microseconds, -1 when the chirp was not found
+    int64_t Measure();
+
+private:
+    AudioCodec* codec_;
+    std::vector<int16_t> chirp_;        // Output rate, interleaved output channels
+    std::vector<int16_t> template_;     // Input rate, mono
+    std::vector<int16_t> output_;
+    std::vector<int16_t> frame_;
+    std::vector<int16_t> capture_;      // First input channel, the microphone
+
+    static void MakeChirp(int sample_rate, std::vector<int16_t>& chirp);
+    int FindOnset() const;
+};
+
+#endif // LATENCY_PROBE_H
@@ -1,10 +1,45 @@
 #include "circular_strip.h"
 #include "application.h"
+#include "task_topology.h"
 #include <esp_log.h>
+#include <soc/soc_caps.h>
+
+#include <algorithm>
+#include <cmath>
 
 #define TAG "CircularStrip"
 
-#define BLINK_INFINITE -1
+// Breathe 的最大帧数，亮度差更大时按比例插值
+#define BREATHE_MAX_FRAMES 128
+// 渐变曲线的 gamma，使亮度变化在人眼看来是匀速的
+#define STRIP_GAMMA 2.2f
+
+namespace {
+
+struct GammaTable {
+    uint8_t values[256];
+    GammaTable() {
+        for (int i = 0; i < 256; i++) {
+            values[i] = (uint8_t)lroundf(powf(i / 255.0f, STRIP_GAMMA) * 255.0f);
+        }
+    }
+};
+
+const GammaTable& Gamma() {
+    static GammaTable table;
+    return table;
+}
+
+// Position t in [0, 255] between low and high, eased by the gamma curve
+uint8_t Mix(uint8_t low, uint8_t high, int t) {
+    return low + ((int)high - low) * Gamma().values[t] / 255;
+}
+
+StripColor Mix(StripColor low, StripColor high, int t) {
+    return { Mix(low.red, high.red, t), Mix(low.green, high.green, t), Mix(low.blue, high.blue, t) };
+}
+
+} // namespace
 
 CircularStrip::CircularStrip(gpio_num_t gpio, uint8_t max_leds) : max_leds_(max_leds) {
     // If the gpio is not connected, you should use NoLed class
@@ -20,28 +55,30 @@ CircularStrip::CircularStrip(gpio_num_t gpio, uint8_t max_leds) : max_leds_(max_
 
     led_strip_rmt_config_t rmt_config = {};
     rmt_config.resolution_hz = 10 * 1000 * 1000; // 10MHz
+#if SOC_RMT_SUPPORT_DMA
+    // The whole frame goes out in one DMA transfer instead of refilling the RMT memory in interrupts
+    rmt_config.flags.with_dma = true;
+    rmt_config.mem_block_symbols = 1024;
+#endif
 
     ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_));
     led_strip_clear(led_strip_);
 
-    esp_timer_create_args_t strip_timer_args = {
-        .callback = [](void *arg) {
-            auto strip = static_cast<CircularStrip*>(arg);
-            std::lock_guard<std::mutex> lock(strip->mutex_);
-            if (strip->strip_callback_ != nullptr) {
-                strip->strip_callback_();
-            }
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "strip_timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&strip_timer_args, &strip_timer_));
+    xTaskCreatePinnedToCore([](void* arg) {
+        static_cast<CircularStrip*>(arg)->StripTaskLoop();
+    }, "strip", TASK_LED_STACK_SIZE, this, TASK_LED_PRIORITY, &strip_task_, TASK_CORE(TASK_LED_CORE));
+
+    strip_timer_ = TimerService::GetInstance().Create("strip_timer", [this]() {
+        frame_index_.fetch_add(1, std::memory_order_relaxed);
+        xTaskNotifyGive(strip_task_);
+    });
 }
 
 CircularStrip::~CircularStrip() {
-    esp_timer_stop(strip_timer_);
+    TimerService::GetInstance().Delete(strip_timer_);
+    if (strip_task_ != nullptr) {
+        vTaskDelete(strip_task_);
+    }
     if (led_strip_ != nullptr) {
         led_strip_del(led_strip_);
     }
@@ -50,7 +87,8 @@ CircularStrip::~CircularStrip() {
 
 void CircularStrip::SetAllColor(StripColor color) {
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(strip_timer_);
+    TimerService::GetInstance().Stop(strip_timer_);
+    frame_count_ = 0;
     for (int i = 0; i < max_leds_; i++) {
         colors_[i] = color;
         led_strip_set_pixel(led_strip_, i, color.red, color.green, color.blue);
@@ -60,120 +98,107 @@ void CircularStrip::SetAllColor(StripColor color) {
 
 void CircularStrip::SetSingleColor(uint8_t index, StripColor color) {
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(strip_timer_);
+    TimerService::GetInstance().Stop(strip_timer_);
+    frame_count_ = 0;
     colors_[index] = color;
     led_strip_set_pixel(led_strip_, index, color.red, color.green, color.blue);
     led_strip_refresh(led_strip_);
 }
 
 void CircularStrip::Blink(StripColor color, int interval_ms) {
-    for (int i = 0; i < max_leds_; i++) {
-        colors_[i] = color;
-    }
-    StartStripTask(interval_ms, [this]() {
-        static bool on = true;
-        if (on) {
-            for (int i = 0; i < max_leds_; i++) {
-                led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
-            }
-            led_strip_refresh(led_strip_);
-        } else {
-            led_strip_clear(led_strip_);
-        }
-        on = !on;
-    });
+    StartAnimation({ color, StripColor() }, 1, true, interval_ms);
 }
 
 void CircularStrip::FadeOut(int interval_ms) {
-    StartStripTask(interval_ms, [this]() {
-        bool all_off = true;
-        for (int i = 0; i < max_leds_; i++) {
-            colors_[i].red /= 2;
-            colors_[i].green /= 2;
-            colors_[i].blue /= 2;
-            if (colors_[i].red != 0 || colors_[i].green != 0 || colors_[i].blue != 0) {
-                all_off = false;
+    // Halve every step from what is shown now, the last frame is all off
+    std::vector<StripColor> frames;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<StripColor> current = colors_;
+        bool all_off = false;
+        while (!all_off) {
+            all_off = true;
+            for (auto& color : current) {
+                color.red /= 2;
+                color.green /= 2;
+                color.blue /= 2;
+                if (color.red != 0 || color.green != 0 || color.blue != 0) {
+                    all_off = false;
+                }
             }
-            led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
-        }
-        if (all_off) {
-            led_strip_clear(led_strip_);
-            esp_timer_stop(strip_timer_);
-        } else {
-            led_strip_refresh(led_strip_);
+            frames.insert(frames.end(), current.begin(), current.end());
         }
-    });
+    }
+    StartAnimation(std::move(frames), max_leds_, false, interval_ms);
 }
 
 void CircularStrip::Breathe(StripColor low, StripColor high, int interval_ms) {
-    StartStripTask(interval_ms, [this, low, high]() {
-        static bool increase = true;
-        static StripColor color = low;
-        if (increase) {
-            if (color.red < high.red) {
-                color.red++;
-            }
-            if (color.green < high.green) {
-                color.green++;
-            }
-            if (color.blue < high.blue) {
-                color.blue++;
-            }
-            if (color.red == high.red && color.green == high.green && color.blue == high.blue) {
-                increase = false;
-            }
-        } else {
-            if (color.red > low.red) {
-                color.red--;
-            }
-            if (color.green > low.green) {
-                color.green--;
-            }
-            if (color.blue > low.blue) {
-                color.blue--;
-            }
-            if (color.red == low.red && color.green == low.green && color.blue == low.blue) {
-                increase = true;
-            }
-        }
-        for (int i = 0; i < max_leds_; i++) {
-            led_strip_set_pixel(led_strip_, i, color.red, color.green, color.blue);
-        }
-        led_strip_refresh(led_strip_);
-    });
+    // Same period as one brightness step per tick, up and back down
+    int steps = std::max({ abs(high.red - low.red), abs(high.green - low.green), abs(high.blue - low.blue), 1 });
+    steps = std::min(steps, BREATHE_MAX_FRAMES / 2);
+    std::vector<StripColor> frames(steps * 2);
+    for (int i = 0; i < steps; i++) {
+        frames[i] = Mix(low, high, i * 255 / steps);
+        frames[steps * 2 - 1 - i] = Mix(low, high, (i + 1) * 255 / steps);
+    }
+    StartAnimation(std::move(frames), 1, true, interval_ms);
 }
 
 void CircularStrip::Scroll(StripColor low, StripColor high, int length, int interval_ms) {
-    for (int i = 0; i < max_leds_; i++) {
-        colors_[i] = low;
-    }
-    StartStripTask(interval_ms, [this, low, high, length]() {
-        static int offset = 0;
-        for (int i = 0; i < max_leds_; i++) {
-            colors_[i] = low;
-        }
+    std::vector<StripColor> frames(max_leds_ * max_leds_, low);
+    for (int offset = 0; offset < max_leds_; offset++) {
         for (int j = 0; j < length; j++) {
-            int i = (offset + j) % max_leds_;
-            colors_[i] = high;
-        }
-        for (int i = 0; i < max_leds_; i++) {
-            led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
+            frames[offset * max_leds_ + (offset + j) % max_leds_] = high;
         }
-        led_strip_refresh(led_strip_);
-        offset = (offset + 1) % max_leds_;
-    });
+    }
+    StartAnimation(std::move(frames), max_leds_, true, interval_ms);
 }
 
-void CircularStrip::StartStripTask(int interval_ms, std::function<void()> cb) {
-    if (led_strip_ == nullptr) {
+void CircularStrip::StartAnimation(std::vector<StripColor>&& frames, int width, bool loop, int interval_ms) {
+    if (led_strip_ == nullptr || frames.empty()) {
         return;
     }
 
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(strip_timer_);
-    
-    strip_callback_ = cb;
-    esp_timer_start_periodic(strip_timer_, interval_ms * 1000);
+    TimerService::GetInstance().Stop(strip_timer_);
+    frames_ = std::move(frames);
+    frame_width_ = width;
+    frame_count_ = frames_.size() / width;
+    frames_loop_ = loop;
+    frame_index_.store(0, std::memory_order_relaxed);
+    ShowFrame(0);
+    TimerService::GetInstance().StartPeriodic(strip_timer_, interval_ms);
+}
+
+// Called with mutex_ held
+void CircularStrip::ShowFrame(int frame) {
+    const StripColor* pixels = &frames_[frame * frame_width_];
+    for (int i = 0; i < max_leds_; i++) {
+        colors_[i] = frame_width_ == 1 ? pixels[0] : pixels[i];
+        led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
+    }
+    led_strip_refresh(led_strip_);
+}
+
+void CircularStrip::StripTaskLoop() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        std::lock_guard<std::mutex> lock(mutex_);
+        // The animation was replaced or stopped since the tick
+        if (frame_count_ == 0 || !TimerService::GetInstance().IsActive(strip_timer_)) {
+            continue;
+        }
+        uint32_t index = frame_index_.load(std::memory_order_relaxed);
+        if (index >= (uint32_t)frame_count_) {
+            if (!frames_loop_) {
+                TimerService::GetInstance().Stop(strip_timer_);
+                continue;
+            }
+            index %= frame_count_;
+            frame_index_.store(index, std::memory_order_relaxed);
+        }
+        ShowFrame(index);
+    }
 }
 
 void CircularStrip::SetBrightness(uint8_t default_brightness, uint8_t low_brightness) {
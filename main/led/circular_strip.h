@@ -4,7 +4,9 @@
 #include "led.h"
 #include <driver/gpio.h>
 #include <led_strip.h>
-#include <esp_timer.h>
+#include "timer_service.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <atomic>
 #include <mutex>
 #include <vector>
@@ -16,6 +18,9 @@ struct StripColor {
     uint8_t red = 0, green = 0, blue = 0;
 };
 
+// Effects are rendered into a frame table once when they start. The periodic timer only
+// advances the frame index and wakes the strip task, which copies the frame to the RMT
+// driver, so a long strip never holds up the other esp_timer callbacks.
 class CircularStrip : public Led {
 public:
     CircularStrip(gpio_num_t gpio, uint8_t max_leds);
@@ -31,19 +36,25 @@ public:
 
 private:
     std::mutex mutex_;
-    TaskHandle_t blink_task_ = nullptr;
     led_strip_handle_t led_strip_ = nullptr;
     int max_leds_ = 0;
-    std::vector<StripColor> colors_;
-    int blink_counter_ = 0;
-    int blink_interval_ms_ = 0;
-    esp_timer_handle_t strip_timer_ = nullptr;
-    std::function<void()> strip_callback_ = nullptr;
+    std::vector<StripColor> colors_;    // What the strip shows now
+    ServiceTimer* strip_timer_ = nullptr;
+    TaskHandle_t strip_task_ = nullptr;
+
+    // frame_width_ is max_leds_, or 1 when every pixel of a frame has the same color
+    std::vector<StripColor> frames_;
+    int frame_width_ = 1;
+    int frame_count_ = 0;
+    bool frames_loop_ = true;
+    std::atomic<uint32_t> frame_index_{0};
 
     uint8_t default_brightness_ = DEFAULT_BRIGHTNESS;
     uint8_t low_brightness_ = LOW_BRIGHTNESS;
 
-    void StartStripTask(int interval_ms, std::function<void()> cb);
+    void StartAnimation(std::vector<StripColor>&& frames, int width, bool loop, int interval_ms);
+    void ShowFrame(int frame);
+    void StripTaskLoop();
     void Rainbow(StripColor low, StripColor high, int interval_ms);
     void FadeOut(int interval_ms);
 };
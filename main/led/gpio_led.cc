@@ -1,4 +1,5 @@
 #include "gpio_led.h"
+#include "ledc_fade.h"
 #include "application.h"
 #include <esp_log.h>
 
@@ -20,6 +21,7 @@
 #define LEDC_LS_MODE           LEDC_LOW_SPEED_MODE
 #define LEDC_LS_CH0_CHANNEL    LEDC_CHANNEL_0
 
+#define LEDC_LS_FREQ_HZ        (4000)
 #define LEDC_DUTY              (8191)
 #define LEDC_FADE_TIME    (1000)
 // GPIO_LED
@@ -42,7 +44,7 @@ GpioLed::GpioLed(gpio_num_t gpio, int output_invert, ledc_timer_t timer_num, led
      */
     ledc_timer_config_t ledc_timer = {};
     ledc_timer.duty_resolution = LEDC_TIMER_13_BIT;  // resolution of PWM duty
-    ledc_timer.freq_hz = 4000;                      // frequency of PWM signal
+    ledc_timer.freq_hz = LEDC_LS_FREQ_HZ;           // frequency of PWM signal
     ledc_timer.speed_mode = LEDC_LS_MODE;           // timer mode
     ledc_timer.timer_num = timer_num;               // timer index
     ledc_timer.clk_cfg = LEDC_AUTO_CLK;              // Auto select the source clock
@@ -60,35 +62,17 @@ GpioLed::GpioLed(gpio_num_t gpio, int output_invert, ledc_timer_t timer_num, led
     // Set LED Controller with previously prepared configuration
     ledc_channel_config(&ledc_channel_);
 
-    // Initialize fade service.
-    ledc_fade_func_install(0);
-
-    // When the callback registered by ledc_cb_degister is called, run led ->OnFadeEnd()
-    ledc_cbs_t ledc_callbacks = {
-        .fade_cb = FadeCallback
-    };
-    ledc_cb_register(ledc_channel_.speed_mode, ledc_channel_.channel, &ledc_callbacks, this);
-
-    esp_timer_create_args_t blink_timer_args = {
-        .callback = [](void *arg) {
-            auto led = static_cast<GpioLed*>(arg);
-            led->OnBlinkTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "Blink Timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&blink_timer_args, &blink_timer_));
+    // Fade end callbacks run on the shared fade task, not in the ISR
+    if (!LedcFade::GetInstance().Attach(ledc_channel_.speed_mode, ledc_channel_.channel, [this]() { OnFadeEnd(); })) {
+        return;
+    }
 
     ledc_initialized_ = true;
 }
 
 GpioLed::~GpioLed() {
-    esp_timer_stop(blink_timer_);
     if (ledc_initialized_) {
-        ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-        ledc_fade_func_uninstall();
+        LedcFade::GetInstance().Detach(ledc_channel_.speed_mode, ledc_channel_.channel);
     }
 }
 
@@ -107,10 +91,8 @@ void GpioLed::TurnOn() {
     }
 
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-    ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+    mode_ = kModeStatic;
+    LedcFade::GetInstance().SetDuty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
 }
 
 void GpioLed::TurnOff() {
@@ -119,10 +101,8 @@ void GpioLed::TurnOff() {
     }
 
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-    ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+    mode_ = kModeStatic;
+    LedcFade::GetInstance().SetDuty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
 }
 
 void GpioLed::BlinkOnce() {
@@ -143,27 +123,24 @@ void GpioLed::StartBlinkTask(int times, int interval_ms) {
     }
 
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-
+    mode_ = kModeBlink;
     blink_counter_ = times * 2;
     blink_interval_ms_ = interval_ms;
-    esp_timer_start_periodic(blink_timer_, interval_ms * 1000);
+    BlinkStep();
 }
 
-void GpioLed::OnBlinkTimer() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    blink_counter_--;
-    if (blink_counter_ & 1) {
-        ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
-    } else {
-        ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
-
-        if (blink_counter_ == 0) {
-            esp_timer_stop(blink_timer_);
-        }
+// Called with mutex_ held, holds the next half period with the fade engine
+void GpioLed::BlinkStep() {
+    auto& fade = LedcFade::GetInstance();
+    if (blink_counter_ == 0) {
+        mode_ = kModeStatic;
+        fade.SetDuty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
+        return;
     }
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+    // An infinite blink starts at -2 and never reaches zero
+    bool on = (blink_counter_ & 1) == 0;
+    blink_counter_--;
+    fade.Hold(ledc_channel_.speed_mode, ledc_channel_.channel, on ? duty_ : 0, blink_interval_ms_, LEDC_LS_FREQ_HZ);
 }
 
 void GpioLed::StartFadeTask() {
@@ -172,30 +149,20 @@ void GpioLed::StartFadeTask() {
     }
 
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
+    mode_ = kModeBreathe;
     fade_up_ = true;
-    ledc_set_fade_with_time(ledc_channel_.speed_mode,
-                            ledc_channel_.channel, LEDC_DUTY, LEDC_FADE_TIME);
-    ledc_fade_start(ledc_channel_.speed_mode,
-                    ledc_channel_.channel, LEDC_FADE_NO_WAIT);
+    LedcFade::GetInstance().Start(ledc_channel_.speed_mode, ledc_channel_.channel, LEDC_DUTY, LEDC_FADE_TIME);
 }
 
 void GpioLed::OnFadeEnd() {
     std::lock_guard<std::mutex> lock(mutex_);
-    fade_up_ = !fade_up_;
-    ledc_set_fade_with_time(ledc_channel_.speed_mode,
-                            ledc_channel_.channel, fade_up_ ? LEDC_DUTY : 0, LEDC_FADE_TIME);
-    ledc_fade_start(ledc_channel_.speed_mode,
-                    ledc_channel_.channel, LEDC_FADE_NO_WAIT);
-}
-
-bool GpioLed::FadeCallback(const ledc_cb_param_t *param, void *user_arg) {
-    if (param->event == LEDC_FADE_END_EVT) {
-        auto led = static_cast<GpioLed*>(user_arg);
-        led->OnFadeEnd();
+    if (mode_ == kModeBlink) {
+        BlinkStep();
+    } else if (mode_ == kModeBreathe) {
+        fade_up_ = !fade_up_;
+        LedcFade::GetInstance().Start(ledc_channel_.speed_mode, ledc_channel_.channel,
+            fade_up_ ? LEDC_DUTY : 0, LEDC_FADE_TIME);
     }
-    return true;
 }
 
 void GpioLed::OnStateChanged() {
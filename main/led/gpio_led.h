@@ -6,7 +6,6 @@
 #include "led.h"
 #include <driver/gpio.h>
 #include <driver/ledc.h>
-#include <esp_timer.h>
 #include <atomic>
 #include <mutex>
 
@@ -23,25 +22,30 @@ class GpioLed : public Led {
     void SetBrightness(uint8_t brightness);
 
  private:
+    // Blink and breathe are chains of hardware fades, each one started when the previous ends
+    enum Mode {
+        kModeStatic,
+        kModeBlink,
+        kModeBreathe,
+    };
+
     std::mutex mutex_;
-    TaskHandle_t blink_task_ = nullptr;
     ledc_channel_config_t ledc_channel_ = {0};
     bool ledc_initialized_ = false;
     uint32_t duty_ = 0;
+    Mode mode_ = kModeStatic;
     int blink_counter_ = 0;
     int blink_interval_ms_ = 0;
-    esp_timer_handle_t blink_timer_ = nullptr;
     bool fade_up_ = true;
 
     void StartBlinkTask(int times, int interval_ms);
-    void OnBlinkTimer();
+    void BlinkStep();
 
     void BlinkOnce();
     void Blink(int times, int interval_ms);
     void StartContinuousBlink(int interval_ms);
     void StartFadeTask();
     void OnFadeEnd();
-    static bool FadeCallback(const ledc_cb_param_t *param, void *user_arg);
 };
 
 #endif  // _GPIO_LED_H_
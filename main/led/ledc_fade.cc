@@ -0,0 +1,111 @@
+#include "ledc_fade.h"
+#include "task_topology.h"
+
+#include <esp_log.h>
+#include <esp_attr.h>
+
+#include <algorithm>
+
+#define TAG "LedcFade"
+
+// LEDC 每一步最多保持的 PWM 周期数 (duty_cycle 寄存器为 10 位)
+#define LEDC_FADE_MAX_CYCLES_PER_STEP 1023
+
+static_assert((int)LEDC_SPEED_MODE_MAX * (int)LEDC_CHANNEL_MAX <= 32, "One notification bit per channel");
+
+// Read by the ISR, set once before any callback is registered
+static TaskHandle_t fade_task = nullptr;
+
+bool LedcFade::Install() {
+    if (installed_) {
+        return true;
+    }
+    esp_err_t err = ledc_fade_func_install(0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to install the fade service: %s", esp_err_to_name(err));
+        return false;
+    }
+    xTaskCreatePinnedToCore([](void* arg) {
+        static_cast<LedcFade*>(arg)->FadeTaskLoop();
+    }, "ledc_fade", TASK_LED_STACK_SIZE, this, TASK_LED_PRIORITY, &task_, TASK_CORE(TASK_LED_CORE));
+    fade_task = task_;
+    installed_ = true;
+    return true;
+}
+
+bool LedcFade::Attach(ledc_mode_t mode, ledc_channel_t channel, std::function<void()> on_end) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!Install()) {
+        return false;
+    }
+    callbacks_[mode][channel] = std::move(on_end);
+    ledc_cbs_t callbacks = {
+        .fade_cb = FadeEndIsr
+    };
+    // The channel index travels in user_arg, the ISR does not touch the callbacks
+    ledc_cb_register(mode, channel, &callbacks, (void*)(uintptr_t)((int)mode * LEDC_CHANNEL_MAX + (int)channel));
+    return true;
+}
+
+void LedcFade::Detach(ledc_mode_t mode, ledc_channel_t channel) {
+    ledc_fade_stop(mode, channel);
+    std::lock_guard<std::mutex> lock(mutex_);
+    callbacks_[mode][channel] = nullptr;
+}
+
+bool LedcFade::Start(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty, int time_ms) {
+    ledc_fade_stop(mode, channel);
+    if (ledc_set_fade_with_time(mode, channel, duty, std::max(time_ms, 1)) != ESP_OK) {
+        return false;
+    }
+    return ledc_fade_start(mode, channel, LEDC_FADE_NO_WAIT) == ESP_OK;
+}
+
+// The fade engine doubles as a timer: jump to duty, then fade by a few LSBs over time_ms.
+// Each step may last at most 1023 PWM cycles, the step count is the smallest that covers
+// the time, a change of a few parts in 8192 is not visible.
+bool LedcFade::Hold(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty, int time_ms, uint32_t freq_hz) {
+    uint32_t cycles = (uint32_t)std::max(time_ms, 1) * freq_hz / 1000;
+    uint32_t steps = cycles / LEDC_FADE_MAX_CYCLES_PER_STEP + 1;
+    uint32_t target = duty >= steps ? duty - steps : duty + steps;
+    SetDuty(mode, channel, duty);
+    return Start(mode, channel, target, time_ms);
+}
+
+void LedcFade::SetDuty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty) {
+    ledc_fade_stop(mode, channel);
+    ledc_set_duty(mode, channel, duty);
+    ledc_update_duty(mode, channel);
+}
+
+bool IRAM_ATTR LedcFade::FadeEndIsr(const ledc_cb_param_t* param, void* user_arg) {
+    if (param->event != LEDC_FADE_END_EVT) {
+        return false;
+    }
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(fade_task, 1u << (uintptr_t)user_arg, eSetBits, &woken);
+    return woken == pdTRUE;
+}
+
+void LedcFade::FadeTaskLoop() {
+    while (true) {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, portMAX_DELAY);
+        for (int mode = 0; mode < LEDC_SPEED_MODE_MAX; mode++) {
+            for (int channel = 0; channel < LEDC_CHANNEL_MAX; channel++) {
+                if ((bits & (1u << (mode * LEDC_CHANNEL_MAX + channel))) == 0) {
+                    continue;
+                }
+                // Called without the lock, the callback usually starts the next fade
+                std::function<void()> callback;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    callback = callbacks_[mode][channel];
+                }
+                if (callback) {
+                    callback();
+                }
+            }
+        }
+    }
+}
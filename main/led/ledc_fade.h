@@ -0,0 +1,47 @@
+#ifndef _LEDC_FADE_H_
+#define _LEDC_FADE_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <driver/ledc.h>
+#include <functional>
+#include <mutex>
+
+// One owner for the LEDC hardware fade engine. Fades run without any CPU wakeups, the
+// fade end interrupt only sets a bit for the channel and the service task runs the
+// channel's callback, so LEDs and backlights never need a periodic timer.
+class LedcFade {
+public:
+    static LedcFade& GetInstance() {
+        static LedcFade instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    LedcFade(const LedcFade&) = delete;
+    LedcFade& operator=(const LedcFade&) = delete;
+
+    // on_end runs on the fade task after every fade of the channel, it may start the next one
+    bool Attach(ledc_mode_t mode, ledc_channel_t channel, std::function<void()> on_end = nullptr);
+    void Detach(ledc_mode_t mode, ledc_channel_t channel);
+
+    bool Start(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty, int time_ms);
+    // Keeps the output at duty for time_ms, see the source
+    bool Hold(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty, int time_ms, uint32_t freq_hz);
+    // Stops a running fade and sets the duty right away
+    void SetDuty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty);
+
+private:
+    LedcFade() = default;
+    ~LedcFade() = default;
+
+    std::mutex mutex_;
+    bool installed_ = false;
+    TaskHandle_t task_ = nullptr;
+    std::function<void()> callbacks_[LEDC_SPEED_MODE_MAX][LEDC_CHANNEL_MAX];
+
+    bool Install();
+    void FadeTaskLoop();
+    static bool FadeEndIsr(const ledc_cb_param_t* param, void* user_arg);
+};
+
+#endif // _LEDC_FADE_H_
@@ -27,21 +27,13 @@ SingleLed::SingleLed(gpio_num_t gpio) {
     ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_));
     led_strip_clear(led_strip_);
 
-    esp_timer_create_args_t blink_timer_args = {
-        .callback = [](void *arg) {
-            auto led = static_cast<SingleLed*>(arg);
-            led->OnBlinkTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "blink_timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&blink_timer_args, &blink_timer_));
+    blink_timer_ = TimerService::GetInstance().Create("blink_timer", [this]() {
+        OnBlinkTimer();
+    });
 }
 
 SingleLed::~SingleLed() {
-    esp_timer_stop(blink_timer_);
+    TimerService::GetInstance().Delete(blink_timer_);
     if (led_strip_ != nullptr) {
         led_strip_del(led_strip_);
     }
@@ -60,7 +52,7 @@ void SingleLed::TurnOn() {
     }
     
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
+    TimerService::GetInstance().Stop(blink_timer_);
     led_strip_set_pixel(led_strip_, 0, r_, g_, b_);
     led_strip_refresh(led_strip_);
 }
@@ -71,7 +63,7 @@ void SingleLed::TurnOff() {
     }
 
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
+    TimerService::GetInstance().Stop(blink_timer_);
     led_strip_clear(led_strip_);
 }
 
@@ -93,11 +85,11 @@ void SingleLed::StartBlinkTask(int times, int interval_ms) {
     }
 
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
+    TimerService::GetInstance().Stop(blink_timer_);
     
     blink_counter_ = times * 2;
     blink_interval_ms_ = interval_ms;
-    esp_timer_start_periodic(blink_timer_, interval_ms * 1000);
+    TimerService::GetInstance().StartPeriodic(blink_timer_, interval_ms);
 }
 
 void SingleLed::OnBlinkTimer() {
@@ -110,7 +102,7 @@ void SingleLed::OnBlinkTimer() {
         led_strip_clear(led_strip_);
 
         if (blink_counter_ == 0) {
-            esp_timer_stop(blink_timer_);
+            TimerService::GetInstance().Stop(blink_timer_);
         }
     }
 }
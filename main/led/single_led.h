@@ -4,7 +4,7 @@
 #include "led.h"
 #include <driver/gpio.h>
 #include <led_strip.h>
-#include <esp_timer.h>
+#include "timer_service.h"
 #include <atomic>
 #include <mutex>
 
@@ -22,7 +22,7 @@ private:
     uint8_t r_ = 0, g_ = 0, b_ = 0;
     int blink_counter_ = 0;
     int blink_interval_ms_ = 0;
-    esp_timer_handle_t blink_timer_ = nullptr;
+    ServiceTimer* blink_timer_ = nullptr;
 
     void StartBlinkTask(int times, int interval_ms);
     void OnBlinkTimer();
@@ -7,6 +7,7 @@
 
 #include "application.h"
 #include "system_info.h"
+#include "audio_benchmark.h"
 
 #define TAG "main"
 
@@ -24,6 +25,11 @@ extern "C" void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+#if CONFIG_USE_AUDIO_BENCHMARK
+    // Measured before any other task runs
+    AudioBenchmark::Run(CONFIG_AUDIO_BENCHMARK_ITERATIONS, CONFIG_AUDIO_BENCHMARK_BUDGET_PERCENT);
+#endif
+
     // Launch the application
     Application::GetInstance().Start();
 }
@@ -0,0 +1,58 @@
+#include "main_task_queue.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+
+#define TAG "MainTaskQueue"
+
+static const char* const kPriorityNames[kTaskPriorityCount] = { "realtime", "normal" };
+
+void MainTaskQueue::Push(MainTask&& task, TaskPriority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queues_[priority].push_back(Entry{ std::move(task), esp_timer_get_time() });
+}
+
+bool MainTaskQueue::RunNext() {
+    Entry entry;
+    int priority;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (priority = 0; priority < kTaskPriorityCount; priority++) {
+            if (!queues_[priority].empty()) {
+                break;
+            }
+        }
+        if (priority == kTaskPriorityCount) {
+            return false;
+        }
+        entry = std::move(queues_[priority].front());
+        queues_[priority].pop_front();
+    }
+
+    int64_t start = esp_timer_get_time();
+    entry.task();
+    int64_t end = esp_timer_get_time();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& stats = stats_[priority];
+    int64_t wait = start - entry.enqueue_time;
+    stats.count++;
+    stats.total_wait_us += wait;
+    stats.max_wait_us = std::max(stats.max_wait_us, wait);
+    stats.max_run_us = std::max(stats.max_run_us, end - start);
+    return true;
+}
+
+void MainTaskQueue::LogStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < kTaskPriorityCount; i++) {
+        auto& stats = stats_[i];
+        if (stats.count == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: %lu tasks, wait avg %lldus max %lldus, run max %lldus, queued %u", kPriorityNames[i],
+            stats.count, stats.total_wait_us / stats.count, stats.max_wait_us, stats.max_run_us, queues_[i].size());
+        stats = Stats();
+    }
+}
@@ -0,0 +1,146 @@
+#ifndef MAIN_TASK_QUEUE_H
+#define MAIN_TASK_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "memory_arena.h"
+
+enum TaskPriority {
+    kTaskPriorityRealtime,  // Audio sends, never wait behind more than one normal task
+    kTaskPriorityNormal,
+    kTaskPriorityCount
+};
+
+// Move-only callable with inline storage, so small captures such as [this, packet]
+// or [this, message = std::string(...)] do not allocate. Larger ones go to kArenaTasks.
+class MainTask {
+public:
+    static constexpr size_t kInlineSize = 32;
+
+    MainTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, MainTask>>>
+    MainTask(F&& callable) {
+        using T = std::decay_t<F>;
+        if constexpr (sizeof(T) <= kInlineSize && alignof(T) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<T>) {
+            new (storage_) T(std::forward<F>(callable));
+            ops_ = &kInlineOps<T>;
+        } else {
+            void* memory = MemoryArenas::GetInstance().Allocate(kArenaTasks, sizeof(T));
+            if (memory == nullptr) {
+                // Same as operator new without exceptions
+                abort();
+            }
+            *reinterpret_cast<T**>(storage_) = new (memory) T(std::forward<F>(callable));
+            ops_ = &kHeapOps<T>;
+        }
+    }
+
+    MainTask(MainTask&& other) noexcept {
+        MoveFrom(other);
+    }
+
+    MainTask& operator=(MainTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    MainTask(const MainTask&) = delete;
+    MainTask& operator=(const MainTask&) = delete;
+
+    ~MainTask() {
+        Reset();
+    }
+
+    void operator()() {
+        ops_->invoke(storage_);
+    }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename T>
+    static constexpr Ops kInlineOps = {
+        [](void* storage) { (*reinterpret_cast<T*>(storage))(); },
+        [](void* dst, void* src) {
+            new (dst) T(std::move(*reinterpret_cast<T*>(src)));
+            reinterpret_cast<T*>(src)->~T();
+        },
+        [](void* storage) { reinterpret_cast<T*>(storage)->~T(); },
+    };
+
+    template <typename T>
+    static constexpr Ops kHeapOps = {
+        [](void* storage) { (**reinterpret_cast<T**>(storage))(); },
+        [](void* dst, void* src) { *reinterpret_cast<T**>(dst) = *reinterpret_cast<T**>(src); },
+        [](void* storage) {
+            T* callable = *reinterpret_cast<T**>(storage);
+            callable->~T();
+            MemoryArenas::GetInstance().Free(callable);
+        },
+    };
+
+    alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+    const Ops* ops_ = nullptr;
+
+    void MoveFrom(MainTask& other) {
+        if (other.ops_ != nullptr) {
+            other.ops_->move(storage_, other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+};
+
+// Main loop task queue, one FIFO per priority class with queueing latency stats
+class MainTaskQueue {
+public:
+    void Push(MainTask&& task, TaskPriority priority);
+    // Runs the oldest task of the highest non-empty class, returns false if there is none
+    bool RunNext();
+    // Logs and resets the stats collected since the last call
+    void LogStats();
+
+private:
+    struct Entry {
+        MainTask task;
+        int64_t enqueue_time;
+    };
+
+    struct Stats {
+        uint32_t count = 0;
+        int64_t total_wait_us = 0;
+        int64_t max_wait_us = 0;
+        int64_t max_run_us = 0;
+    };
+
+    std::mutex mutex_;
+    // The deque blocks come and go with the backlog, keep them off the system heap
+    std::deque<Entry, ArenaAllocator<Entry, kArenaTasks>> queues_[kTaskPriorityCount];
+    Stats stats_[kTaskPriorityCount];
+};
+
+#endif // MAIN_TASK_QUEUE_H
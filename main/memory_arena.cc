@@ -0,0 +1,115 @@
+#include "memory_arena.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#define TAG "MemoryArenas"
+
+MemoryArenas::MemoryArenas() {
+    struct Config {
+        const char* name;
+        uint32_t caps;
+        size_t size;
+    };
+    const Config configs[kArenaCount] = {
+        {"audio", MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEMORY_ARENA_AUDIO_SIZE},
+        {"audio_dma", MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL, MEMORY_ARENA_AUDIO_DMA_SIZE},
+        {"protocol", MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEMORY_ARENA_PROTOCOL_SIZE},
+        {"display", MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEMORY_ARENA_DISPLAY_SIZE},
+        {"iot", MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEMORY_ARENA_IOT_SIZE},
+        {"tasks", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, MEMORY_ARENA_TASKS_SIZE},
+    };
+
+    // Only the table here, the regions are reserved by the first Allocate of each arena
+    for (int i = 0; i < kArenaCount; i++) {
+        arenas_[i].name = configs[i].name;
+        arenas_[i].caps = configs[i].caps;
+        arenas_[i].size = configs[i].size;
+    }
+}
+
+void MemoryArenas::Create(Arena& arena) {
+    arena.base = (uint8_t*)heap_caps_malloc(arena.size, arena.caps);
+    multi_heap_handle_t heap = nullptr;
+    if (arena.base != nullptr) {
+        heap = multi_heap_register(arena.base, arena.size);
+    }
+    if (heap == nullptr) {
+        ESP_LOGW(TAG, "Arena %s (%u bytes) not available, using the heap", arena.name, arena.size);
+        heap_caps_free(arena.base);
+        arena.base = nullptr;
+        return;
+    }
+    // multi_heap takes the lock around every call, the arenas are shared between tasks
+    multi_heap_set_lock(heap, &arena.lock);
+    ESP_LOGI(TAG, "Arena %s created, %u bytes", arena.name, arena.size);
+    arena.heap.store(heap, std::memory_order_release);
+}
+
+void* MemoryArenas::Allocate(MemoryArenaId id, size_t size) {
+    auto& arena = arenas_[id];
+    std::call_once(arena.created, [this, &arena]() { Create(arena); });
+    multi_heap_handle_t heap = arena.heap.load(std::memory_order_acquire);
+    if (heap != nullptr) {
+        void* ptr = multi_heap_malloc(heap, size);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+    }
+
+    // Log the first one only, a full arena usually stays full
+    if (arena.fallbacks++ == 0 && heap != nullptr) {
+        ESP_LOGW(TAG, "Arena %s full (%u bytes requested), falling back to the heap", arena.name, size);
+    }
+    void* ptr = heap_caps_malloc(size, arena.caps);
+    if (ptr == nullptr && !(arena.caps & MALLOC_CAP_DMA)) {
+        ptr = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    return ptr;
+}
+
+void MemoryArenas::Free(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    for (auto& arena : arenas_) {
+        multi_heap_handle_t heap = arena.heap.load(std::memory_order_acquire);
+        if (heap != nullptr && ptr >= arena.base && ptr < arena.base + arena.size) {
+            multi_heap_free(heap, ptr);
+            return;
+        }
+    }
+    heap_caps_free(ptr);
+}
+
+void MemoryArenas::LogStats() {
+    for (auto& arena : arenas_) {
+        multi_heap_handle_t heap = arena.heap.load(std::memory_order_acquire);
+        if (heap == nullptr) {
+            continue;
+        }
+        multi_heap_info_t info;
+        multi_heap_get_info(heap, &info);
+        size_t capacity = info.total_free_bytes + info.total_allocated_bytes;
+        ESP_LOGI(TAG, "%s: used %u / %u, peak %u, largest free %u, fallbacks %lu", arena.name,
+            info.total_allocated_bytes, capacity, capacity - info.minimum_free_bytes,
+            info.largest_free_block, arena.fallbacks.load());
+    }
+    // Fragmentation shows here long before the free total runs low
+    ESP_LOGI(TAG, "Internal heap largest free block: %u", heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+}
+
+ArenaBuffer::ArenaBuffer(MemoryArenaId id, size_t size) {
+    data_ = (char*)MemoryArenas::GetInstance().Allocate(id, size);
+    size_ = data_ != nullptr ? size : 0;
+}
+
+ArenaBuffer::~ArenaBuffer() {
+    MemoryArenas::GetInstance().Free(data_);
+}
+
+void ArenaBuffer::Reset(MemoryArenaId id, size_t size) {
+    MemoryArenas::GetInstance().Free(data_);
+    data_ = (char*)MemoryArenas::GetInstance().Allocate(id, size);
+    size_ = data_ != nullptr ? size : 0;
+}
@@ -0,0 +1,138 @@
+#ifndef MEMORY_ARENA_H
+#define MEMORY_ARENA_H
+
+#include <freertos/FreeRTOS.h>
+#include <multi_heap.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+
+// 各子系统内存池大小, 板级 config.h 可以覆盖; 没有 PSRAM 时 PSRAM 池不创建, 直接使用系统堆
+#ifndef MEMORY_ARENA_AUDIO_SIZE
+#define MEMORY_ARENA_AUDIO_SIZE (192 * 1024)
+#endif
+#ifndef MEMORY_ARENA_AUDIO_DMA_SIZE
+#define MEMORY_ARENA_AUDIO_DMA_SIZE (8 * 1024)
+#endif
+#ifndef MEMORY_ARENA_PROTOCOL_SIZE
+#define MEMORY_ARENA_PROTOCOL_SIZE (32 * 1024)
+#endif
+#ifndef MEMORY_ARENA_DISPLAY_SIZE
+#define MEMORY_ARENA_DISPLAY_SIZE (64 * 1024)
+#endif
+#ifndef MEMORY_ARENA_IOT_SIZE
+#define MEMORY_ARENA_IOT_SIZE (16 * 1024)
+#endif
+#ifndef MEMORY_ARENA_TASKS_SIZE
+#define MEMORY_ARENA_TASKS_SIZE (8 * 1024)
+#endif
+
+enum MemoryArenaId {
+    kArenaAudio,        // PSRAM: packet pool, packet rings, wake word pre-roll
+    kArenaAudioDma,     // Internal DMA capable: I2S conversion scratch
+    kArenaProtocol,     // PSRAM: JSON bigger than a control message, both directions
+    kArenaDisplay,      // PSRAM: font index and glyph cache
+    kArenaIot,          // PSRAM: cached descriptors
+    kArenaTasks,        // Internal: task captures bigger than the inline storage, task queues
+    kArenaCount
+};
+
+// One heap per subsystem, carved out of the memory it belongs in when its first allocation is
+// made, so an arena nobody uses costs nothing. A subsystem's churn then fragments only its own
+// region, never the internal heap that the WiFi and LWIP buffers need. An arena that is full or
+// could not be created falls back to the system heap with the same placement, the fallbacks
+// are counted.
+class MemoryArenas {
+public:
+    static MemoryArenas& GetInstance() {
+        static MemoryArenas instance;
+        return instance;
+    }
+    // 删除拷贝构造函数和赋值运算符
+    MemoryArenas(const MemoryArenas&) = delete;
+    MemoryArenas& operator=(const MemoryArenas&) = delete;
+
+    void* Allocate(MemoryArenaId id, size_t size);
+    // Takes anything Allocate returned, from whichever arena or fallback it came
+    void Free(void* ptr);
+
+    // Use and high-water mark of every arena, plus the largest free internal block
+    void LogStats();
+
+private:
+    struct Arena {
+        const char* name;
+        uint32_t caps;
+        size_t size;
+        uint8_t* base = nullptr;
+        // Set once the region is registered, Free and LogStats skip the arena until then
+        std::atomic<multi_heap_handle_t> heap{nullptr};
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        std::once_flag created;
+        std::atomic<uint32_t> fallbacks{0};
+    };
+
+    Arena arenas_[kArenaCount];
+
+    MemoryArenas();
+    ~MemoryArenas() = default;
+
+    void Create(Arena& arena);
+};
+
+// STL allocator on one arena, for containers that grow and shrink all the time
+template <typename T, MemoryArenaId Id>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    template <typename U>
+    struct rebind {
+        using other = ArenaAllocator<U, Id>;
+    };
+
+    ArenaAllocator() = default;
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U, Id>&) {}
+
+    T* allocate(size_t n) {
+        void* ptr = MemoryArenas::GetInstance().Allocate(Id, n * sizeof(T));
+        if (ptr == nullptr) {
+            // Same as operator new without exceptions
+            abort();
+        }
+        return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, size_t) {
+        MemoryArenas::GetInstance().Free(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U, Id>&) const { return true; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U, Id>&) const { return false; }
+};
+
+// Owns one arena allocation, for the message buffers that live for a single call
+class ArenaBuffer {
+public:
+    ArenaBuffer() = default;
+    ArenaBuffer(MemoryArenaId id, size_t size);
+    ~ArenaBuffer();
+    ArenaBuffer(const ArenaBuffer&) = delete;
+    ArenaBuffer& operator=(const ArenaBuffer&) = delete;
+
+    inline char* data() { return data_; }
+    // 0 when the allocation failed
+    inline size_t size() const { return size_; }
+    // Frees the current allocation and makes a new one
+    void Reset(MemoryArenaId id, size_t size);
+
+private:
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+#endif // MEMORY_ARENA_H
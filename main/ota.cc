@@ -1,4 +1,7 @@
 #include "ota.h"
+#include "ota_writer.h"
+#include "ota_patch.h"
+#include "trace.h"
 #include "system_info.h"
 #include "settings.h"
 #include "assets/lang_config.h"
@@ -10,6 +13,7 @@
 #include <esp_app_format.h>
 #include <esp_efuse.h>
 #include <esp_efuse_table.h>
+#include <esp_heap_caps.h>
 #ifdef SOC_HMAC_SUPPORTED
 #include <esp_hmac.h>
 #endif
@@ -21,6 +25,11 @@
 
 #define TAG "Ota"
 
+// 每次从 HTTP 读取的字节数
+#define OTA_DOWNLOAD_BUFFER_SIZE 4096
+// 缓存检查版本响应的最大长度，用于 304 Not Modified
+#define OTA_CACHED_RESPONSE_MAX_SIZE 3900
+
 
 Ota::Ota() {
 #ifdef ESP_EFUSE_BLOCK_USR_DATA
@@ -49,9 +58,13 @@ std::string Ota::GetCheckVersionUrl() {
     return url;
 }
 
-std::unique_ptr<Http> Ota::SetupHttp() {
+// 检查版本与激活轮询复用同一个客户端，公共请求头只设置一次
+Http* Ota::SetupHttp(std::unique_ptr<Http>& http) {
+    if (http != nullptr) {
+        return http.get();
+    }
     auto& board = Board::GetInstance();
-    auto http = board.CreateHttp();
+    http.reset(board.CreateHttp());
     auto user_agent = SystemInfo::GetUserAgent();
     http->SetHeader("Activation-Version", has_serial_number_ ? "2" : "1");
     http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
@@ -63,14 +76,20 @@ std::unique_ptr<Http> Ota::SetupHttp() {
     http->SetHeader("User-Agent", user_agent);
     http->SetHeader("Accept-Language", Lang::CODE);
     http->SetHeader("Content-Type", "application/json");
+    http->SetHeader("Connection", "keep-alive");
+    return http.get();
+}
 
-    return std::unique_ptr<Http>(http);
+void Ota::ReleaseHttp() {
+    check_http_.reset();
+    activate_http_.reset();
 }
 
 /* 
  * Specification: https://ccnphfhqs21z.feishu.cn/wiki/FjW6wZmisimNBBkov6OcmfvknVd
  */
 esp_err_t Ota::CheckVersion() {
+    TRACE_SCOPE(kTraceCheckVersion);
     auto& board = Board::GetInstance();
     auto app_desc = esp_app_get_description();
 
@@ -84,7 +103,22 @@ esp_err_t Ota::CheckVersion() {
         return ESP_ERR_INVALID_ARG;
     }
 
-    auto http = SetupHttp();
+    // The server answers 304 when the response would be the same as the cached one
+    Settings settings("ota", true);
+    std::string etag = settings.GetString("etag");
+    // Http has no way to remove a header, a client that sent an old etag is replaced
+    // once there is nothing cached to match
+    if (etag.empty() && check_http_conditional_) {
+        check_http_.reset();
+    }
+    if (check_http_ == nullptr) {
+        check_http_conditional_ = false;
+    }
+    auto http = SetupHttp(check_http_);
+    if (!etag.empty()) {
+        http->SetHeader("If-None-Match", etag);
+        check_http_conditional_ = true;
+    }
 
     std::string data = board.GetJson();
     std::string method = data.length() > 0 ? "POST" : "GET";
@@ -95,25 +129,52 @@ esp_err_t Ota::CheckVersion() {
 
     if (!http->Open(method, url, data)) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
+        check_http_.reset();
         return ESP_FAIL;
     }
 
     auto status_code = http->GetStatusCode();
-    if (status_code != 200) {
+    bool not_modified = status_code == 304 && !etag.empty();
+    if (status_code != 200 && !not_modified) {
         ESP_LOGE(TAG, "Failed to check version, status_code=%d", status_code);
+        http->Close();
         return ESP_FAIL;
     }
 
-    data = http->GetBody();
-    http->Close();
+    if (not_modified) {
+        http->Close();
+        data = settings.GetString("body");
+        ESP_LOGI(TAG, "Check version response not modified, etag %s", etag.c_str());
+    } else {
+        data = http->GetBody();
+        etag = http->GetResponseHeader("ETag");
+        http->Close();
+        // NVS 字符串最长 4000 字节，过长的响应不缓存
+        if (!etag.empty() && data.length() < OTA_CACHED_RESPONSE_MAX_SIZE) {
+            if (settings.GetString("etag") != etag) {
+                settings.SetString("etag", etag);
+                settings.SetString("body", data);
+            }
+        } else {
+            settings.EraseKey("etag");
+            settings.EraseKey("body");
+        }
+    }
+    return ParseCheckVersionResponse(data, !not_modified);
+}
 
-    // Response: { "firmware": { "version": "1.0.0", "url": "http://" } }
+esp_err_t Ota::ParseCheckVersionResponse(const std::string& data, bool fresh) {
+    // Response: { "firmware": { "version": "1.0.0", "url": "http://", "patch_url": "http://" } }
     // Parse the JSON response and check if the version is newer
     // If it is, set has_new_version_ to true and store the new version and URL
     
     cJSON *root = cJSON_Parse(data.c_str());
     if (root == NULL) {
         ESP_LOGE(TAG, "Failed to parse JSON response");
+        if (!fresh) {
+            Settings settings("ota", true);
+            settings.EraseKey("etag");
+        }
         return ESP_ERR_INVALID_RESPONSE;
     }
 
@@ -183,8 +244,22 @@ esp_err_t Ota::CheckVersion() {
         ESP_LOGI(TAG, "No websocket section found!");
     }
 
+    // Per device I2S DMA depth, AudioCodec reads it before creating the channels on the next boot
+    cJSON *audio = cJSON_GetObjectItem(root, "audio");
+    if (cJSON_IsObject(audio)) {
+        Settings settings("audio", true);
+        for (auto key : {"dma_desc_num", "dma_frame_num"}) {
+            cJSON *item = cJSON_GetObjectItem(audio, key);
+            if (cJSON_IsNumber(item) && settings.GetInt(key) != item->valueint) {
+                settings.SetInt(key, item->valueint);
+                ESP_LOGI(TAG, "Audio %s set to %d, applied after reboot", key, item->valueint);
+            }
+        }
+    }
+
+    // A cached server time is stale
     has_server_time_ = false;
-    cJSON *server_time = cJSON_GetObjectItem(root, "server_time");
+    cJSON *server_time = fresh ? cJSON_GetObjectItem(root, "server_time") : nullptr;
     if (cJSON_IsObject(server_time)) {
         cJSON *timestamp = cJSON_GetObjectItem(server_time, "timestamp");
         cJSON *timezone_offset = cJSON_GetObjectItem(server_time, "timezone_offset");
@@ -204,7 +279,7 @@ esp_err_t Ota::CheckVersion() {
             settimeofday(&tv, NULL);
             has_server_time_ = true;
         }
-    } else {
+    } else if (fresh) {
         ESP_LOGW(TAG, "No server_time section found!");
     }
 
@@ -219,6 +294,14 @@ esp_err_t Ota::CheckVersion() {
         if (cJSON_IsString(url)) {
             firmware_url_ = url->valuestring;
         }
+        // 服务器根据上报的当前版本和 elf_sha256 选出的差分包，没有时为空
+        firmware_patch_url_.clear();
+#if CONFIG_OTA_DELTA_UPDATE
+        cJSON *patch_url = cJSON_GetObjectItem(firmware, "patch_url");
+        if (cJSON_IsString(patch_url)) {
+            firmware_patch_url_ = patch_url->valuestring;
+        }
+#endif
 
         if (cJSON_IsString(version) && cJSON_IsString(url)) {
             // Check if the version is newer, for example, 0.1.0 is newer than 0.0.1
@@ -262,50 +345,98 @@ void Ota::MarkCurrentVersionValid() {
     }
 }
 
-bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback) {
-    ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
-    esp_ota_handle_t update_handle = 0;
-    auto update_partition = esp_ota_get_next_update_partition(NULL);
-    if (update_partition == NULL) {
-        ESP_LOGE(TAG, "Failed to get update partition");
-        return false;
+// Opens the firmware at `offset`. Returns ESP_FAIL for errors worth retrying.
+static esp_err_t OpenFirmware(Http* http, const std::string& firmware_url, size_t offset, size_t& content_length) {
+    if (offset > 0) {
+        http->SetHeader("Range", "bytes=" + std::to_string(offset) + "-");
     }
-
-    ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
-
-    auto http = Board::GetInstance().CreateHttp();
     if (!http->Open("GET", firmware_url)) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
-        return false;
+        return ESP_FAIL;
     }
 
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
-        return false;
+    int status_code = http->GetStatusCode();
+    if (offset == 0) {
+        if (status_code != 200) {
+            ESP_LOGE(TAG, "Failed to get firmware, status code: %d", status_code);
+            return status_code >= 500 ? ESP_FAIL : ESP_ERR_INVALID_RESPONSE;
+        }
+        content_length = http->GetBodyLength();
+        if (content_length == 0) {
+            ESP_LOGE(TAG, "Failed to get content length");
+            return ESP_ERR_INVALID_SIZE;
+        }
+        return ESP_OK;
+    }
+
+    // Resuming only works if the server honours the range, otherwise the data would not line up
+    if (status_code != 206) {
+        ESP_LOGE(TAG, "Server doesn't support resuming, status code: %d", status_code);
+        return status_code >= 500 ? ESP_FAIL : ESP_ERR_NOT_SUPPORTED;
+    }
+    if (http->GetBodyLength() != content_length - offset) {
+        ESP_LOGE(TAG, "Unexpected range length %u, expected %u", http->GetBodyLength(), content_length - offset);
+        return ESP_ERR_INVALID_SIZE;
     }
+    ESP_LOGI(TAG, "Resuming download at %u/%u", offset, content_length);
+    return ESP_OK;
+}
 
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
+// Downloads `url` into `sink`, resuming with a Range request when the connection drops
+static bool Download(const std::string& url, std::function<void(int progress, size_t speed)>& callback,
+    std::function<esp_err_t(const uint8_t* data, size_t size)> sink) {
+    auto buffer = (uint8_t*)heap_caps_malloc(OTA_DOWNLOAD_BUFFER_SIZE, MALLOC_CAP_8BIT);
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate download buffer");
         return false;
     }
 
-    char buffer[512];
+    auto& board = Board::GetInstance();
+    std::unique_ptr<Http> http;
+    size_t content_length = 0;
     size_t total_read = 0, recent_read = 0;
+    int failures = 0;
+    bool success = false;
     auto last_calc_time = esp_timer_get_time();
     while (true) {
-        int ret = http->Read(buffer, sizeof(buffer));
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            return false;
+        if (http == nullptr) {
+            http.reset(board.CreateHttp());
+            auto err = OpenFirmware(http.get(), url, total_read, content_length);
+            if (err != ESP_OK) {
+                http.reset();
+                if (err != ESP_FAIL || ++failures > CONFIG_OTA_RESUME_RETRIES) {
+                    break;
+                }
+                vTaskDelay(pdMS_TO_TICKS(1000 * failures));
+                continue;
+            }
+        }
+
+        int ret = http->Read((char*)buffer, std::min<size_t>(OTA_DOWNLOAD_BUFFER_SIZE, content_length - total_read));
+        if (ret < 0 || (ret == 0 && total_read < content_length)) {
+            // Dropped connection, continue from the last byte received
+            ESP_LOGW(TAG, "Download interrupted at %u/%u: %s", total_read, content_length,
+                ret < 0 ? esp_err_to_name(ret) : "connection closed");
+            http.reset();
+            if (++failures > CONFIG_OTA_RESUME_RETRIES) {
+                ESP_LOGE(TAG, "Giving up after %d retries", CONFIG_OTA_RESUME_RETRIES);
+                break;
+            }
+            vTaskDelay(pdMS_TO_TICKS(1000 * failures));
+            continue;
+        }
+        if (ret > 0) {
+            failures = 0;
+            if (sink(buffer, ret) != ESP_OK) {
+                break;
+            }
         }
 
         // Calculate speed and progress every second
         recent_read += ret;
         total_read += ret;
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
+        bool finished = total_read >= content_length;
+        if (esp_timer_get_time() - last_calc_time >= 1000000 || finished) {
             size_t progress = total_read * 100 / content_length;
             ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
             if (callback) {
@@ -315,49 +446,75 @@ bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progre
             recent_read = 0;
         }
 
-        if (ret == 0) {
+        if (finished) {
+            http->Close();
+            success = true;
             break;
         }
+    }
+    heap_caps_free(buffer);
+    return success;
+}
 
-        if (!image_header_checked) {
-            image_header.append(buffer, ret);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
-                
-                auto current_version = esp_app_get_description()->version;
-                ESP_LOGI(TAG, "Current version: %s, New version: %s", current_version, new_app_info.version);
-
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    ESP_LOGE(TAG, "Failed to begin OTA");
-                    return false;
-                }
+// Rebuilds the new firmware from the running partition and a delta patch
+static bool ApplyPatch(const std::string& patch_url, const esp_partition_t* update_partition,
+    std::function<void(int progress, size_t speed)>& callback) {
+    auto running_partition = esp_ota_get_running_partition();
+    ESP_LOGI(TAG, "Downloading patch for %s from %s", running_partition->label, patch_url.c_str());
 
-                image_header_checked = true;
-                std::string().swap(image_header);
-            }
-        }
-        auto err = esp_ota_write(update_handle, buffer, ret);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-            esp_ota_abort(update_handle);
-            return false;
+    OtaWriter writer(CONFIG_OTA_BLOCK_SIZE, CONFIG_OTA_PIPELINE_BLOCKS);
+    OtaPatcher patcher(running_partition, writer);
+    if (patcher.Begin() != ESP_OK || writer.Begin(update_partition) != ESP_OK) {
+        return false;
+    }
+    bool success = Download(patch_url, callback, [&patcher](const uint8_t* data, size_t size) {
+        return patcher.Feed(data, size);
+    });
+    if (!success || patcher.Finish() != ESP_OK) {
+        writer.Abort();
+        return false;
+    }
+    return writer.End() == ESP_OK;
+}
+
+bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback,
+    const std::string& patch_url) {
+    TRACE_SCOPE(kTraceUpgrade);
+    auto update_partition = esp_ota_get_next_update_partition(NULL);
+    if (update_partition == NULL) {
+        ESP_LOGE(TAG, "Failed to get update partition");
+        return false;
+    }
+    ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
+
+    // 差分包失败（旧固件不匹配、下载失败等）时回退到完整固件
+    bool success = false;
+    if (!patch_url.empty()) {
+        success = ApplyPatch(patch_url, update_partition, callback);
+        if (!success) {
+            ESP_LOGW(TAG, "Failed to apply patch, downloading the full firmware");
         }
     }
-    http->Close();
 
-    esp_err_t err = esp_ota_end(update_handle);
-    if (err != ESP_OK) {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            ESP_LOGE(TAG, "Image validation failed, image is corrupted");
-        } else {
-            ESP_LOGE(TAG, "Failed to end OTA: %s", esp_err_to_name(err));
+    if (!success) {
+        ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
+        OtaWriter writer(CONFIG_OTA_BLOCK_SIZE, CONFIG_OTA_PIPELINE_BLOCKS);
+        if (writer.Begin(update_partition) != ESP_OK) {
+            return false;
+        }
+        success = Download(firmware_url, callback, [&writer](const uint8_t* data, size_t size) {
+            return writer.Write(data, size);
+        });
+        if (!success) {
+            writer.Abort();
+            return false;
+        }
+        if (writer.End() != ESP_OK) {
+            return false;
         }
-        return false;
     }
 
-    err = esp_ota_set_boot_partition(update_partition);
+    esp_err_t err = esp_ota_set_boot_partition(update_partition);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
         return false;
@@ -368,7 +525,7 @@ bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progre
 }
 
 bool Ota::StartUpgrade(std::function<void(int progress, size_t speed)> callback) {
-    return Upgrade(firmware_url_, callback);
+    return Upgrade(firmware_url_, callback, firmware_patch_url_);
 }
 
 
@@ -437,6 +594,7 @@ std::string Ota::GetActivationPayload() {
 }
 
 esp_err_t Ota::Activate() {
+    TRACE_SCOPE(kTraceActivate);
     if (!has_activation_challenge_) {
         ESP_LOGW(TAG, "No activation challenge found");
         return ESP_FAIL;
@@ -449,24 +607,63 @@ esp_err_t Ota::Activate() {
         url += "activate";
     }
 
-    auto http = SetupHttp();
+    auto http = SetupHttp(activate_http_);
 
     std::string data = GetActivationPayload();
 
     if (!http->Open("POST", url, data)) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
+        activate_http_.reset();
         return ESP_FAIL;
     }
     
+    // Read the body before closing, so the connection can be reused by the next poll
     auto status_code = http->GetStatusCode();
+    auto body = http->GetBody();
+    http->Close();
     if (status_code == 202) {
         return ESP_ERR_TIMEOUT;
     }
     if (status_code != 200) {
-        ESP_LOGE(TAG, "Failed to activate, code: %d, body: %s", status_code, http->GetBody().c_str());
+        ESP_LOGE(TAG, "Failed to activate, code: %d, body: %s", status_code, body.c_str());
         return ESP_FAIL;
     }
 
     ESP_LOGI(TAG, "Activation successful");
+    activate_http_.reset();
+    return ESP_OK;
+}
+
+esp_err_t Ota::UploadRecording(size_t parts, std::function<void(size_t part, std::string& data)> serialize_part) {
+    // Microphone audio only goes to the server the device checks versions with, never in clear
+    std::string url = GetCheckVersionUrl();
+    if (url.rfind("https://", 0) != 0) {
+        ESP_LOGE(TAG, "Recording upload needs an https OTA url");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    url += url.back() != '/' ? "/recording" : "recording";
+
+    // One client for all parts, the connection is kept alive between them
+    std::unique_ptr<Http> upload_http;
+    std::string data;
+    size_t total = 0;
+    for (size_t part = 0; part < parts; part++) {
+        serialize_part(part, data);
+        auto http = SetupHttp(upload_http);
+        http->SetHeader("Content-Type", "application/octet-stream");
+        http->SetHeader("Recording-Part", std::to_string(part + 1) + "/" + std::to_string(parts));
+        if (!http->Open("POST", url, data)) {
+            ESP_LOGE(TAG, "Failed to open HTTP connection");
+            return ESP_FAIL;
+        }
+        auto status_code = http->GetStatusCode();
+        http->Close();
+        if (status_code != 200) {
+            ESP_LOGE(TAG, "Failed to upload recording part %u, code: %d", part + 1, status_code);
+            return ESP_FAIL;
+        }
+        total += data.size();
+    }
+    ESP_LOGI(TAG, "Uploaded %u bytes of recording in %u parts to %s", total, parts, url.c_str());
     return ESP_OK;
 }
@@ -2,6 +2,7 @@
 #define _OTA_H
 
 #include <functional>
+#include <memory>
 #include <string>
 
 #include <esp_err.h>
@@ -14,6 +15,9 @@ public:
 
     esp_err_t CheckVersion();
     esp_err_t Activate();
+    // POSTs a conversation recording to <check version url>/recording in `parts` requests, only
+    // over https; `serialize_part` fills the body of each
+    esp_err_t UploadRecording(size_t parts, std::function<void(size_t part, std::string& data)> serialize_part);
     bool HasActivationChallenge() { return has_activation_challenge_; }
     bool HasNewVersion() { return has_new_version_; }
     bool HasMqttConfig() { return has_mqtt_config_; }
@@ -21,15 +25,20 @@ public:
     bool HasActivationCode() { return has_activation_code_; }
     bool HasServerTime() { return has_server_time_; }
     bool StartUpgrade(std::function<void(int progress, size_t speed)> callback);
-    static bool Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback);
+    // patch_url 是针对运行中固件的差分包，应用失败时下载 firmware_url 的完整固件
+    static bool Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback,
+        const std::string& patch_url = "");
     void MarkCurrentVersionValid();
 
     const std::string& GetFirmwareVersion() const { return firmware_version_; }
     const std::string& GetCurrentVersion() const { return current_version_; }
     const std::string& GetFirmwareUrl() const { return firmware_url_; }
+    const std::string& GetFirmwarePatchUrl() const { return firmware_patch_url_; }
     const std::string& GetActivationMessage() const { return activation_message_; }
     const std::string& GetActivationCode() const { return activation_code_; }
     std::string GetCheckVersionUrl();
+    // Drops the clients kept between check version and activation requests
+    void ReleaseHttp();
 
 private:
     std::string activation_message_;
@@ -44,15 +53,22 @@ private:
     std::string current_version_;
     std::string firmware_version_;
     std::string firmware_url_;
+    std::string firmware_patch_url_;
     std::string activation_challenge_;
     std::string serial_number_;
     int activation_timeout_ms_ = 30000;
 
+    std::unique_ptr<Http> check_http_;
+    // check_http_ carries an If-None-Match header from an earlier request
+    bool check_http_conditional_ = false;
+    std::unique_ptr<Http> activate_http_;
+
     std::function<void(int progress, size_t speed)> upgrade_callback_;
     std::vector<int> ParseVersion(const std::string& version);
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
     std::string GetActivationPayload();
-    std::unique_ptr<Http> SetupHttp();
+    Http* SetupHttp(std::unique_ptr<Http>& http);
+    esp_err_t ParseCheckVersionResponse(const std::string& data, bool fresh);
 };
 
 #endif // _OTA_H
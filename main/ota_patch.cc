@@ -0,0 +1,302 @@
+#include "ota_patch.h"
+#include "ota_writer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <rom/miniz.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "OtaPatcher"
+
+// 读取旧固件的缓冲区大小
+#define OTA_PATCH_SCRATCH_SIZE 4096
+
+static void* AllocPreferPsram(size_t size) {
+    void* data = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (data == nullptr) {
+        data = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    return data;
+}
+
+static uint32_t ReadU32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+OtaPatcher::OtaPatcher(const esp_partition_t* source, OtaWriter& writer)
+    : source_(source), writer_(writer) {
+    mbedtls_sha256_init(&sha256_);
+}
+
+OtaPatcher::~OtaPatcher() {
+    mbedtls_sha256_free(&sha256_);
+    heap_caps_free(inflator_);
+    heap_caps_free(window_);
+    heap_caps_free(scratch_);
+}
+
+esp_err_t OtaPatcher::Begin() {
+    // The inflate window has to be a full 32 KiB because the stream may refer back that far
+    inflator_ = (tinfl_decompressor*)AllocPreferPsram(sizeof(tinfl_decompressor));
+    window_ = (uint8_t*)AllocPreferPsram(TINFL_LZ_DICT_SIZE);
+    scratch_ = (uint8_t*)heap_caps_malloc(OTA_PATCH_SCRATCH_SIZE, MALLOC_CAP_8BIT);
+    if (inflator_ == nullptr || window_ == nullptr || scratch_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate patch buffers");
+        return ESP_ERR_NO_MEM;
+    }
+    tinfl_init(inflator_);
+    return ESP_OK;
+}
+
+esp_err_t OtaPatcher::Feed(const uint8_t* data, size_t size) {
+    if (state_ == kStateHeader) {
+        size_t n = std::min(size, sizeof(header_) - header_size_);
+        memcpy((uint8_t*)&header_ + header_size_, data, n);
+        header_size_ += n;
+        data += n;
+        size -= n;
+        if (header_size_ < sizeof(header_)) {
+            return ESP_OK;
+        }
+
+        if (header_.magic != OTA_PATCH_MAGIC || header_.version != OTA_PATCH_VERSION) {
+            ESP_LOGE(TAG, "Not a firmware patch");
+            return ESP_ERR_INVALID_VERSION;
+        }
+        if (header_.source_size == 0 || header_.source_size > source_->size || header_.target_size == 0) {
+            ESP_LOGE(TAG, "Invalid patch sizes, source %lu, target %lu", header_.source_size, header_.target_size);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        auto err = VerifySource();
+        if (err != ESP_OK) {
+            return err;
+        }
+        ESP_LOGI(TAG, "Applying patch to %s, %lu -> %lu bytes", source_->label, header_.source_size, header_.target_size);
+        mbedtls_sha256_starts(&sha256_, 0);
+        state_ = kStateOpcode;
+    }
+    if (size == 0) {
+        return ESP_OK;
+    }
+    return Inflate(data, size);
+}
+
+esp_err_t OtaPatcher::VerifySource() {
+    // A patch made against another build would produce garbage, so check before erasing anything
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    esp_err_t err = ESP_OK;
+    for (uint32_t offset = 0; offset < header_.source_size; offset += OTA_PATCH_SCRATCH_SIZE) {
+        size_t n = std::min<size_t>(OTA_PATCH_SCRATCH_SIZE, header_.source_size - offset);
+        err = esp_partition_read(source_, offset, scratch_, n);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read %s: %s", source_->label, esp_err_to_name(err));
+            break;
+        }
+        mbedtls_sha256_update(&ctx, scratch_, n);
+    }
+    uint8_t sha256[32];
+    mbedtls_sha256_finish(&ctx, sha256);
+    mbedtls_sha256_free(&ctx);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (memcmp(sha256, header_.source_sha256, sizeof(sha256)) != 0) {
+        ESP_LOGW(TAG, "Patch was made for another firmware");
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+esp_err_t OtaPatcher::Inflate(const uint8_t* data, size_t size) {
+    if (inflate_done_) {
+        ESP_LOGE(TAG, "Unexpected data after the end of the patch");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    while (true) {
+        // The window wraps, tinfl keeps back references inside it
+        size_t in_size = size;
+        size_t out_size = TINFL_LZ_DICT_SIZE - window_pos_;
+        auto status = tinfl_decompress(inflator_, data, &in_size, window_, window_ + window_pos_, &out_size,
+            TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_PARSE_ZLIB_HEADER);
+        data += in_size;
+        size -= in_size;
+        if (out_size > 0) {
+            auto err = ParseOps(window_ + window_pos_, out_size);
+            if (err != ESP_OK) {
+                return err;
+            }
+            window_pos_ = (window_pos_ + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+
+        if (status == TINFL_STATUS_DONE) {
+            inflate_done_ = true;
+            if (size > 0) {
+                ESP_LOGE(TAG, "Unexpected data after the end of the patch");
+                return ESP_ERR_INVALID_SIZE;
+            }
+            return ESP_OK;
+        } else if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Failed to inflate patch: %d", status);
+            return ESP_ERR_INVALID_RESPONSE;
+        } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            return ESP_OK;
+        }
+        // TINFL_STATUS_HAS_MORE_OUTPUT, go around with the wrapped window
+    }
+}
+
+esp_err_t OtaPatcher::ParseOps(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        size_t n = 0;
+        esp_err_t err = ESP_OK;
+        switch (state_) {
+        case kStateOpcode:
+            op_ = data[0];
+            n = 1;
+            if (op_ == kOtaPatchEnd) {
+                state_ = kStateDone;
+            } else if (op_ == kOtaPatchCopy || op_ == kOtaPatchInsert || op_ == kOtaPatchAdd) {
+                args_size_ = 0;
+                state_ = kStateArgs;
+            } else {
+                ESP_LOGE(TAG, "Unknown patch op 0x%02x", op_);
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            break;
+        case kStateArgs: {
+            size_t args_length = op_ == kOtaPatchInsert ? 4 : 8;
+            n = std::min(size, args_length - args_size_);
+            memcpy(args_ + args_size_, data, n);
+            args_size_ += n;
+            if (args_size_ == args_length) {
+                err = StartOp();
+            }
+            break;
+        }
+        case kStateInsert:
+            n = std::min<size_t>(size, op_remaining_);
+            err = Output(data, n);
+            op_remaining_ -= n;
+            if (op_remaining_ == 0) {
+                state_ = kStateOpcode;
+            }
+            break;
+        case kStateAdd:
+            n = std::min<size_t>(size, op_remaining_);
+            err = AddSource(data, n);
+            op_remaining_ -= n;
+            if (op_remaining_ == 0) {
+                state_ = kStateOpcode;
+            }
+            break;
+        default:
+            ESP_LOGE(TAG, "Unexpected ops after the end marker");
+            return ESP_ERR_INVALID_SIZE;
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        data += n;
+        size -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t OtaPatcher::StartOp() {
+    uint32_t length;
+    if (op_ == kOtaPatchInsert) {
+        op_src_ = 0;
+        length = ReadU32(args_);
+    } else {
+        op_src_ = ReadU32(args_);
+        length = ReadU32(args_ + 4);
+        if ((uint64_t)op_src_ + length > header_.source_size) {
+            ESP_LOGE(TAG, "Patch reads past the source, %lu+%lu", op_src_, length);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    if (output_size_ + length > header_.target_size) {
+        ESP_LOGE(TAG, "Patch writes past the target size");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    op_remaining_ = length;
+    state_ = kStateOpcode;
+    if (length == 0) {
+        return ESP_OK;
+    }
+    if (op_ == kOtaPatchCopy) {
+        op_remaining_ = 0;
+        return CopySource(op_src_, length);
+    }
+    state_ = op_ == kOtaPatchInsert ? kStateInsert : kStateAdd;
+    return ESP_OK;
+}
+
+esp_err_t OtaPatcher::CopySource(uint32_t offset, uint32_t length) {
+    while (length > 0) {
+        size_t n = std::min<size_t>(length, OTA_PATCH_SCRATCH_SIZE);
+        auto err = esp_partition_read(source_, offset, scratch_, n);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read %s: %s", source_->label, esp_err_to_name(err));
+            return err;
+        }
+        err = Output(scratch_, n);
+        if (err != ESP_OK) {
+            return err;
+        }
+        offset += n;
+        length -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t OtaPatcher::AddSource(const uint8_t* diff, size_t length) {
+    while (length > 0) {
+        size_t n = std::min<size_t>(length, OTA_PATCH_SCRATCH_SIZE);
+        auto err = esp_partition_read(source_, op_src_, scratch_, n);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read %s: %s", source_->label, esp_err_to_name(err));
+            return err;
+        }
+        for (size_t i = 0; i < n; i++) {
+            scratch_[i] += diff[i];
+        }
+        err = Output(scratch_, n);
+        if (err != ESP_OK) {
+            return err;
+        }
+        op_src_ += n;
+        diff += n;
+        length -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t OtaPatcher::Output(const uint8_t* data, size_t size) {
+    mbedtls_sha256_update(&sha256_, data, size);
+    output_size_ += size;
+    return writer_.Write(data, size);
+}
+
+esp_err_t OtaPatcher::Finish() {
+    if (state_ != kStateDone || !inflate_done_) {
+        ESP_LOGE(TAG, "Patch is truncated");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (output_size_ != header_.target_size) {
+        ESP_LOGE(TAG, "Patch produced %u bytes, expected %lu", output_size_, header_.target_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t sha256[32];
+    mbedtls_sha256_finish(&sha256_, sha256);
+    if (memcmp(sha256, header_.target_sha256, sizeof(sha256)) != 0) {
+        ESP_LOGE(TAG, "Patched firmware doesn't match the target hash");
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,93 @@
+#ifndef OTA_PATCH_H
+#define OTA_PATCH_H
+
+#include <esp_err.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+#include <cstddef>
+#include <cstdint>
+
+class OtaWriter;
+struct tinfl_decompressor_tag;
+
+#define OTA_PATCH_MAGIC 0x50445a58 // "XZDP"
+#define OTA_PATCH_VERSION 1
+
+// 差分包头，不压缩，后面是 zlib 压缩的操作流，由 scripts/ota_delta/make_patch.py 生成
+struct __attribute__((packed)) OtaPatchHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t source_size;       // 运行中分区参与比较的字节数
+    uint32_t target_size;       // 新固件大小
+    uint8_t source_sha256[32];  // 运行中分区 [0, source_size) 的 SHA256
+    uint8_t target_sha256[32];  // 新固件的 SHA256
+};
+static_assert(sizeof(OtaPatchHeader) == 80, "OtaPatchHeader layout must match make_patch.py");
+
+// 操作流，所有整数为小端序
+enum OtaPatchOp : uint8_t {
+    kOtaPatchEnd = 0x00,    // 结束
+    kOtaPatchCopy = 0x01,   // u32 src, u32 len: 复制旧固件
+    kOtaPatchInsert = 0x02, // u32 len, data[len]: 插入新数据
+    kOtaPatchAdd = 0x03,    // u32 src, u32 len, diff[len]: 旧固件逐字节加 diff（模 256）
+};
+
+// Rebuilds the new image from the running partition and a streamed patch, the output goes
+// straight to an OtaWriter. The patch is fed as it downloads, nothing is buffered except
+// the inflate window.
+class OtaPatcher {
+public:
+    OtaPatcher(const esp_partition_t* source, OtaWriter& writer);
+    ~OtaPatcher();
+
+    OtaPatcher(const OtaPatcher&) = delete;
+    OtaPatcher& operator=(const OtaPatcher&) = delete;
+
+    esp_err_t Begin();
+    esp_err_t Feed(const uint8_t* data, size_t size);
+    // Checks that the whole patch was applied and the output matches the target hash
+    esp_err_t Finish();
+
+    inline size_t bytes_output() const { return output_size_; }
+
+private:
+    enum State {
+        kStateHeader,
+        kStateOpcode,
+        kStateArgs,
+        kStateInsert,
+        kStateAdd,
+        kStateDone,
+    };
+
+    const esp_partition_t* source_;
+    OtaWriter& writer_;
+    OtaPatchHeader header_ = {};
+    size_t header_size_ = 0;
+    tinfl_decompressor_tag* inflator_ = nullptr;
+    uint8_t* window_ = nullptr;
+    size_t window_pos_ = 0;
+    bool inflate_done_ = false;
+    uint8_t* scratch_ = nullptr;
+    mbedtls_sha256_context sha256_;
+
+    State state_ = kStateHeader;
+    uint8_t op_ = kOtaPatchEnd;
+    uint8_t args_[8];
+    size_t args_size_ = 0;
+    uint32_t op_src_ = 0;
+    uint32_t op_remaining_ = 0;
+    size_t output_size_ = 0;
+
+    esp_err_t VerifySource();
+    esp_err_t Inflate(const uint8_t* data, size_t size);
+    esp_err_t ParseOps(const uint8_t* data, size_t size);
+    esp_err_t StartOp();
+    esp_err_t CopySource(uint32_t offset, uint32_t length);
+    esp_err_t AddSource(const uint8_t* diff, size_t length);
+    esp_err_t Output(const uint8_t* data, size_t size);
+};
+
+#endif // OTA_PATCH_H
@@ -0,0 +1,182 @@
+#include "ota_writer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_app_format.h>
+#include <esp_app_desc.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "OtaWriter"
+
+OtaWriter::OtaWriter(size_t block_size, int block_count)
+    : block_size_(block_size), block_count_(block_count) {
+}
+
+OtaWriter::~OtaWriter() {
+    if (task_handle_ != nullptr) {
+        Abort();
+    }
+    for (auto& block : blocks_) {
+        heap_caps_free(block.data);
+    }
+    if (free_queue_ != nullptr) {
+        vQueueDelete(free_queue_);
+    }
+    if (full_queue_ != nullptr) {
+        vQueueDelete(full_queue_);
+    }
+    if (done_ != nullptr) {
+        vSemaphoreDelete(done_);
+    }
+}
+
+esp_err_t OtaWriter::Begin(const esp_partition_t* partition) {
+    // Blocks go to PSRAM when there is one, the flash driver copies them through an internal buffer
+    blocks_.reserve(block_count_);
+    for (int i = 0; i < block_count_; i++) {
+        auto data = (uint8_t*)heap_caps_malloc(block_size_, MALLOC_CAP_SPIRAM);
+        if (data == nullptr) {
+            data = (uint8_t*)heap_caps_malloc(block_size_, MALLOC_CAP_8BIT);
+        }
+        if (data == nullptr) {
+            break;
+        }
+        blocks_.push_back({data, 0});
+    }
+    if (blocks_.size() < 2) {
+        ESP_LOGE(TAG, "Failed to allocate %d blocks of %u bytes", block_count_, block_size_);
+        return ESP_ERR_NO_MEM;
+    }
+
+    free_queue_ = xQueueCreate(blocks_.size(), sizeof(OtaBlock*));
+    // One extra entry for the end marker
+    full_queue_ = xQueueCreate(blocks_.size() + 1, sizeof(OtaBlock*));
+    done_ = xSemaphoreCreateBinary();
+    if (free_queue_ == nullptr || full_queue_ == nullptr || done_ == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (auto& block : blocks_) {
+        OtaBlock* pointer = &block;
+        xQueueSend(free_queue_, &pointer, 0);
+    }
+
+    auto err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle_);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to begin OTA: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    if (xTaskCreate([](void* arg) {
+        auto writer = (OtaWriter*)arg;
+        writer->WriteLoop();
+        vTaskDelete(NULL);
+    }, "ota_writer", 4096, this, uxTaskPriorityGet(NULL), &task_handle_) != pdPASS) {
+        esp_ota_abort(update_handle_);
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Writing to %s with %u blocks of %u bytes", partition->label, blocks_.size(), block_size_);
+    return ESP_OK;
+}
+
+void OtaWriter::WriteLoop() {
+    while (true) {
+        OtaBlock* block = nullptr;
+        xQueueReceive(full_queue_, &block, portMAX_DELAY);
+        if (block == nullptr) {
+            break;
+        }
+        // Keep draining after a failure so the reader never waits on a full queue
+        if (error_ == ESP_OK) {
+            auto err = esp_ota_write(update_handle_, block->data, block->size);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+                error_ = err;
+            } else {
+                bytes_written_ += block->size;
+            }
+        }
+        block->size = 0;
+        xQueueSend(free_queue_, &block, portMAX_DELAY);
+    }
+    xSemaphoreGive(done_);
+}
+
+OtaBlock* OtaWriter::AcquireBlock() {
+    OtaBlock* block = nullptr;
+    xQueueReceive(free_queue_, &block, portMAX_DELAY);
+    if (error_ != ESP_OK) {
+        xQueueSend(free_queue_, &block, 0);
+        return nullptr;
+    }
+    return block;
+}
+
+void OtaWriter::Submit(OtaBlock* block) {
+    if (!header_logged_) {
+        header_logged_ = true;
+        size_t offset = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+        if (block->size >= offset + sizeof(esp_app_desc_t)) {
+            auto new_app_info = (const esp_app_desc_t*)(block->data + offset);
+            ESP_LOGI(TAG, "Current version: %s, New version: %s", esp_app_get_description()->version, new_app_info->version);
+        }
+    }
+    xQueueSend(full_queue_, &block, portMAX_DELAY);
+}
+
+esp_err_t OtaWriter::Write(const void* data, size_t size) {
+    auto bytes = (const uint8_t*)data;
+    while (size > 0) {
+        if (current_ == nullptr) {
+            current_ = AcquireBlock();
+            if (current_ == nullptr) {
+                return error_;
+            }
+        }
+        size_t n = std::min(size, block_size_ - current_->size);
+        memcpy(current_->data + current_->size, bytes, n);
+        current_->size += n;
+        bytes += n;
+        size -= n;
+        if (current_->size == block_size_) {
+            Submit(current_);
+            current_ = nullptr;
+        }
+    }
+    return ESP_OK;
+}
+
+void OtaWriter::StopTask() {
+    if (task_handle_ == nullptr) {
+        return;
+    }
+    OtaBlock* end = nullptr;
+    xQueueSend(full_queue_, &end, portMAX_DELAY);
+    xSemaphoreTake(done_, portMAX_DELAY);
+    task_handle_ = nullptr;
+}
+
+esp_err_t OtaWriter::End() {
+    if (current_ != nullptr) {
+        Submit(current_);
+        current_ = nullptr;
+    }
+    StopTask();
+    if (error_ != ESP_OK) {
+        esp_ota_abort(update_handle_);
+        return error_;
+    }
+    auto err = esp_ota_end(update_handle_);
+    if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+        ESP_LOGE(TAG, "Image validation failed, image is corrupted");
+    } else if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to end OTA: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+void OtaWriter::Abort() {
+    StopTask();
+    esp_ota_abort(update_handle_);
+}
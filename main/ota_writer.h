@@ -0,0 +1,62 @@
+#ifndef OTA_WRITER_H
+#define OTA_WRITER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_ota_ops.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct OtaBlock {
+    uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+// Writes firmware blocks to the update partition on its own task, so the next block can be
+// downloaded while the previous one is being erased and written. Blocks cycle between a free
+// and a full queue, nothing is allocated after Begin().
+class OtaWriter {
+public:
+    OtaWriter(size_t block_size, int block_count);
+    ~OtaWriter();
+
+    OtaWriter(const OtaWriter&) = delete;
+    OtaWriter& operator=(const OtaWriter&) = delete;
+
+    esp_err_t Begin(const esp_partition_t* partition);
+    // Copies into the current block, a full block is handed to the writer task
+    esp_err_t Write(const void* data, size_t size);
+    // Writes the last partial block, waits for the queued blocks and validates the image
+    esp_err_t End();
+    void Abort();
+
+    inline size_t block_size() const { return block_size_; }
+    inline size_t bytes_written() const { return bytes_written_; }
+
+private:
+    size_t block_size_;
+    int block_count_;
+    std::vector<OtaBlock> blocks_;
+    OtaBlock* current_ = nullptr;
+    bool header_logged_ = false;
+    QueueHandle_t free_queue_ = nullptr;
+    QueueHandle_t full_queue_ = nullptr;
+    SemaphoreHandle_t done_ = nullptr;
+    TaskHandle_t task_handle_ = nullptr;
+    esp_ota_handle_t update_handle_ = 0;
+    std::atomic<esp_err_t> error_{ESP_OK};
+    std::atomic<size_t> bytes_written_{0};
+
+    void WriteLoop();
+    void StopTask();
+    // Waits for a free block, nullptr once a write has failed
+    OtaBlock* AcquireBlock();
+    void Submit(OtaBlock* block);
+};
+
+#endif // OTA_WRITER_H
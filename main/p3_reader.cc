@@ -0,0 +1,99 @@
+#include "p3_reader.h"
+
+#include <esp_log.h>
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include "protocol.h"
+
+#define TAG "P3Reader"
+
+P3Reader::P3Reader(std::string_view data) {
+    if (data.size() < sizeof(BinaryProtocol3)) {
+        return;
+    }
+    uint32_t magic;
+    memcpy(&magic, data.data(), sizeof(magic));
+    if (magic != P3_V2_MAGIC) {
+        // Legacy stream, frame type 0 first
+        if (data[0] != 0) {
+            ESP_LOGW(TAG, "Not a P3 sound");
+            return;
+        }
+        frames_ = remaining_ = data;
+        return;
+    }
+
+    // Flash mapped assets may sit at any offset, copy the header out
+    P3HeaderV2 header;
+    if (data.size() < sizeof(header)) {
+        ESP_LOGW(TAG, "Truncated P3 header");
+        return;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.version != P3_V2_VERSION || header.header_size < sizeof(header) ||
+        header.data_offset > data.size() || header.header_size + (uint64_t)header.index_size * 4 > header.data_offset ||
+        (header.index_size != 0 && header.index_size != header.frame_count)) {
+        ESP_LOGW(TAG, "Invalid P3 header, version %u", header.version);
+        return;
+    }
+    if (header.channels != 1 || header.frame_duration == 0) {
+        ESP_LOGW(TAG, "Unsupported P3 sound, %u channels, %u ms frames", header.channels, header.frame_duration);
+        return;
+    }
+    sample_rate_ = header.sample_rate;
+    frame_duration_ = header.frame_duration;
+    channels_ = header.channels;
+    frame_count_ = header.frame_count;
+    preroll_frames_ = header.preroll_frames;
+    if (header.index_size != 0) {
+        index_ = reinterpret_cast<const uint8_t*>(data.data()) + header.header_size;
+    }
+    frames_ = remaining_ = data.substr(header.data_offset);
+}
+
+bool P3Reader::Next(std::string_view& payload) {
+    if (remaining_.size() < sizeof(BinaryProtocol3)) {
+        remaining_ = {};
+        return false;
+    }
+    auto p3 = reinterpret_cast<const BinaryProtocol3*>(remaining_.data());
+    size_t payload_size = ntohs(p3->payload_size);
+    size_t frame_size = sizeof(BinaryProtocol3) + payload_size;
+    if (frame_size > remaining_.size()) {
+        ESP_LOGW(TAG, "Truncated P3 frame, %u of %u bytes", remaining_.size(), frame_size);
+        remaining_ = {};
+        return false;
+    }
+    payload = remaining_.substr(sizeof(BinaryProtocol3), payload_size);
+    remaining_.remove_prefix(frame_size);
+    position_++;
+    return true;
+}
+
+bool P3Reader::Seek(uint32_t index) {
+    if (index_ != nullptr) {
+        if (index >= frame_count_) {
+            return false;
+        }
+        uint32_t offset;
+        memcpy(&offset, index_ + index * sizeof(offset), sizeof(offset));
+        if (offset >= frames_.size()) {
+            return false;
+        }
+        remaining_ = frames_.substr(offset);
+        position_ = index;
+        return true;
+    }
+
+    remaining_ = frames_;
+    position_ = 0;
+    std::string_view payload;
+    while (position_ < index) {
+        if (!Next(payload)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#ifndef P3_READER_H
+#define P3_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#define P3_V2_MAGIC 0x32563350  // "P3V2"
+#define P3_V2_VERSION 2
+// 旧格式没有文件头, 固定为 16kHz / 60ms
+#define P3_LEGACY_SAMPLE_RATE 16000
+#define P3_LEGACY_FRAME_DURATION_MS 60
+
+// Layout written by scripts/p3_tools, all little endian. The frames that follow keep the legacy
+// layout, a BinaryProtocol3 header with the big endian payload size in front of each one.
+struct P3HeaderV2 {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;       // Offset of the index, newer versions may append fields
+    uint32_t sample_rate;
+    uint16_t frame_duration;    // ms
+    uint8_t channels;
+    uint8_t reserved;
+    uint32_t frame_count;
+    uint32_t preroll_frames;    // Decoded to settle the decoder but not played
+    uint32_t index_size;        // uint32 frame offsets from data_offset, 0 or frame_count entries
+    uint32_t data_offset;       // From the start of the file
+} __attribute__((packed));
+
+// Reads a P3 sound in place, from flash mapped or PSRAM data, in either layout: v2 with a header
+// and a seek index, or the legacy stream of frames without header, which starts with a zero byte.
+class P3Reader {
+public:
+    P3Reader() = default;
+    // Check valid() afterwards, a malformed header leaves the reader empty
+    explicit P3Reader(std::string_view data);
+
+    bool valid() const { return !frames_.empty(); }
+    int sample_rate() const { return sample_rate_; }
+    int frame_duration() const { return frame_duration_; }
+    int channels() const { return channels_; }
+    // 0 when unknown, the legacy layout does not say
+    uint32_t frame_count() const { return frame_count_; }
+    uint32_t preroll_frames() const { return preroll_frames_; }
+    uint32_t position() const { return position_; }
+    bool AtEnd() const { return remaining_.empty(); }
+
+    // Opus payload of the next frame, false at the end or on a truncated frame
+    bool Next(std::string_view& payload);
+    // Continues at frame `index`: a lookup with the index, a walk from the start without one
+    bool Seek(uint32_t index);
+
+private:
+    std::string_view frames_;
+    std::string_view remaining_;
+    const uint8_t* index_ = nullptr;
+    uint32_t frame_count_ = 0;
+    uint32_t preroll_frames_ = 0;
+    uint32_t position_ = 0;
+    int sample_rate_ = P3_LEGACY_SAMPLE_RATE;
+    int frame_duration_ = P3_LEGACY_FRAME_DURATION_MS;
+    int channels_ = 1;
+};
+
+#endif // P3_READER_H
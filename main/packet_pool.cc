@@ -0,0 +1,152 @@
+#include "packet_pool.h"
+#include "memory_arena.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <new>
+
+#define TAG "PacketPool"
+
+struct PacketBlock {
+    std::atomic<int> refs;
+    uint16_t size;
+    uint16_t capacity;
+    // Index in the pool, -1 for heap blocks
+    int16_t index;
+    uint8_t data[];
+};
+
+AudioPacket::AudioPacket(const AudioPacket& other) : block_(other.block_) {
+    if (block_ != nullptr) {
+        block_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+AudioPacket& AudioPacket::operator=(const AudioPacket& other) {
+    if (block_ != other.block_) {
+        if (other.block_ != nullptr) {
+            other.block_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        Release();
+        block_ = other.block_;
+    }
+    return *this;
+}
+
+AudioPacket& AudioPacket::operator=(AudioPacket&& other) noexcept {
+    if (this != &other) {
+        Release();
+        block_ = other.block_;
+        other.block_ = nullptr;
+    }
+    return *this;
+}
+
+void AudioPacket::Release() {
+    if (block_ != nullptr && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        PacketPool::GetInstance().Free(block_);
+    }
+    block_ = nullptr;
+}
+
+uint8_t* AudioPacket::data() {
+    return block_ != nullptr ? block_->data : nullptr;
+}
+
+const uint8_t* AudioPacket::data() const {
+    return block_ != nullptr ? block_->data : nullptr;
+}
+
+size_t AudioPacket::size() const {
+    return block_ != nullptr ? block_->size : 0;
+}
+
+size_t AudioPacket::capacity() const {
+    return block_ != nullptr ? block_->capacity : 0;
+}
+
+bool AudioPacket::resize(size_t size) {
+    if (block_ == nullptr || size > block_->capacity) {
+        return false;
+    }
+    block_->size = size;
+    return true;
+}
+
+PacketPool::PacketPool() {
+    block_stride_ = (sizeof(PacketBlock) + PACKET_POOL_BLOCK_SIZE + 3) & ~3;
+    slab_ = (uint8_t*)MemoryArenas::GetInstance().Allocate(kArenaAudio, PACKET_POOL_BLOCKS * block_stride_);
+    if (slab_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u x %u bytes, using the heap", PACKET_POOL_BLOCKS, block_stride_);
+        return;
+    }
+
+    for (int i = 0; i < PACKET_POOL_BLOCKS; i++) {
+        auto block = new (slab_ + i * block_stride_) PacketBlock;
+        block->capacity = PACKET_POOL_BLOCK_SIZE;
+        block->index = i;
+        free_list_[i] = i;
+    }
+    free_count_ = PACKET_POOL_BLOCKS;
+}
+
+PacketPool::~PacketPool() {
+    MemoryArenas::GetInstance().Free(slab_);
+}
+
+AudioPacket PacketPool::Allocate(size_t size) {
+    PacketBlock* block = nullptr;
+    if (size <= PACKET_POOL_BLOCK_SIZE) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_count_ > 0) {
+            block = (PacketBlock*)(slab_ + free_list_[--free_count_] * block_stride_);
+        }
+    }
+
+    if (block == nullptr) {
+        if (size > UINT16_MAX) {
+            ESP_LOGE(TAG, "Packet too large: %u bytes", size);
+            return AudioPacket();
+        }
+        // Per frame while the pool is short, kept in the audio arena so the internal heap does not fragment
+        auto memory = MemoryArenas::GetInstance().Allocate(kArenaAudio, sizeof(PacketBlock) + size);
+        if (memory == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate packet: %u bytes", size);
+            return AudioPacket();
+        }
+        // Log the first one only, this runs once per audio frame
+        if (fallback_allocations_++ == 0) {
+            ESP_LOGW(TAG, "Pool exhausted or packet too large (%u bytes), falling back to heap", size);
+        }
+        block = new (memory) PacketBlock;
+        block->capacity = size;
+        block->index = -1;
+    }
+
+    block->refs.store(1, std::memory_order_relaxed);
+    block->size = size;
+    return AudioPacket(block);
+}
+
+AudioPacket PacketPool::Allocate(const uint8_t* data, size_t size) {
+    auto packet = Allocate(size);
+    if (packet) {
+        memcpy(packet.data(), data, size);
+    }
+    return packet;
+}
+
+void PacketPool::Free(PacketBlock* block) {
+    if (block->index < 0) {
+        block->~PacketBlock();
+        MemoryArenas::GetInstance().Free(block);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_list_[free_count_++] = block->index;
+}
+
+size_t PacketPool::FreeBlocks() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return free_count_;
+}
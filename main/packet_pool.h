@@ -0,0 +1,77 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// 音频包缓冲池: 固定数量 x 固定大小
+#define PACKET_POOL_BLOCKS 64
+#define PACKET_POOL_BLOCK_SIZE 512
+
+struct PacketBlock;
+
+// Ref-counted handle to a pooled buffer. Copies share the buffer, so a packet can be captured
+// in a std::function and still be allocated only once; the last handle returns it to the pool.
+class AudioPacket {
+public:
+    AudioPacket() = default;
+    AudioPacket(const AudioPacket& other);
+    AudioPacket(AudioPacket&& other) noexcept : block_(other.block_) { other.block_ = nullptr; }
+    AudioPacket& operator=(const AudioPacket& other);
+    AudioPacket& operator=(AudioPacket&& other) noexcept;
+    ~AudioPacket() { Release(); }
+
+    uint8_t* data();
+    const uint8_t* data() const;
+    size_t size() const;
+    size_t capacity() const;
+    bool empty() const { return size() == 0; }
+    // Shrinks or grows the payload within capacity(), returns false if it does not fit
+    bool resize(size_t size);
+
+    explicit operator bool() const { return block_ != nullptr; }
+
+private:
+    friend class PacketPool;
+    explicit AudioPacket(PacketBlock* block) : block_(block) {}
+
+    PacketBlock* block_ = nullptr;
+
+    void Release();
+};
+
+class PacketPool {
+public:
+    static PacketPool& GetInstance() {
+        static PacketPool instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+
+    // Packets larger than a block, or allocated while the pool is empty, fall back to the heap
+    AudioPacket Allocate(size_t size);
+    AudioPacket Allocate(const uint8_t* data, size_t size);
+
+    size_t FreeBlocks() const;
+    inline uint32_t fallback_allocations() const { return fallback_allocations_; }
+
+private:
+    PacketPool();
+    ~PacketPool();
+
+    mutable std::mutex mutex_;
+    uint8_t* slab_ = nullptr;
+    size_t block_stride_ = 0;
+    uint16_t free_list_[PACKET_POOL_BLOCKS];
+    size_t free_count_ = 0;
+    std::atomic<uint32_t> fallback_allocations_{0};
+
+    friend class AudioPacket;
+    void Free(PacketBlock* block);
+};
+
+#endif // PACKET_POOL_H
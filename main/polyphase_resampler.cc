@@ -0,0 +1,167 @@
+#include "polyphase_resampler.h"
+
+#include <esp_log.h>
+
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+
+#define TAG "PolyphaseResampler"
+
+// 每个相位的抽头数，越大阻带越好，计算量线性增长
+#define RESAMPLER_TAPS_PER_PHASE 24
+#define RESAMPLER_KAISER_BETA 7.0
+// 通带截止频率占较低采样率奈奎斯特频率的比例
+#define RESAMPLER_CUTOFF 0.9
+#define RESAMPLER_MAX_PHASES 320
+
+struct PolyphaseResampler::Kernel {
+    int up;     // L
+    int down;   // M
+    int taps;   // Per phase
+    // Phase major, each phase reversed so the dot product runs forward over the input
+    std::vector<int16_t> coefficients;
+};
+
+static double BesselI0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static std::shared_ptr<const PolyphaseResampler::Kernel> BuildKernel(int up, int down) {
+    auto kernel = std::make_shared<PolyphaseResampler::Kernel>();
+    kernel->up = up;
+    kernel->down = down;
+    kernel->taps = RESAMPLER_TAPS_PER_PHASE;
+    int length = up * kernel->taps;
+    // Cutoff relative to the upsampled rate
+    double cutoff = RESAMPLER_CUTOFF / std::max(up, down);
+    double center = (length - 1) / 2.0;
+    double window_norm = BesselI0(RESAMPLER_KAISER_BETA);
+
+    std::vector<double> prototype(length);
+    for (int i = 0; i < length; i++) {
+        double t = i - center;
+        double sinc = t == 0 ? 1.0 : std::sin(M_PI * cutoff * t) / (M_PI * cutoff * t);
+        double r = t / center;
+        double window = BesselI0(RESAMPLER_KAISER_BETA * std::sqrt(std::max(0.0, 1 - r * r))) / window_norm;
+        prototype[i] = sinc * window;
+    }
+
+    // Every phase gets unity DC gain, which also scales the interpolation by L
+    kernel->coefficients.resize(length);
+    for (int phase = 0; phase < up; phase++) {
+        double sum = 0;
+        for (int k = 0; k < kernel->taps; k++) {
+            sum += prototype[k * up + phase];
+        }
+        for (int k = 0; k < kernel->taps; k++) {
+            double value = prototype[k * up + phase] / sum * 32768.0;
+            kernel->coefficients[phase * kernel->taps + (kernel->taps - 1 - k)] =
+                (int16_t)std::lround(std::fmax(-32768.0, std::fmin(32767.0, value)));
+        }
+    }
+    ESP_LOGI(TAG, "Built %d/%d kernel, %d phases x %d taps", up, down, up, kernel->taps);
+    return kernel;
+}
+
+static std::shared_ptr<const PolyphaseResampler::Kernel> GetKernel(int up, int down) {
+    static std::mutex mutex;
+    static std::vector<std::shared_ptr<const PolyphaseResampler::Kernel>> kernels;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& kernel : kernels) {
+        if (kernel->up == up && kernel->down == down) {
+            return kernel;
+        }
+    }
+    kernels.push_back(BuildKernel(up, down));
+    return kernels.back();
+}
+
+PolyphaseResampler::PolyphaseResampler() {
+}
+
+PolyphaseResampler::~PolyphaseResampler() {
+}
+
+void PolyphaseResampler::Configure(int input_sample_rate, int output_sample_rate) {
+    int divisor = std::gcd(input_sample_rate, output_sample_rate);
+    int up = output_sample_rate / divisor;
+    int down = input_sample_rate / divisor;
+    if (up > RESAMPLER_MAX_PHASES) {
+        ESP_LOGE(TAG, "Unsupported ratio %d -> %d", input_sample_rate, output_sample_rate);
+        kernel_.reset();
+        return;
+    }
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+    kernel_ = GetKernel(up, down);
+    Reset();
+}
+
+void PolyphaseResampler::Reset() {
+    position_ = 0;
+    history_size_ = kernel_ ? kernel_->taps - 1 : 0;
+    history_.assign(history_size_, 0);
+}
+
+int PolyphaseResampler::GetOutputSamples(int input_samples) const {
+    if (!kernel_) {
+        return 0;
+    }
+    return ((int64_t)input_samples * kernel_->up + kernel_->down - 1) / kernel_->down + 1;
+}
+
+int PolyphaseResampler::Process(const int16_t* input, int input_samples, int16_t* output) {
+    if (!kernel_ || input_samples <= 0) {
+        return 0;
+    }
+    const int up = kernel_->up;
+    const int down = kernel_->down;
+    const int taps = kernel_->taps;
+    const int16_t* coefficients = kernel_->coefficients.data();
+
+    // Append the input after the history first, so output may overwrite input.
+    // Capacity only grows to the largest chunk, after that nothing is allocated.
+    history_.resize(history_size_ + input_samples);
+    memcpy(history_.data() + history_size_, input, input_samples * sizeof(int16_t));
+    const int16_t* x = history_.data();
+    const int available = history_size_ + input_samples;
+
+    int produced = 0;
+    uint32_t position = position_;
+    while (true) {
+        int base = position / up;
+        if (base + taps > available) {
+            break;
+        }
+        const int16_t* h = coefficients + (position % up) * taps;
+        const int16_t* s = x + base;
+        // Unity gain phases keep the sum of |h| near 1.2, so 32 bits do not overflow
+        int32_t acc = 1 << 14;
+        int k = 0;
+        for (; k + 4 <= taps; k += 4) {
+            acc += h[k] * s[k] + h[k + 1] * s[k + 1] + h[k + 2] * s[k + 2] + h[k + 3] * s[k + 3];
+        }
+        for (; k < taps; k++) {
+            acc += h[k] * s[k];
+        }
+        acc >>= 15;
+        output[produced++] = acc > 32767 ? 32767 : (acc < -32768 ? -32768 : acc);
+        position += down;
+    }
+
+    // Keep what the next output still needs
+    int consumed = std::min<int>(position / up, available);
+    int keep = available - consumed;
+    memmove(history_.data(), history_.data() + consumed, keep * sizeof(int16_t));
+    history_size_ = keep;
+    history_.resize(keep);
+    position_ = position - consumed * up;
+    return produced;
+}
@@ -0,0 +1,40 @@
+#ifndef POLYPHASE_RESAMPLER_H
+#define POLYPHASE_RESAMPLER_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Rational polyphase resampler for mono int16 PCM. The Q15 kernels are built once per
+// ratio and shared by every instance, each instance only keeps its filter history and
+// phase, so the stream continues seamlessly across calls.
+class PolyphaseResampler {
+public:
+    struct Kernel;
+
+    PolyphaseResampler();
+    ~PolyphaseResampler();
+
+    void Configure(int input_sample_rate, int output_sample_rate);
+    // Upper bound of the samples Process writes for `input_samples`
+    int GetOutputSamples(int input_samples) const;
+    // Returns the samples written, `output` may be the same buffer as `input`
+    int Process(const int16_t* input, int input_samples, int16_t* output);
+    // Drops the history, the next call starts a new stream
+    void Reset();
+
+    inline int input_sample_rate() const { return input_sample_rate_; }
+    inline int output_sample_rate() const { return output_sample_rate_; }
+
+private:
+    std::shared_ptr<const Kernel> kernel_;
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    // Position of the next output in 1/L input samples, relative to the start of history_
+    uint32_t position_ = 0;
+    // The last taps - 1 input samples followed by the current input
+    std::vector<int16_t> history_;
+    int history_size_ = 0;
+};
+
+#endif // POLYPHASE_RESAMPLER_H
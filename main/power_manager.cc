@@ -0,0 +1,57 @@
+#include "power_manager.h"
+
+#include <esp_log.h>
+
+#define TAG "PowerManager"
+
+PowerManager::PowerManager() {
+}
+
+PowerManager::~PowerManager() {
+    if (cpu_lock_ != nullptr) {
+        if (!idle_) {
+            esp_pm_lock_release(cpu_lock_);
+        }
+        esp_pm_lock_delete(cpu_lock_);
+    }
+}
+
+void PowerManager::Initialize(int min_freq_mhz) {
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = min_freq_mhz,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true,
+#else
+        .light_sleep_enable = false,
+#endif
+    };
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure power management: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "active", &cpu_lock_));
+    esp_pm_lock_acquire(cpu_lock_);
+    ESP_LOGI(TAG, "CPU %d-%d MHz, light sleep %s", config.min_freq_mhz, config.max_freq_mhz,
+        config.light_sleep_enable ? "on" : "off");
+#else
+    ESP_LOGW(TAG, "CONFIG_PM_ENABLE is off, the idle mode only stops the timers");
+#endif
+}
+
+void PowerManager::SetIdle(bool idle) {
+    if (idle_ == idle) {
+        return;
+    }
+    idle_ = idle;
+    if (cpu_lock_ != nullptr) {
+        if (idle) {
+            esp_pm_lock_release(cpu_lock_);
+        } else {
+            esp_pm_lock_acquire(cpu_lock_);
+        }
+    }
+    ESP_LOGI(TAG, "%s idle power mode", idle ? "Enter" : "Exit");
+}
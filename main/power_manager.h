@@ -0,0 +1,25 @@
+#ifndef POWER_MANAGER_H
+#define POWER_MANAGER_H
+
+#include <esp_pm.h>
+
+// Dynamic frequency scaling for the idle power mode. While active a CPU_FREQ_MAX lock keeps
+// the core at full speed, in idle it is released, so only the locks of the running drivers
+// (I2S capture for the wake word) decide the clock and automatic light sleep can kick in
+// once none is held.
+class PowerManager {
+public:
+    PowerManager();
+    ~PowerManager();
+
+    // Needs CONFIG_PM_ENABLE, light sleep also needs CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    void Initialize(int min_freq_mhz);
+    void SetIdle(bool idle);
+    bool idle() const { return idle_; }
+
+private:
+    esp_pm_lock_handle_t cpu_lock_ = nullptr;
+    bool idle_ = false;
+};
+
+#endif // POWER_MANAGER_H
@@ -0,0 +1,140 @@
+#include "binary_control.h"
+#include "protocol.h"
+
+#include <esp_log.h>
+#include <arpa/inet.h>
+#include <cstring>
+
+#define TAG "BinaryControl"
+
+// 枚举值表, 下标即编码, 只能在末尾追加
+static const std::string_view kControlValues[] = {
+    "start", "stop", "detect", "speech", "silence", "sentence_start", "sentence_end",
+    "auto", "manual", "realtime", "wake_word_detected",
+};
+
+static const char* const kControlKinds[] = {
+    nullptr, "listen", "abort", "goodbye", "latency", "tts", "stt", "llm",
+};
+
+// JSON key of every tag, in tag order
+static const char* const kControlKeys[] = {
+    nullptr, "state", "mode", "reason", "text", "emotion", "t",
+};
+
+ControlWriter::ControlWriter(ControlMessageKind kind) {
+    auto header = (BinaryProtocol3*)buffer_;
+    header->type = BINARY_CONTROL_TYPE;
+    header->reserved = kind;
+    header->payload_size = 0;
+    length_ = sizeof(BinaryProtocol3);
+}
+
+ControlWriter& ControlWriter::AddValue(ControlTag tag, std::string_view value) {
+    for (size_t i = 0; i < sizeof(kControlValues) / sizeof(kControlValues[0]); i++) {
+        if (kControlValues[i] == value) {
+            uint8_t index = i;
+            AddField(tag, &index, sizeof(index));
+            return *this;
+        }
+    }
+    ESP_LOGW(TAG, "No code for value %.*s", (int)value.size(), value.data());
+    overflow_ = true;
+    return *this;
+}
+
+ControlWriter& ControlWriter::AddString(ControlTag tag, std::string_view value) {
+    AddField(tag, value.data(), value.size());
+    return *this;
+}
+
+ControlWriter& ControlWriter::AddUint32(ControlTag tag, uint32_t value) {
+    uint32_t be = htonl(value);
+    AddField(tag, &be, sizeof(be));
+    return *this;
+}
+
+void ControlWriter::AddField(ControlTag tag, const void* data, size_t size) {
+    size_t length_size = size < 0x80 ? 1 : 2;
+    if (overflow_ || size > 0x7fff || length_ + 1 + length_size + size > sizeof(buffer_)) {
+        overflow_ = true;
+        return;
+    }
+    buffer_[length_++] = tag;
+    if (length_size == 1) {
+        buffer_[length_++] = size;
+    } else {
+        buffer_[length_++] = 0x80 | (size >> 8);
+        buffer_[length_++] = size & 0xff;
+    }
+    memcpy(buffer_ + length_, data, size);
+    length_ += size;
+}
+
+std::string_view ControlWriter::Finish() {
+    if (overflow_) {
+        return std::string_view();
+    }
+    auto header = (BinaryProtocol3*)buffer_;
+    header->payload_size = htons(length_ - sizeof(BinaryProtocol3));
+    return std::string_view((const char*)buffer_, length_);
+}
+
+std::string_view DecodeBinaryControl(const uint8_t* data, size_t size, JsonWriter& json) {
+    if (size < sizeof(BinaryProtocol3)) {
+        return std::string_view();
+    }
+    auto header = (const BinaryProtocol3*)data;
+    size_t payload_size = ntohs(header->payload_size);
+    if (header->type != BINARY_CONTROL_TYPE || header->reserved == 0
+        || header->reserved >= sizeof(kControlKinds) / sizeof(kControlKinds[0])
+        || sizeof(BinaryProtocol3) + payload_size > size) {
+        ESP_LOGE(TAG, "Invalid control frame, kind %u, size %u", header->reserved, size);
+        return std::string_view();
+    }
+    json.AddString("type", kControlKinds[header->reserved]);
+
+    const uint8_t* p = header->payload;
+    const uint8_t* end = p + payload_size;
+    while (p < end) {
+        uint8_t tag = *p++;
+        if (p >= end) {
+            return std::string_view();
+        }
+        size_t length = *p++;
+        if (length & 0x80) {
+            if (p >= end) {
+                return std::string_view();
+            }
+            length = ((length & 0x7f) << 8) | *p++;
+        }
+        if (length > (size_t)(end - p)) {
+            return std::string_view();
+        }
+        // Unknown tags are skipped, newer servers may send more fields
+        if (tag > 0 && tag < sizeof(kControlKeys) / sizeof(kControlKeys[0])) {
+            auto key = kControlKeys[tag];
+            switch (tag) {
+            case kControlTagState:
+            case kControlTagMode:
+            case kControlTagReason:
+                if (length == 1 && p[0] < sizeof(kControlValues) / sizeof(kControlValues[0])) {
+                    json.AddString(key, kControlValues[p[0]]);
+                }
+                break;
+            case kControlTagTimestamp:
+                if (length == sizeof(uint32_t)) {
+                    uint32_t be;
+                    memcpy(&be, p, sizeof(be));
+                    json.AddInt(key, (int)ntohl(be));
+                }
+                break;
+            default:
+                json.AddString(key, std::string_view((const char*)p, length));
+                break;
+            }
+        }
+        p += length;
+    }
+    return json.Finish();
+}
@@ -0,0 +1,64 @@
+#ifndef BINARY_CONTROL_H
+#define BINARY_CONTROL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "json_message.h"
+
+// BinaryProtocol3.type of a control frame, audio frames use 0
+#define BINARY_CONTROL_TYPE 0x02
+// 固定格式的上行控制消息都能放下, 放不下时回退到 JSON
+#define BINARY_CONTROL_MESSAGE_SIZE 128
+
+// Compact encoding of the small, frequent control messages, negotiated in hello with
+// "control":"tlv". A frame is a BinaryProtocol3 header, with the message kind in `reserved`,
+// followed by TLV fields: tag, length (one byte below 0x80, otherwise two bytes with the top
+// bit set) and value. The session id is bound when the channel opens and is never repeated.
+// Everything else (hello, iot, telemetry, trace, ...) stays JSON.
+enum ControlMessageKind : uint8_t {
+    kControlListen = 1,
+    kControlAbort,
+    kControlGoodbye,
+    kControlLatency,
+    kControlTts,
+    kControlStt,
+    kControlLlm,
+};
+
+enum ControlTag : uint8_t {
+    kControlTagState = 1,   // Enumerated value
+    kControlTagMode,        // Enumerated value
+    kControlTagReason,      // Enumerated value
+    kControlTagText,        // UTF-8 string
+    kControlTagEmotion,     // UTF-8 string
+    kControlTagTimestamp,   // Big endian uint32
+};
+
+// Writes one control frame into its own buffer. Finish() returns an empty view when a field
+// did not fit or an enumerated value is not in the shared table, the caller then sends JSON.
+class ControlWriter {
+public:
+    explicit ControlWriter(ControlMessageKind kind);
+
+    // `value` must be one of the enumerated strings ("start", "stop", "auto", ...)
+    ControlWriter& AddValue(ControlTag tag, std::string_view value);
+    ControlWriter& AddString(ControlTag tag, std::string_view value);
+    ControlWriter& AddUint32(ControlTag tag, uint32_t value);
+
+    std::string_view Finish();
+
+private:
+    uint8_t buffer_[BINARY_CONTROL_MESSAGE_SIZE];
+    size_t length_;
+    bool overflow_ = false;
+
+    void AddField(ControlTag tag, const void* data, size_t size);
+};
+
+// Rewrites a downlink control frame as the JSON message it stands for, so the application
+// keeps one handler for both encodings. Returns an empty view on a malformed frame.
+std::string_view DecodeBinaryControl(const uint8_t* data, size_t size, JsonWriter& json);
+
+#endif // BINARY_CONTROL_H
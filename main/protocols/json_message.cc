@@ -0,0 +1,409 @@
+#include "json_message.h"
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+
+static const char* SkipSpace(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// `p` points at the opening quote, returns the closing quote or nullptr
+static const char* SkipString(const char* p, const char* end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '"') {
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+// `p` points at '{' or '[', returns the matching bracket or nullptr
+static const char* SkipContainer(const char* p, const char* end) {
+    int depth = 0;
+    for (; p < end; p++) {
+        if (*p == '"') {
+            p = SkipString(p, end);
+            if (p == nullptr) {
+                return nullptr;
+            }
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (--depth == 0) {
+                return p;
+            }
+        }
+    }
+    return nullptr;
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool ParseHex4(const char* p, const char* end, uint32_t& value) {
+    if (end - p < 4) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = HexValue(p[i]);
+        if (digit < 0) {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+static void AppendUtf8(std::string& out, uint32_t code) {
+    if (code < 0x80) {
+        out.push_back(code);
+    } else if (code < 0x800) {
+        out.push_back(0xC0 | (code >> 6));
+        out.push_back(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out.push_back(0xE0 | (code >> 12));
+        out.push_back(0x80 | ((code >> 6) & 0x3F));
+        out.push_back(0x80 | (code & 0x3F));
+    } else {
+        out.push_back(0xF0 | (code >> 18));
+        out.push_back(0x80 | ((code >> 12) & 0x3F));
+        out.push_back(0x80 | ((code >> 6) & 0x3F));
+        out.push_back(0x80 | (code & 0x3F));
+    }
+}
+
+JsonMessage::JsonMessage(const char* data, size_t length) {
+    const char* end = data + length;
+    const char* p = SkipSpace(data, end);
+    if (p == end || *p != '{') {
+        return;
+    }
+    p = SkipSpace(p + 1, end);
+    if (p < end && *p == '}') {
+        valid_ = true;
+        return;
+    }
+
+    while (p < end) {
+        if (*p != '"') {
+            return;
+        }
+        const char* key_end = SkipString(p, end);
+        if (key_end == nullptr) {
+            return;
+        }
+        std::string_view key(p + 1, key_end - p - 1);
+
+        p = SkipSpace(key_end + 1, end);
+        if (p == end || *p != ':') {
+            return;
+        }
+        p = SkipSpace(p + 1, end);
+        if (p == end) {
+            return;
+        }
+
+        std::string_view value;
+        char kind = *p;
+        if (kind == '"') {
+            const char* value_end = SkipString(p, end);
+            if (value_end == nullptr) {
+                return;
+            }
+            value = std::string_view(p + 1, value_end - p - 1);
+            p = value_end + 1;
+        } else if (kind == '{' || kind == '[') {
+            const char* value_end = SkipContainer(p, end);
+            if (value_end == nullptr) {
+                return;
+            }
+            value = std::string_view(p, value_end - p + 1);
+            p = value_end + 1;
+        } else {
+            const char* value_start = p;
+            while (p < end && *p != ',' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+                p++;
+            }
+            value = std::string_view(value_start, p - value_start);
+        }
+
+        if (field_count_ < JSON_MESSAGE_MAX_FIELDS) {
+            fields_[field_count_++] = Field{ key, value, kind };
+        }
+
+        p = SkipSpace(p, end);
+        if (p == end) {
+            return;
+        }
+        if (*p == '}') {
+            valid_ = true;
+            return;
+        }
+        if (*p != ',') {
+            return;
+        }
+        p = SkipSpace(p + 1, end);
+    }
+}
+
+const JsonMessage::Field* JsonMessage::Find(std::string_view key) const {
+    for (size_t i = 0; i < field_count_; i++) {
+        if (fields_[i].key == key) {
+            return &fields_[i];
+        }
+    }
+    return nullptr;
+}
+
+bool JsonMessage::Has(std::string_view key) const {
+    auto field = Find(key);
+    return field != nullptr && field->value != "null";
+}
+
+std::string_view JsonMessage::Get(std::string_view key) const {
+    auto field = Find(key);
+    return field != nullptr ? field->value : std::string_view();
+}
+
+bool JsonMessage::GetString(std::string_view key, std::string& value) const {
+    auto field = Find(key);
+    if (field == nullptr || field->kind != '"') {
+        return false;
+    }
+
+    const char* p = field->value.data();
+    const char* end = p + field->value.size();
+    value.clear();
+    value.reserve(field->value.size());
+    while (p < end) {
+        if (*p != '\\') {
+            value.push_back(*p++);
+            continue;
+        }
+        if (++p == end) {
+            return false;
+        }
+        char c = *p++;
+        switch (c) {
+            case 'b': value.push_back('\b'); break;
+            case 'f': value.push_back('\f'); break;
+            case 'n': value.push_back('\n'); break;
+            case 'r': value.push_back('\r'); break;
+            case 't': value.push_back('\t'); break;
+            case 'u': {
+                uint32_t code;
+                if (!ParseHex4(p, end, code)) {
+                    return false;
+                }
+                p += 4;
+                // Characters outside the BMP come as a surrogate pair
+                uint32_t low;
+                if (code >= 0xD800 && code < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u'
+                    && ParseHex4(p + 2, end, low) && low >= 0xDC00 && low < 0xE000) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                AppendUtf8(value, code);
+                break;
+            }
+            default:
+                // \" \\ \/
+                value.push_back(c);
+                break;
+        }
+    }
+    return true;
+}
+
+bool JsonMessage::GetInt(std::string_view key, int& value) const {
+    auto field = Find(key);
+    if (field == nullptr || field->kind == '"' || field->kind == '{' || field->kind == '[') {
+        return false;
+    }
+    auto begin = field->value.data();
+    auto end = begin + field->value.size();
+    // Fractions are truncated like cJSON's valueint
+    return std::from_chars(begin, end, value).ec == std::errc();
+}
+
+JsonMessage JsonMessage::GetObject(std::string_view key) const {
+    auto field = Find(key);
+    if (field == nullptr || field->kind != '{') {
+        return JsonMessage();
+    }
+    return JsonMessage(field->value);
+}
+
+JsonArrayReader::JsonArrayReader(std::string_view json) {
+    const char* end = json.data() + json.size();
+    const char* p = SkipSpace(json.data(), end);
+    if (p < end && *p == '[') {
+        p_ = p + 1;
+        end_ = end;
+    }
+}
+
+bool JsonArrayReader::Next(std::string_view& item) {
+    const char* p = SkipSpace(p_, end_);
+    if (p == end_ || *p == ']') {
+        return false;
+    }
+
+    const char* item_end;
+    if (*p == '"') {
+        item_end = SkipString(p, end_);
+    } else if (*p == '{' || *p == '[') {
+        item_end = SkipContainer(p, end_);
+    } else {
+        item_end = p;
+        while (item_end + 1 < end_ && item_end[1] != ',' && item_end[1] != ']' && item_end[1] != ' '
+            && item_end[1] != '\t' && item_end[1] != '\n' && item_end[1] != '\r') {
+            item_end++;
+        }
+    }
+    if (item_end == nullptr) {
+        p_ = end_;
+        return false;
+    }
+    item = std::string_view(p, item_end - p + 1);
+
+    p = SkipSpace(item_end + 1, end_);
+    if (p < end_ && *p == ',') {
+        p++;
+    }
+    p_ = p;
+    return true;
+}
+
+JsonWriter::JsonWriter(char* buffer, size_t size) : buffer_(buffer), size_(size) {
+    Append('{');
+}
+
+void JsonWriter::Append(char c) {
+    if (length_ >= size_) {
+        overflow_ = true;
+        return;
+    }
+    buffer_[length_++] = c;
+}
+
+void JsonWriter::Append(std::string_view text) {
+    if (text.size() > size_ - length_) {
+        overflow_ = true;
+        return;
+    }
+    memcpy(buffer_ + length_, text.data(), text.size());
+    length_ += text.size();
+}
+
+void JsonWriter::AppendEscaped(std::string_view text) {
+    static const char kHex[] = "0123456789abcdef";
+    Append('"');
+    for (unsigned char c : text) {
+        switch (c) {
+            case '"': Append("\\\""); break;
+            case '\\': Append("\\\\"); break;
+            case '\n': Append("\\n"); break;
+            case '\r': Append("\\r"); break;
+            case '\t': Append("\\t"); break;
+            default:
+                if (c < 0x20) {
+                    char escaped[] = { '\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xF] };
+                    Append(std::string_view(escaped, sizeof(escaped)));
+                } else {
+                    Append(static_cast<char>(c));
+                }
+                break;
+        }
+    }
+    Append('"');
+}
+
+void JsonWriter::AppendKey(std::string_view key) {
+    if (need_comma_) {
+        Append(',');
+    }
+    need_comma_ = true;
+    AppendEscaped(key);
+    Append(':');
+}
+
+JsonWriter& JsonWriter::AddString(std::string_view key, std::string_view value) {
+    AppendKey(key);
+    AppendEscaped(value);
+    return *this;
+}
+
+JsonWriter& JsonWriter::AddInt(std::string_view key, int value) {
+    AppendKey(key);
+    char digits[12];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    Append(std::string_view(digits, result.ptr - digits));
+    return *this;
+}
+
+JsonWriter& JsonWriter::AddBool(std::string_view key, bool value) {
+    AppendKey(key);
+    Append(value ? "true" : "false");
+    return *this;
+}
+
+JsonWriter& JsonWriter::AddRaw(std::string_view key, std::string_view json) {
+    AppendKey(key);
+    Append(json);
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginObject(std::string_view key) {
+    AppendKey(key);
+    Append('{');
+    need_comma_ = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndObject() {
+    Append('}');
+    need_comma_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginArray(std::string_view key) {
+    AppendKey(key);
+    Append('[');
+    need_comma_ = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::AddRawItem(std::string_view json) {
+    if (need_comma_) {
+        Append(',');
+    }
+    need_comma_ = true;
+    Append(json);
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndArray() {
+    Append(']');
+    need_comma_ = true;
+    return *this;
+}
+
+std::string_view JsonWriter::Finish() {
+    Append('}');
+    if (overflow_) {
+        return std::string_view();
+    }
+    return std::string_view(buffer_, length_);
+}
@@ -0,0 +1,94 @@
+#ifndef JSON_MESSAGE_H
+#define JSON_MESSAGE_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// 顶层字段数上限, 超出的字段被忽略
+#define JSON_MESSAGE_MAX_FIELDS 16
+// 控制消息缓冲区大小, 足够容纳 hello / listen / abort 等固定格式的消息
+#define JSON_CONTROL_MESSAGE_SIZE 256
+
+// Length bounded, non-allocating view of a JSON object. One pass over the text records where
+// each top level value starts and ends; values are only decoded when asked for, and nested
+// objects are scanned the same way on demand. The text must outlive the message.
+class JsonMessage {
+public:
+    JsonMessage() = default;
+    JsonMessage(const char* data, size_t length);
+    explicit JsonMessage(std::string_view json) : JsonMessage(json.data(), json.size()) {}
+
+    inline bool valid() const { return valid_; }
+    // Raw value of "type", server message types never need unescaping
+    inline std::string_view type() const { return Get("type"); }
+
+    bool Has(std::string_view key) const;
+    // Raw value: strings without their quotes and still escaped, objects and arrays with their brackets
+    std::string_view Get(std::string_view key) const;
+    bool GetString(std::string_view key, std::string& value) const;
+    bool GetInt(std::string_view key, int& value) const;
+    JsonMessage GetObject(std::string_view key) const;
+
+private:
+    struct Field {
+        std::string_view key;
+        std::string_view value;
+        char kind;  // First character of the value: '"', '{', '[' or the scalar itself
+    };
+
+    Field fields_[JSON_MESSAGE_MAX_FIELDS];
+    size_t field_count_ = 0;
+    bool valid_ = false;
+
+    const Field* Find(std::string_view key) const;
+};
+
+// Walks the items of a JSON array in place, each item is returned as its raw text
+class JsonArrayReader {
+public:
+    explicit JsonArrayReader(std::string_view json);
+
+    // Returns false at the end of the array or on malformed input
+    bool Next(std::string_view& item);
+
+private:
+    const char* p_ = nullptr;
+    const char* end_ = nullptr;
+};
+
+// Writes a JSON object into a caller supplied buffer, usually on the stack. Commas and string
+// escaping are handled here; if the buffer runs out, Finish() returns an empty view.
+class JsonWriter {
+public:
+    JsonWriter(char* buffer, size_t size);
+
+    JsonWriter& AddString(std::string_view key, std::string_view value);
+    JsonWriter& AddInt(std::string_view key, int value);
+    JsonWriter& AddBool(std::string_view key, bool value);
+    // `json` is copied verbatim, it must already be valid JSON
+    JsonWriter& AddRaw(std::string_view key, std::string_view json);
+    JsonWriter& BeginObject(std::string_view key);
+    JsonWriter& EndObject();
+    JsonWriter& BeginArray(std::string_view key);
+    // `json` is copied verbatim as the next array item
+    JsonWriter& AddRawItem(std::string_view json);
+    JsonWriter& EndArray();
+
+    // Closes the outermost object and returns the message, call once
+    std::string_view Finish();
+
+private:
+    char* buffer_;
+    size_t size_;
+    size_t length_ = 0;
+    bool need_comma_ = false;
+    bool overflow_ = false;
+
+    void Append(char c);
+    void Append(std::string_view text);
+    void AppendEscaped(std::string_view text);
+    void AppendKey(std::string_view key);
+};
+
+#endif // JSON_MESSAGE_H
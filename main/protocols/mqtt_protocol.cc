@@ -1,13 +1,12 @@
 #include "mqtt_protocol.h"
 #include "board.h"
 #include "application.h"
+#include "trace.h"
 #include "settings.h"
+#include "deferred_log.h"
 
 #include <esp_log.h>
 #include <ml307_mqtt.h>
-#include <ml307_udp.h>
-#include <cstring>
-#include <arpa/inet.h>
 #include "assets/lang_config.h"
 
 #define TAG "MQTT"
@@ -18,9 +17,7 @@ MqttProtocol::MqttProtocol() {
 
 MqttProtocol::~MqttProtocol() {
     ESP_LOGI(TAG, "MqttProtocol deinit");
-    if (udp_ != nullptr) {
-        delete udp_;
-    }
+    udp_channel_.Close();
     if (mqtt_ != nullptr) {
         delete mqtt_;
     }
@@ -60,33 +57,42 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        ESP_LOGI(TAG, "Received MQTT message, topic: %s, payload: %s", topic.c_str(), payload.c_str());
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
-            ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
+        ArenaBuffer control;
+        std::string_view text = payload;
+        if (binary_control_ && !payload.empty() && (uint8_t)payload[0] == BINARY_CONTROL_TYPE) {
+            // JSON always starts with '{', so the two encodings share the topic
+            text = DecodeControl((const uint8_t*)payload.data(), payload.size(), control);
+            if (text.empty()) {
+                return;
+            }
+        } else {
+            DLOG_TEXT(ESP_LOG_INFO, TAG, "Received MQTT message", payload.data(), payload.size());
+        }
+        JsonMessage message(text);
+        if (!message.valid()) {
+            ESP_LOGE(TAG, "Failed to parse json message %.*s", (int)text.size(), text.data());
             return;
         }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (type == nullptr) {
+        auto type = message.type();
+        if (type.empty()) {
             ESP_LOGE(TAG, "Message type is not specified");
-            cJSON_Delete(root);
             return;
         }
 
-        if (strcmp(type->valuestring, "hello") == 0) {
-            ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
+        if (type == "hello") {
+            ParseServerHello(message);
+        } else if (type == "goodbye") {
+            std::string session_id;
+            bool has_session_id = message.GetString("session_id", session_id);
+            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", has_session_id ? session_id.c_str() : "null");
+            if (!has_session_id || session_id_ == session_id) {
                 Application::GetInstance().Schedule([this]() {
                     CloseAudioChannel();
                 });
             }
         } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+            on_incoming_json_(message);
         }
-        cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -101,59 +107,48 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     return true;
 }
 
-bool MqttProtocol::SendText(const std::string& text) {
+bool MqttProtocol::SendText(std::string_view text) {
     if (publish_topic_.empty()) {
         return false;
     }
-    if (!mqtt_->Publish(publish_topic_, text)) {
-        ESP_LOGE(TAG, "Failed to publish message: %s", text.c_str());
+    if (text.empty()) {
+        ESP_LOGE(TAG, "Message does not fit its buffer");
+        return false;
+    }
+    if (!mqtt_->Publish(publish_topic_, std::string(text))) {
+        ESP_LOGE(TAG, "Failed to publish message: %.*s", (int)text.size(), text.data());
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
     }
     return true;
 }
 
-void MqttProtocol::SendAudio(const std::vector<uint8_t>& data) {
-    std::lock_guard<std::mutex> lock(channel_mutex_);
-    if (udp_ == nullptr) {
-        return;
+bool MqttProtocol::SendBinary(std::string_view frame) {
+    if (publish_topic_.empty()) {
+        return false;
     }
-
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(data.size());
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
-
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + data.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
-
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, data.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)data.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
-        ESP_LOGE(TAG, "Failed to encrypt audio data");
-        return;
+    if (!mqtt_->Publish(publish_topic_, std::string(frame))) {
+        ESP_LOGE(TAG, "Failed to publish control frame, size: %u", frame.size());
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
     }
+    return true;
+}
 
+void MqttProtocol::SendAudio(const AudioPacket& packet) {
     busy_sending_audio_ = true;
-    udp_->Send(encrypted);
+    size_t size = udp_channel_.Send(packet);
     busy_sending_audio_ = false;
+    if (size > 0) {
+        metrics_.OnUplink(size);
+    }
 }
 
 void MqttProtocol::CloseAudioChannel() {
-    {
-        std::lock_guard<std::mutex> lock(channel_mutex_);
-        if (udp_ != nullptr) {
-            delete udp_;
-            udp_ = nullptr;
-        }
-    }
+    udp_channel_.Close();
 
-    std::string message = "{";
-    message += "\"session_id\":\"" + session_id_ + "\",";
-    message += "\"type\":\"goodbye\"";
-    message += "}";
-    SendText(message);
+    FinishMetrics(mqtt_ != nullptr && mqtt_->IsConnected());
+    SendGoodbye();
 
     if (on_audio_channel_closed_ != nullptr) {
         on_audio_channel_closed_();
@@ -161,6 +156,7 @@ void MqttProtocol::CloseAudioChannel() {
 }
 
 bool MqttProtocol::OpenAudioChannel() {
+    TRACE_SCOPE(kTraceOpenAudioChannel);
     if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
         ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
         if (!StartMqttClient(true)) {
@@ -172,16 +168,18 @@ bool MqttProtocol::OpenAudioChannel() {
     error_occurred_ = false;
     session_id_ = "";
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
+    metrics_.Begin();
 
     // 发送 hello 消息申请 UDP 通道
-    std::string message = "{";
-    message += "\"type\":\"hello\",";
-    message += "\"version\": 3,";
-    message += "\"transport\":\"udp\",";
-    message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
-    if (!SendText(message)) {
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("type", "hello").AddInt("version", 3).AddString("transport", "udp");
+    AddControlParams(json);
+    json.BeginObject("audio_params").AddString("format", "opus").AddInt("sample_rate", 16000).AddInt("channels", 1);
+    AddUplinkAudioParams(json);
+    json.EndObject();
+    metrics_.OnHelloSent();
+    if (!SendText(json.Finish())) {
         return false;
     }
 
@@ -193,123 +191,48 @@ bool MqttProtocol::OpenAudioChannel() {
         return false;
     }
 
-    std::lock_guard<std::mutex> lock(channel_mutex_);
-    if (udp_ != nullptr) {
-        delete udp_;
-    }
-    udp_ = Board::GetInstance().CreateUdp();
-    udp_->OnMessage([this](const std::string& data) {
-        if (data.size() < sizeof(aes_nonce_)) {
-            ESP_LOGE(TAG, "Invalid audio packet size: %zu", data.size());
-            return;
-        }
-        ESP_LOGI(TAG, "Received UDP audio packet, size: %zu", data.size());
-        if (data[0] != 0x01) {
-            ESP_LOGE(TAG, "Invalid audio packet type: %x", data[0]);
-            return;
-        }
-        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
-        }
-
-        std::vector<uint8_t> decrypted;
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        decrypted.resize(decrypted_size);
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)decrypted.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
-            return;
-        }
+    udp_channel_.Open([this](AudioPacket&& packet, uint32_t sequence, size_t wire_size) {
+        metrics_.OnDownlink(wire_size, sequence);
         if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(decrypted));
+            on_incoming_audio_(std::move(packet), sequence);
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
-    udp_->Connect(udp_server_, udp_port_);
-
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
     }
     return true;
 }
 
-void MqttProtocol::ParseServerHello(const cJSON* root) {
-    auto transport = cJSON_GetObjectItem(root, "transport");
-    if (transport == nullptr || strcmp(transport->valuestring, "udp") != 0) {
-        ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
+void MqttProtocol::ParseServerHello(const JsonMessage& root) {
+    auto transport = root.Get("transport");
+    if (transport != "udp") {
+        ESP_LOGE(TAG, "Unsupported transport: %.*s", (int)transport.size(), transport.data());
         return;
     }
 
-    auto session_id = cJSON_GetObjectItem(root, "session_id");
-    if (session_id != nullptr) {
-        session_id_ = session_id->valuestring;
+    if (root.GetString("session_id", session_id_)) {
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
     // Get sample rate from hello message
-    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
-    if (audio_params != NULL) {
-        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
-        if (sample_rate != NULL) {
-            server_sample_rate_ = sample_rate->valueint;
-        }
-        auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
-        if (frame_duration != NULL) {
-            server_frame_duration_ = frame_duration->valueint;
-        }
+    auto audio_params = root.GetObject("audio_params");
+    if (audio_params.valid()) {
+        audio_params.GetInt("sample_rate", server_sample_rate_);
+        audio_params.GetInt("frame_duration", server_frame_duration_);
+        ParseUplinkAudioParams(audio_params);
     }
     ESP_LOGI(TAG, "Server audio params: sample_rate=%d, frame_duration=%d", server_sample_rate_, server_frame_duration_);
 
-    auto udp = cJSON_GetObjectItem(root, "udp");
-    if (udp == nullptr) {
-        ESP_LOGE(TAG, "UDP is not specified");
+    ParseControlParams(root);
+    if (!udp_channel_.Configure(root.GetObject("udp"))) {
         return;
     }
-    udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
-    udp_port_ = cJSON_GetObjectItem(udp, "port")->valueint;
-    auto key = cJSON_GetObjectItem(udp, "key")->valuestring;
-    auto nonce = cJSON_GetObjectItem(udp, "nonce")->valuestring;
-
-    // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
-    // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
-    local_sequence_ = 0;
-    remote_sequence_ = 0;
+    metrics_.OnHelloReceived();
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
-static const char hex_chars[] = "0123456789ABCDEF";
-// 辅助函数，将单个十六进制字符转换为对应的数值
-static inline uint8_t CharToHex(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    return 0;  // 对于无效输入，返回0
-}
-
-std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
-    std::string decoded;
-    decoded.reserve(hex_string.size() / 2);
-    for (size_t i = 0; i < hex_string.size(); i += 2) {
-        char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
-        decoded.push_back(byte);
-    }
-    return decoded;
-}
-
 bool MqttProtocol::IsAudioChannelOpened() const {
-    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+    return udp_channel_.IsOpened() && !error_occurred_ && !IsTimeout();
 }
@@ -3,10 +3,8 @@
 
 
 #include "protocol.h"
+#include "udp_audio_channel.h"
 #include <mqtt.h>
-#include <udp.h>
-#include <cJSON.h>
-#include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
@@ -26,7 +24,7 @@ public:
     ~MqttProtocol();
 
     void Start() override;
-    void SendAudio(const std::vector<uint8_t>& data) override;
+    void SendAudio(const AudioPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
@@ -40,21 +38,15 @@ private:
     std::string password_;
     std::string publish_topic_;
 
-    std::mutex channel_mutex_;
     Mqtt* mqtt_ = nullptr;
-    Udp* udp_ = nullptr;
-    mbedtls_aes_context aes_ctx_;
-    std::string aes_nonce_;
-    std::string udp_server_;
-    int udp_port_;
-    uint32_t local_sequence_;
-    uint32_t remote_sequence_;
+    UdpAudioChannel udp_channel_;
 
     bool StartMqttClient(bool report_error=false);
-    void ParseServerHello(const cJSON* root);
-    std::string DecodeHexString(const std::string& hex_string);
+    void ParseServerHello(const JsonMessage& root);
 
-    bool SendText(const std::string& text) override;
+    bool SendText(std::string_view text) override;
+    bool CanSendBinary() const override { return true; }
+    bool SendBinary(std::string_view frame) override;
 };
 
 
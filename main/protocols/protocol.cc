@@ -1,14 +1,27 @@
 #include "protocol.h"
+#include "audio_telemetry.h"
+#include "settings.h"
+#include "memory_arena.h"
+#include "timer_service.h"
 
 #include <esp_log.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <algorithm>
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
+Protocol::~Protocol() {
+    if (batch_timer_ != nullptr) {
+        TimerService::GetInstance().Delete(batch_timer_);
+    }
+}
+
+void Protocol::OnIncomingJson(std::function<void(const JsonMessage& message)> callback) {
     on_incoming_json_ = callback;
 }
 
-void Protocol::OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data)> callback) {
+void Protocol::OnIncomingAudio(std::function<void(AudioPacket&& packet, uint32_t sequence)> callback) {
     on_incoming_audio_ = callback;
 }
 
@@ -24,6 +37,10 @@ void Protocol::OnNetworkError(std::function<void(const std::string& message)> ca
     on_network_error_ = callback;
 }
 
+void Protocol::OnUplinkBatchTimeout(std::function<void(AudioPacket&& packet)> callback) {
+    on_uplink_batch_timeout_ = callback;
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -32,87 +49,223 @@ void Protocol::SetError(const std::string& message) {
 }
 
 void Protocol::SendAbortSpeaking(AbortReason reason) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
+    ControlWriter control(kControlAbort);
     if (reason == kAbortReasonWakeWordDetected) {
-        message += ",\"reason\":\"wake_word_detected\"";
+        control.AddValue(kControlTagReason, "wake_word_detected");
     }
-    message += "}";
-    SendText(message);
+    if (SendControl(control)) {
+        return;
+    }
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("session_id", session_id_).AddString("type", "abort");
+    if (reason == kAbortReasonWakeWordDetected) {
+        json.AddString("reason", "wake_word_detected");
+    }
+    SendText(json.Finish());
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
-    std::string json = "{\"session_id\":\"" + session_id_ + 
-                      "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+    ControlWriter control(kControlListen);
+    control.AddValue(kControlTagState, "detect").AddString(kControlTagText, wake_word);
+    if (SendControl(control)) {
+        return;
+    }
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("session_id", session_id_).AddString("type", "listen").AddString("state", "detect")
+        .AddString("text", wake_word);
+    SendText(json.Finish());
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\"";
-    message += ",\"type\":\"listen\",\"state\":\"start\"";
+    const char* mode_name = "manual";
     if (mode == kListeningModeRealtime) {
-        message += ",\"mode\":\"realtime\"";
+        mode_name = "realtime";
     } else if (mode == kListeningModeAutoStop) {
-        message += ",\"mode\":\"auto\"";
-    } else {
-        message += ",\"mode\":\"manual\"";
+        mode_name = "auto";
     }
-    message += "}";
-    SendText(message);
+    metrics_.OnListenStart();
+    ControlWriter control(kControlListen);
+    control.AddValue(kControlTagState, "start").AddValue(kControlTagMode, mode_name);
+    if (SendControl(control)) {
+        return;
+    }
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("session_id", session_id_).AddString("type", "listen").AddString("state", "start")
+        .AddString("mode", mode_name);
+    SendText(json.Finish());
 }
 
 void Protocol::SendStopListening() {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    // Do not hold back the tail of the utterance
+    auto packet = FlushAudio();
+    if (packet) {
+        SendAudio(packet);
+    }
+    metrics_.OnListenStop();
+    ControlWriter control(kControlListen);
+    control.AddValue(kControlTagState, "stop");
+    if (SendControl(control)) {
+        return;
+    }
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("session_id", session_id_).AddString("type", "listen").AddString("state", "stop");
+    SendText(json.Finish());
 }
 
-void Protocol::SendIotDescriptors(const std::string& descriptors) {
-    cJSON* root = cJSON_Parse(descriptors.c_str());
-    if (root == nullptr) {
-        ESP_LOGE(TAG, "Failed to parse IoT descriptors: %s", descriptors.c_str());
+void Protocol::SendVadState(bool speaking) {
+    // Flush the batch first so the server gets everything before the pause
+    if (!speaking) {
+        auto packet = FlushAudio();
+        if (packet) {
+            SendAudio(packet);
+        }
+    }
+    ControlWriter control(kControlListen);
+    control.AddValue(kControlTagState, speaking ? "speech" : "silence");
+    if (SendControl(control)) {
         return;
     }
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("session_id", session_id_).AddString("type", "listen")
+        .AddString("state", speaking ? "speech" : "silence");
+    SendText(json.Finish());
+}
 
-    if (!cJSON_IsArray(root)) {
-        ESP_LOGE(TAG, "IoT descriptors should be an array");
-        cJSON_Delete(root);
+void Protocol::SendGoodbye() {
+    ControlWriter control(kControlGoodbye);
+    if (SendControl(control)) {
         return;
     }
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("session_id", session_id_).AddString("type", "goodbye");
+    SendText(json.Finish());
+}
 
-    int arraySize = cJSON_GetArraySize(root);
-    for (int i = 0; i < arraySize; ++i) {
-        cJSON* descriptor = cJSON_GetArrayItem(root, i);
-        if (descriptor == nullptr) {
-            ESP_LOGE(TAG, "Failed to get IoT descriptor at index %d", i);
-            continue;
-        }
+void Protocol::FinishMetrics(bool send) {
+    auto report = metrics_.Finish();
+    if (report.empty()) {
+        return;
+    }
+#if CONFIG_PROTOCOL_METRICS_REPORT
+    if (send) {
+        ArenaBuffer buffer(kArenaProtocol, report.size() + JSON_CONTROL_MESSAGE_SIZE);
+        JsonWriter json(buffer.data(), buffer.size());
+        json.AddString("session_id", session_id_).AddString("type", "metrics").AddRaw("network", report);
+        SendText(json.Finish());
+    }
+#endif
+}
 
-        cJSON* messageRoot = cJSON_CreateObject();
-        cJSON_AddStringToObject(messageRoot, "session_id", session_id_.c_str());
-        cJSON_AddStringToObject(messageRoot, "type", "iot");
-        cJSON_AddBoolToObject(messageRoot, "update", true);
+void Protocol::SendIotDescriptors(std::string_view descriptors) {
+    // One message per thing, each item is copied straight out of the cached array
+    JsonArrayReader reader(descriptors);
+    std::string_view descriptor;
+    int count = 0;
+    while (reader.Next(descriptor)) {
+        ArenaBuffer buffer(kArenaProtocol, descriptor.size() + JSON_CONTROL_MESSAGE_SIZE);
+        JsonWriter json(buffer.data(), buffer.size());
+        json.AddString("session_id", session_id_).AddString("type", "iot").AddBool("update", true)
+            .BeginArray("descriptors").AddRawItem(descriptor).EndArray();
+        SendText(json.Finish());
+        count++;
+    }
+    if (count == 0) {
+        ESP_LOGE(TAG, "IoT descriptors should be a non-empty array");
+    }
+}
 
-        cJSON* descriptorArray = cJSON_CreateArray();
-        cJSON_AddItemToArray(descriptorArray, cJSON_Duplicate(descriptor, 1));
-        cJSON_AddItemToObject(messageRoot, "descriptors", descriptorArray);
+void Protocol::SendIotStates(const std::string& states) {
+    // The states are not bounded, size the buffer once for them
+    ArenaBuffer buffer(kArenaProtocol, states.size() + JSON_CONTROL_MESSAGE_SIZE);
+    JsonWriter json(buffer.data(), buffer.size());
+    json.AddString("session_id", session_id_).AddString("type", "iot").AddBool("update", true)
+        .AddRaw("states", states);
+    SendText(json.Finish());
+}
 
-        char* message = cJSON_PrintUnformatted(messageRoot);
-        if (message == nullptr) {
-            ESP_LOGE(TAG, "Failed to print JSON message for IoT descriptor at index %d", i);
-            cJSON_Delete(messageRoot);
-            continue;
-        }
+void Protocol::SendAudioTelemetry(std::string_view report) {
+    ArenaBuffer buffer(kArenaProtocol, report.size() + JSON_CONTROL_MESSAGE_SIZE);
+    JsonWriter json(buffer.data(), buffer.size());
+    json.AddString("session_id", session_id_).AddString("type", "telemetry").AddRaw("audio", report);
+    SendText(json.Finish());
+}
 
-        SendText(std::string(message));
-        cJSON_free(message);
-        cJSON_Delete(messageRoot);
+void Protocol::SendLatencyProbe(int timestamp_ms) {
+    ControlWriter control(kControlLatency);
+    control.AddUint32(kControlTagTimestamp, timestamp_ms);
+    if (SendControl(control)) {
+        return;
     }
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("session_id", session_id_).AddString("type", "latency").AddInt("t", timestamp_ms);
+    SendText(json.Finish());
+}
 
-    cJSON_Delete(root);
+void Protocol::SendTtsCached(std::string_view hash) {
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("session_id", session_id_).AddString("type", "tts").AddString("state", "cached")
+        .AddString("hash", hash);
+    SendText(json.Finish());
 }
 
-void Protocol::SendIotStates(const std::string& states) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"iot\",\"update\":true,\"states\":" + states + "}";
-    SendText(message);
+void Protocol::SendTrace(std::string_view data) {
+    // Trace dumps are the largest messages, they must not land in the internal heap
+    ArenaBuffer buffer(kArenaProtocol, data.size() + JSON_CONTROL_MESSAGE_SIZE);
+    JsonWriter json(buffer.data(), buffer.size());
+    json.AddString("session_id", session_id_).AddString("type", "trace").AddString("data", data);
+    SendText(json.Finish());
+}
+
+void Protocol::AddControlParams(JsonWriter& hello) {
+    binary_control_ = false;
+#if CONFIG_PROTOCOL_BINARY_CONTROL
+    if (CanSendBinary()) {
+        hello.AddString("control", "tlv");
+    }
+#endif
+}
+
+void Protocol::ParseControlParams(const JsonMessage& hello) {
+#if CONFIG_PROTOCOL_BINARY_CONTROL
+    // The server binds the session id at hello, the frames never carry it
+    binary_control_ = CanSendBinary() && hello.Get("control") == "tlv";
+    ESP_LOGI(TAG, "Control encoding: %s", binary_control_ ? "tlv" : "json");
+#endif
+}
+
+bool Protocol::SendControl(ControlWriter& control) {
+    if (!binary_control_) {
+        return false;
+    }
+    auto frame = control.Finish();
+    if (frame.empty()) {
+        return false;
+    }
+    // A transport error is reported by SendBinary, sending JSON as well would only repeat it
+    SendBinary(frame);
+    return true;
+}
+
+std::string_view Protocol::DecodeControl(const uint8_t* data, size_t size, ArenaBuffer& buffer) {
+    // Text fields may need escaping, leave room for it
+    buffer.Reset(kArenaProtocol, size * 2 + JSON_CONTROL_MESSAGE_SIZE);
+    if (buffer.size() == 0) {
+        return std::string_view();
+    }
+    JsonWriter json(buffer.data(), buffer.size());
+    auto text = DecodeBinaryControl(data, size, json);
+    if (text.empty()) {
+        ESP_LOGE(TAG, "Failed to decode control frame, size: %u", size);
+    }
+    return text;
 }
 
 bool Protocol::IsTimeout() const {
@@ -130,3 +283,132 @@ bool Protocol::IsAudioChannelBusy() const {
     return busy_sending_audio_;
 }
 
+
+int Protocol::PreferredFrameDuration() {
+    int frame_duration = Settings("audio").GetInt("frame_duration", OPUS_FRAME_DURATION_MS);
+    if (frame_duration != 20 && frame_duration != 40 && frame_duration != 60) {
+        ESP_LOGW(TAG, "Invalid frame duration %d, using %d ms", frame_duration, OPUS_FRAME_DURATION_MS);
+        return OPUS_FRAME_DURATION_MS;
+    }
+    return frame_duration;
+}
+
+void Protocol::AddUplinkAudioParams(JsonWriter& audio_params) {
+    int frame_duration = PreferredFrameDuration();
+    uplink_frame_duration_ = frame_duration;
+    audio_params.AddInt("frame_duration", frame_duration);
+    ResetUplinkBatch();
+    uplink_frames_per_packet_ = 1;
+    requested_frames_per_packet_ = 1;
+#if CONFIG_UPLINK_FRAMES_PER_PACKET > 1
+    // The oldest frame of a batch waits (N - 1) frames, keep that under the delay cap
+    uplink_max_delay_ms_ = CONFIG_UPLINK_BATCH_MAX_DELAY_MS;
+    requested_frames_per_packet_ = std::min(CONFIG_UPLINK_FRAMES_PER_PACKET, 1 + uplink_max_delay_ms_ / frame_duration);
+#endif
+    if (requested_frames_per_packet_ > 1) {
+        audio_params.AddInt("frames_per_packet", requested_frames_per_packet_);
+    }
+}
+
+void Protocol::ParseUplinkAudioParams(const JsonMessage& audio_params) {
+    int frame_duration;
+    if (audio_params.GetInt("uplink_frame_duration", frame_duration)) {
+        if (frame_duration == 20 || frame_duration == 40 || frame_duration == 60) {
+            uplink_frame_duration_ = frame_duration;
+        } else {
+            ESP_LOGW(TAG, "Ignore uplink frame duration %d", frame_duration);
+        }
+    }
+    ESP_LOGI(TAG, "Uplink frame duration: %d ms", uplink_frame_duration_);
+
+    uplink_frames_per_packet_ = 1;
+    int frames_per_packet;
+    if (audio_params.GetInt("frames_per_packet", frames_per_packet) && requested_frames_per_packet_ > 1) {
+        uplink_frames_per_packet_ = std::clamp(frames_per_packet, 1, requested_frames_per_packet_);
+    }
+    if (uplink_frames_per_packet_ > 1) {
+        ESP_LOGI(TAG, "Uplink batching: %d frames per packet", uplink_frames_per_packet_);
+    }
+}
+
+void Protocol::ResetUplinkBatch() {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    batch_ = AudioPacket();
+    batch_frames_ = 0;
+}
+
+AudioPacket Protocol::PackAudio(AudioPacket&& frame) {
+    if (uplink_frames_per_packet_ <= 1 || !frame) {
+        return std::move(frame);
+    }
+
+    size_t needed = sizeof(uint16_t) + frame.size();
+    if (needed > PACKET_POOL_BLOCK_SIZE) {
+        ESP_LOGW(TAG, "Drop oversized uplink frame: %u bytes", frame.size());
+        AudioTelemetry::GetInstance().Count(kAudioCounterUplinkDropped);
+        return AudioPacket();
+    }
+
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    AudioPacket ready;
+    if (batch_ && batch_.size() + needed > batch_.capacity()) {
+        // Does not fit, send what we have and start over
+        ready = std::move(batch_);
+        batch_frames_ = 0;
+    }
+    if (!batch_) {
+        batch_ = PacketPool::GetInstance().Allocate(PACKET_POOL_BLOCK_SIZE);
+        if (!batch_ || !batch_.resize(0)) {
+            return ready;
+        }
+        batch_start_time_ = std::chrono::steady_clock::now();
+        if (batch_timer_ == nullptr) {
+            batch_timer_ = TimerService::GetInstance().Create("uplink_batch", [this]() {
+                OnBatchTimer();
+            });
+        }
+        TimerService::GetInstance().StartOnce(batch_timer_, uplink_max_delay_ms_);
+    }
+    batch_.resize(batch_.size() + needed);
+
+    auto p = batch_.data() + batch_.size() - needed;
+    uint16_t size = htons(frame.size());
+    memcpy(p, &size, sizeof(size));
+    memcpy(p + sizeof(size), frame.data(), frame.size());
+    batch_frames_++;
+
+    auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - batch_start_time_);
+    if (!ready && (batch_frames_ >= uplink_frames_per_packet_ || waited.count() >= uplink_max_delay_ms_)) {
+        ready = std::move(batch_);
+        batch_frames_ = 0;
+    }
+    return ready;
+}
+
+AudioPacket Protocol::FlushAudio() {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    batch_frames_ = 0;
+    if (!batch_ || batch_.empty()) {
+        batch_ = AudioPacket();
+        return AudioPacket();
+    }
+    return std::move(batch_);
+}
+
+// A stale expiry finds no batch or a newer one, which is rearmed for the rest of its delay
+void Protocol::OnBatchTimer() {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    if (!batch_ || batch_.empty()) {
+        return;
+    }
+    auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - batch_start_time_);
+    if (waited.count() < uplink_max_delay_ms_) {
+        TimerService::GetInstance().StartOnce(batch_timer_, uplink_max_delay_ms_ - waited.count());
+        return;
+    }
+    if (on_uplink_batch_timeout_ != nullptr) {
+        AudioPacket packet = std::move(batch_);
+        batch_frames_ = 0;
+        on_uplink_batch_timeout_(std::move(packet));
+    }
+}
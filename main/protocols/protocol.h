@@ -1,10 +1,24 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
-#include <cJSON.h>
 #include <string>
+#include <string_view>
 #include <functional>
 #include <chrono>
+#include <mutex>
+
+#include "memory_arena.h"
+#include "packet_pool.h"
+#include "json_message.h"
+#include "protocol_metrics.h"
+#include "binary_control.h"
+
+// Default uplink frame duration, the actual one is negotiated in hello
+#ifdef CONFIG_OPUS_FRAME_DURATION_MS
+#define OPUS_FRAME_DURATION_MS CONFIG_OPUS_FRAME_DURATION_MS
+#else
+#define OPUS_FRAME_DURATION_MS 60
+#endif
 
 struct BinaryProtocol3 {
     uint8_t type;
@@ -24,9 +38,11 @@ enum ListeningMode {
     kListeningModeRealtime // 需要 AEC 支持
 };
 
+struct ServiceTimer;
+
 class Protocol {
 public:
-    virtual ~Protocol() = default;
+    virtual ~Protocol();
 
     inline int server_sample_rate() const {
         return server_sample_rate_;
@@ -37,29 +53,68 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    inline int uplink_frames_per_packet() const {
+        return uplink_frames_per_packet_;
+    }
+    // Negotiated in hello, the uplink encoder is rebuilt when it differs
+    inline int uplink_frame_duration() const {
+        return uplink_frame_duration_;
+    }
+    // Network counters of the current session, reported when the audio channel closes
+    inline ProtocolMetrics& metrics() {
+        return metrics_;
+    }
 
-    void OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    // Uplink frame duration asked for in hello: the audio.frame_duration setting or the Kconfig default
+    static int PreferredFrameDuration();
+
+    // `sequence` increases by one per frame, gaps and reordering are handled by the receiver
+    void OnIncomingAudio(std::function<void(AudioPacket&& packet, uint32_t sequence)> callback);
+    void OnIncomingJson(std::function<void(const JsonMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
+    // A part-full batch reached the max delay with no frame behind it. Runs on the timer task with
+    // the batch lock held, so the packet is handed over before PackAudio can return a later one.
+    void OnUplinkBatchTimeout(std::function<void(AudioPacket&& packet)> callback);
 
     virtual void Start() = 0;
+    // Optionally connects ahead of OpenAudioChannel, which then only has to say hello
+    virtual void PrepareAudioChannel() {}
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
     virtual bool IsAudioChannelBusy() const;
-    virtual void SendAudio(const std::vector<uint8_t>& data) = 0;
+    // True when downlink audio and JSON come in one ordered stream, the frames that follow a
+    // sentence_start are then known to belong to that sentence
+    virtual bool IsAudioInOrderWithJson() const { return false; }
+    virtual void SendAudio(const AudioPacket& packet) = 0;
+    // Batches encoded frames when the server agreed to it in hello. Returns the packet to pass to
+    // SendAudio, or an empty handle while the batch fills up. A batch holds each frame prefixed by
+    // its big endian uint16 size; without batching the frame is returned as is.
+    AudioPacket PackAudio(AudioPacket&& frame);
+    // Returns the partly filled batch, if any
+    AudioPacket FlushAudio();
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
+    // Auto stop mode with the VAD gate: the uplink pauses during silence and resumes on speech
+    virtual void SendVadState(bool speaking);
     virtual void SendAbortSpeaking(AbortReason reason);
-    virtual void SendIotDescriptors(const std::string& descriptors);
+    virtual void SendIotDescriptors(std::string_view descriptors);
     virtual void SendIotStates(const std::string& states);
+    // `report` is the AudioTelemetry JSON object
+    virtual void SendAudioTelemetry(std::string_view report);
+    // `data` is the base64 encoded Trace dump
+    virtual void SendTrace(std::string_view data);
+    // {"type":"latency","t":..}, a server that supports it echoes the message back unchanged
+    virtual void SendLatencyProbe(int timestamp_ms);
+    // The sentence with this hash plays from the TTS cache, the server skips streaming it
+    virtual void SendTtsCached(std::string_view hash);
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
-    std::function<void(std::vector<uint8_t>&& data)> on_incoming_audio_;
+    std::function<void(const JsonMessage& message)> on_incoming_json_;
+    std::function<void(AudioPacket&& packet, uint32_t sequence)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
@@ -70,10 +125,47 @@ protected:
     bool busy_sending_audio_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    int uplink_frames_per_packet_ = 1;
+    int uplink_frame_duration_ = 60;
+    int uplink_max_delay_ms_ = 0;
+    ProtocolMetrics metrics_;
+    // Negotiated in hello, the small control messages then go out as TLV frames
+    bool binary_control_ = false;
+
+    // Adds the frame duration and batching request to the hello audio_params and reads the server's answer
+    void AddUplinkAudioParams(JsonWriter& audio_params);
+    void ParseUplinkAudioParams(const JsonMessage& audio_params);
+    void ResetUplinkBatch();
+    // Asks for the binary control encoding if the transport can carry it, and reads the answer
+    void AddControlParams(JsonWriter& hello);
+    void ParseControlParams(const JsonMessage& hello);
+    // False when the frame is not negotiated or did not fit, the caller sends JSON instead
+    bool SendControl(ControlWriter& control);
+    // JSON equivalent of a downlink control frame, written into `buffer`; empty if malformed
+    std::string_view DecodeControl(const uint8_t* data, size_t size, ArenaBuffer& buffer);
+
+    void SendGoodbye();
+    // Ends the session's metrics and logs them, `send` while the channel can still carry the report
+    void FinishMetrics(bool send);
 
-    virtual bool SendText(const std::string& text) = 0;
+    virtual bool SendText(std::string_view text) = 0;
+    // Transports that can carry binary control frames next to the audio override both
+    virtual bool CanSendBinary() const { return false; }
+    virtual bool SendBinary(std::string_view frame) { return false; }
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+
+private:
+    std::mutex batch_mutex_;
+    AudioPacket batch_;
+    int batch_frames_ = 0;
+    int requested_frames_per_packet_ = 1;
+    std::chrono::time_point<std::chrono::steady_clock> batch_start_time_;
+    // Armed when a batch starts, sends it at the max delay if the frames stop coming
+    ServiceTimer* batch_timer_ = nullptr;
+    std::function<void(AudioPacket&& packet)> on_uplink_batch_timeout_;
+
+    void OnBatchTimer();
 };
 
 #endif // PROTOCOL_H
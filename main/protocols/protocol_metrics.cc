@@ -0,0 +1,159 @@
+#include "protocol_metrics.h"
+#include "json_message.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+
+#define TAG "ProtocolMetrics"
+
+void ProtocolMetrics::Direction::Add(size_t size, int64_t now) {
+    if (packets == 0) {
+        first_time = now;
+    }
+    packets++;
+    bytes += size;
+    last_time = now;
+}
+
+// Over the time audio flowed, the pauses between turns are included
+int ProtocolMetrics::Direction::kbps() const {
+    int64_t duration_us = last_time - first_time;
+    if (packets < 2 || duration_us <= 0) {
+        return 0;
+    }
+    return bytes * 8 * 1000 / duration_us;
+}
+
+void ProtocolMetrics::Begin() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_ = Session();
+    session_.active = true;
+    session_.begin_time = esp_timer_get_time();
+}
+
+void ProtocolMetrics::OnHelloSent() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_.hello_sent_time = esp_timer_get_time();
+}
+
+void ProtocolMetrics::OnHelloReceived() {
+    int64_t rtt_us;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (session_.hello_sent_time == 0 || session_.hello_rtt_us >= 0) {
+            return;
+        }
+        rtt_us = esp_timer_get_time() - session_.hello_sent_time;
+        session_.hello_rtt_us = rtt_us;
+    }
+    RecordRtt(rtt_us);
+}
+
+void ProtocolMetrics::RecordRtt(int64_t rtt_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!session_.active) {
+        return;
+    }
+    if (session_.rtt_samples == 0) {
+        session_.rtt_min_us = rtt_us;
+        session_.rtt_max_us = rtt_us;
+    } else {
+        session_.rtt_min_us = std::min(session_.rtt_min_us, rtt_us);
+        session_.rtt_max_us = std::max(session_.rtt_max_us, rtt_us);
+    }
+    session_.rtt_samples++;
+    session_.rtt_total_us += rtt_us;
+}
+
+void ProtocolMetrics::OnUplink(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (session_.active) {
+        session_.uplink.Add(bytes, esp_timer_get_time());
+    }
+}
+
+void ProtocolMetrics::OnDownlink(size_t bytes, uint32_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!session_.active) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    session_.downlink.Add(bytes, now);
+
+    if (!session_.sequence_started) {
+        session_.sequence_started = true;
+        session_.first_sequence = sequence;
+        session_.highest_sequence = sequence;
+    } else if ((int32_t)(sequence - session_.highest_sequence) > 0) {
+        session_.highest_sequence = sequence;
+    } else {
+        // Duplicates land here too
+        session_.reordered++;
+    }
+
+    if (session_.listen_start_time > 0) {
+        session_.start_total_us += now - session_.listen_start_time;
+        session_.start_turns++;
+        session_.listen_start_time = 0;
+    }
+    if (session_.listen_stop_time > 0) {
+        session_.stop_total_us += now - session_.listen_stop_time;
+        session_.stop_turns++;
+        session_.listen_stop_time = 0;
+    }
+}
+
+void ProtocolMetrics::OnListenStart() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_.listen_start_time = esp_timer_get_time();
+    session_.listen_stop_time = 0;
+}
+
+void ProtocolMetrics::OnListenStop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_.listen_stop_time = esp_timer_get_time();
+}
+
+bool ProtocolMetrics::active() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return session_.active;
+}
+
+std::string ProtocolMetrics::Finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!session_.active) {
+        return "";
+    }
+    session_.active = false;
+    auto& s = session_;
+
+    int duration_ms = (esp_timer_get_time() - s.begin_time) / 1000;
+    uint32_t expected = s.sequence_started ? s.highest_sequence - s.first_sequence + 1 : 0;
+    uint32_t lost = expected > s.downlink.packets ? expected - s.downlink.packets : 0;
+    int loss_permille = expected > 0 ? lost * 1000 / expected : 0;
+    int rtt_avg_ms = s.rtt_samples > 0 ? s.rtt_total_us / s.rtt_samples / 1000 : -1;
+    int after_start_ms = s.start_turns > 0 ? s.start_total_us / s.start_turns / 1000 : -1;
+    int after_stop_ms = s.stop_turns > 0 ? s.stop_total_us / s.stop_turns / 1000 : -1;
+
+    char buffer[PROTOCOL_METRICS_REPORT_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddInt("duration_ms", duration_ms);
+    json.BeginObject("rtt").AddInt("hello_ms", s.hello_rtt_us >= 0 ? s.hello_rtt_us / 1000 : -1)
+        .AddInt("samples", s.rtt_samples).AddInt("avg_ms", rtt_avg_ms)
+        .AddInt("min_ms", s.rtt_min_us / 1000).AddInt("max_ms", s.rtt_max_us / 1000).EndObject();
+    json.BeginObject("uplink").AddInt("packets", s.uplink.packets).AddInt("bytes", s.uplink.bytes)
+        .AddInt("kbps", s.uplink.kbps()).EndObject();
+    json.BeginObject("downlink").AddInt("packets", s.downlink.packets).AddInt("bytes", s.downlink.bytes)
+        .AddInt("kbps", s.downlink.kbps()).AddInt("expected", expected).AddInt("lost", lost)
+        .AddInt("reordered", s.reordered).AddInt("loss_permille", loss_permille).EndObject();
+    json.BeginObject("first_audio").AddInt("turns", s.start_turns).AddInt("after_listen_start_ms", after_start_ms)
+        .AddInt("after_listen_stop_ms", after_stop_ms).EndObject();
+
+    ESP_LOGI(TAG, "Session %d ms, rtt avg %d ms (%d samples), up %lu pkts %d kbps, down %lu pkts %d kbps, "
+        "lost %lu/%lu, reordered %lu, first audio %d ms after listen start, %d ms after stop",
+        duration_ms, rtt_avg_ms, s.rtt_samples, s.uplink.packets, s.uplink.kbps(), s.downlink.packets,
+        s.downlink.kbps(), lost, expected, s.reordered, after_start_ms, after_stop_ms);
+    return std::string(json.Finish());
+}
@@ -0,0 +1,79 @@
+#ifndef PROTOCOL_METRICS_H
+#define PROTOCOL_METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Fits the report with every counter at its largest
+#define PROTOCOL_METRICS_REPORT_SIZE 640
+
+// Per session network counters kept by Protocol: round trip samples, uplink and downlink
+// bytes, downlink loss and reordering from the sequence numbers, and the time until the
+// first reply audio. Begin() starts a session, the report is built once when it ends.
+class ProtocolMetrics {
+public:
+    // Called when the audio channel is being opened, drops the previous session
+    void Begin();
+    void OnHelloSent();
+    // The hello round trip is the first RTT sample of every session
+    void OnHelloReceived();
+    void RecordRtt(int64_t rtt_us);
+
+    void OnUplink(size_t bytes);
+    // `sequence` as delivered to the jitter buffer, it increases by one per packet
+    void OnDownlink(size_t bytes, uint32_t sequence);
+    void OnListenStart();
+    void OnListenStop();
+
+    bool active() const;
+    // {"duration_ms":..,"rtt":{..},"uplink":{..},"downlink":{..},"first_audio":{..}}
+    // and ends the session, empty when none was active
+    std::string Finish();
+
+private:
+    struct Direction {
+        uint32_t packets = 0;
+        uint64_t bytes = 0;
+        int64_t first_time = 0;
+        int64_t last_time = 0;
+
+        void Add(size_t size, int64_t now);
+        int kbps() const;
+    };
+
+    // Everything a session counts, reset as a whole by Begin()
+    struct Session {
+        bool active = false;
+        int64_t begin_time = 0;
+        int64_t hello_sent_time = 0;
+        int64_t hello_rtt_us = -1;
+
+        int rtt_samples = 0;
+        int64_t rtt_total_us = 0;
+        int64_t rtt_min_us = 0;
+        int64_t rtt_max_us = 0;
+
+        Direction uplink;
+        Direction downlink;
+        // RFC 3550 style: packets expected from the sequence range, reordered ones arrive below the highest
+        bool sequence_started = false;
+        uint32_t first_sequence = 0;
+        uint32_t highest_sequence = 0;
+        uint32_t reordered = 0;
+
+        // Listen start and stop still waiting for their first downlink audio
+        int64_t listen_start_time = 0;
+        int64_t listen_stop_time = 0;
+        int start_turns = 0;
+        int64_t start_total_us = 0;
+        int stop_turns = 0;
+        int64_t stop_total_us = 0;
+    };
+
+    mutable std::mutex mutex_;
+    Session session_;
+};
+
+#endif // PROTOCOL_METRICS_H
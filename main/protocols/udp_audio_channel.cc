@@ -0,0 +1,159 @@
+#include "udp_audio_channel.h"
+#include "board.h"
+#include "deferred_log.h"
+
+#include <esp_log.h>
+#include <arpa/inet.h>
+#include <cstring>
+
+#define TAG "UdpAudio"
+
+UdpAudioChannel::UdpAudioChannel() {
+    mbedtls_aes_init(&aes_ctx_);
+}
+
+UdpAudioChannel::~UdpAudioChannel() {
+    Close();
+    mbedtls_aes_free(&aes_ctx_);
+}
+
+bool UdpAudioChannel::Configure(const JsonMessage& udp) {
+    std::string key;
+    std::string nonce;
+    std::string server;
+    int port = 0;
+    if (!udp.valid() || !udp.GetString("server", server) || !udp.GetInt("port", port)
+        || !udp.GetString("key", key) || !udp.GetString("nonce", nonce)) {
+        ESP_LOGE(TAG, "UDP is not specified");
+        return false;
+    }
+    auto decoded_nonce = DecodeHexString(nonce);
+    if (decoded_nonce.size() != 16) {
+        ESP_LOGE(TAG, "Invalid nonce size: %u", decoded_nonce.size());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    server_ = server;
+    port_ = port;
+    aes_nonce_ = decoded_nonce;
+    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
+    local_sequence_ = 0;
+    remote_sequence_ = 0;
+    return true;
+}
+
+void UdpAudioChannel::Open(AudioCallback callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (udp_ != nullptr) {
+        delete udp_;
+    }
+    udp_ = Board::GetInstance().CreateUdp();
+    buffer_.reserve(aes_nonce_.size() + PACKET_POOL_BLOCK_SIZE);
+    udp_->OnMessage([this, callback](const std::string& data) {
+        OnMessage(data, callback);
+    });
+    udp_->Connect(server_, port_);
+}
+
+void UdpAudioChannel::Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (udp_ != nullptr) {
+        delete udp_;
+        udp_ = nullptr;
+    }
+}
+
+bool UdpAudioChannel::IsOpened() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return udp_ != nullptr;
+}
+
+size_t UdpAudioChannel::Send(const AudioPacket& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (udp_ == nullptr || !packet) {
+        return 0;
+    }
+
+    // Header and ciphertext go straight into the channel buffer, it only grows on the first packets
+    size_t header_size = aes_nonce_.size();
+    buffer_.resize(header_size + packet.size());
+    auto buffer = (uint8_t*)buffer_.data();
+    memcpy(buffer, aes_nonce_.data(), header_size);
+    *(uint16_t*)&buffer[2] = htons(packet.size());
+    *(uint32_t*)&buffer[12] = htonl(++local_sequence_);
+
+    // CTR advances the counter block, so keep the header intact and count on a copy
+    uint8_t counter[16];
+    memcpy(counter, buffer, sizeof(counter));
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet.size(), &nc_off, counter, stream_block,
+        packet.data(), buffer + header_size) != 0) {
+        ESP_LOGE(TAG, "Failed to encrypt audio data");
+        return 0;
+    }
+
+    udp_->Send(buffer_);
+    return buffer_.size();
+}
+
+void UdpAudioChannel::OnMessage(const std::string& data, const AudioCallback& callback) {
+    if (data.size() < aes_nonce_.size()) {
+        DLOG_EVERY(1000, ESP_LOG_ERROR, TAG, "Invalid audio packet size: %u", (unsigned)data.size());
+        return;
+    }
+    DLOG_EVERY(1000, ESP_LOG_INFO, TAG, "Received UDP audio packet, size: %u", (unsigned)data.size());
+    if (data[0] != 0x01) {
+        DLOG_EVERY(1000, ESP_LOG_ERROR, TAG, "Invalid audio packet type: %x", (unsigned)(uint8_t)data[0]);
+        return;
+    }
+    // Late and reordered packets are kept, the jitter buffer decides if they can still be played
+    uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
+    if (sequence != remote_sequence_ + 1) {
+        DLOG_EVERY(1000, ESP_LOG_WARN, TAG, "Received audio packet with wrong sequence: %lu, expected: %lu",
+            sequence, remote_sequence_ + 1);
+    }
+
+    size_t decrypted_size = data.size() - aes_nonce_.size();
+    // Decrypt straight into the pooled packet that goes to the decoder
+    auto decrypted = PacketPool::GetInstance().Allocate(decrypted_size);
+    if (!decrypted) {
+        return;
+    }
+    // The header is the counter block, copy it since CTR advances it
+    uint8_t counter[16];
+    memcpy(counter, data.data(), sizeof(counter));
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    auto encrypted = (const uint8_t*)data.data() + aes_nonce_.size();
+    int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, counter, stream_block, encrypted, decrypted.data());
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+        return;
+    }
+    if ((int32_t)(sequence - remote_sequence_) > 0) {
+        remote_sequence_ = sequence;
+    }
+    if (callback != nullptr) {
+        callback(std::move(decrypted), sequence, data.size());
+    }
+}
+
+// 辅助函数，将单个十六进制字符转换为对应的数值
+static inline uint8_t CharToHex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 0;  // 对于无效输入，返回0
+}
+
+std::string UdpAudioChannel::DecodeHexString(const std::string& hex_string) {
+    std::string decoded;
+    decoded.reserve(hex_string.size() / 2);
+    for (size_t i = 0; i + 1 < hex_string.size(); i += 2) {
+        char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
+        decoded.push_back(byte);
+    }
+    return decoded;
+}
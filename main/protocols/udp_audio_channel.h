@@ -0,0 +1,50 @@
+#ifndef UDP_AUDIO_CHANNEL_H
+#define UDP_AUDIO_CHANNEL_H
+
+#include <udp.h>
+#include <mbedtls/aes.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "packet_pool.h"
+#include "json_message.h"
+
+// AES-CTR encrypted audio over UDP, negotiated in the server hello. Every packet starts with
+// the 16 byte nonce with the payload size and the sequence number patched in; the header is
+// also the CTR counter block of the payload. Shared by the MQTT and WebSocket transports.
+class UdpAudioChannel {
+public:
+    // `wire_size` is the datagram size, header included
+    using AudioCallback = std::function<void(AudioPacket&& packet, uint32_t sequence, size_t wire_size)>;
+
+    UdpAudioChannel();
+    ~UdpAudioChannel();
+
+    // Reads server, port, key and nonce from the "udp" object of the hello, resets the sequences
+    bool Configure(const JsonMessage& udp);
+    void Open(AudioCallback callback);
+    void Close();
+    bool IsOpened() const;
+    // Returns the datagram size, 0 if nothing was sent
+    size_t Send(const AudioPacket& packet);
+
+private:
+    mutable std::mutex mutex_;
+    Udp* udp_ = nullptr;
+    mbedtls_aes_context aes_ctx_;
+    std::string aes_nonce_;
+    // 发送缓冲区: nonce 头 + 密文, 每个通道复用
+    std::string buffer_;
+    std::string server_;
+    int port_ = 0;
+    uint32_t local_sequence_ = 0;
+    uint32_t remote_sequence_ = 0;
+
+    void OnMessage(const std::string& data, const AudioCallback& callback);
+    static std::string DecodeHexString(const std::string& hex_string);
+};
+
+#endif // UDP_AUDIO_CHANNEL_H
@@ -2,9 +2,12 @@
 #include "board.h"
 #include "system_info.h"
 #include "application.h"
+#include "trace.h"
+#include "task_topology.h"
+#include "deferred_log.h"
+#include "tts_cache.h"
 
 #include <cstring>
-#include <cJSON.h>
 #include <esp_log.h>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
@@ -16,6 +19,7 @@ WebsocketProtocol::WebsocketProtocol() {
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    std::lock_guard<std::mutex> lock(connect_mutex_);
     if (websocket_ != nullptr) {
         delete websocket_;
     }
@@ -25,23 +29,40 @@ WebsocketProtocol::~WebsocketProtocol() {
 void WebsocketProtocol::Start() {
 }
 
-void WebsocketProtocol::SendAudio(const std::vector<uint8_t>& data) {
-    if (websocket_ == nullptr) {
+void WebsocketProtocol::SendAudio(const AudioPacket& packet) {
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    if (udp_audio_) {
+        busy_sending_audio_ = true;
+        size_t size = udp_channel_.Send(packet);
+        busy_sending_audio_ = false;
+        if (size > 0) {
+            metrics_.OnUplink(size);
+        }
+        return;
+    }
+#endif
+    if (websocket_ == nullptr || !packet) {
         return;
     }
-    ESP_LOGI("WS", "Sent audio bytes: %d", data.size()); 
+    DLOG_EVERY(1000, ESP_LOG_INFO, TAG, "Sent audio bytes: %u", (unsigned)packet.size());
+    metrics_.OnUplink(packet.size());
     busy_sending_audio_ = true;
-    websocket_->Send(data.data(), data.size(), true);
+    websocket_->Send(packet.data(), packet.size(), true);
     busy_sending_audio_ = false;
 }
 
-bool WebsocketProtocol::SendText(const std::string& text) {
+bool WebsocketProtocol::SendText(std::string_view text) {
     if (websocket_ == nullptr) {
         return false;
     }
 
-    if (!websocket_->Send(text)) {
-        ESP_LOGE(TAG, "Failed to send text: %s", text.c_str());
+    if (text.empty()) {
+        ESP_LOGE(TAG, "Text message does not fit its buffer");
+        return false;
+    }
+
+    if (!websocket_->Send(text.data(), text.size())) {
+        ESP_LOGE(TAG, "Failed to send text: %.*s", (int)text.size(), text.data());
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
     }
@@ -49,25 +70,93 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+bool WebsocketProtocol::SendBinary(std::string_view frame) {
+    if (websocket_ == nullptr) {
+        return false;
+    }
+    if (!websocket_->Send(frame.data(), frame.size(), true)) {
+        ESP_LOGE(TAG, "Failed to send control frame, size: %u", frame.size());
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+#endif
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return channel_opened_ && IsConnected() && !error_occurred_ && !IsTimeout();
+}
+
+bool WebsocketProtocol::IsAudioInOrderWithJson() const {
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    return !udp_audio_;
+#else
+    return true;
+#endif
+}
+
+bool WebsocketProtocol::IsConnected() const {
+    return websocket_ != nullptr && websocket_->IsConnected();
 }
 
 void WebsocketProtocol::CloseAudioChannel() {
-    if (websocket_ != nullptr) {
-        delete websocket_;
-        websocket_ = nullptr;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    udp_audio_ = false;
+    udp_channel_.Close();
+#endif
+#if CONFIG_WEBSOCKET_KEEP_ALIVE
+    if (IsConnected()) {
+        // End the conversation but keep the connection warm for the next one
+        FinishMetrics(true);
+        SendGoodbye();
+        if (channel_opened_.exchange(false) && on_audio_channel_closed_ != nullptr) {
+            on_audio_channel_closed_();
+        }
+        return;
+    }
+#endif
+    FinishMetrics(IsConnected());
+    {
+        // A prewarm may be inside Connect(), wait for it instead of deleting under its feet
+        std::lock_guard<std::mutex> lock(connect_mutex_);
+        if (websocket_ != nullptr) {
+            delete websocket_;
+            websocket_ = nullptr;
+        }
     }
+    channel_opened_ = false;
 }
 
-bool WebsocketProtocol::OpenAudioChannel() {
+void WebsocketProtocol::PrepareAudioChannel() {
+#if CONFIG_WEBSOCKET_PREWARM
+    // Only runs while idle; the task swaps websocket_ under connect_mutex_ like every other owner
+    if (IsConnected() || channel_opened_ || prewarm_running_.exchange(true)) {
+        return;
+    }
+    xTaskCreatePinnedToCore([](void* arg) {
+        auto protocol = (WebsocketProtocol*)arg;
+        {
+            std::lock_guard<std::mutex> lock(protocol->connect_mutex_);
+            if (!protocol->IsConnected() && !protocol->channel_opened_) {
+                ESP_LOGI(TAG, "Prewarming websocket connection");
+                if (!protocol->Connect()) {
+                    ESP_LOGW(TAG, "Prewarm failed, connecting on demand");
+                }
+            }
+        }
+        protocol->prewarm_running_ = false;
+        vTaskDelete(NULL);
+    }, "ws_prewarm", TASK_NETWORK_STACK_SIZE, this, TASK_NETWORK_PRIORITY, nullptr, TASK_CORE(TASK_NETWORK_CORE));
+#endif
+}
+
+// Called with connect_mutex_ held, it replaces websocket_
+bool WebsocketProtocol::Connect() {
     if (websocket_ != nullptr) {
         delete websocket_;
     }
 
-    busy_sending_audio_ = false;
-    error_occurred_ = false;
-    session_id_ = "";
     std::string url = CONFIG_WEBSOCKET_URL;
     std::string token = "Bearer " + std::string(CONFIG_WEBSOCKET_ACCESS_TOKEN);
     websocket_ = Board::GetInstance().CreateWebSocket();
@@ -75,57 +164,119 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->SetHeader("Protocol-Version", "1");
     websocket_->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
-
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
+        ArenaBuffer control;
+        if (binary && binary_control_ && len > 0 && (uint8_t)data[0] == BINARY_CONTROL_TYPE) {
+            // Audio is on UDP when control is binary, the binary frames are all control frames
+            auto text = DecodeControl((const uint8_t*)data, len, control);
+            if (text.empty()) {
+                return;
+            }
+            data = text.data();
+            len = text.size();
+            binary = false;
+        }
         if (binary) {
-            ESP_LOGI(TAG, "Received audio binary, length: %zu", len);
+            DLOG_EVERY(1000, ESP_LOG_INFO, TAG, "Received audio binary, length: %u", (unsigned)len);
+            uint32_t sequence = ++remote_sequence_;
+            metrics_.OnDownlink(len, sequence);
             if (on_incoming_audio_ != nullptr) {
-                on_incoming_audio_(std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len));
+                on_incoming_audio_(PacketPool::GetInstance().Allocate((const uint8_t*)data, len), sequence);
             }
         } else {
-            ESP_LOGI(TAG, "Received JSON: %.*s", (int)len, data);
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (type != NULL) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
-                }
-            } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
+            if (control.size() == 0) {
+                DLOG_TEXT(ESP_LOG_INFO, TAG, "Received JSON", data, len);
+            }
+            // Text frames are not null terminated, scan within `len`
+            JsonMessage message(data, len);
+            auto type = message.type();
+            if (!message.valid() || type.empty()) {
+                ESP_LOGE(TAG, "Missing message type, data: %.*s", (int)len, data);
+            } else if (type == "hello") {
+                ParseServerHello(message);
+            } else if (on_incoming_json_ != nullptr) {
+                on_incoming_json_(message);
             }
-            cJSON_Delete(root);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     websocket_->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
-        if (on_audio_channel_closed_ != nullptr) {
+        bool was_opened = channel_opened_.exchange(false);
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+        udp_audio_ = false;
+        udp_channel_.Close();
+#endif
+        FinishMetrics(false);
+#if CONFIG_WEBSOCKET_KEEP_ALIVE
+        // A warm connection dropped while idle is not a closed channel, the next turn reconnects
+        bool notify = was_opened;
+#else
+        bool notify = true;
+#endif
+        if (notify && on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
     });
 
     if (!websocket_->Connect(url.c_str())) {
         ESP_LOGE(TAG, "Failed to connect to websocket server");
-        SetError(Lang::Strings::SERVER_NOT_FOUND);
         return false;
     }
+    return true;
+}
+
+bool WebsocketProtocol::OpenAudioChannel() {
+    TRACE_SCOPE(kTraceOpenAudioChannel);
+    busy_sending_audio_ = false;
+    error_occurred_ = false;
+    remote_sequence_ = 0;
+    {
+        std::lock_guard<std::mutex> lock(connect_mutex_);
+#if CONFIG_WEBSOCKET_KEEP_ALIVE
+        if (IsConnected()) {
+            ESP_LOGI(TAG, "Reusing websocket connection, session: %s", session_id_.c_str());
+        } else if (!Connect()) {
+            SetError(Lang::Strings::SERVER_NOT_FOUND);
+            return false;
+        }
+#else
+        session_id_ = "";
+        if (!Connect()) {
+            SetError(Lang::Strings::SERVER_NOT_FOUND);
+            return false;
+        }
+#endif
+    }
+    last_incoming_time_ = std::chrono::steady_clock::now();
+    metrics_.Begin();
 
     // Send hello message to describe the client
     // keys: message type, version, audio_params (format, sample_rate, channels)
-    std::string message = "{";
-    message += "\"type\":\"hello\",";
-    message += "\"version\": 1,";
-    message += "\"transport\":\"websocket\",";
-    message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
-    if (!SendText(message)) {
+    char buffer[JSON_CONTROL_MESSAGE_SIZE];
+    JsonWriter json(buffer, sizeof(buffer));
+    json.AddString("type", "hello").AddInt("version", 1).AddString("transport", "websocket");
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Servers that don't know the key answer without "udp" and audio stays in binary frames
+    json.AddString("audio_transport", "udp");
+#endif
+    AddControlParams(json);
+#if CONFIG_USE_TTS_CACHE
+    // Servers that know the key put a reply hash in sentence_start
+    if (TtsCache::GetInstance().IsMounted()) {
+        json.AddBool("tts_cache", true);
+    }
+#endif
+    if (!session_id_.empty()) {
+        // Ask the server to resume the previous session
+        json.AddString("session_id", session_id_);
+    }
+    json.BeginObject("audio_params").AddString("format", "opus").AddInt("sample_rate", 16000).AddInt("channels", 1);
+    AddUplinkAudioParams(json);
+    json.EndObject();
+    metrics_.OnHelloSent();
+    if (!SendText(json.Finish())) {
         return false;
     }
 
@@ -137,6 +288,19 @@ bool WebsocketProtocol::OpenAudioChannel() {
         return false;
     }
 
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    if (udp_audio_) {
+        udp_channel_.Open([this](AudioPacket&& packet, uint32_t sequence, size_t wire_size) {
+            metrics_.OnDownlink(wire_size, sequence);
+            if (on_incoming_audio_ != nullptr) {
+                on_incoming_audio_(std::move(packet), sequence);
+            }
+            last_incoming_time_ = std::chrono::steady_clock::now();
+        });
+    }
+#endif
+
+    channel_opened_ = true;
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
     }
@@ -144,31 +308,36 @@ bool WebsocketProtocol::OpenAudioChannel() {
     return true;
 }
 
-void WebsocketProtocol::ParseServerHello(const cJSON* root) {
-    auto transport = cJSON_GetObjectItem(root, "transport");
-    if (transport == nullptr || strcmp(transport->valuestring, "websocket") != 0) {
-        ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
+void WebsocketProtocol::ParseServerHello(const JsonMessage& root) {
+    auto transport = root.Get("transport");
+    if (transport != "websocket") {
+        ESP_LOGE(TAG, "Unsupported transport: %.*s", (int)transport.size(), transport.data());
         return;
     }
 
-    auto session_id = cJSON_GetObjectItem(root, "session_id");
-    if (session_id != nullptr) {
-        session_id_ = session_id->valuestring;
+    if (root.GetString("session_id", session_id_)) {
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
-    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
-    if (audio_params != NULL) {
-        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
-        if (sample_rate != NULL) {
-            server_sample_rate_ = sample_rate->valueint;
-        }
-        auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
-        if (frame_duration != NULL) {
-            server_frame_duration_ = frame_duration->valueint;
-        }
+    auto audio_params = root.GetObject("audio_params");
+    if (audio_params.valid()) {
+        audio_params.GetInt("sample_rate", server_sample_rate_);
+        audio_params.GetInt("frame_duration", server_frame_duration_);
+        ParseUplinkAudioParams(audio_params);
     }
     ESP_LOGI(TAG, "Server audio params: sample_rate=%d, frame_duration=%d", server_sample_rate_, server_frame_duration_);
 
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    auto udp = root.GetObject("udp");
+    udp_audio_ = udp.valid() && udp_channel_.Configure(udp);
+    ESP_LOGI(TAG, "Audio transport: %s", udp_audio_ ? "udp" : "websocket");
+#endif
+    ParseControlParams(root);
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Binary frames carry the audio when it stays on the websocket
+    binary_control_ = binary_control_ && udp_audio_;
+#endif
+
+    metrics_.OnHelloReceived();
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
@@ -3,11 +3,17 @@
 
 
 #include "protocol.h"
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+#include "udp_audio_channel.h"
+#endif
 
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
+#include <atomic>
+#include <mutex>
+
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
 class WebsocketProtocol : public Protocol {
@@ -16,17 +22,37 @@ public:
     ~WebsocketProtocol();
 
     void Start() override;
-    void SendAudio(const std::vector<uint8_t>& data) override;
+    void PrepareAudioChannel() override;
+    void SendAudio(const AudioPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    bool IsAudioInOrderWithJson() const override;
 
 private:
     EventGroupHandle_t event_group_handle_;
     WebSocket* websocket_ = nullptr;
+    // Held while connecting, OpenAudioChannel joins a handshake started by PrepareAudioChannel
+    std::mutex connect_mutex_;
+    std::atomic<bool> channel_opened_{false};
+    std::atomic<bool> prewarm_running_{false};
+    // TCP keeps the order, frames are numbered locally for the jitter buffer
+    uint32_t remote_sequence_ = 0;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Control stays on the websocket, audio goes over UDP when the server hello offers it
+    UdpAudioChannel udp_channel_;
+    std::atomic<bool> udp_audio_{false};
+#endif
 
-    void ParseServerHello(const cJSON* root);
-    bool SendText(const std::string& text) override;
+    bool Connect();
+    bool IsConnected() const;
+    void ParseServerHello(const JsonMessage& root);
+    bool SendText(std::string_view text) override;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Only while audio is on UDP, otherwise the binary frames are audio
+    bool CanSendBinary() const override { return true; }
+    bool SendBinary(std::string_view frame) override;
+#endif
 };
 
 #endif
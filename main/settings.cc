@@ -1,58 +1,303 @@
 #include "settings.h"
+#include "timer_service.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_system.h>
 #include <nvs_flash.h>
 
+#include <map>
+#include <mutex>
+#include <vector>
+
 #define TAG "Settings"
 
-Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
-    nvs_open(ns.c_str(), read_write_ ? NVS_READWRITE : NVS_READONLY, &nvs_handle_);
-}
+// 最后一次修改后多久写入 flash，连续修改（如拖动音量）时最多推迟 SETTINGS_COMMIT_MAX_DELAY_MS
+#define SETTINGS_COMMIT_DELAY_MS 1000
+#define SETTINGS_COMMIT_MAX_DELAY_MS 5000
+#define SETTINGS_COMMIT_SLACK_MS 500
 
-Settings::~Settings() {
-    if (nvs_handle_ != 0) {
-        if (read_write_ && dirty_) {
-            ESP_ERROR_CHECK(nvs_commit(nvs_handle_));
+namespace {
+
+struct SettingValue {
+    nvs_type_t type = NVS_TYPE_ANY;
+    int32_t int_value = 0;
+    std::string string_value;
+    bool dirty = false;
+    bool erased = false;
+};
+
+struct SettingNamespace {
+    std::map<std::string, SettingValue> values;
+    bool erase_all = false;
+    bool dirty = false;
+};
+
+class SettingsCache {
+public:
+    static SettingsCache& GetInstance() {
+        static SettingsCache instance;
+        return instance;
+    }
+
+    bool GetString(const std::string& ns, const std::string& key, std::string& value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto item = Find(ns, key);
+        if (item == nullptr || item->type != NVS_TYPE_STR) {
+            return false;
         }
-        nvs_close(nvs_handle_);
+        value = item->string_value;
+        return true;
     }
-}
 
-std::string Settings::GetString(const std::string& key, const std::string& default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
+    bool GetInt(const std::string& ns, const std::string& key, int32_t& value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto item = Find(ns, key);
+        if (item == nullptr || item->type != NVS_TYPE_I32) {
+            return false;
+        }
+        value = item->int_value;
+        return true;
     }
 
-    size_t length = 0;
-    if (nvs_get_str(nvs_handle_, key.c_str(), nullptr, &length) != ESP_OK) {
-        return default_value;
+    void SetString(const std::string& ns, const std::string& key, const std::string& value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& item = Load(ns).values[key];
+        if (!item.erased && item.type == NVS_TYPE_STR && item.string_value == value) {
+            return;
+        }
+        item.type = NVS_TYPE_STR;
+        item.erased = false;
+        item.string_value = value;
+        MarkDirty(ns, item);
+    }
+
+    void SetInt(const std::string& ns, const std::string& key, int32_t value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& item = Load(ns).values[key];
+        if (!item.erased && item.type == NVS_TYPE_I32 && item.int_value == value) {
+            return;
+        }
+        item.type = NVS_TYPE_I32;
+        item.erased = false;
+        item.int_value = value;
+        item.string_value.clear();
+        MarkDirty(ns, item);
+    }
+
+    void EraseKey(const std::string& ns, const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& space = Load(ns);
+        auto it = space.values.find(key);
+        if (it == space.values.end() || it->second.erased) {
+            return;
+        }
+        it->second.erased = true;
+        MarkDirty(ns, it->second);
+    }
+
+    void EraseAll(const std::string& ns) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& space = Load(ns);
+        space.values.clear();
+        space.erase_all = true;
+        space.dirty = true;
+        ScheduleCommit();
+    }
+
+    void Flush() {
+        // Only one writer at a time, readers keep using the cache while the flash is written
+        std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+        std::vector<std::pair<std::string, SettingNamespace>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& [name, space] : namespaces_) {
+                if (!space.dirty) {
+                    continue;
+                }
+                SettingNamespace changes;
+                changes.erase_all = space.erase_all;
+                for (auto it = space.values.begin(); it != space.values.end();) {
+                    if (it->second.dirty) {
+                        changes.values[it->first] = it->second;
+                        it->second.dirty = false;
+                    }
+                    it = it->second.erased ? space.values.erase(it) : std::next(it);
+                }
+                space.erase_all = false;
+                space.dirty = false;
+                pending.emplace_back(name, std::move(changes));
+            }
+            first_dirty_time_ = 0;
+        }
+
+        for (auto& [name, changes] : pending) {
+            Commit(name, changes);
+        }
+    }
+
+    void Reload() {
+        std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        TimerService::GetInstance().Stop(commit_timer_);
+        namespaces_.clear();
+        first_dirty_time_ = 0;
+    }
+
+private:
+    std::mutex mutex_;
+    std::mutex flush_mutex_;
+    std::map<std::string, SettingNamespace> namespaces_;
+    ServiceTimer* commit_timer_ = nullptr;
+    int64_t first_dirty_time_ = 0;
+
+    SettingsCache() {
+        // A commit may run a little late, it then shares the wakeup of other timers
+        commit_timer_ = TimerService::GetInstance().Create("settings_commit", [this]() {
+            Flush();
+        }, SETTINGS_COMMIT_SLACK_MS);
+        // Runs in esp_restart(), so a reboot right after a change still keeps it
+        esp_register_shutdown_handler([]() {
+            SettingsCache::GetInstance().Flush();
+        });
+    }
+
+    // Reads every string and integer of the namespace with a single nvs_open
+    SettingNamespace& Load(const std::string& ns) {
+        auto it = namespaces_.find(ns);
+        if (it != namespaces_.end()) {
+            return it->second;
+        }
+        auto& space = namespaces_[ns];
+
+        nvs_handle_t handle;
+        if (nvs_open(ns.c_str(), NVS_READONLY, &handle) != ESP_OK) {
+            return space;
+        }
+        nvs_iterator_t iterator = nullptr;
+        esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns.c_str(), NVS_TYPE_ANY, &iterator);
+        while (err == ESP_OK) {
+            nvs_entry_info_t info;
+            nvs_entry_info(iterator, &info);
+            SettingValue value;
+            if (info.type == NVS_TYPE_I32) {
+                if (nvs_get_i32(handle, info.key, &value.int_value) == ESP_OK) {
+                    value.type = NVS_TYPE_I32;
+                }
+            } else if (info.type == NVS_TYPE_STR) {
+                size_t length = 0;
+                if (nvs_get_str(handle, info.key, nullptr, &length) == ESP_OK) {
+                    value.string_value.resize(length);
+                    if (nvs_get_str(handle, info.key, value.string_value.data(), &length) == ESP_OK) {
+                        while (!value.string_value.empty() && value.string_value.back() == '\0') {
+                            value.string_value.pop_back();
+                        }
+                        value.type = NVS_TYPE_STR;
+                    }
+                }
+            }
+            if (value.type != NVS_TYPE_ANY) {
+                space.values[info.key] = std::move(value);
+            }
+            err = nvs_entry_next(&iterator);
+        }
+        nvs_release_iterator(iterator);
+        nvs_close(handle);
+        ESP_LOGD(TAG, "Loaded %u settings from %s", space.values.size(), ns.c_str());
+        return space;
+    }
+
+    const SettingValue* Find(const std::string& ns, const std::string& key) {
+        auto& space = Load(ns);
+        auto it = space.values.find(key);
+        if (it == space.values.end() || it->second.erased) {
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    void MarkDirty(const std::string& ns, SettingValue& item) {
+        item.dirty = true;
+        namespaces_[ns].dirty = true;
+        ScheduleCommit();
+    }
+
+    void ScheduleCommit() {
+        // Restart the delay on every change, unless the oldest change is already waiting too long
+        auto now = esp_timer_get_time();
+        if (first_dirty_time_ == 0) {
+            first_dirty_time_ = now;
+        } else if (TimerService::GetInstance().IsActive(commit_timer_)
+            && now - first_dirty_time_ >= SETTINGS_COMMIT_MAX_DELAY_MS * 1000LL) {
+            return;
+        }
+        TimerService::GetInstance().StartOnce(commit_timer_, SETTINGS_COMMIT_DELAY_MS);
+    }
+
+    void Commit(const std::string& ns, const SettingNamespace& changes) {
+        nvs_handle_t handle;
+        auto err = nvs_open(ns.c_str(), NVS_READWRITE, &handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to open namespace %s: %s", ns.c_str(), esp_err_to_name(err));
+            return;
+        }
+        if (changes.erase_all) {
+            err = nvs_erase_all(handle);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to erase namespace %s: %s", ns.c_str(), esp_err_to_name(err));
+            }
+        }
+        for (auto& [key, value] : changes.values) {
+            if (value.erased) {
+                err = nvs_erase_key(handle, key.c_str());
+                if (err == ESP_ERR_NVS_NOT_FOUND) {
+                    err = ESP_OK;
+                }
+            } else if (value.type == NVS_TYPE_I32) {
+                err = nvs_set_i32(handle, key.c_str(), value.int_value);
+            } else {
+                err = nvs_set_str(handle, key.c_str(), value.string_value.c_str());
+            }
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to write %s.%s: %s", ns.c_str(), key.c_str(), esp_err_to_name(err));
+            }
+        }
+        err = nvs_commit(handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to commit namespace %s: %s", ns.c_str(), esp_err_to_name(err));
+        }
+        nvs_close(handle);
+        ESP_LOGI(TAG, "Committed %u changes to %s", changes.values.size(), ns.c_str());
     }
+};
 
+} // namespace
+
+Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
+}
+
+Settings::~Settings() {
+}
+
+std::string Settings::GetString(const std::string& key, const std::string& default_value) {
     std::string value;
-    value.resize(length);
-    ESP_ERROR_CHECK(nvs_get_str(nvs_handle_, key.c_str(), value.data(), &length));
-    while (!value.empty() && value.back() == '\0') {
-        value.pop_back();
+    if (!SettingsCache::GetInstance().GetString(ns_, key, value)) {
+        return default_value;
     }
     return value;
 }
 
 void Settings::SetString(const std::string& key, const std::string& value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_str(nvs_handle_, key.c_str(), value.c_str()));
-        dirty_ = true;
+        SettingsCache::GetInstance().SetString(ns_, key, value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
-    }
-
     int32_t value;
-    if (nvs_get_i32(nvs_handle_, key.c_str(), &value) != ESP_OK) {
+    if (!SettingsCache::GetInstance().GetInt(ns_, key, value)) {
         return default_value;
     }
     return value;
@@ -60,8 +305,7 @@ int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
 
 void Settings::SetInt(const std::string& key, int32_t value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_i32(nvs_handle_, key.c_str(), value));
-        dirty_ = true;
+        SettingsCache::GetInstance().SetInt(ns_, key, value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -69,10 +313,7 @@ void Settings::SetInt(const std::string& key, int32_t value) {
 
 void Settings::EraseKey(const std::string& key) {
     if (read_write_) {
-        auto ret = nvs_erase_key(nvs_handle_, key.c_str());
-        if (ret != ESP_ERR_NVS_NOT_FOUND) {
-            ESP_ERROR_CHECK(ret);
-        }
+        SettingsCache::GetInstance().EraseKey(ns_, key);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -80,8 +321,16 @@ void Settings::EraseKey(const std::string& key) {
 
 void Settings::EraseAll() {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_erase_all(nvs_handle_));
+        SettingsCache::GetInstance().EraseAll(ns_);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
+
+void Settings::Flush() {
+    SettingsCache::GetInstance().Flush();
+}
+
+void Settings::Reload() {
+    SettingsCache::GetInstance().Reload();
+}
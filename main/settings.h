@@ -4,6 +4,9 @@
 #include <string>
 #include <nvs_flash.h>
 
+// Settings are served from a process-wide cache. A namespace is read from NVS in one pass
+// the first time it is used, writes are committed in the background after a short delay,
+// and everything pending is committed before esp_restart().
 class Settings {
 public:
     Settings(const std::string& ns, bool read_write = false);
@@ -16,11 +19,14 @@ public:
     void EraseKey(const std::string& key);
     void EraseAll();
 
+    // Commits pending writes now
+    static void Flush();
+    // Drops the cache and pending writes, after the NVS partition was erased
+    static void Reload();
+
 private:
     std::string ns_;
-    nvs_handle_t nvs_handle_ = 0;
     bool read_write_ = false;
-    bool dirty_ = false;
 };
 
 #endif
@@ -7,6 +7,8 @@
 #include <esp_system.h>
 #include <esp_partition.h>
 #include <esp_app_desc.h>
+#include <algorithm>
+#include <cstring>
 
 
 #define TAG "SystemInfo"
@@ -130,3 +132,105 @@ exit:    //Common return path
     return ret;
 }
 
+
+esp_err_t TaskMonitor::Sample() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int next = current_ ^ 1;
+    auto* snapshot = snapshots_[next];
+    configRUN_TIME_COUNTER_TYPE now;
+    UBaseType_t size = uxTaskGetSystemState(snapshot, TASK_MONITOR_MAX_TASKS, &now);
+    if (size == 0) {
+        // The buffer is too small for all tasks
+        return ESP_ERR_INVALID_SIZE;
+    }
+    // Task numbers only grow, sorted snapshots are matched in one pass
+    std::sort(snapshot, snapshot + size, [](const TaskStatus_t& a, const TaskStatus_t& b) {
+        return a.xTaskNumber < b.xTaskNumber;
+    });
+    snapshot_sizes_[next] = size;
+    snapshot_times_[next] = now;
+
+    bool diff = has_previous_;
+    auto* previous = snapshots_[current_];
+    UBaseType_t previous_size = snapshot_sizes_[current_];
+    uint64_t elapsed = (uint64_t)(now - snapshot_times_[current_]) * CONFIG_FREERTOS_NUMBER_OF_CORES;
+    current_ = next;
+    has_previous_ = true;
+    if (!diff || elapsed == 0) {
+        return ESP_OK;
+    }
+
+    UBaseType_t j = 0;
+    usage_count_ = 0;
+    for (int core = 0; core < CONFIG_FREERTOS_NUMBER_OF_CORES; core++) {
+        core_usage_[core] = -1;
+    }
+    for (UBaseType_t i = 0; i < size; i++) {
+        auto& task = snapshot[i];
+        while (j < previous_size && previous[j].xTaskNumber < task.xTaskNumber) {
+            j++;
+        }
+        // A task created since the previous sample counts from zero
+        uint32_t run_time = task.ulRunTimeCounter;
+        if (j < previous_size && previous[j].xTaskNumber == task.xTaskNumber) {
+            run_time -= previous[j].ulRunTimeCounter;
+        }
+
+        BaseType_t core_id = task.xCoreID;
+        auto& usage = usage_[usage_count_++];
+        strlcpy(usage.name, task.pcTaskName, sizeof(usage.name));
+        usage.core_id = core_id;
+        usage.cpu_permille = std::min<uint64_t>((uint64_t)run_time * 1000 / elapsed, 1000);
+        usage.stack_high_water = task.usStackHighWaterMark;
+
+        // Idle time of a core is the run time of its idle task
+        for (int core = 0; core < CONFIG_FREERTOS_NUMBER_OF_CORES; core++) {
+            if (task.xHandle == xTaskGetIdleTaskHandleForCore(core)) {
+                uint64_t core_elapsed = elapsed / CONFIG_FREERTOS_NUMBER_OF_CORES;
+                core_usage_[core] = 100 - (int)std::min<uint64_t>((uint64_t)run_time * 100 / core_elapsed, 100);
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+size_t TaskMonitor::GetTasks(TaskUsage* tasks, size_t max_tasks) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t count = std::min(max_tasks, usage_count_);
+    std::copy(usage_, usage_ + count, tasks);
+    return count;
+}
+
+int TaskMonitor::GetCoreUsage(int core_id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (core_id < 0 || core_id >= CONFIG_FREERTOS_NUMBER_OF_CORES || usage_count_ == 0) {
+        return -1;
+    }
+    return core_usage_[core_id];
+}
+
+void TaskMonitor::LogStats(size_t top_tasks) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (usage_count_ == 0) {
+        return;
+    }
+#if CONFIG_FREERTOS_NUMBER_OF_CORES > 1
+    ESP_LOGI(TAG, "CPU usage: core0 %d%%, core1 %d%%", core_usage_[0], core_usage_[1]);
+#else
+    ESP_LOGI(TAG, "CPU usage: %d%%", core_usage_[0]);
+#endif
+    // Sort indexes, this may run on the small esp_timer stack
+    uint8_t order[TASK_MONITOR_MAX_TASKS];
+    for (size_t i = 0; i < usage_count_; i++) {
+        order[i] = i;
+    }
+    top_tasks = std::min(top_tasks, usage_count_);
+    std::partial_sort(order, order + top_tasks, order + usage_count_, [this](uint8_t a, uint8_t b) {
+        return usage_[a].cpu_permille > usage_[b].cpu_permille;
+    });
+    for (size_t i = 0; i < top_tasks; i++) {
+        auto& task = usage_[order[i]];
+        ESP_LOGI(TAG, "%-16s core %2d %3u.%u%% stack free %lu", task.name, task.core_id,
+            task.cpu_permille / 10, task.cpu_permille % 10, task.stack_high_water);
+    }
+}
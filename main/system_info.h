@@ -5,6 +5,11 @@
 
 #include <esp_err.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mutex>
+
+// 任务采样快照容量, 超出的任务不统计
+#define TASK_MONITOR_MAX_TASKS 40
 
 class SystemInfo {
 public:
@@ -17,4 +22,48 @@ public:
     static esp_err_t PrintRealTimeStats(TickType_t xTicksToWait);
 };
 
+struct TaskUsage {
+    char name[configMAX_TASK_NAME_LEN];
+    BaseType_t core_id;             // tskNO_AFFINITY if not pinned
+    uint16_t cpu_permille;          // Of all cores, since the previous sample
+    uint32_t stack_high_water;      // Bytes that were never used
+};
+
+// Always-on CPU usage sampler. Each Sample() takes one snapshot into a fixed buffer and diffs
+// it against the previous one, so the caller never blocks and nothing is allocated.
+class TaskMonitor {
+public:
+    static TaskMonitor& GetInstance() {
+        static TaskMonitor instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    TaskMonitor(const TaskMonitor&) = delete;
+    TaskMonitor& operator=(const TaskMonitor&) = delete;
+
+    esp_err_t Sample();
+
+    // Copies up to `max_tasks` entries of the last sample, returns the number copied
+    size_t GetTasks(TaskUsage* tasks, size_t max_tasks) const;
+    // Busy percentage of a core over the last sample period, -1 if unknown
+    int GetCoreUsage(int core_id) const;
+    // Logs the per-core usage and the busiest tasks
+    void LogStats(size_t top_tasks = 5) const;
+
+private:
+    TaskMonitor() = default;
+    ~TaskMonitor() = default;
+
+    mutable std::mutex mutex_;
+    TaskStatus_t snapshots_[2][TASK_MONITOR_MAX_TASKS];
+    UBaseType_t snapshot_sizes_[2] = {};
+    configRUN_TIME_COUNTER_TYPE snapshot_times_[2] = {};
+    int current_ = 0;
+    bool has_previous_ = false;
+
+    TaskUsage usage_[TASK_MONITOR_MAX_TASKS];
+    size_t usage_count_ = 0;
+    int core_usage_[CONFIG_FREERTOS_NUMBER_OF_CORES];
+};
+
 #endif // _SYSTEM_INFO_H_
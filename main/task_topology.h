@@ -0,0 +1,130 @@
+#ifndef TASK_TOPOLOGY_H
+#define TASK_TOPOLOGY_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// 板级 config.h 可以覆盖下面任意一项
+#include "config.h"
+
+// 默认布局 (ESP32-S3)：
+// Core 1: 麦克风采集、AFE (NS/AEC/唤醒词)
+// Core 0: WiFi/lwIP、协议、opus 编码、解码与播放、LVGL
+// 单核芯片上 core 参数不起作用
+
+// Capture, AudioLoop reads the codec and feeds the AFE
+#ifndef TASK_AUDIO_INPUT_CORE
+#define TASK_AUDIO_INPUT_CORE 1
+#endif
+#ifndef TASK_AUDIO_INPUT_PRIORITY
+#define TASK_AUDIO_INPUT_PRIORITY 8
+#endif
+#ifndef TASK_AUDIO_INPUT_STACK_SIZE
+#define TASK_AUDIO_INPUT_STACK_SIZE (4096 * 2)
+#endif
+
+// esp-sr internal AFE task
+#ifndef TASK_AFE_CORE
+#define TASK_AFE_CORE 1
+#endif
+#ifndef TASK_AFE_PRIORITY
+#define TASK_AFE_PRIORITY 1
+#endif
+
+// AFE fetch task, runs wakenet/multinet and the wake word pre-roll encoder
+#ifndef TASK_AFE_FETCH_CORE
+#define TASK_AFE_FETCH_CORE 1
+#endif
+#ifndef TASK_AFE_FETCH_PRIORITY
+#define TASK_AFE_FETCH_PRIORITY 3
+#endif
+#ifndef TASK_AFE_FETCH_STACK_SIZE
+#define TASK_AFE_FETCH_STACK_SIZE (4096 * 8)
+#endif
+
+// Background workers (BackgroundTask), worker i runs on core TASK_ENCODE_CORE + i,
+// uplink opus encoding moves to whichever worker is free
+#ifndef TASK_ENCODE_CORE
+#define TASK_ENCODE_CORE 0
+#endif
+#ifndef TASK_ENCODE_PRIORITY
+#define TASK_ENCODE_PRIORITY 2
+#endif
+#ifndef TASK_ENCODE_STACK_SIZE
+#define TASK_ENCODE_STACK_SIZE (4096 * 8)
+#endif
+// The uplink is one serial group and keeps one worker busy at most, every extra worker costs
+// another TASK_ENCODE_STACK_SIZE of internal RAM
+#ifndef TASK_ENCODE_WORKERS
+#define TASK_ENCODE_WORKERS 1
+#endif
+// Queued uplink chunks per worker, about 0.5s of audio
+#ifndef TASK_ENCODE_QUEUE_SIZE
+#define TASK_ENCODE_QUEUE_SIZE 16
+#endif
+
+// Playback, the I2S writer runs at this priority and the decoder one below
+#ifndef TASK_PLAYBACK_CORE
+#define TASK_PLAYBACK_CORE 0
+#endif
+#ifndef TASK_PLAYBACK_PRIORITY
+#define TASK_PLAYBACK_PRIORITY 8
+#endif
+#ifndef TASK_PLAYBACK_OUTPUT_STACK_SIZE
+#define TASK_PLAYBACK_OUTPUT_STACK_SIZE 4096
+#endif
+#ifndef TASK_PLAYBACK_DECODE_STACK_SIZE
+#define TASK_PLAYBACK_DECODE_STACK_SIZE (4096 * 4)
+#endif
+
+// Protocol helpers: version check, websocket prewarm
+#ifndef TASK_NETWORK_CORE
+#define TASK_NETWORK_CORE 0
+#endif
+#ifndef TASK_NETWORK_PRIORITY
+#define TASK_NETWORK_PRIORITY 2
+#endif
+#ifndef TASK_NETWORK_STACK_SIZE
+#define TASK_NETWORK_STACK_SIZE (4096 * 2)
+#endif
+
+// LVGL port task
+#ifndef TASK_LVGL_CORE
+#define TASK_LVGL_CORE 0
+#endif
+#ifndef TASK_LVGL_PRIORITY
+#define TASK_LVGL_PRIORITY 1
+#endif
+#ifndef TASK_LVGL_STACK_SIZE
+#define TASK_LVGL_STACK_SIZE 4096
+#endif
+
+// LED strip animation, copies precomputed frames to the RMT driver
+#ifndef TASK_LED_CORE
+#define TASK_LED_CORE 0
+#endif
+#ifndef TASK_LED_PRIORITY
+#define TASK_LED_PRIORITY 1
+#endif
+#ifndef TASK_LED_STACK_SIZE
+#define TASK_LED_STACK_SIZE 2048
+#endif
+
+// Deferred log printer, lowest priority so console output never delays audio or network
+#ifndef TASK_LOG_CORE
+#define TASK_LOG_CORE 0
+#endif
+#ifndef TASK_LOG_PRIORITY
+#define TASK_LOG_PRIORITY 1
+#endif
+#ifndef TASK_LOG_STACK_SIZE
+#define TASK_LOG_STACK_SIZE 3072
+#endif
+
+#if CONFIG_FREERTOS_UNICORE
+#define TASK_CORE(core) 0
+#else
+#define TASK_CORE(core) (core)
+#endif
+
+#endif // TASK_TOPOLOGY_H
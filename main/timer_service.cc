@@ -0,0 +1,252 @@
+#include "timer_service.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+
+#define TAG "TimerService"
+
+struct ServiceTimer {
+    const char* name;
+    std::function<void()> callback;
+    uint32_t slack_ms;
+    uint32_t period_ms = 0;     // 0 for one shot
+    int64_t expire_ms = 0;
+    bool active = false;        // On the wheel
+    bool due = false;           // Picked by the running wakeup, not yet called
+    bool deleted = false;
+    ServiceTimer* prev = nullptr;
+    ServiceTimer* next = nullptr;
+
+    uint32_t runs = 0;
+    int64_t total_us = 0;
+    int64_t max_us = 0;
+};
+
+static inline int64_t NowMs() {
+    return esp_timer_get_time() / 1000;
+}
+
+// 向上对齐到 slack 的整数倍, 相同 slack 的定时器在同一时刻到期
+static inline int64_t AlignDeadline(int64_t deadline_ms, uint32_t slack_ms) {
+    if (slack_ms <= 1) {
+        return deadline_ms;
+    }
+    return (deadline_ms + slack_ms - 1) / slack_ms * slack_ms;
+}
+
+TimerService::TimerService() {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<TimerService*>(arg)->OnWakeup();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "timer_service",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &wakeup_timer_));
+    processed_ms_ = NowMs();
+}
+
+TimerService::~TimerService() {
+    esp_timer_stop(wakeup_timer_);
+    esp_timer_delete(wakeup_timer_);
+    for (auto timer : timers_) {
+        delete timer;
+    }
+}
+
+ServiceTimer* TimerService::Create(const char* name, std::function<void()> callback, uint32_t slack_ms) {
+    auto timer = new ServiceTimer();
+    timer->name = name;
+    timer->callback = std::move(callback);
+    timer->slack_ms = slack_ms;
+    std::lock_guard<std::mutex> lock(mutex_);
+    timers_.push_back(timer);
+    return timer;
+}
+
+void TimerService::Delete(ServiceTimer* timer) {
+    if (timer == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (timer->active) {
+        Remove(timer);
+    }
+    timer->due = false;
+    timer->deleted = true;
+    // A wakeup may hold it in due_, it is freed once the wakeup is done
+    if (!dispatching_) {
+        timers_.erase(std::remove(timers_.begin(), timers_.end(), timer), timers_.end());
+        delete timer;
+    }
+    Rearm();
+}
+
+void TimerService::StartPeriodic(ServiceTimer* timer, uint32_t period_ms) {
+    Start(timer, period_ms, period_ms);
+}
+
+void TimerService::StartOnce(ServiceTimer* timer, uint32_t timeout_ms) {
+    Start(timer, timeout_ms, 0);
+}
+
+void TimerService::Start(ServiceTimer* timer, uint32_t delay_ms, uint32_t period_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (timer->active) {
+        Remove(timer);
+    }
+    timer->period_ms = period_ms;
+    // Deadlines up to processed_ms_ are behind the dispatcher, the next wakeup would miss it
+    timer->expire_ms = std::max(AlignDeadline(NowMs() + delay_ms, timer->slack_ms), processed_ms_ + 1);
+    timer->due = false;
+    Insert(timer);
+    Rearm();
+}
+
+void TimerService::Stop(ServiceTimer* timer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (timer->active) {
+        Remove(timer);
+    }
+    timer->due = false;
+    Rearm();
+}
+
+bool TimerService::IsActive(ServiceTimer* timer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return timer->active || timer->due;
+}
+
+// Called with mutex_ held
+void TimerService::Insert(ServiceTimer* timer) {
+    auto& head = slots_[timer->expire_ms & (TIMER_SERVICE_SLOTS - 1)];
+    timer->prev = nullptr;
+    timer->next = head;
+    if (head != nullptr) {
+        head->prev = timer;
+    }
+    head = timer;
+    timer->active = true;
+}
+
+// Called with mutex_ held
+void TimerService::Remove(ServiceTimer* timer) {
+    if (timer->prev != nullptr) {
+        timer->prev->next = timer->next;
+    } else {
+        slots_[timer->expire_ms & (TIMER_SERVICE_SLOTS - 1)] = timer->next;
+    }
+    if (timer->next != nullptr) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = nullptr;
+    timer->active = false;
+}
+
+// Called with mutex_ held. There are only a handful of timers, the earliest deadline is
+// found by a scan; the wheel saves walking them all on every wakeup.
+void TimerService::Rearm() {
+    int64_t earliest = -1;
+    for (auto timer : timers_) {
+        if (timer->active && (earliest < 0 || timer->expire_ms < earliest)) {
+            earliest = timer->expire_ms;
+        }
+    }
+    if (earliest == armed_ms_) {
+        return;
+    }
+    esp_timer_stop(wakeup_timer_);
+    armed_ms_ = earliest;
+    if (earliest >= 0) {
+        int64_t delay_ms = std::max<int64_t>(earliest - NowMs(), 0);
+        esp_timer_start_once(wakeup_timer_, delay_ms * 1000 + 1);
+    }
+}
+
+// Runs on the esp_timer task
+void TimerService::OnWakeup() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    armed_ms_ = -1;
+    wakeups_++;
+
+    // Only the slots of the elapsed ticks can hold due timers, all of them after a full turn
+    int64_t now = NowMs();
+    int64_t ticks = std::min<int64_t>(now - processed_ms_, TIMER_SERVICE_SLOTS);
+    due_.clear();
+    for (int64_t i = 1; i <= ticks; i++) {
+        for (auto timer = slots_[(processed_ms_ + i) & (TIMER_SERVICE_SLOTS - 1)]; timer != nullptr; timer = timer->next) {
+            if (timer->expire_ms <= now) {
+                due_.push_back(timer);
+            }
+        }
+    }
+    processed_ms_ = now;
+    std::sort(due_.begin(), due_.end(), [](ServiceTimer* a, ServiceTimer* b) {
+        return a->expire_ms < b->expire_ms;
+    });
+
+    // Periodic timers are back on the wheel before any callback runs, so a callback can stop
+    // or restart its own timer like with esp_timer
+    for (auto timer : due_) {
+        Remove(timer);
+        timer->due = true;
+        if (timer->period_ms > 0) {
+            int64_t next = timer->expire_ms + timer->period_ms;
+            if (next <= now) {
+                next = now + timer->period_ms;
+            }
+            timer->expire_ms = AlignDeadline(next, timer->slack_ms);
+            Insert(timer);
+        }
+    }
+
+    dispatching_ = true;
+    for (auto timer : due_) {
+        if (!timer->due || timer->deleted) {
+            continue;
+        }
+        timer->due = false;
+        lock.unlock();
+        int64_t start = esp_timer_get_time();
+        timer->callback();
+        int64_t duration = esp_timer_get_time() - start;
+        lock.lock();
+        dispatches_++;
+        timer->runs++;
+        timer->total_us += duration;
+        timer->max_us = std::max(timer->max_us, duration);
+    }
+    dispatching_ = false;
+
+    // Deleted while the callbacks ran, by them or by another task
+    for (auto it = timers_.begin(); it != timers_.end();) {
+        if ((*it)->deleted) {
+            delete *it;
+            it = timers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    due_.clear();
+    Rearm();
+}
+
+void TimerService::LogStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ESP_LOGI(TAG, "%lu wakeups, %lu callbacks", wakeups_, dispatches_);
+    for (auto timer : timers_) {
+        if (timer->runs == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: %lu runs, avg %lld us, max %lld us", timer->name, timer->runs,
+            timer->total_us / timer->runs, timer->max_us);
+        timer->runs = 0;
+        timer->total_us = 0;
+        timer->max_us = 0;
+    }
+    wakeups_ = 0;
+    dispatches_ = 0;
+}
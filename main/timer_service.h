@@ -0,0 +1,67 @@
+#ifndef TIMER_SERVICE_H
+#define TIMER_SERVICE_H
+
+#include <esp_timer.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// 时间轮槽位数, 必须是 2 的幂, 每个槽位 1ms
+#define TIMER_SERVICE_SLOTS 256
+
+struct ServiceTimer;
+
+// Every software timer of the firmware on one hashed timing wheel, driven by a single one-shot
+// esp_timer armed for the earliest deadline. A timer with slack has its deadlines rounded up to
+// a multiple of the slack, so periodic work with the same slack lands in the same wakeup.
+// Callbacks run on the esp_timer task, as before, and their run time is accounted per timer.
+class TimerService {
+public:
+    static TimerService& GetInstance() {
+        static TimerService instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    TimerService(const TimerService&) = delete;
+    TimerService& operator=(const TimerService&) = delete;
+
+    // `slack_ms` is how late the callback may run, 0 for animations that need the exact period
+    ServiceTimer* Create(const char* name, std::function<void()> callback, uint32_t slack_ms = 0);
+    // Safe from the timer's own callback
+    void Delete(ServiceTimer* timer);
+
+    // Restart the timer if it is active. Late periodic ticks are skipped, not run in a burst.
+    void StartPeriodic(ServiceTimer* timer, uint32_t period_ms);
+    void StartOnce(ServiceTimer* timer, uint32_t timeout_ms);
+    void Stop(ServiceTimer* timer);
+    bool IsActive(ServiceTimer* timer);
+
+    // Wakeups and dispatches since the last call, then one line per timer that ran
+    void LogStats();
+
+private:
+    TimerService();
+    ~TimerService();
+
+    std::mutex mutex_;
+    esp_timer_handle_t wakeup_timer_ = nullptr;
+    ServiceTimer* slots_[TIMER_SERVICE_SLOTS] = {};
+    std::vector<ServiceTimer*> timers_;
+    // Timers due in the current wakeup, kept to avoid an allocation per wakeup
+    std::vector<ServiceTimer*> due_;
+    int64_t processed_ms_ = 0;  // Every deadline up to here has been dispatched
+    int64_t armed_ms_ = -1;     // Deadline the wakeup timer is armed for
+    bool dispatching_ = false;
+    uint32_t wakeups_ = 0;
+    uint32_t dispatches_ = 0;
+
+    void Start(ServiceTimer* timer, uint32_t delay_ms, uint32_t period_ms);
+    void Insert(ServiceTimer* timer);
+    void Remove(ServiceTimer* timer);
+    void Rearm();
+    void OnWakeup();
+};
+
+#endif // TIMER_SERVICE_H
@@ -0,0 +1,117 @@
+#include "trace.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_cpu.h>
+#include <mbedtls/base64.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "Trace"
+
+#ifdef CONFIG_TRACE_BUFFER_EVENTS
+#define TRACE_BUFFER_EVENTS CONFIG_TRACE_BUFFER_EVENTS
+#else
+#define TRACE_BUFFER_EVENTS 1024
+#endif
+static_assert((TRACE_BUFFER_EVENTS & (TRACE_BUFFER_EVENTS - 1)) == 0, "TRACE_BUFFER_EVENTS must be a power of two");
+
+// 每行 base64 字符数
+#define TRACE_LOG_LINE_SIZE 96
+
+static const char* const kTraceEventNames[kTraceEventCount] = {
+    "boot", "boot_audio", "boot_network", "boot_protocol", "audio_front_end",
+    "check_version", "activate", "upgrade", "wake_word_init", "wake_word_detected",
+    "audio_processor_init", "vad", "open_audio_channel", "device_state",
+    "tts_start", "tts_stop", "sentence", "stt"
+};
+
+struct __attribute__((packed)) TraceDumpHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t record_count;
+    uint32_t dropped;       // Overwritten before the dump
+    uint32_t names_size;    // NUL separated names, indexed by event id
+};
+
+Trace::Trace() {
+    records_ = (TraceRecord*)heap_caps_calloc(TRACE_BUFFER_EVENTS, sizeof(TraceRecord), MALLOC_CAP_SPIRAM);
+    if (records_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %d trace events, tracing disabled", TRACE_BUFFER_EVENTS);
+    }
+}
+
+Trace::~Trace() {
+    heap_caps_free(records_);
+}
+
+void Trace::Record(TraceEvent event, TracePhase phase, uint32_t arg) {
+    if (records_ == nullptr) {
+        return;
+    }
+    uint32_t index = next_.fetch_add(1, std::memory_order_relaxed) & (TRACE_BUFFER_EVENTS - 1);
+    auto& record = records_[index];
+    record.timestamp_us = (uint32_t)esp_timer_get_time();
+    record.arg = arg;
+    record.event = event;
+    record.phase = phase;
+    record.core = esp_cpu_get_core_id();
+}
+
+std::string Trace::Serialize() const {
+    // A writer racing the dump may leave one torn record, the converter skips invalid ones
+    uint32_t next = next_.load(std::memory_order_relaxed);
+    uint32_t count = next < TRACE_BUFFER_EVENTS ? next : TRACE_BUFFER_EVENTS;
+    if (records_ == nullptr) {
+        count = 0;
+    }
+
+    std::string names;
+    for (auto name : kTraceEventNames) {
+        names.append(name);
+        names.push_back('\0');
+    }
+
+    TraceDumpHeader header = {
+        .magic = TRACE_DUMP_MAGIC,
+        .version = TRACE_DUMP_VERSION,
+        .record_size = sizeof(TraceRecord),
+        .record_count = count,
+        .dropped = next - count,
+        .names_size = (uint32_t)names.size(),
+    };
+    std::string data;
+    data.reserve(sizeof(header) + names.size() + count * sizeof(TraceRecord));
+    data.append((const char*)&header, sizeof(header));
+    data.append(names);
+    for (uint32_t i = next - count; i != next; i++) {
+        data.append((const char*)&records_[i & (TRACE_BUFFER_EVENTS - 1)], sizeof(TraceRecord));
+    }
+    return data;
+}
+
+std::string Trace::SerializeBase64() const {
+    auto data = Serialize();
+    size_t length = 0;
+    mbedtls_base64_encode(nullptr, 0, &length, (const unsigned char*)data.data(), data.size());
+    std::string encoded(length, '\0');
+    mbedtls_base64_encode((unsigned char*)encoded.data(), encoded.size(), &length,
+        (const unsigned char*)data.data(), data.size());
+    encoded.resize(length);
+    return encoded;
+}
+
+void Trace::DumpToLog() const {
+    auto encoded = SerializeBase64();
+    ESP_LOGI(TAG, "XZTRACE BEGIN %u", encoded.size());
+    for (size_t offset = 0; offset < encoded.size(); offset += TRACE_LOG_LINE_SIZE) {
+        ESP_LOGI(TAG, "%.*s", (int)std::min<size_t>(TRACE_LOG_LINE_SIZE, encoded.size() - offset), encoded.data() + offset);
+    }
+    ESP_LOGI(TAG, "XZTRACE END");
+}
+
+void Trace::Reset() {
+    next_.store(0, std::memory_order_relaxed);
+}
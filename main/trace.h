@@ -0,0 +1,113 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Trace events, the names in trace.cc follow the same order
+enum TraceEvent : uint16_t {
+    kTraceBoot,             // Application::Start until the device is idle
+    kTraceBootAudio,        // Codec, encoder and playback setup
+    kTraceBootNetwork,      // Board::StartNetwork
+    kTraceBootProtocol,     // Protocol creation and Start
+    kTraceAudioFrontEnd,    // AFE and wake word model loading
+    kTraceCheckVersion,     // Ota::CheckVersion
+    kTraceActivate,         // Ota::Activate
+    kTraceUpgrade,          // Ota::Upgrade
+    kTraceWakeWordInit,     // WakeWordDetect::Initialize
+    kTraceWakeWordDetected,
+    kTraceAudioProcessorInit,
+    kTraceVad,              // Counter, 1 while speech is detected
+    kTraceOpenAudioChannel, // Protocol::OpenAudioChannel
+    kTraceDeviceState,      // Counter, DeviceState value
+    kTraceTtsStart,
+    kTraceTtsStop,
+    kTraceSentence,         // TTS sentence_start
+    kTraceStt,
+    kTraceEventCount
+};
+
+enum TracePhase : uint8_t {
+    kTracePhaseBegin = 'b',     // Async span, may end on another task
+    kTracePhaseEnd = 'e',
+    kTracePhaseComplete = 'X',  // Recorded at the end, arg is the duration in us
+    kTracePhaseInstant = 'i',
+    kTracePhaseCounter = 'C',   // arg is the value
+};
+
+// 12 bytes, the timestamp wraps every 71 minutes and is unwrapped by the converter
+struct __attribute__((packed)) TraceRecord {
+    uint32_t timestamp_us;
+    uint32_t arg;
+    uint16_t event;
+    uint8_t phase;
+    uint8_t core;
+};
+
+#define TRACE_DUMP_MAGIC 0x52545a58 // "XZTR"
+#define TRACE_DUMP_VERSION 1
+
+// Fixed ring of timestamped events in PSRAM. Recording is one atomic increment and a
+// 12 byte store, safe from any task. Old events are overwritten, a dump is converted to
+// Chrome trace format by scripts/trace_to_chrome.py.
+class Trace {
+public:
+    static Trace& GetInstance() {
+        static Trace instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    Trace(const Trace&) = delete;
+    Trace& operator=(const Trace&) = delete;
+
+    void Record(TraceEvent event, TracePhase phase, uint32_t arg = 0);
+
+    // Header, event names, then the records from oldest to newest
+    std::string Serialize() const;
+    std::string SerializeBase64() const;
+    // Prints the base64 dump between XZTRACE BEGIN / XZTRACE END lines
+    void DumpToLog() const;
+    void Reset();
+
+private:
+    Trace();
+    ~Trace();
+
+    TraceRecord* records_ = nullptr;
+    std::atomic<uint32_t> next_{0};
+};
+
+class TraceScope {
+public:
+    explicit TraceScope(TraceEvent event) : event_(event), start_(esp_timer_get_time()) {}
+    ~TraceScope() {
+        Trace::GetInstance().Record(event_, kTracePhaseComplete, esp_timer_get_time() - start_);
+    }
+
+private:
+    TraceEvent event_;
+    int64_t start_;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#if CONFIG_USE_TRACE
+#define TRACE_BEGIN(event) Trace::GetInstance().Record(event, kTracePhaseBegin)
+#define TRACE_END(event) Trace::GetInstance().Record(event, kTracePhaseEnd)
+#define TRACE_INSTANT(event) Trace::GetInstance().Record(event, kTracePhaseInstant)
+#define TRACE_COUNTER(event, value) Trace::GetInstance().Record(event, kTracePhaseCounter, value)
+#define TRACE_SCOPE(event) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(event)
+#else
+#define TRACE_BEGIN(event) do {} while (0)
+#define TRACE_END(event) do {} while (0)
+#define TRACE_INSTANT(event) do {} while (0)
+#define TRACE_COUNTER(event, value) do {} while (0)
+#define TRACE_SCOPE(event) do {} while (0)
+#endif
+
+#endif // TRACE_H
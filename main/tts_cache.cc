@@ -0,0 +1,286 @@
+#include "tts_cache.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_rom_crc.h>
+#include <spi_flash_mmap.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "protocol.h"
+#include "p3_reader.h"
+
+#define TAG "TtsCache"
+
+static inline uint32_t EntrySpan(uint32_t size) {
+    return (sizeof(TtsCacheEntryHeader) + size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+}
+
+TtsCache::TtsCache() {
+    if (!Mount("tts_cache")) {
+        return;
+    }
+    for (auto& recording : recordings_) {
+        recording.data = (uint8_t*)heap_caps_malloc(TTS_CACHE_MAX_ENTRY_SIZE, MALLOC_CAP_SPIRAM);
+        if (recording.data == nullptr) {
+            recording.data = (uint8_t*)heap_caps_malloc(TTS_CACHE_MAX_ENTRY_SIZE, MALLOC_CAP_8BIT);
+        }
+    }
+}
+
+TtsCache::~TtsCache() {
+    for (auto& recording : recordings_) {
+        heap_caps_free(recording.data);
+    }
+    if (data_ != nullptr) {
+        esp_partition_munmap(mmap_handle_);
+    }
+}
+
+bool TtsCache::Mount(const char* partition_label) {
+    auto partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (partition == nullptr) {
+        ESP_LOGW(TAG, "No %s partition, replies are not cached", partition_label);
+        return false;
+    }
+    // esp_partition_write invalidates the cache of mapped ranges, new entries are seen through the mapping
+    const void* data = nullptr;
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &data, &mmap_handle_);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map the %s partition: %s", partition_label, esp_err_to_name(err));
+        return false;
+    }
+    partition_ = partition;
+    data_ = static_cast<const uint8_t*>(data);
+
+    // Every entry starts on a sector, anything that does not check out is skipped a sector at a time
+    uint32_t newest_end = 0;
+    bool found = false;
+    for (uint32_t offset = 0; offset + sizeof(TtsCacheEntryHeader) <= partition_->size;) {
+        auto header = reinterpret_cast<const TtsCacheEntryHeader*>(data_ + offset);
+        if (header->magic != TTS_CACHE_MAGIC || header->size > TTS_CACHE_MAX_ENTRY_SIZE ||
+            offset + EntrySpan(header->size) > partition_->size ||
+            esp_rom_crc32_le(0, data_ + offset + sizeof(TtsCacheEntryHeader), header->size) != header->crc) {
+            offset += SPI_FLASH_SEC_SIZE;
+            continue;
+        }
+        std::string hash(header->hash, strnlen(header->hash, TTS_CACHE_HASH_LENGTH));
+        auto it = entries_.find(hash);
+        if (it == entries_.end() || it->second.sequence < header->sequence) {
+            entries_[hash] = {offset, header->size, header->sequence};
+        }
+        if (!found || header->sequence >= next_sequence_) {
+            next_sequence_ = header->sequence + 1;
+            newest_end = offset + EntrySpan(header->size);
+            found = true;
+        }
+        offset += EntrySpan(header->size);
+    }
+    write_offset_ = newest_end < partition_->size ? newest_end : 0;
+    ESP_LOGI(TAG, "%u cached replies in %lu bytes, next write at 0x%lx", entries_.size(), partition_->size, write_offset_);
+    return true;
+}
+
+std::string_view TtsCache::Find(std::string_view hash) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (data_ == nullptr) {
+        return std::string_view();
+    }
+    auto it = entries_.find(std::string(hash));
+    if (it == entries_.end()) {
+        misses_++;
+        return std::string_view();
+    }
+    hits_++;
+    // May still play when the next flush runs
+    auto& entry = it->second;
+    if (std::none_of(pins_.begin(), pins_.end(), [&entry](const Entry& pin) { return pin.offset == entry.offset; })) {
+        pins_.push_back(entry);
+    }
+    return std::string_view((const char*)data_ + it->second.offset + sizeof(TtsCacheEntryHeader), it->second.size);
+}
+
+void TtsCache::BeginRecording(std::string_view hash, int sample_rate, int frame_duration) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // sentence_start also ends the sentence before it
+    if (recording_ != nullptr && recording_->frames > 0) {
+        FinishRecording();
+    }
+    recording_ = nullptr;
+    if (data_ == nullptr || hash.empty() || hash.size() > TTS_CACHE_HASH_LENGTH || pending_ >= TTS_CACHE_PENDING_ENTRIES) {
+        return;
+    }
+    auto& recording = recordings_[pending_];
+    if (recording.data == nullptr) {
+        return;
+    }
+    memset(recording.hash, 0, sizeof(recording.hash));
+    memcpy(recording.hash, hash.data(), hash.size());
+    // The P3 header is filled in once the frame count is known
+    recording.size = sizeof(P3HeaderV2);
+    recording.frames = 0;
+    recording.sample_rate = sample_rate;
+    recording.frame_duration = frame_duration;
+    recording_ = &recording;
+}
+
+void TtsCache::AddFrame(const AudioPacket& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (recording_ == nullptr) {
+        return;
+    }
+    size_t frame_size = sizeof(BinaryProtocol3) + packet.size();
+    if (recording_->frames >= TTS_CACHE_MAX_FRAMES || recording_->size + frame_size > TTS_CACHE_MAX_ENTRY_SIZE) {
+        // Too long to hold the stream behind it, the sentence stays uncached
+        recording_ = nullptr;
+        return;
+    }
+    auto p3 = reinterpret_cast<BinaryProtocol3*>(recording_->data + recording_->size);
+    p3->type = 0;
+    p3->reserved = 0;
+    p3->payload_size = htons(packet.size());
+    memcpy(p3->payload, packet.data(), packet.size());
+    recording_->size += frame_size;
+    recording_->frames++;
+}
+
+void TtsCache::EndRecording(bool complete) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (recording_ == nullptr) {
+        return;
+    }
+    if (complete && recording_->frames > 0) {
+        FinishRecording();
+    }
+    recording_ = nullptr;
+}
+
+// Called with mutex_ held
+void TtsCache::FinishRecording() {
+    P3HeaderV2 header = {};
+    header.magic = P3_V2_MAGIC;
+    header.version = P3_V2_VERSION;
+    header.header_size = sizeof(header);
+    header.sample_rate = recording_->sample_rate;
+    header.frame_duration = recording_->frame_duration;
+    header.channels = 1;
+    header.frame_count = recording_->frames;
+    header.data_offset = sizeof(header);
+    memcpy(recording_->data, &header, sizeof(header));
+    pending_++;
+}
+
+void TtsCache::Flush() {
+    int count;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        count = pending_;
+        if (count == 0) {
+            return;
+        }
+        // Lookups from now on pin for this flush and the next one
+        flush_pins_ = std::move(pins_);
+        pins_.clear();
+    }
+
+    // Only the slots below `count` are written, recording continues in the ones above
+    for (int i = 0; i < count; i++) {
+        Write(recordings_[i]);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush_pins_.clear();
+    for (int i = count; i < TTS_CACHE_PENDING_ENTRIES; i++) {
+        std::swap(recordings_[i - count], recordings_[i]);
+    }
+    if (recording_ != nullptr) {
+        recording_ -= count;
+    }
+    pending_ -= count;
+    ESP_LOGI(TAG, "Stored %d replies, %u cached, %lu hits, %lu misses", count, entries_.size(), hits_, misses_);
+}
+
+// Called with mutex_ held
+const TtsCache::Entry* TtsCache::FindPin(uint32_t offset, uint32_t span) const {
+    for (auto pins : {&pins_, &flush_pins_}) {
+        for (auto& pin : *pins) {
+            if (pin.offset < offset + span && offset < pin.offset + EntrySpan(pin.size)) {
+                return &pin;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void TtsCache::Write(const Recording& recording) {
+    std::string hash(recording.hash, strnlen(recording.hash, TTS_CACHE_HASH_LENGTH));
+    uint32_t span = EntrySpan(recording.size);
+    uint32_t offset;
+    TtsCacheEntryHeader header = {};
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (entries_.find(hash) != entries_.end() || span > partition_->size) {
+            return;
+        }
+        // Skip past the pinned entries, one pass over the log at most
+        offset = write_offset_;
+        size_t skipped = 0;
+        while (true) {
+            if (offset + span > partition_->size) {
+                offset = 0;
+            }
+            auto pin = FindPin(offset, span);
+            if (pin == nullptr) {
+                break;
+            }
+            if (++skipped > pins_.size() + flush_pins_.size()) {
+                ESP_LOGW(TAG, "No room around the playing replies, %s is not stored", hash.c_str());
+                return;
+            }
+            offset = pin->offset + EntrySpan(pin->size);
+        }
+        write_offset_ = offset + span;
+        header.sequence = next_sequence_++;
+
+        // The overwritten entries are gone from the index before their sectors are erased
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.offset < offset + span && offset < it->second.offset + EntrySpan(it->second.size)) {
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    header.magic = TTS_CACHE_MAGIC;
+    memcpy(header.hash, recording.hash, TTS_CACHE_HASH_LENGTH);
+    header.size = recording.size;
+    header.sample_rate = recording.sample_rate;
+    header.frame_duration = recording.frame_duration;
+    header.crc = esp_rom_crc32_le(0, recording.data, recording.size);
+
+    // The header goes in last, an interrupted write leaves no valid entry behind. A sector at a
+    // time, so the audio tasks run between the stalls.
+    esp_err_t err = ESP_OK;
+    for (uint32_t sector = 0; sector < span && err == ESP_OK; sector += SPI_FLASH_SEC_SIZE) {
+        err = esp_partition_erase_range(partition_, offset + sector, SPI_FLASH_SEC_SIZE);
+        vTaskDelay(1);
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition_, offset + sizeof(header), recording.data, recording.size);
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition_, offset, &header, sizeof(header));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store %s: %s", hash.c_str(), esp_err_to_name(err));
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[hash] = {offset, (uint32_t)recording.size, header.sequence};
+}
@@ -0,0 +1,117 @@
+#ifndef TTS_CACHE_H
+#define TTS_CACHE_H
+
+#include <esp_partition.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "packet_pool.h"
+
+#define TTS_CACHE_MAGIC 0x43545a58  // "XZTC"
+// 服务器提供的哈希最长字符数, 更长的不缓存
+#define TTS_CACHE_HASH_LENGTH 32
+// 每条缓存的最大帧数与字节数. 播放缓存时服务器音频流在抖动缓冲中等待, 不能超过它的容量
+#ifndef TTS_CACHE_MAX_FRAMES
+#define TTS_CACHE_MAX_FRAMES 30
+#endif
+#ifndef TTS_CACHE_MAX_ENTRY_SIZE
+#define TTS_CACHE_MAX_ENTRY_SIZE (12 * 1024)
+#endif
+// 一轮对话中等待写入 flash 的句子数
+#ifndef TTS_CACHE_PENDING_ENTRIES
+#define TTS_CACHE_PENDING_ENTRIES 4
+#endif
+
+// Written in front of every entry, the entries start on flash sector boundaries
+struct TtsCacheEntryHeader {
+    uint32_t magic;
+    char hash[TTS_CACHE_HASH_LENGTH];   // Zero padded
+    uint32_t size;                      // P3 v2 sound after the header
+    uint16_t sample_rate;
+    uint16_t frame_duration;
+    uint32_t sequence;                  // Write order, the oldest entry is overwritten first
+    uint32_t crc;                       // esp_rom_crc32_le of the sound
+} __attribute__((packed));
+
+// Content addressed cache of server replies in the "tts_cache" partition. An entry holds the
+// Opus frames of one sentence as a P3 v2 sound at the server's rate, keyed by the hash the
+// server puts in sentence_start, so a hit plays through AudioPlayback like a local sound.
+// The partition is a log written from the start and wrapped around, and is memory mapped
+// once: lookups return views into flash.
+// Recording happens on the network task into PSRAM, the flash writes only in Flush.
+class TtsCache {
+public:
+    static TtsCache& GetInstance() {
+        static TtsCache instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    TtsCache(const TtsCache&) = delete;
+    TtsCache& operator=(const TtsCache&) = delete;
+
+    bool IsMounted() const { return data_ != nullptr; }
+
+    // P3 sound of the reply, empty when it is not cached. The entry is pinned: the flush after
+    // the lookup and any flush running during it write around it.
+    std::string_view Find(std::string_view hash);
+
+    // Collects the frames of a sentence that missed, ends the previous recording
+    void BeginRecording(std::string_view hash, int sample_rate, int frame_duration);
+    // Drops the recording once it grows beyond the limits
+    void AddFrame(const AudioPacket& packet);
+    // Keeps the current recording for the next Flush, `complete` false discards it
+    void EndRecording(bool complete = true);
+    // Writes the kept recordings to flash. Every erased sector stalls the flash cache on both
+    // cores for tens of milliseconds, run it in idle, off the audio path.
+    void Flush();
+
+private:
+    TtsCache();
+    ~TtsCache();
+
+    struct Entry {
+        uint32_t offset;
+        uint32_t size;
+        uint32_t sequence;
+    };
+
+    struct Recording {
+        char hash[TTS_CACHE_HASH_LENGTH];
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        int frames = 0;
+        int sample_rate = 0;
+        int frame_duration = 0;
+    };
+
+    std::mutex mutex_;
+    const esp_partition_t* partition_ = nullptr;
+    esp_partition_mmap_handle_t mmap_handle_ = 0;
+    const uint8_t* data_ = nullptr;
+    std::unordered_map<std::string, Entry> entries_;
+    uint32_t write_offset_ = 0;
+    uint32_t next_sequence_ = 0;
+    // Found since the last flush, and found while the current one runs
+    std::vector<Entry> pins_;
+    std::vector<Entry> flush_pins_;
+
+    Recording recordings_[TTS_CACHE_PENDING_ENTRIES];
+    Recording* recording_ = nullptr;    // Being filled
+    int pending_ = 0;                   // recordings_[0, pending_) wait for Flush
+
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+
+    bool Mount(const char* partition_label);
+    void FinishRecording();
+    const Entry* FindPin(uint32_t offset, uint32_t span) const;
+    void Write(const Recording& recording);
+};
+
+#endif // TTS_CACHE_H
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""
+Converts a TTF/OTF font into the font partition image read by main/display/partition_font.cc
+
+Glyphs are rendered with Pillow at 4 bpp. The layout matches PartitionFontHeader and PartitionFontGlyph:
+
+    header (32 bytes) | glyph index (16 bytes each, sorted by code point) | bitmaps (rows byte aligned)
+"""
+import argparse
+import struct
+import sys
+
+from PIL import ImageFont
+
+MAGIC = 0x54465A58  # "XZFT"
+VERSION = 1
+BPP = 4
+HEADER_FORMAT = "<IHBBHhhHHHIII"
+GLYPH_FORMAT = "<IIHBBbbH"
+
+
+def parse_ranges(text):
+    """"0x20-0x7F,0x4E00-0x9FFF" -> set of code points"""
+    codepoints = set()
+    for part in text.split(","):
+        part = part.strip()
+        if not part:
+            continue
+        if "-" in part:
+            start, end = part.split("-", 1)
+            codepoints.update(range(int(start, 0), int(end, 0) + 1))
+        else:
+            codepoints.add(int(part, 0))
+    return codepoints
+
+
+def render_glyph(font, char):
+    """Returns (adv_w, box_w, box_h, ofs_x, ofs_y, bitmap)"""
+    mask, offset = font.getmask2(char, mode="L", anchor="ls")
+    adv_w = int(round(font.getlength(char)))
+    box_w, box_h = mask.size
+    if box_w == 0 or box_h == 0:
+        return adv_w, 0, 0, 0, 0, b""
+    if box_w > 255 or box_h > 255:
+        raise ValueError(f"glyph U+{ord(char):04X} is too large")
+
+    # Offset is the top left corner relative to the baseline origin, LVGL wants the bottom left with y up
+    ofs_x = offset[0]
+    ofs_y = -(offset[1] + box_h)
+
+    stride = (box_w + 1) // 2
+    bitmap = bytearray(stride * box_h)
+    for y in range(box_h):
+        for x in range(box_w):
+            value = mask.getpixel((x, y)) >> 4
+            if x & 1:
+                bitmap[y * stride + x // 2] |= value
+            else:
+                bitmap[y * stride + x // 2] |= value << 4
+    return adv_w, box_w, box_h, ofs_x, ofs_y, bytes(bitmap)
+
+
+def mask_pixels(mask):
+    width, height = mask.size
+    return width, height, bytes(mask.getpixel((x, y)) for y in range(height) for x in range(width))
+
+
+def has_glyph(font, char, notdef):
+    if char.isspace():
+        return True
+    return mask_pixels(font.getmask(char, mode="L")) != notdef
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build a font partition image for PartitionFont")
+    parser.add_argument("font", help="TTF/OTF font file")
+    parser.add_argument("output", help="Output partition image, e.g. font.bin")
+    parser.add_argument("--size", type=int, default=16, help="Pixel size (default 16)")
+    parser.add_argument("--range", dest="ranges", default="0x20-0x7E",
+                        help="Code point ranges, e.g. 0x20-0x7E,0x3000-0x303F,0x4E00-0x9FFF")
+    parser.add_argument("--text", help="UTF-8 text file, every character in it is included as well")
+    parser.add_argument("--partition-size", type=lambda v: int(v, 0),
+                        help="Fail if the image doesn't fit a partition of this size")
+    args = parser.parse_args()
+
+    font = ImageFont.truetype(args.font, args.size)
+    codepoints = parse_ranges(args.ranges)
+    if args.text:
+        with open(args.text, encoding="utf-8") as f:
+            codepoints.update(ord(c) for c in f.read() if c not in "\r\n")
+
+    # Characters the font maps to .notdef render the same as an unassigned code point
+    notdef = mask_pixels(font.getmask(chr(0x10FFFD), mode="L"))
+
+    glyphs = []
+    for codepoint in sorted(codepoints):
+        char = chr(codepoint)
+        if not has_glyph(font, char, notdef):
+            continue
+        glyphs.append((codepoint, render_glyph(font, char)))
+
+    if not glyphs:
+        sys.exit("no glyphs found in the given ranges")
+
+    ascent, descent = font.getmetrics()
+    max_box_w = max(g[1][1] for g in glyphs)
+    max_box_h = max(g[1][2] for g in glyphs)
+    index_offset = struct.calcsize(HEADER_FORMAT)
+    bitmap_offset = index_offset + len(glyphs) * struct.calcsize(GLYPH_FORMAT)
+
+    index = bytearray()
+    bitmaps = bytearray()
+    for codepoint, (adv_w, box_w, box_h, ofs_x, ofs_y, bitmap) in glyphs:
+        index += struct.pack(GLYPH_FORMAT, codepoint, len(bitmaps), adv_w, box_w, box_h, ofs_x, ofs_y, 0)
+        bitmaps += bitmap
+
+    header = struct.pack(HEADER_FORMAT, MAGIC, VERSION, BPP, 0,
+                         ascent + descent, descent, -max(1, args.size // 10), max(1, args.size // 16),
+                         max_box_w, max_box_h, len(glyphs), index_offset, bitmap_offset)
+    image = header + index + bitmaps
+
+    if args.partition_size is not None and len(image) > args.partition_size:
+        sys.exit(f"image is {len(image)} bytes, larger than the partition ({args.partition_size} bytes)")
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print(f"{len(glyphs)} glyphs, line height {ascent + descent}, max box {max_box_w}x{max_box_h}, "
+          f"{len(image)} bytes -> {args.output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -7,7 +7,7 @@ HEADER_TEMPLATE = """// Auto-generated language config
 #pragma once
 
 #include <string_view>
-
+{includes}
 #ifndef {lang_code_for_font}
     #define {lang_code_for_font}  // 預設語言
 #endif
@@ -28,7 +28,27 @@ namespace Lang {{
 }}
 """
 
-def generate_header(input_path, output_path):
+def generate_sound(base_name, use_assets):
+    # 访问函数而不是全局变量, 查找只在第一次使用时做一次, 不进入各个源文件的静态初始化
+    if use_assets:
+        # 从 assets 分区映射，不嵌入固件
+        return f'''
+        inline const std::string_view& P3_{base_name.upper()}() {{
+        static const std::string_view sound = AssetStore::GetInstance().GetSound("{base_name}");
+        return sound;
+        }}'''
+    return f'''
+        extern const char p3_{base_name}_start[] asm("_binary_{base_name}_p3_start");
+        extern const char p3_{base_name}_end[] asm("_binary_{base_name}_p3_end");
+        inline const std::string_view& P3_{base_name.upper()}() {{
+        static const std::string_view sound {{
+        static_cast<const char*>(p3_{base_name}_start),
+        static_cast<size_t>(p3_{base_name}_end - p3_{base_name}_start)
+        }};
+        return sound;
+        }}'''
+
+def generate_header(input_path, output_path, use_assets=False):
     with open(input_path, 'r', encoding='utf-8') as f:
         data = json.load(f)
 
@@ -46,31 +66,16 @@ def generate_header(input_path, output_path):
         strings.append(f'        constexpr const char* {key.upper()} = "{value}";')
 
     # 生成音效常量
-    for file in os.listdir(os.path.dirname(input_path)):
-        if file.endswith('.p3'):
-            base_name = os.path.splitext(file)[0]
-            sounds.append(f'''
-        extern const char p3_{base_name}_start[] asm("_binary_{base_name}_p3_start");
-        extern const char p3_{base_name}_end[] asm("_binary_{base_name}_p3_end");
-        static const std::string_view P3_{base_name.upper()} {{
-        static_cast<const char*>(p3_{base_name}_start),
-        static_cast<size_t>(p3_{base_name}_end - p3_{base_name}_start)
-        }};''')
-    
-    # 生成公共音效
-    for file in os.listdir(os.path.join(os.path.dirname(output_path), 'common')):
-        if file.endswith('.p3'):
-            base_name = os.path.splitext(file)[0]
-            sounds.append(f'''
-        extern const char p3_{base_name}_start[] asm("_binary_{base_name}_p3_start");
-        extern const char p3_{base_name}_end[] asm("_binary_{base_name}_p3_end");
-        static const std::string_view P3_{base_name.upper()} {{
-        static_cast<const char*>(p3_{base_name}_start),
-        static_cast<size_t>(p3_{base_name}_end - p3_{base_name}_start)
-        }};''')
+    sound_dirs = [os.path.dirname(input_path), os.path.join(os.path.dirname(output_path), 'common')]
+    for sound_dir in sound_dirs:
+        for file in os.listdir(sound_dir):
+            if file.endswith('.p3'):
+                base_name = os.path.splitext(file)[0]
+                sounds.append(generate_sound(base_name, use_assets))
 
     # 填充模板
     content = HEADER_TEMPLATE.format(
+        includes='\n#include "asset_store.h"\n' if use_assets else '',
         lang_code=lang_code,
         lang_code_for_font=lang_code.replace('-', '_').lower(),
         strings="\n".join(sorted(strings)),
@@ -86,6 +91,7 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("--input", required=True, help="输入JSON文件路径")
     parser.add_argument("--output", required=True, help="输出头文件路径")
+    parser.add_argument("--assets", action="store_true", help="音效从 assets 分区读取")
     args = parser.parse_args()
 
-    generate_header(args.input, args.output)
\ No newline at end of file
+    generate_header(args.input, args.output, args.assets)
\ No newline at end of file
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""
+Builds a delta patch from one firmware image to another, applied on the device by main/ota_patch.cc
+
+    header (80 bytes, uncompressed) | zlib stream of ops
+
+Ops, all integers little endian:
+
+    0x00                          end
+    0x01 u32 src u32 len          copy len bytes of the old image from src
+    0x02 u32 len data[len]        insert new bytes
+    0x03 u32 src u32 len diff[len] old[src + i] + diff[i] (mod 256), for code that moved slightly
+
+The patch is applied again here before it is written, so a bad patch never leaves the host.
+"""
+import argparse
+import hashlib
+import struct
+import sys
+import zlib
+
+MAGIC = 0x50445A58  # "XZDP"
+VERSION = 1
+HEADER_FORMAT = "<IHHII32s32s"
+
+OP_END = 0x00
+OP_COPY = 0x01
+OP_INSERT = 0x02
+OP_ADD = 0x03
+
+INDEX_KEY = 8        # bytes hashed per index entry
+INDEX_STRIDE = 4     # old image positions indexed
+MIN_MATCH = 32       # shorter matches are cheaper as inserts
+MAX_CANDIDATES = 8   # positions tried per key
+
+
+def build_index(old):
+    index = {}
+    for pos in range(0, len(old) - INDEX_KEY + 1, INDEX_STRIDE):
+        candidates = index.setdefault(old[pos:pos + INDEX_KEY], [])
+        if len(candidates) < MAX_CANDIDATES:
+            candidates.append(pos)
+    return index
+
+
+def match_length(old, src, new, dst):
+    length = 0
+    limit = min(len(old) - src, len(new) - dst)
+    # Compare in chunks first, byte by byte for the tail
+    while length + 256 <= limit and old[src + length:src + length + 256] == new[dst + length:dst + length + 256]:
+        length += 256
+    while length < limit and old[src + length] == new[dst + length]:
+        length += 1
+    return length
+
+
+def find_match(index, old, new, dst):
+    best_src, best_len = 0, 0
+    for src in index.get(new[dst:dst + INDEX_KEY], ()):
+        length = match_length(old, src, new, dst)
+        if length > best_len:
+            best_src, best_len = src, length
+    return best_src, best_len
+
+
+def diff(old, new):
+    index = build_index(old)
+    ops = bytearray()
+    gap_start = 0
+    offset = None  # old position minus new position of the last copy
+
+    def flush_gap(start, end):
+        if start >= end:
+            return
+        length = end - start
+        if offset is not None and 0 <= start + offset and end + offset <= len(old):
+            # Mostly the same bytes as the old image at the same offset, e.g. shifted addresses
+            src = start + offset
+            same = sum(1 for i in range(length) if old[src + i] == new[start + i])
+            if same * 2 >= length:
+                ops.extend(struct.pack("<BII", OP_ADD, src, length))
+                ops.extend((new[start + i] - old[src + i]) & 0xFF for i in range(length))
+                return
+        ops.extend(struct.pack("<BI", OP_INSERT, length))
+        ops.extend(new[start:end])
+
+    pos = 0
+    while pos < len(new):
+        src, length = find_match(index, old, new, pos) if pos + INDEX_KEY <= len(new) else (0, 0)
+        if length < MIN_MATCH:
+            pos += 1
+            continue
+        flush_gap(gap_start, pos)
+        ops.extend(struct.pack("<BII", OP_COPY, src, length))
+        offset = src - pos
+        pos += length
+        gap_start = pos
+    flush_gap(gap_start, len(new))
+    ops.append(OP_END)
+    return bytes(ops)
+
+
+def apply(old, ops):
+    out = bytearray()
+    pos = 0
+    while True:
+        op = ops[pos]
+        pos += 1
+        if op == OP_END:
+            return bytes(out)
+        if op == OP_COPY:
+            src, length = struct.unpack_from("<II", ops, pos)
+            pos += 8
+            out += old[src:src + length]
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", ops, pos)
+            pos += 4
+            out += ops[pos:pos + length]
+            pos += length
+        elif op == OP_ADD:
+            src, length = struct.unpack_from("<II", ops, pos)
+            pos += 8
+            out += bytes((old[src + i] + ops[pos + i]) & 0xFF for i in range(length))
+            pos += length
+        else:
+            raise ValueError(f"unknown op 0x{op:02x}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build an OTA delta patch for OtaPatcher")
+    parser.add_argument("old", help="Firmware running on the device, e.g. build/xiaozhi.bin of the old release")
+    parser.add_argument("new", help="New firmware")
+    parser.add_argument("output", help="Output patch, e.g. xiaozhi-1.5.0-1.6.0.xzdp")
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+
+    ops = diff(old, new)
+    if apply(old, ops) != new:
+        sys.exit("patch verification failed")
+
+    header = struct.pack(HEADER_FORMAT, MAGIC, VERSION, 0, len(old), len(new),
+                         hashlib.sha256(old).digest(), hashlib.sha256(new).digest())
+    patch = header + zlib.compress(ops, 9)
+    with open(args.output, "wb") as f:
+        f.write(patch)
+    print(f"{len(old)} -> {len(new)} bytes, patch {len(patch)} bytes "
+          f"({len(patch) * 100 / len(new):.1f}% of the new firmware) -> {args.output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,62 +1,77 @@
-# convert audio files to protocol v3 stream
+# convert audio files to P3 sounds
 import librosa
 import opuslib
-import struct
 import sys
 import tqdm
 import numpy as np
 import argparse
 import pyloudnorm as pyln
 
-def encode_audio_to_opus(input_file, output_file, target_lufs=None):
+from p3_format import P3Sound, write_p3, OPUS_SAMPLE_RATES
+
+def encode_audio_to_opus(input_file, output_file, target_lufs=None, sample_rate=16000, frame_duration=60,
+                         preroll_frames=0, legacy=False, index=False):
     # Load audio file using librosa
-    audio, sample_rate = librosa.load(input_file, sr=None, mono=False, dtype=np.float32)
-    
+    audio, source_rate = librosa.load(input_file, sr=None, mono=False, dtype=np.float32)
+
     # Convert to mono if stereo
     if audio.ndim == 2:
         audio = librosa.to_mono(audio)
-    
+
     if target_lufs is not None:
-        print("Note: Automatic loudness adjustment is enabled, which may cause", file=sys.stderr) 
+        print("Note: Automatic loudness adjustment is enabled, which may cause", file=sys.stderr)
         print("      audio distortion. If the input audio has already been ", file=sys.stderr)
         print("      loudness-adjusted or if the input audio is TTS audio, ", file=sys.stderr)
         print("      please use the `-d` parameter to disable loudness adjustment.", file=sys.stderr)
-        meter = pyln.Meter(sample_rate)
+        meter = pyln.Meter(source_rate)
         current_loudness = meter.integrated_loudness(audio)
         audio = pyln.normalize.loudness(audio, current_loudness, target_lufs)
         print(f"Adjusted loudness: {current_loudness:.1f} LUFS -> {target_lufs} LUFS")
 
-    # Convert sample rate to 16000Hz if necessary
-    target_sample_rate = 16000
-    if sample_rate != target_sample_rate:
-        audio = librosa.resample(audio, orig_sr=sample_rate, target_sr=target_sample_rate)
-        sample_rate = target_sample_rate
-    
+    # 0 keeps the source rate, rounded up to a rate Opus can encode
+    if sample_rate == 0:
+        sample_rate = next((rate for rate in OPUS_SAMPLE_RATES if rate >= source_rate), OPUS_SAMPLE_RATES[-1])
+    if source_rate != sample_rate:
+        audio = librosa.resample(audio, orig_sr=source_rate, target_sr=sample_rate)
+
     # Convert audio data back to int16 after processing
     audio = (audio * 32767).astype(np.int16)
-    
+
+    # Silent frames in front settle the decoder, the device decodes them without playing them
+    frame_size = int(sample_rate * frame_duration / 1000)
+    audio = np.concatenate([np.zeros(frame_size * preroll_frames, dtype=np.int16), audio])
+
     # Initialize Opus encoder
     encoder = opuslib.Encoder(sample_rate, 1, opuslib.APPLICATION_AUDIO)
 
     # Encode and save
-    with open(output_file, 'wb') as f:
-        duration = 60  # 60ms per frame
-        frame_size = int(sample_rate * duration / 1000)
-        for i in tqdm.tqdm(range(0, len(audio) - frame_size, frame_size)):
-            frame = audio[i:i + frame_size]
-            opus_data = encoder.encode(frame.tobytes(), frame_size=frame_size)
-            packet = struct.pack('>BBH', 0, 0, len(opus_data)) + opus_data
-            f.write(packet)
+    sound = P3Sound(sample_rate=sample_rate, frame_duration=frame_duration, preroll_frames=preroll_frames, version=2)
+    for i in tqdm.tqdm(range(0, len(audio) - frame_size, frame_size)):
+        frame = audio[i:i + frame_size]
+        sound.frames.append(encoder.encode(frame.tobytes(), frame_size=frame_size))
+    write_p3(output_file, sound, index=index, legacy=legacy)
+    print(f"{len(sound.frames)} frames, {sample_rate} Hz, {frame_duration} ms")
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description='Convert audio to Opus with loudness normalization')
     parser.add_argument('input_file', help='Input audio file')
-    parser.add_argument('output_file', help='Output .opus file')
+    parser.add_argument('output_file', help='Output .p3 file')
     parser.add_argument('-l', '--lufs', type=float, default=-16.0,
                        help='Target loudness in LUFS (default: -16)')
     parser.add_argument('-d', '--disable-loudnorm', action='store_true',
                        help='Disable loudness normalization')
+    parser.add_argument('-r', '--sample-rate', type=int, default=16000, choices=(0,) + OPUS_SAMPLE_RATES,
+                       help='Encoding sample rate, 0 keeps the source rate (default: 16000)')
+    parser.add_argument('-f', '--frame-duration', type=int, default=60, choices=(10, 20, 40, 60),
+                       help='Frame duration in ms (default: 60)')
+    parser.add_argument('-p', '--preroll', type=int, default=0,
+                       help='Silent frames decoded ahead of the sound but not played (default: 0)')
+    parser.add_argument('--index', action='store_true',
+                       help='Append a frame offset index, 4 bytes per frame, for tools that seek')
+    parser.add_argument('--legacy', action='store_true',
+                       help='Write the old headerless layout, for firmware without P3 v2 support')
     args = parser.parse_args()
 
     target_lufs = None if args.disable_loudnorm else args.lufs
-    encode_audio_to_opus(args.input_file, args.output_file, target_lufs)
\ No newline at end of file
+    encode_audio_to_opus(args.input_file, args.output_file, target_lufs, args.sample_rate, args.frame_duration,
+                         args.preroll, args.legacy, args.index)
@@ -0,0 +1,92 @@
+"""
+Reads and writes P3 sounds, the layout read by main/p3_reader.cc.
+
+v2: a 32 byte little endian header, an optional index of uint32 frame offsets, then the frames.
+The firmware plays sounds front to back and never seeks, so the index is only written on request.
+Legacy: the frames alone, always 16 kHz mono with 60 ms frames.
+Every frame is [1 byte type, 1 byte reserved, 2 byte big endian length, Opus data].
+"""
+import struct
+from dataclasses import dataclass, field
+
+MAGIC = 0x32563350  # "P3V2"
+VERSION = 2
+HEADER_FORMAT = "<IHHIHBBIIII"
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+LEGACY_SAMPLE_RATE = 16000
+LEGACY_FRAME_DURATION = 60
+OPUS_SAMPLE_RATES = (8000, 12000, 16000, 24000, 48000)
+
+
+@dataclass
+class P3Sound:
+    sample_rate: int = LEGACY_SAMPLE_RATE
+    frame_duration: int = LEGACY_FRAME_DURATION
+    channels: int = 1
+    preroll_frames: int = 0
+    frames: list = field(default_factory=list)
+    version: int = 1
+
+    @property
+    def frame_size(self):
+        """Samples per channel in one frame"""
+        return self.sample_rate * self.frame_duration // 1000
+
+    def seek(self, seconds):
+        """Index of the frame that plays at `seconds`, counted after the preroll"""
+        return self.preroll_frames + int(seconds * 1000 // self.frame_duration)
+
+
+def _read_frames(data, offset):
+    frames = []
+    while offset + 4 <= len(data):
+        _type, _reserved, size = struct.unpack_from(">BBH", data, offset)
+        offset += 4
+        if offset + size > len(data):
+            break  # Truncated frame
+        frames.append(data[offset:offset + size])
+        offset += size
+    return frames
+
+
+def parse_p3(data):
+    if len(data) >= HEADER_SIZE and struct.unpack_from("<I", data)[0] == MAGIC:
+        (_magic, version, header_size, sample_rate, frame_duration, channels, _reserved,
+         frame_count, preroll_frames, _index_size, data_offset) = struct.unpack_from(HEADER_FORMAT, data)
+        if version != VERSION or header_size < HEADER_SIZE or data_offset > len(data):
+            raise ValueError(f"unsupported P3 header, version {version}")
+        frames = _read_frames(data, data_offset)
+        if len(frames) != frame_count:
+            raise ValueError(f"P3 header says {frame_count} frames, found {len(frames)}")
+        return P3Sound(sample_rate, frame_duration, channels, preroll_frames, frames, version)
+    if data and data[0] != 0:
+        raise ValueError("not a P3 file")
+    return P3Sound(frames=_read_frames(data, 0))
+
+
+def read_p3(path):
+    with open(path, "rb") as f:
+        return parse_p3(f.read())
+
+
+def build_p3(sound, index=False, legacy=False):
+    body = b"".join(struct.pack(">BBH", 0, 0, len(frame)) + frame for frame in sound.frames)
+    if legacy:
+        if (sound.sample_rate, sound.frame_duration, sound.preroll_frames) != (LEGACY_SAMPLE_RATE, LEGACY_FRAME_DURATION, 0):
+            raise ValueError("the legacy layout is 16 kHz with 60 ms frames and no preroll")
+        return body
+    offsets = []
+    offset = 0
+    for frame in sound.frames:
+        offsets.append(offset)
+        offset += 4 + len(frame)
+    index_data = struct.pack(f"<{len(offsets)}I", *offsets) if index else b""
+    header = struct.pack(HEADER_FORMAT, MAGIC, VERSION, HEADER_SIZE, sound.sample_rate, sound.frame_duration,
+                         sound.channels, 0, len(sound.frames), sound.preroll_frames,
+                         len(offsets) if index else 0, HEADER_SIZE + len(index_data))
+    return header + index_data + body
+
+
+def write_p3(path, sound, index=False, legacy=False):
+    with open(path, "wb") as f:
+        f.write(build_p3(sound, index, legacy))
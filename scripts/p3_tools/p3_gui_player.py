@@ -3,66 +3,49 @@ from tkinter import filedialog, messagebox
 import threading
 import time
 import opuslib
-import struct
 import numpy as np
 import sounddevice as sd
 import os
 
+from p3_format import read_p3
+
 
 def play_p3_file(input_file, stop_event=None, pause_event=None):
     """
     播放p3格式的音频文件
-    p3格式: [1字节类型, 1字节保留, 2字节长度, Opus数据]
+    v2 文件头给出采样率和帧长, 旧格式固定为 16000Hz / 60ms
     """
-    # 初始化Opus解码器
-    sample_rate = 16000  # 采样率固定为16000Hz
+    sound = read_p3(input_file)
     channels = 1  # 单声道
-    decoder = opuslib.Decoder(sample_rate, channels)
-    
-    # 帧大小 (60ms)
-    frame_size = int(sample_rate * 60 / 1000)
+    decoder = opuslib.Decoder(sound.sample_rate, channels)
     
     # 打开音频流
     stream = sd.OutputStream(
-        samplerate=sample_rate,
+        samplerate=sound.sample_rate,
         channels=channels,
         dtype='int16'
     )
     stream.start()
     
     try:
-        with open(input_file, 'rb') as f:
-            print(f"正在播放: {input_file}")
+        print(f"正在播放: {input_file}")
+        
+        for i, opus_data in enumerate(sound.frames):
+            while pause_event and pause_event.is_set() and not (stop_event and stop_event.is_set()):
+                time.sleep(0.1)
+            if stop_event and stop_event.is_set():
+                break
             
-            while True:
-                if stop_event and stop_event.is_set():
-                    break
-
-                if pause_event and pause_event.is_set():
-                    time.sleep(0.1)
-                    continue
-
-                # 读取头部 (4字节)
-                header = f.read(4)
-                if not header or len(header) < 4:
-                    break
-                
-                # 解析头部
-                packet_type, reserved, data_len = struct.unpack('>BBH', header)
-                
-                # 读取Opus数据
-                opus_data = f.read(data_len)
-                if not opus_data or len(opus_data) < data_len:
-                    break
-                
-                # 解码Opus数据
-                pcm_data = decoder.decode(opus_data, frame_size)
-                
-                # 将字节转换为numpy数组
-                audio_array = np.frombuffer(pcm_data, dtype=np.int16)
-                
-                # 播放音频
-                stream.write(audio_array)
+            # 解码Opus数据, 预热帧只解码不播放
+            pcm_data = decoder.decode(opus_data, sound.frame_size)
+            if i < sound.preroll_frames:
+                continue
+            
+            # 将字节转换为numpy数组
+            audio_array = np.frombuffer(pcm_data, dtype=np.int16)
+            
+            # 播放音频
+            stream.write(audio_array)
                 
     except KeyboardInterrupt:
         print("\n播放已停止")
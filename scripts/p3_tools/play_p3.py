@@ -1,58 +1,49 @@
 # 播放p3格式的音频文件
 import opuslib
-import struct
 import numpy as np
 import sounddevice as sd
 import argparse
 
-def play_p3_file(input_file):
+from p3_format import read_p3
+
+def play_p3_file(input_file, start=0.0, loop=False):
     """
     播放p3格式的音频文件
-    p3格式: [1字节类型, 1字节保留, 2字节长度, Opus数据]
+    v2 文件头给出采样率和帧长, 旧格式固定为 16000Hz / 60ms
     """
-    # 初始化Opus解码器
-    sample_rate = 16000  # 采样率固定为16000Hz
+    sound = read_p3(input_file)
     channels = 1  # 单声道
-    decoder = opuslib.Decoder(sample_rate, channels)
-    
-    # 帧大小 (60ms)
-    frame_size = int(sample_rate * 60 / 1000)
-    
+    decoder = opuslib.Decoder(sound.sample_rate, channels)
+
     # 打开音频流
     stream = sd.OutputStream(
-        samplerate=sample_rate,
+        samplerate=sound.sample_rate,
         channels=channels,
         dtype='int16'
     )
     stream.start()
-    
+
     try:
-        with open(input_file, 'rb') as f:
-            print(f"正在播放: {input_file}")
-            
-            while True:
-                # 读取头部 (4字节)
-                header = f.read(4)
-                if not header or len(header) < 4:
-                    break
-                
-                # 解析头部
-                packet_type, reserved, data_len = struct.unpack('>BBH', header)
-                
-                # 读取Opus数据
-                opus_data = f.read(data_len)
-                if not opus_data or len(opus_data) < data_len:
-                    break
-                
+        print(f"正在播放: {input_file} ({sound.sample_rate}Hz, {sound.frame_duration}ms, {len(sound.frames)} 帧)")
+        # 预热帧只解码不播放; 从中间开始时按帧索引定位
+        first = sound.seek(start) if start > 0 else 0
+        while True:
+            for i, opus_data in enumerate(sound.frames[first:], first):
                 # 解码Opus数据
-                pcm_data = decoder.decode(opus_data, frame_size)
-                
+                pcm_data = decoder.decode(opus_data, sound.frame_size)
+                if i < sound.preroll_frames:
+                    continue
+
                 # 将字节转换为numpy数组
                 audio_array = np.frombuffer(pcm_data, dtype=np.int16)
-                
+
                 # 播放音频
                 stream.write(audio_array)
-                
+            if not loop:
+                break
+            # 循环时跳过预热帧
+            first = sound.preroll_frames
+
     except KeyboardInterrupt:
         print("\n播放已停止")
     finally:
@@ -63,9 +54,11 @@ def play_p3_file(input_file):
 def main():
     parser = argparse.ArgumentParser(description='播放p3格式的音频文件')
     parser.add_argument('input_file', help='输入的p3文件路径')
+    parser.add_argument('-s', '--start', type=float, default=0.0, help='从第几秒开始播放')
+    parser.add_argument('-l', '--loop', action='store_true', help='循环播放, Ctrl+C 停止')
     args = parser.parse_args()
-    
-    play_p3_file(args.input_file)
+
+    play_p3_file(args.input_file, args.start, args.loop)
 
 if __name__ == "__main__":
-    main() 
+    main()
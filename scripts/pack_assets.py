@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""
+Packs P3 sounds and an optional font into the assets partition image read by main/asset_store.cc
+
+The layout matches AssetStoreHeader and AssetStoreEntry:
+
+    header (16 bytes) | entry index (44 bytes each, sorted by name) | data (4 byte aligned)
+
+Sounds are named "<language>/<name>" and "common/<name>", several languages can share one image.
+Add the partition to the partition table and flash the image, e.g.
+
+    assets,   data, 0x41,    ,          512K,
+
+    parttool.py write_partition --partition-name assets --input assets.bin
+"""
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = 0x53415A58  # "XZAS"
+VERSION = 1
+NAME_LENGTH = 32
+HEADER_FORMAT = "<IHHII"
+ENTRY_FORMAT = f"<{NAME_LENGTH}sIIB3x"
+
+FORMAT_RAW = 0
+FORMAT_P3 = 1
+FORMAT_FONT = 2
+
+
+def collect_sounds(directory, prefix):
+    assets = []
+    for file in sorted(os.listdir(directory)):
+        if file.endswith(".p3"):
+            name = f"{prefix}/{os.path.splitext(file)[0]}"
+            with open(os.path.join(directory, file), "rb") as f:
+                assets.append((name, FORMAT_P3, f.read()))
+    return assets
+
+
+def pack(assets):
+    assets = sorted(assets, key=lambda asset: asset[0].encode("utf-8"))
+    names = [asset[0] for asset in assets]
+    if len(set(names)) != len(names):
+        raise ValueError("duplicate asset names")
+
+    header_size = struct.calcsize(HEADER_FORMAT)
+    index_size = struct.calcsize(ENTRY_FORMAT) * len(assets)
+    offset = (header_size + index_size + 3) & ~3
+
+    index = bytearray()
+    data = bytearray()
+    for name, fmt, content in assets:
+        encoded = name.encode("utf-8")
+        if len(encoded) > NAME_LENGTH:
+            raise ValueError(f"asset name {name} is longer than {NAME_LENGTH} bytes")
+        index += struct.pack(ENTRY_FORMAT, encoded, offset + len(data), len(content), fmt)
+        data += content
+        data += b"\0" * (-len(data) % 4)
+
+    total_size = offset + len(data)
+    header = struct.pack(HEADER_FORMAT, MAGIC, VERSION, len(assets), header_size, total_size)
+    padding = b"\0" * (offset - header_size - index_size)
+    return header + index + padding + data
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack the assets partition image")
+    parser.add_argument("output", help="output image, e.g. assets.bin")
+    parser.add_argument("--assets-dir", default=os.path.join(os.path.dirname(__file__), "..", "main", "assets"),
+                        help="directory holding the language folders and common/")
+    parser.add_argument("--language", action="append", default=[],
+                        help="language folder to include, e.g. zh-CN, may be repeated, default all")
+    parser.add_argument("--font", help="font image from Font_Converter/font_to_partition.py, stored as 'font'")
+    parser.add_argument("--partition-size", type=lambda x: int(x, 0), default=0,
+                        help="fail when the image is larger than this")
+    args = parser.parse_args()
+
+    languages = args.language
+    if not languages:
+        languages = [d for d in sorted(os.listdir(args.assets_dir))
+                     if d != "common" and os.path.isfile(os.path.join(args.assets_dir, d, "language.json"))]
+
+    assets = collect_sounds(os.path.join(args.assets_dir, "common"), "common")
+    for language in languages:
+        assets += collect_sounds(os.path.join(args.assets_dir, language), language)
+    if args.font:
+        with open(args.font, "rb") as f:
+            assets.append(("font", FORMAT_FONT, f.read()))
+
+    image = pack(assets)
+    if args.partition_size and len(image) > args.partition_size:
+        print(f"Image is {len(image)} bytes, larger than the partition ({args.partition_size} bytes)", file=sys.stderr)
+        sys.exit(1)
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print(f"Packed {len(assets)} assets for {', '.join(languages)}, {len(image)} bytes")
+
+
+if __name__ == "__main__":
+    main()
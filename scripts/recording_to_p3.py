@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""
+Splits a conversation recording from main/conversation_recorder.cc into two p3 files,
+<output>_up.p3 (microphone) and <output>_down.p3 (server audio). The device uploads the
+recording in parts (Recording-Part header), pass them in order.
+
+Play or convert them with the tools in scripts/p3_tools; the P3 v2 headers carry the sample
+rate of each direction.
+"""
+import argparse
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "p3_tools"))
+from p3_format import P3Sound, write_p3  # noqa: E402
+
+MAGIC = 0x43525A58  # "XZRC"
+HEADER_FORMAT = "<IHHIIIII"
+# Version 2 appends the frame duration of each direction
+HEADER_V2_FORMAT = HEADER_FORMAT + "HH"
+RECORD_FORMAT = "<IHBB"
+
+
+def parse(data):
+    magic, version, slot_size, count, dropped, skipped, up_rate, down_rate = struct.unpack_from(HEADER_FORMAT, data)
+    if magic != MAGIC or version not in (1, 2):
+        sys.exit("not a recording dump")
+    header_format = HEADER_V2_FORMAT if version == 2 else HEADER_FORMAT
+    # Version 1 firmware always used 60 ms frames
+    up_duration, down_duration = struct.unpack_from(header_format, data)[8:] if version == 2 else (60, 60)
+    offset = struct.calcsize(header_format)
+    records = []
+    for _ in range(count):
+        if offset + struct.calcsize(RECORD_FORMAT) > len(data):
+            break
+        timestamp, size, direction, _reserved = struct.unpack_from(RECORD_FORMAT, data, offset)
+        offset += struct.calcsize(RECORD_FORMAT)
+        payload = data[offset:offset + size]
+        offset += size
+        if size == 0 or direction > 1:
+            continue  # Torn record written during the dump
+        records.append((timestamp, direction, payload))
+    return records, dropped, skipped, (up_rate, up_duration), (down_rate, down_duration)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a xiaozhi conversation recording to p3 files")
+    parser.add_argument("input", nargs="+", help="Binary recording parts uploaded by the device, in order")
+    parser.add_argument("output", help="Output prefix")
+    args = parser.parse_args()
+
+    records = []
+    for i, path in enumerate(args.input):
+        with open(path, "rb") as f:
+            part, part_dropped, skipped, (up_rate, up_duration), (down_rate, down_duration) = parse(f.read())
+        # Every part counts the older records it leaves out, only the first one's were lost
+        if i == 0:
+            dropped = part_dropped
+        records += part
+    up = [payload for _, direction, payload in records if direction == 0]
+    down = [payload for _, direction, payload in records if direction == 1]
+    write_p3(args.output + "_up.p3", P3Sound(up_rate, up_duration, frames=up, version=2))
+    write_p3(args.output + "_down.p3", P3Sound(down_rate, down_duration, frames=down, version=2))
+    if records:
+        span = (records[-1][0] - records[0][0]) / 1000
+        print(f"{span:.1f} s, {dropped} overwritten, {skipped} too large")
+    print(f"uplink {len(up)} packets at {up_rate} Hz / {up_duration} ms, "
+          f"downlink {len(down)} packets at {down_rate} Hz / {down_duration} ms")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+Converts a trace dump from main/trace.cc into Chrome trace format (chrome://tracing or https://ui.perfetto.dev)
+
+The input is one of:
+    - the raw binary dump
+    - a serial log containing the XZTRACE BEGIN / XZTRACE END block
+    - the JSON message of type "trace" sent over the protocol
+"""
+import argparse
+import base64
+import json
+import re
+import struct
+import sys
+
+MAGIC = 0x52545A58  # "XZTR"
+HEADER_FORMAT = "<IHHIII"
+RECORD_FORMAT = "<IIHBB"
+
+
+def load_dump(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) >= 4 and struct.unpack_from("<I", data)[0] == MAGIC:
+        return data
+
+    text = data.decode("utf-8", errors="replace")
+    if text.lstrip().startswith("{"):
+        return base64.b64decode(json.loads(text)["data"])
+
+    match = re.search(r"XZTRACE BEGIN.*?\n(.*?)XZTRACE END", text, re.S)
+    if not match:
+        sys.exit("no trace found in " + path)
+    # Each log line is "I (1234) Trace: <base64>"
+    lines = [line.rsplit(" ", 1)[-1].strip() for line in match.group(1).splitlines() if line.strip()]
+    lines = [re.sub(r"\x1b\[[0-9;]*m", "", line) for line in lines]
+    return base64.b64decode("".join(lines))
+
+
+def parse(data):
+    magic, version, record_size, count, dropped, names_size = struct.unpack_from(HEADER_FORMAT, data)
+    if magic != MAGIC or version != 1:
+        sys.exit("not a trace dump")
+    offset = struct.calcsize(HEADER_FORMAT)
+    names = data[offset:offset + names_size].split(b"\0")
+    names = [name.decode() for name in names if name]
+    offset += names_size
+
+    records = []
+    for i in range(count):
+        records.append(struct.unpack_from(RECORD_FORMAT, data, offset + i * record_size))
+    return names, records, dropped
+
+
+def convert(names, records):
+    events = []
+    base = 0
+    previous = None
+    for timestamp, arg, event, phase, core in records:
+        if event >= len(names) or chr(phase) not in "beXiC":
+            continue  # Torn record written during the dump
+        # Timestamps are the low 32 bits of esp_timer_get_time()
+        if previous is not None and timestamp + base < previous - (1 << 31):
+            base += 1 << 32
+        ts = timestamp + base
+        previous = ts
+
+        phase = chr(phase)
+        item = {"name": names[event], "cat": "xiaozhi", "ph": phase, "pid": 1, "tid": core, "ts": ts}
+        if phase == "X":
+            item["ts"] = ts - arg
+            item["dur"] = arg
+        elif phase in "be":
+            item["id"] = event
+        elif phase == "i":
+            item["s"] = "g"
+        elif phase == "C":
+            item["args"] = {names[event]: arg}
+        events.append(item)
+    events.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": 0, "args": {"name": "core 0"}})
+    events.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": 1, "args": {"name": "core 1"}})
+    return events
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a xiaozhi trace dump to Chrome trace JSON")
+    parser.add_argument("input", help="Binary dump, serial log or trace JSON message")
+    parser.add_argument("output", help="Output JSON, open it in chrome://tracing or Perfetto")
+    args = parser.parse_args()
+
+    names, records, dropped = parse(load_dump(args.input))
+    events = convert(names, records)
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, f)
+    print(f"{len(records)} events, {dropped} overwritten -> {args.output}")
+
+
+if __name__ == "__main__":
+    main()